@@ -0,0 +1,342 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h> // FILE, fmemopen, fprintf
+#include <time.h> // clock_gettime
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "builtins.h"
+#include "vm.h"
+#include "jit.h"
+#include "reader.h"
+
+// Benchmark harness, run with `main --bench`.
+//
+// Each benchmark runs `BENCH_WARMUP` untimed repetitions and then
+// `BENCH_DEFAULT_REPS` timed ones (override with `LISP_BENCH_REPS`). A repetition
+// performs `ops` operations; the report gives the median and 99th
+// percentile time per operation and the median throughput. Each run
+// rewrites `BENCH_OUTPUT` with one tab-separated line per benchmark, so
+// runs from different commits can be diffed.
+//
+// Lisp workloads run under both evaluators and are named `NAME/vm` and
+// `NAME/tree`.
+
+#define BENCH_WARMUP 3
+#define BENCH_DEFAULT_REPS 21
+#define BENCH_OUTPUT "bench_output.txt"
+
+// Defined in `./main.c`.
+ValueRef eval(ValueRef, Env*);
+void run_stream(FILE*, Env*, bool);
+
+typedef struct BenchResult {
+    const char* name;
+    size_t ops; // Operations per repetition.
+    size_t reps;
+    double median_ns; // Per operation.
+    double p99_ns;    // Per operation.
+    double ops_per_sec;
+} BenchResult;
+
+static double bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/// Nearest-rank percentile of the sorted `samples`.
+static double percentile(const double* samples, size_t count, double p) {
+    size_t rank = (size_t) (p / 100.0 * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return samples[rank - 1];
+}
+
+static size_t bench_reps(void) {
+    const char* reps = getenv("LISP_BENCH_REPS");
+    size_t count = reps ? strtoul(reps, NULL, 10) : BENCH_DEFAULT_REPS;
+    return count > 0 ? count : 1;
+}
+
+/// Times `run(ctx)` and summarizes the samples.
+static BenchResult bench_measure(const char* name, size_t ops, void (*run)(void*), void* ctx) {
+    for (size_t i = 0; i < BENCH_WARMUP; i++) run(ctx);
+    size_t reps = bench_reps();
+    double samples[reps];
+    for (size_t i = 0; i < reps; i++) {
+        double start = bench_now_ns();
+        run(ctx);
+        samples[i] = (bench_now_ns() - start) / ops;
+    }
+    qsort(samples, reps, sizeof(double), compare_doubles);
+    double median = percentile(samples, reps, 50);
+    return (BenchResult) {
+        .name=name, .ops=ops, .reps=reps,
+        .median_ns=median,
+        .p99_ns=percentile(samples, reps, 99),
+        .ops_per_sec=1e9 / median,
+    };
+}
+
+static void bench_report(FILE* out, BenchResult r) {
+    printf("%-20s %12.1f ns/op (p99 %12.1f) %14.0f ops/s\n",
+           r.name, r.median_ns, r.p99_ns, r.ops_per_sec);
+    fprintf(out, "%s\t%zu\t%zu\t%.1f\t%.1f\t%.0f\n",
+            r.name, r.ops, r.reps, r.median_ns, r.p99_ns, r.ops_per_sec);
+}
+
+////////////////////////////// WORKLOADS //////////////////////////////
+typedef struct LispBench {
+    const char* name;
+    const char* setup; // Top-level forms evaluated once.
+    const char* expr;  // The expression each repetition evaluates.
+    size_t ops;        // Procedure calls per evaluation of `expr`.
+} LispBench;
+
+typedef struct LispBenchCtx {
+    ValueRef expr;
+    Env* env;
+} LispBenchCtx;
+
+static void run_lisp_bench(void* ctx) {
+    LispBenchCtx* lisp = ctx;
+    eval(lisp->expr, lisp->env);
+}
+
+static void eval_string(const char* text, Env* env) {
+    FILE* in = fmemopen((void*) text, strlen(text), "r");
+    if (in == NULL) panic("%s", "fmemopen failed!");
+    run_stream(in, env, false);
+    fclose(in);
+}
+
+static ValueRef read_one(const char* text) {
+    FILE* in = fmemopen((void*) text, strlen(text), "r");
+    if (in == NULL) panic("%s", "fmemopen failed!");
+    Reader reader;
+    reader_init(&reader, in);
+    ValueRef value = (ValueRef) NULL;
+    if (!read_value(&reader, &value)) panic("No datum in `%s`!", text);
+    reader_free(&reader);
+    fclose(in);
+    return value;
+}
+
+static const char* LIST_PRELUDE =
+    "(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))\n"
+    "(define map (lambda (f xs) (if xs (cons (f (car xs)) (map f (cdr xs))) '())))\n"
+    "(define fold (lambda (f acc xs) (if xs (fold f (f acc (car xs)) (cdr xs)) acc)))\n"
+    "(define xs (iota 1000 '()))\n";
+
+/// Builds `((lambda (a0) ((lambda (a1) ... (+ a0 ... aN-1) ... 1)) 0)`, a
+/// body that reads a variable from every frame of an `N`-deep chain.
+static char* deep_env_source(size_t depth) {
+    size_t cap = 64 * depth + 64, len = 0;
+    char* text = malloc(cap);
+    if (text == NULL) panic("%s", "Bench source alloc error!");
+    for (size_t i = 0; i < depth; i++)
+        len += snprintf(text + len, cap - len, "((lambda (a%zu) ", i);
+    len += snprintf(text + len, cap - len, "(+");
+    for (size_t i = 0; i < depth; i++)
+        len += snprintf(text + len, cap - len, " a%zu", i);
+    len += snprintf(text + len, cap - len, ")");
+    for (size_t i = depth; i-- > 0;)
+        len += snprintf(text + len, cap - len, ") %zu)", i);
+    return text;
+}
+
+#define DEEP_ENV_DEPTH 100
+
+static void bench_lisp(FILE* out, const LispBench* bench) {
+    static const char* modes[] = { "jit", "vm", "tree" };
+    bool enabled = VM.enabled, jit = JIT.enabled;
+    for (int mode = jit ? 0 : 1; mode < 3; mode++) {
+        VM.enabled = mode < 2;
+        JIT.enabled = mode == 0;
+        Env* env = global_env();
+        eval_string(LIST_PRELUDE, env);
+        if (bench->setup) eval_string(bench->setup, env);
+        LispBenchCtx ctx = { .expr=read_one(bench->expr), .env=env };
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s/%s", bench->name, modes[mode]);
+        bench_report(out, bench_measure(name, bench->ops, run_lisp_bench, &ctx));
+    }
+    VM.enabled = enabled;
+    JIT.enabled = jit;
+}
+
+#define ALLOC_BENCH_CELLS 1000000
+
+static void run_alloc_bench(void* ctx) {
+    ValueRef list = (ValueRef) NULL;
+    for (size_t i = 0; i < ALLOC_BENCH_CELLS; i++)
+        list = make_pair_ref(NUM(i), list);
+    *(volatile ValueRef*) ctx = list;
+}
+
+#define LIST_WALK_CELLS 100000
+
+static volatile int64_t LIST_WALK_SUM;
+
+// Sums a list of fixnums cell by cell, as `value_eq` and `print_value` walk.
+static void run_list_walk_bench(void* ctx) {
+    int64_t sum = 0;
+    for (ListRef x = *(ListRef*) ctx; !is_null(x); x = cdr_lookup(x))
+        sum += fixnum_value(car_lookup(x));
+    LIST_WALK_SUM = sum;
+}
+
+#define INTERN_BENCH_NAMES 10000
+
+typedef struct InternBenchCtx {
+    char (*names)[32];
+    size_t round; // Written over each name's first 8 characters, so every
+                  // repetition of the miss benchmark interns fresh names.
+} InternBenchCtx;
+
+static void run_intern_hit_bench(void* ctx) {
+    InternBenchCtx* intern = ctx;
+    for (size_t i = 0; i < INTERN_BENCH_NAMES; i++)
+        make_symbol_ref(intern->names[i]);
+}
+
+static void run_intern_miss_bench(void* ctx) {
+    InternBenchCtx* intern = ctx;
+    char prefix[9];
+    snprintf(prefix, sizeof(prefix), "%08zx", ++intern->round);
+    for (size_t i = 0; i < INTERN_BENCH_NAMES; i++) {
+        memcpy(intern->names[i], prefix, 8);
+        make_symbol_ref(intern->names[i]);
+    }
+}
+
+// The kernels `vector_sum` picks from, over the same fixnums.
+#define VECTOR_SUM_ITEMS 1000000
+
+typedef struct VectorSumCtx {
+    FixnumSumFn kernel;
+    ValueRef* items;
+} VectorSumCtx;
+
+static volatile int64_t VECTOR_SUM_TOTAL;
+
+static void run_vector_sum_bench(void* ctx) {
+    VectorSumCtx* sum = ctx;
+    int64_t total = 0;
+    sum->kernel(sum->items, VECTOR_SUM_ITEMS, &total);
+    VECTOR_SUM_TOTAL = total;
+}
+///////////////////////////////////////////////////////////////////////
+
+void bench(void) {
+    FILE* out = fopen(BENCH_OUTPUT, "w");
+    if (out == NULL) {
+        perror(BENCH_OUTPUT);
+        exit(1);
+    }
+    fprintf(out, "# name\tops\treps\tmedian_ns_per_op\tp99_ns_per_op\tops_per_sec\n");
+
+    // table-ref and alist-ref count lookups, each of the 1000 keys in `xs`;
+    // vector-sum and string-index count elements scanned rather than calls.
+    // fib(20) makes 21891 calls; map-fold 1001 each of map and fold, 1000
+    // of each closure and one of the outer lambda; (iota 100000) 100001.
+    // pmap counts its 1000 calls, each a fold over `xs`.
+    char* deep = deep_env_source(DEEP_ENV_DEPTH);
+    const LispBench lisp_benches[] = {
+        {
+            .name="fib",
+            .setup="(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+            .expr="(fib 20)",
+            .ops=21891,
+        },
+        {
+            .name="map-fold",
+            .expr="((lambda (k) (fold (lambda (a x) (+ a x)) 0 (map (lambda (x) (* x k)) xs))) 3)",
+            .ops=4003,
+        },
+        { .name="deep-env", .expr=deep, .ops=DEEP_ENV_DEPTH },
+        { .name="cons-list", .expr="(iota 100000 '())", .ops=100001 },
+        { .name="pmap", .expr="(pmap (lambda (x) (fold + x xs)) xs)", .ops=1000 },
+        {
+            .name="table-ref",
+            .setup="(define t (make-table)) (map (lambda (x) (table-set! t x x)) xs)",
+            .expr="(fold (lambda (a x) (+ a (table-ref t x))) 0 xs)",
+            .ops=1000,
+        },
+        {
+            .name="alist-ref",
+            .setup="(define al (map (lambda (x) (cons x x)) xs))\n"
+                   "(define assv (lambda (k al) (if (= k (car (car al))) (car al) (assv k (cdr al)))))",
+            .expr="(fold (lambda (a x) (+ a (cdr (assv x al)))) 0 xs)",
+            .ops=1000,
+        },
+        {
+            .name="vector-sum",
+            .setup="(define v (make-vector 1000000 3))",
+            .expr="(vector-sum v)",
+            .ops=1000000,
+        },
+        {
+            .name="string-index",
+            .setup="(define s (make-string 1000000 97))",
+            .expr="(string-index s 98)",
+            .ops=1000000,
+        },
+    };
+    for (size_t i = 0; i < sizeof(lisp_benches) / sizeof(lisp_benches[0]); i++)
+        bench_lisp(out, &lisp_benches[i]);
+    free(deep);
+
+    ValueRef sink;
+    bench_report(out, bench_measure("alloc-pair", ALLOC_BENCH_CELLS, run_alloc_bench, &sink));
+
+    // The same list, consed up back to front and made in one go by
+    // `make_list`, which lays it out in consecutive cells.
+    ValueRef* items = malloc(LIST_WALK_CELLS * sizeof(ValueRef));
+    if (items == NULL) panic("%s", "Bench list alloc error!");
+    ListRef consed = (ValueRef) NULL;
+    for (size_t i = LIST_WALK_CELLS; i-- > 0;) {
+        items[i] = NUM(i);
+        consed = CONS(items[i], consed);
+    }
+    ListRef listed = make_list(items, LIST_WALK_CELLS);
+    free(items);
+    bench_report(out, bench_measure("list-walk/cons", LIST_WALK_CELLS, run_list_walk_bench, &consed));
+    bench_report(out, bench_measure("list-walk/list", LIST_WALK_CELLS, run_list_walk_bench, &listed));
+
+    VectorSumCtx sum = { .kernel=fixnum_sum_scalar, .items=malloc(VECTOR_SUM_ITEMS * sizeof(ValueRef)) };
+    if (sum.items == NULL) panic("%s", "Bench vector alloc error!");
+    for (size_t i = 0; i < VECTOR_SUM_ITEMS; i++) sum.items[i] = NUM(i % 1000);
+    bench_report(out, bench_measure("sum/scalar", VECTOR_SUM_ITEMS, run_vector_sum_bench, &sum));
+#ifdef __x86_64__
+    sum.kernel = fixnum_sum_sse2;
+    bench_report(out, bench_measure("sum/sse2", VECTOR_SUM_ITEMS, run_vector_sum_bench, &sum));
+    if (__builtin_cpu_supports("avx2")) {
+        sum.kernel = fixnum_sum_avx2;
+        bench_report(out, bench_measure("sum/avx2", VECTOR_SUM_ITEMS, run_vector_sum_bench, &sum));
+    }
+#endif
+    free(sum.items);
+
+    InternBenchCtx intern = { .names=malloc(INTERN_BENCH_NAMES * sizeof(*intern.names)), .round=0 };
+    if (intern.names == NULL) panic("%s", "Bench names alloc error!");
+    for (size_t i = 0; i < INTERN_BENCH_NAMES; i++)
+        snprintf(intern.names[i], sizeof(intern.names[i]), "xxxxxxxx-bench-sym-%05zu", i);
+    bench_report(out, bench_measure("intern-miss", INTERN_BENCH_NAMES, run_intern_miss_bench, &intern));
+    bench_report(out, bench_measure("intern-hit", INTERN_BENCH_NAMES, run_intern_hit_bench, &intern));
+    free(intern.names);
+
+    fclose(out);
+    printf("Wrote %s\n", BENCH_OUTPUT);
+}
+
+#endif
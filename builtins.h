@@ -3,33 +3,76 @@
 
 #include "value_types.h"
 #include "env_type.h"
+#include "resolve.h"
+#include "numbers.h"
+#include "vectors.h"
+#include "tables.h"
 #include "helper_macros.h"
 
-ValueRef eval(ValueRef, Env*);
+ValueRef eval_resolved(ValueRef, Env*);
 
-/// NOTE: `eval` ensures that `args` will be a `ListRef`
-
-#define builtin_procedure_definition(NAME, IDENT, ...) \
-    ValueRef IDENT##__builtin(ListRef args) {          \
-        __VA_ARGS__                                    \
-    }                                                  \
-    static BuiltinProc IDENT = {                       \
-        .name=NAME,                                    \
-        .fn=IDENT##__builtin                           \
+/// The body sees its evaluated arguments as `argc` and `argv`. Callers
+/// check `argc` against `MIN_ARGS` and `MAX_ARGS` (or `VARIADIC`) before
+/// calling, so the body can index `argv` without checking.
+#define builtin_procedure_definition_with(NAME, IDENT, MIN_ARGS, MAX_ARGS, BINARY, ...) \
+    ValueRef IDENT##__builtin(size_t argc, const ValueRef* argv) {                        \
+        __VA_ARGS__                                                                       \
+    }                                                                                     \
+    static BuiltinProc IDENT = {                                                          \
+        .name=NAME,                                                                       \
+        .fn=IDENT##__builtin,                                                             \
+        .min_args=MIN_ARGS,                                                               \
+        .max_args=MAX_ARGS,                                                               \
+        .binary=BINARY                                                                    \
     }
 
-#define special_form_definition(NAME, IDENT, ...)            \
-    ValueRef IDENT##__special_form(ListRef args, Env* env) { \
-        __VA_ARGS__                                          \
-    }                                                        \
-    static SpecialForm IDENT = {                             \
-        .name=NAME,                                          \
-        .fn=IDENT##__special_form                            \
+#define builtin_procedure_definition(NAME, IDENT, MIN_ARGS, MAX_ARGS, ...) \
+    builtin_procedure_definition_with(NAME, IDENT, MIN_ARGS, MAX_ARGS, NULL, __VA_ARGS__)
+
+/// Like `builtin_procedure_definition`, but two-argument calls go to
+/// `IDENT##__binary(a, b)` instead, which must be defined first.
+#define binary_builtin_procedure_definition(NAME, IDENT, MIN_ARGS, MAX_ARGS, ...) \
+    builtin_procedure_definition_with(NAME, IDENT, MIN_ARGS, MAX_ARGS, IDENT##__binary, __VA_ARGS__)
+
+#define special_form_definition_with(NAME, IDENT, RESOLVER, TAIL, ...) \
+    ValueRef IDENT##__special_form(ListRef args, Env* env) {           \
+        __VA_ARGS__                                                    \
+    }                                                                  \
+    static SpecialForm IDENT = {                                       \
+        .name=NAME,                                                    \
+        .fn=IDENT##__special_form,                                     \
+        .resolve=RESOLVER,                                             \
+        .tail=TAIL                                                     \
     }
 
+/// `RESOLVER` rewrites the form's arguments before evaluation; `args` are
+/// its output.
+#define special_form_definition(NAME, IDENT, RESOLVER, ...) \
+    special_form_definition_with(NAME, IDENT, RESOLVER, false, __VA_ARGS__)
+
+/// Like `special_form_definition`, but the body returns an expression that
+/// `eval` then evaluates in tail position.
+#define tail_special_form_definition(NAME, IDENT, RESOLVER, ...) \
+    special_form_definition_with(NAME, IDENT, RESOLVER, true, __VA_ARGS__)
+
+// '() is false, everything else is true. Predicates return `t` for true.
+static SymbolRef TRUE_SYMBOL = (SymbolRef) NULL;
+#define make_boolean(b) ((b) ? (ValueRef) TRUE_SYMBOL : (ValueRef) NULL)
+
+// Resolves the body in a new scope for the parameters.
+static ListRef resolve_lambda(ListRef args, Scope* scope) {
+    if (is_null(args))
+        panic("%s", "Special form `lambda` takes 2 arguments, none given!");
+    ListRef params = assume_list(car_lookup(args));
+    PairRef body_pair = assume_pair_ref(cdr_lookup(args));
+    Scope body_scope = { .parent=scope, .names=params, .root=scope->root };
+    ValueRef body = resolve(car_lookup(body_pair), &body_scope);
+    return CONS(params, CONS(body, cdr_lookup(body_pair)));
+}
+
 // Form: '(lambda (x1 x2 ...) body)
 // Precondition: args = '((x1 x2 ...) body)
-special_form_definition("lambda", lambda, {
+special_form_definition("lambda", lambda, resolve_lambda, {
     if (is_null(args))
         panic("%s", "Special form `lambda` takes 2 arguments, none given!");
     ListRef params = assume_list(car_lookup(args));
@@ -40,102 +83,460 @@ special_form_definition("lambda", lambda, {
     return PROC(env, params, body);
 });
 
-// Form: '(set! symbol value)
-// Precondition: args = '()
-special_form_definition("set!", set_bang, {
+// Resolves the target symbol to a reference, and the value expression.
+static ListRef resolve_set_bang(ListRef args, Scope* scope) {
     if (is_null(args))
         panic("%s", "Special form `set!` takes 2 arguments, none given!");
     SymbolRef symbol = assume_symbol_ref(car_lookup(args));
     PairRef rest = assume_pair_ref(cdr_lookup(args));
-    ValueRef value = eval(car_lookup(rest), env);
+    ValueRef target = resolve_symbol(symbol, scope);
+    return CONS(target, CONS(resolve(car_lookup(rest), scope), cdr_lookup(rest)));
+}
+
+// Form: '(set! symbol value)
+// Precondition: args = '(reference value)
+special_form_definition("set!", set_bang, resolve_set_bang, {
+    if (is_null(args))
+        panic("%s", "Special form `set!` takes 2 arguments, none given!");
+    ValueRef target = car_lookup(args);
+    PairRef rest = assume_pair_ref(cdr_lookup(args));
+    ValueRef value = eval_resolved(car_lookup(rest), env);
     if (!is_null(cdr_lookup(rest)))
         panic("%s", "Special form `set!` takes no more than 2 arguments!");
-    
-    Env* env_ancestor = env_find(env, symbol);
-    env_ancestor->value = value; // Mutate the environment.
+
+    ValueRef* slot = env_ref_slot(env, target);
+    if (*slot == UNBOUND_VALUE)
+        panic("Unbound Symbol: `%s`", symbol_to_string(env_ref_name(env, target)));
+    bool global = is_other_kind(target, GLOBAL_REF);
+    if (global) optimize_check_rebind(env->root, global_ref_symbol(target));
+    *slot = value; // Mutate the environment.
+    if (global) bump_global_version();
     return (ValueRef) NULL;
 });
 
-builtin_procedure_definition("+", plus, {
-    Number total = make_number(0);
-    for (
-        ListRef arg = args;
-        !is_null(arg);
-        arg = assume_list(cdr_lookup(arg))
-    ) {
-        Number x = assume_number(car_lookup(arg));
-        total = NUM(GET_VALUE_DATA(total) + GET_VALUE_DATA(x));
+// Form: '(if test consequent [alternative])
+tail_special_form_definition("if", if_, resolve_list, {
+    if (is_null(args))
+        panic("%s", "Special form `if` takes 2 or 3 arguments, none given!");
+    ValueRef test = eval_resolved(car_lookup(args), env);
+    PairRef branches = assume_pair_ref(cdr_lookup(args));
+    ListRef alternative = assume_list(cdr_lookup(branches));
+    if (!is_null(alternative) && !is_null(cdr_lookup(alternative)))
+        panic("%s", "Special form `if` takes no more than 3 arguments!");
+    if (!is_null(test)) return car_lookup(branches);
+    return is_null(alternative) ? (ValueRef) NULL : car_lookup(alternative);
+});
+
+// Leaves the quoted datum as it is.
+static ListRef resolve_quote(ListRef args, Scope* scope) {
+    return args;
+}
+
+// Form: '(quote datum)
+special_form_definition("quote", quote, resolve_quote, {
+    if (is_null(args))
+        panic("%s", "Special form `quote` takes 1 argument, none given!");
+    if (!is_null(cdr_lookup(args)))
+        panic("%s", "Special form `quote` takes no more than 1 argument!");
+    return car_lookup(args);
+});
+
+// Keeps the name as a symbol, and resolves the value expression.
+static ListRef resolve_define(ListRef args, Scope* scope) {
+    if (is_null(args))
+        panic("%s", "Special form `define` takes 2 arguments, none given!");
+    SymbolRef symbol = assume_symbol_ref(car_lookup(args));
+    PairRef rest = assume_pair_ref(cdr_lookup(args));
+    return CONS(symbol, CONS(resolve(car_lookup(rest), scope), cdr_lookup(rest)));
+}
+
+// Form: '(define symbol value)
+// Always binds in the global frame, and returns the symbol.
+special_form_definition("define", define, resolve_define, {
+    if (is_null(args))
+        panic("%s", "Special form `define` takes 2 arguments, none given!");
+    SymbolRef symbol = car_lookup(args);
+    PairRef rest = assume_pair_ref(cdr_lookup(args));
+    if (!is_null(cdr_lookup(rest)))
+        panic("%s", "Special form `define` takes no more than 2 arguments!");
+    env_define(env, symbol, eval_resolved(car_lookup(rest), env));
+    return symbol;
+});
+
+// Binary entry points for `+`, `-` and `*`: two fixnums stay on the
+// unboxed fast path, with one tag check per operand and no loop.
+#define binary_arithmetic_definition(IDENT, FIXNUM_OP, NUM_OP)               \
+    static ValueRef IDENT##__binary(ValueRef a, ValueRef b) {                \
+        Number result;                                                       \
+        if (is_number(a) && is_number(b) && FIXNUM_OP(a, b, &result))        \
+            return result;                                                   \
+        return NUM_OP(assume_numeric(a), assume_numeric(b));                 \
     }
+
+binary_arithmetic_definition(plus, fixnum_add, num_add)
+binary_arithmetic_definition(minus, fixnum_sub, num_sub)
+binary_arithmetic_definition(times, fixnum_mul, num_mul)
+
+binary_builtin_procedure_definition("+", plus, 0, VARIADIC, {
+    Number total = make_number(0);
+    for (size_t i = 0; i < argc; i++)
+        total = num_add(total, assume_numeric(argv[i]));
     return (ValueRef) total;
 });
 
-builtin_procedure_definition("*", times, {
+binary_builtin_procedure_definition("*", times, 0, VARIADIC, {
     Number product = make_number(1);
-    for (
-        ListRef arg = args;
-        !is_null(arg);
-        arg = assume_list(cdr_lookup(arg))
-    ) {
-        Number x = assume_number(car_lookup(arg));
-        product = NUM(GET_VALUE_DATA(product) * GET_VALUE_DATA(x));
-    }
+    for (size_t i = 0; i < argc; i++)
+        product = num_mul(product, assume_numeric(argv[i]));
     return (ValueRef) product;
 });
 
+// '(- x) negates, '(- x y ...) subtracts the rest from `x`.
+binary_builtin_procedure_definition("-", minus, 1, VARIADIC, {
+    Number first = assume_numeric(argv[0]);
+    if (argc == 1) return num_neg(first);
+    Number difference = first;
+    for (size_t i = 1; i < argc; i++)
+        difference = num_sub(difference, assume_numeric(argv[i]));
+    return (ValueRef) difference;
+});
+
+#define numeric_comparison_definition(NAME, IDENT, OP)                              \
+    static ValueRef IDENT##__binary(ValueRef a, ValueRef b) {                       \
+        if (is_number(a) && is_number(b))                                           \
+            return make_boolean(fixnum_cmp(a, b) OP 0);                             \
+        return make_boolean(num_compare(assume_numeric(a), assume_numeric(b), OP)); \
+    }                                                                               \
+    binary_builtin_procedure_definition(NAME, IDENT, 1, VARIADIC, {                 \
+        Number prev = assume_numeric(argv[0]);                                      \
+        for (size_t i = 1; i < argc; i++) {                                         \
+            Number x = assume_numeric(argv[i]);                                     \
+            if (!num_compare(prev, x, OP)) return make_boolean(false);              \
+            prev = x;                                                               \
+        }                                                                           \
+        return make_boolean(true);                                                  \
+    })
+
+numeric_comparison_definition("=", num_eq, ==);
+numeric_comparison_definition("<", less_than, <);
+
+// '(/ x) inverts, '(/ x y ...) divides `x` by the rest.
+builtin_procedure_definition("/", divide, 1, VARIADIC, {
+    Number first = assume_numeric(argv[0]);
+    if (argc == 1) return num_div(make_fixnum(1), first);
+    Number quotient = first;
+    for (size_t i = 1; i < argc; i++)
+        quotient = num_div(quotient, assume_numeric(argv[i]));
+    return (ValueRef) quotient;
+});
+
 // '(cons car cdr)
-builtin_procedure_definition("cons", cons, {
-    if (is_null(args))
-        panic("%s", "Builtin `cons` takes 2 arguments, none given!");
-    ValueRef car = car_lookup(args);
-    PairRef rest = assume_pair_ref(cdr_lookup(args));
-    ValueRef cdr = car_lookup(rest);
-    if (!is_null(cdr_lookup(rest)))
-        panic("%s", "Builtin `cons` takes no more than 2 arguments!");
-    return CONS(car, cdr);
+builtin_procedure_definition("cons", cons, 2, 2, {
+    if (HASH_CONSING) return hash_cons(argv[0], argv[1]);
+    return CONS(argv[0], argv[1]);
 });
 
-// '(car)
-builtin_procedure_definition("car", car, {
-    if (is_null(args))
-        panic("%s", "Builtin `car` takes 1 argument, none given!");
-    ValueRef arg = car_lookup(args);
-    if (!is_null(cdr_lookup(args)))
-        panic("%s", "Builtin `car` takes no more than 1 argument!");
-    PairRef pair = assume_pair_ref(arg);
-    return car_lookup(pair);
+// '(car pair)
+builtin_procedure_definition("car", car, 1, 1, {
+    return car_lookup(assume_pair_ref(argv[0]));
+});
+
+// '(cdr pair)
+builtin_procedure_definition("cdr", cdr, 1, 1, {
+    return cdr_lookup(assume_pair_ref(argv[0]));
+});
+
+// '(list x1 x2 ...), lists the arguments in consecutive cells if it can.
+builtin_procedure_definition("list", list_, 0, VARIADIC, {
+    if (HASH_CONSING) {
+        ListRef list = (ValueRef) NULL;
+        for (size_t i = argc; i-- > 0;) list = hash_cons(argv[i], list);
+        return list;
+    }
+    return make_list(argv, argc);
+});
+
+// '(equal? a b), compares by structure. Hash-consed data compares in O(1).
+builtin_procedure_definition("equal?", equal_p, 2, 2, {
+    return make_boolean(value_eq(argv[0], argv[1]));
+});
+
+/// Checks that `index` is a fixnum indexing an aggregate of `len` elements.
+static size_t assume_index(const char* builtin, ValueRef index, size_t len) {
+    if (!is_number(index))
+        panic("Builtin `%s` expects an integer index, got %s!", builtin, typename_of(index));
+    int64_t i = fixnum_value(index);
+    if (i < 0 || (uint64_t) i >= len)
+        panic("Builtin `%s`: index %ld is out of range for length %zu!", builtin, i, len);
+    return (size_t) i;
+}
+
+/// Checks that `len` is a fixnum fit to be a length.
+static size_t assume_length(const char* builtin, ValueRef len) {
+    if (!is_number(len) || fixnum_value(len) < 0)
+        panic("Builtin `%s` expects a non-negative integer length, got %s!", builtin, typename_of(len));
+    return (size_t) fixnum_value(len);
+}
+
+// '(vector x1 x2 ...)
+builtin_procedure_definition("vector", vector_, 0, VARIADIC, {
+    ValueRef vector = make_vector(argc, (ValueRef) NULL);
+    memcpy(vector_lookup(vector)->items, argv, argc * sizeof(ValueRef));
+    return vector;
 });
 
-// '(cdr arg)
-builtin_procedure_definition("cdr", cdr, {
+// '(make-vector n [fill]), a vector of `n` copies of `fill`, or of '().
+builtin_procedure_definition("make-vector", make_vector_, 1, 2, {
+    return make_vector(assume_length("make-vector", argv[0]), argc == 2 ? argv[1] : (ValueRef) NULL);
+});
+
+// '(vector-length v)
+builtin_procedure_definition("vector-length", vector_length, 1, 1, {
+    return make_number(vector_lookup(argv[0])->len);
+});
+
+// '(vector-ref v i)
+builtin_procedure_definition("vector-ref", vector_ref, 2, 2, {
+    Vector* v = vector_lookup(argv[0]);
+    return v->items[assume_index("vector-ref", argv[1], v->len)];
+});
+
+// '(vector-set! v i x), returns '().
+builtin_procedure_definition("vector-set!", vector_set_bang, 3, 3, {
+    Vector* v = vector_lookup(argv[0]);
+    v->items[assume_index("vector-set!", argv[1], v->len)] = argv[2];
+    return (ValueRef) NULL;
+});
+
+// '(vector-sum v), adds up the elements of `v`.
+builtin_procedure_definition("vector-sum", vector_sum_, 1, 1, {
+    return vector_sum(argv[0]);
+});
+
+// Defined in `./main.c`.
+ValueRef apply_value(ValueRef fn, size_t argc, const ValueRef* argv);
+
+// '(vector-map f v), a vector of `f` applied to each element of `v`.
+builtin_procedure_definition("vector-map", vector_map, 2, 2, {
+    ValueRef fn = argv[0], from = argv[1];
+    size_t len = vector_lookup(from)->len;
+    ValueRef to = make_vector(len, (ValueRef) NULL);
+    for (size_t i = 0; i < len && i < vector_lookup(from)->len; i++) {
+        ValueRef item = vector_lookup(from)->items[i];
+        ValueRef result = apply_value(fn, 1, &item);
+        vector_lookup(to)->items[i] = result;
+    }
+    return to;
+});
+
+// '(list->vector xs)
+builtin_procedure_definition("list->vector", list_to_vector_, 1, 1, {
+    return list_to_vector(assume_list(argv[0]));
+});
+
+// '(vector->list v)
+builtin_procedure_definition("vector->list", vector_to_list, 1, 1, {
+    Vector* v = vector_lookup(argv[0]);
+    return make_list(v->items, v->len);
+});
+
+// '(make-string n [byte]), a string of `n` copies of `byte`, or of zeros.
+builtin_procedure_definition("make-string", make_string_, 1, 2, {
+    size_t len = assume_length("make-string", argv[0]);
+    ValueRef string = make_string(NULL, len);
+    if (argc == 2) {
+        if (!is_number(argv[1]) || fixnum_value(argv[1]) < 0 || fixnum_value(argv[1]) > 255)
+            panic("Builtin `make-string` expects a byte, got %s!", typename_of(argv[1]));
+        memset(string_lookup(string)->bytes, (int) fixnum_value(argv[1]), len);
+    }
+    return string;
+});
+
+// '(string-length s), in bytes.
+builtin_procedure_definition("string-length", string_length, 1, 1, {
+    return make_number(string_lookup(argv[0])->len);
+});
+
+// '(string-ref s i), the byte at `i`, as an integer.
+builtin_procedure_definition("string-ref", string_ref, 2, 2, {
+    String* s = string_lookup(argv[0]);
+    return make_number((unsigned char) s->bytes[assume_index("string-ref", argv[1], s->len)]);
+});
+
+// '(string-index s c), the index of the first byte `c` in `s`, or '().
+// `c` is a byte or a one-byte string.
+builtin_procedure_definition("string-index", string_index, 2, 2, {
+    String* s = string_lookup(argv[0]);
+    ValueRef c = argv[1];
+    int byte;
+    if (is_string(c) && string_lookup(c)->len == 1) byte = (unsigned char) string_lookup(c)->bytes[0];
+    else if (is_number(c) && fixnum_value(c) >= 0 && fixnum_value(c) <= 255) byte = (int) fixnum_value(c);
+    else panic("Builtin `string-index` expects a byte or a one-byte string, got %s!", typename_of(c));
+    const char* found = memchr(s->bytes, byte, s->len);
+    return found ? make_number(found - s->bytes) : (ValueRef) NULL;
+});
+
+// '(string-append s1 s2 ...)
+builtin_procedure_definition("string-append", string_append, 0, VARIADIC, {
+    size_t len = 0;
+    for (size_t i = 0; i < argc; i++) len += string_lookup(argv[i])->len;
+    ValueRef string = make_string(NULL, len);
+    char* out = string_lookup(string)->bytes;
+    for (size_t i = 0; i < argc; i++) {
+        String* s = string_lookup(argv[i]);
+        memcpy(out, s->bytes, s->len);
+        out += s->len;
+    }
+    return string;
+});
+
+// '(make-table)
+builtin_procedure_definition("make-table", make_table_, 0, 0, {
+    return make_table();
+});
+
+// '(table-ref t key default), returns `default`, or '() if it's left out,
+// when `t` has no entry for `key`.
+builtin_procedure_definition("table-ref", table_ref, 2, 3, {
+    return table_get(argv[0], argv[1], argc == 3 ? argv[2] : (ValueRef) NULL);
+});
+
+// '(table-set! t key value), returns '().
+builtin_procedure_definition("table-set!", table_set_bang, 3, 3, {
+    table_put(argv[0], argv[1], argv[2]);
+    return (ValueRef) NULL;
+});
+
+// '(table-count t), the number of keys in `t`.
+builtin_procedure_definition("table-count", table_count, 1, 1, {
+    return make_number(table_lookup(argv[0])->count);
+});
+
+// Defined in `./parallel.h`.
+ListRef par_map(ValueRef fn, ListRef xs, bool collect);
+
+// '(pmap f xs), applies `f` to the elements of `xs` in parallel and lists
+// the results in order. `f` must not `define` or `set!` anything.
+builtin_procedure_definition("pmap", pmap, 2, 2, {
+    return par_map(argv[0], assume_list(argv[1]), true);
+});
+
+// '(pfor-each f xs), like `pmap` but only for effect. Returns '().
+builtin_procedure_definition("pfor-each", pfor_each, 2, 2, {
+    return par_map(argv[0], assume_list(argv[1]), false);
+});
+
+// Defined in `./memo.h`.
+ProcRef make_memo_proc(ProcRef fn, size_t limit);
+
+static size_t memo_limit(ValueRef limit) {
+    if (!is_number(limit) || fixnum_value(limit) < 1)
+        panic("%s", "A memo table's size bound must be a positive integer!");
+    return fixnum_value(limit);
+}
+
+// '(memoize f [max-entries]), returns a procedure that calls `f` once per
+// distinct (`equal`) list of arguments and remembers the results. With
+// `max-entries`, the least recently used results are forgotten first.
+builtin_procedure_definition("memoize", memoize, 1, 2, {
+    if (!is_proc(argv[0]))
+        panic("Builtin `memoize` expects a procedure, got %s!", typename_of(argv[0]));
+    return make_memo_proc(argv[0], argc == 2 ? memo_limit(argv[1]) : 0);
+});
+
+// '(print value), prints `value` on its own line and returns it.
+builtin_procedure_definition("print", print, 1, 1, {
+    println_value(stdout, argv[0]);
+    return argv[0];
+});
+
+// Keeps the name as a symbol, and resolves the rest.
+static ListRef resolve_define_memo(ListRef args, Scope* scope) {
     if (is_null(args))
-        panic("%s", "Builtin `cdr` takes 1 argument, none given!");
-    ValueRef arg = car_lookup(args);
-    if (!is_null(cdr_lookup(args)))
-        panic("%s", "Builtin `cdr` takes no more than 1 argument!");
-    PairRef pair = assume_pair_ref(arg);
-    return cdr_lookup(pair);
+        panic("%s", "Special form `define-memo` takes 2 or 3 arguments, none given!");
+    SymbolRef symbol = assume_symbol_ref(car_lookup(args));
+    return CONS(symbol, resolve_list(assume_list(cdr_lookup(args)), scope));
+}
+
+// Form: '(define-memo symbol procedure [max-entries])
+// Like `define`, but binds `(memoize procedure max-entries)`, so recursive
+// calls through `symbol` hit the cache too.
+special_form_definition("define-memo", define_memo, resolve_define_memo, {
+    if (is_null(args))
+        panic("%s", "Special form `define-memo` takes 2 or 3 arguments, none given!");
+    SymbolRef symbol = car_lookup(args);
+    PairRef rest = assume_pair_ref(cdr_lookup(args));
+    ListRef limit = assume_list(cdr_lookup(rest));
+    if (!is_null(limit) && !is_null(cdr_lookup(limit)))
+        panic("%s", "Special form `define-memo` takes no more than 3 arguments!");
+    ValueRef fn = eval_resolved(car_lookup(rest), env);
+    if (!is_proc(fn))
+        panic("Special form `define-memo` expects a procedure, got %s!", typename_of(fn));
+    size_t max_entries = is_null(limit) ? 0 : memo_limit(eval_resolved(car_lookup(limit), env));
+    env_define(env, symbol, make_memo_proc(fn, max_entries));
+    return symbol;
 });
 
-static void register_builtin(Env** env, BuiltinProc proc) {
-    char* name = proc.name;
-    *env = make_env(*env, make_symbol_ref(name), make_builtin_proc(proc.name, proc.fn));
+static void register_builtin(Env* env, BuiltinProc* proc) {
+    char* name = proc->name;
+    env_define(env, make_symbol_ref(name), make_builtin_proc(proc));
+}
+
+static void register_special_form(Env* env, SpecialForm* form) {
+    char* name = form->name;
+    env_define(env, make_symbol_ref(name), make_special_form(form));
+}
+
+// Everything `global_env` binds, also looked up by name when an image is
+// loaded (see `./image.h`).
+static BuiltinProc* const BUILTIN_PROCS[] = {
+    &plus, &times, &minus, &divide, &num_eq, &less_than,
+    &cons, &car, &cdr, &list_, &equal_p, &print, &pmap, &pfor_each, &memoize,
+    &vector_, &make_vector_, &vector_length, &vector_ref, &vector_set_bang,
+    &vector_sum_, &vector_map, &list_to_vector_, &vector_to_list,
+    &make_string_, &string_length, &string_ref, &string_index, &string_append,
+    &make_table_, &table_ref, &table_set_bang, &table_count,
+};
+
+static SpecialForm* const SPECIAL_FORMS[] = {
+    &lambda, &set_bang, &if_, &quote, &define, &define_memo,
+};
+
+/// Returns the standard builtin called `name`, or `NULL`.
+BuiltinProc* find_builtin(const char* name) {
+    for (size_t i = 0; i < sizeof(BUILTIN_PROCS) / sizeof(BUILTIN_PROCS[0]); i++)
+        if (str_eq(BUILTIN_PROCS[i]->name, name)) return BUILTIN_PROCS[i];
+    return NULL;
+}
+
+/// Returns the special form called `name`, or `NULL`.
+SpecialForm* find_special_form(const char* name) {
+    for (size_t i = 0; i < sizeof(SPECIAL_FORMS) / sizeof(SPECIAL_FORMS[0]); i++)
+        if (str_eq(SPECIAL_FORMS[i]->name, name)) return SPECIAL_FORMS[i];
+    return NULL;
+}
+
+/// Whether `head` is the special form `form`.
+static bool is_form(ValueRef head, SpecialForm* form) {
+    return is_special_form(head) && special_form_lookup(head).fn == form->fn;
 }
 
-static void register_special_form(Env** env, SpecialForm form) {
-    char* name = form.name;
-    *env = make_env(*env, make_symbol_ref(name), make_special_form(form.name, form.fn));
+/// Panics for a call of the special form `fn` that doesn't name it at the
+/// head, e.g. through a variable. Its arguments were resolved as ordinary
+/// expressions (see `./resolve.h`), which the form can't take.
+static void special_form_misused(ValueRef fn) {
+    panic("Special form `%s` can only be called by name, not through a variable!",
+          special_form_lookup(fn).name);
 }
 
 Env* global_env() {
-    Env* env = NULL;
-    register_builtin(&env, plus);
-    register_builtin(&env, times);
-    register_builtin(&env, cons);
-    register_builtin(&env, car);
-    register_builtin(&env, cdr);
-    register_special_form(&env, lambda);
-    register_special_form(&env, set_bang);
+    TRUE_SYMBOL = make_symbol_ref("t");
+    Env* env = make_global_env();
+    for (size_t i = 0; i < sizeof(BUILTIN_PROCS) / sizeof(BUILTIN_PROCS[0]); i++)
+        register_builtin(env, BUILTIN_PROCS[i]);
+    for (size_t i = 0; i < sizeof(SPECIAL_FORMS) / sizeof(SPECIAL_FORMS[0]); i++)
+        register_special_form(env, SPECIAL_FORMS[i]);
     return env;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,136 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdio.h> // FILE, fmemopen
+#include <pthread.h> // pthread_t, pthread_join
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "builtins.h"
+#include "gc.h"
+#include "vm.h"
+#include "reader.h"
+
+// Isolated interpreter contexts, for running independent programs on
+// several threads at once.
+//
+// Each context has a global environment of its own, so definitions made in
+// one are invisible to the others. Any number of threads may evaluate at
+// the same time, as long as each context is used by one thread at a time
+// and contexts share no values other than symbols and numbers. The pools,
+// the symbol table and the collector are shared and thread-safe.
+//
+// A thread must attach before it allocates anything and detach before it
+// exits. The main thread is attached by `GC_INIT()`:
+//
+//     void* worker(void* arg) {
+//         LISP_THREAD_ATTACH();
+//         LispContext* ctx = lisp_context_new(true);
+//         ValueRef three = lisp_context_eval_string(ctx, "(+ 1 2)");
+//         lisp_context_free(ctx);
+//         lisp_thread_detach();
+//         return NULL;
+//     }
+//
+// A collection waits for every attached thread to reach a safepoint, so an
+// attached thread that blocks outside the interpreter must do it through
+// `gc_call_blocking`, as `lisp_thread_join` does.
+
+// Defined in `./main.c`.
+ValueRef eval(ValueRef, Env*);
+
+typedef struct LispContext {
+    Env* env;
+    bool vm; // Evaluate on the bytecode VM rather than the tree-walker.
+    struct LispContext* prev;
+    struct LispContext* next;
+} LispContext;
+
+// Every live context, so the collector can find their environments.
+// Guarded by `HEAP_LOCK`.
+static LispContext* LISP_CONTEXTS = NULL;
+
+static void context_mark_roots(void* local) {
+    for (LispContext* ctx = LISP_CONTEXTS; ctx != NULL; ctx = ctx->next)
+        if (ctx->env != NULL) gc_mark_env(ctx->env);
+}
+
+void context_init(void) {
+    gc_register_root_scanner(context_mark_roots, NULL);
+}
+
+#define LISP_THREAD_ATTACH() GC_THREAD_ATTACH()
+
+/// Releases the calling thread's interpreter state and detaches it from
+/// the collector.
+void lisp_thread_detach(void) {
+    vm_thread_free();
+    profile_thread_free();
+    env_free_slot_blocks();
+    gc_thread_detach();
+}
+
+LispContext* lisp_context_new(bool vm) {
+    LispContext* ctx = malloc(sizeof(LispContext));
+    if (ctx == NULL) panic("%s", "Context alloc error!");
+    *ctx = (LispContext) { .env=NULL, .vm=vm, .prev=NULL };
+    gc_heap_lock();
+    ctx->next = LISP_CONTEXTS;
+    if (LISP_CONTEXTS != NULL) LISP_CONTEXTS->prev = ctx;
+    LISP_CONTEXTS = ctx;
+    pthread_mutex_unlock(&HEAP_LOCK);
+    // Linked first, so the environment is a root as soon as it exists.
+    ctx->env = global_env();
+    return ctx;
+}
+
+void lisp_context_free(LispContext* ctx) {
+    gc_heap_lock();
+    if (ctx->prev != NULL) ctx->prev->next = ctx->next;
+    else LISP_CONTEXTS = ctx->next;
+    if (ctx->next != NULL) ctx->next->prev = ctx->prev;
+    pthread_mutex_unlock(&HEAP_LOCK);
+    free(ctx);
+}
+
+ValueRef lisp_context_eval(LispContext* ctx, ValueRef expr) {
+    bool enabled = VM.enabled;
+    VM.enabled = ctx->vm;
+    ValueRef value = eval(expr, ctx->env);
+    VM.enabled = enabled;
+    return value;
+}
+
+/// Evaluates every form in `text`, returning the last one's value.
+ValueRef lisp_context_eval_string(LispContext* ctx, const char* text) {
+    FILE* in = fmemopen((void*) text, strlen(text), "r");
+    if (in == NULL) panic("%s", "fmemopen failed!");
+    Reader reader;
+    reader_init(&reader, in);
+    ValueRef expr, value = (ValueRef) NULL;
+    while (read_value(&reader, &expr))
+        value = lisp_context_eval(ctx, expr);
+    reader_free(&reader);
+    fclose(in);
+    return value;
+}
+
+typedef struct ThreadJoin {
+    pthread_t thread;
+    void* result;
+} ThreadJoin;
+
+static void thread_join_blocking(void* arg) {
+    ThreadJoin* join = arg;
+    if (pthread_join(join->thread, &join->result) != 0) panic("%s", "pthread_join failed!");
+}
+
+/// Joins `thread` without holding up collections in the meantime.
+void* lisp_thread_join(pthread_t thread) {
+    ThreadJoin join = { .thread=thread, .result=NULL };
+    gc_call_blocking(thread_join_blocking, &join);
+    return join.result;
+}
+
+#endif
@@ -1,43 +1,242 @@
 #ifndef ENV_TYPE_H
 #define ENV_TYPE_H
 
-#include <stdlib.h> // malloc
+#include <stdlib.h> // malloc, free
 #include "value_types.h"
 
+#define ENV_INLINE_SLOTS 4
+
+// A frame holds every parameter of one procedure call in `slots`, in the
+// order of `names`. Frames with more than `ENV_INLINE_SLOTS` parameters keep
+// their slots in a power-of-two block from `ENV_SLOT_BLOCKS`.
+//
+// Frames come from the `ENVS` pool. A frame is `captured` once a closure
+// might refer to it; until then, the evaluator that made it for a call
+// hands it straight back with `env_release` when the call returns, so
+// non-escaping frames are reused in LIFO order without waiting for the
+// collector.
+//
+// The global frame sits at the root of every chain (`parent == NULL`). Its
+// slots are indexed directly by symbol index, with `UNBOUND_VALUE` for
+// symbols that have no global binding.
 typedef struct Env {
     struct Env* parent;
-    SymbolRef symbol;
-    ValueRef value;
+    struct Env* root;
+    ListRef names;
+    size_t count;
+    bool captured;
+    ValueRef* slots;
+    ValueRef inline_slots[ENV_INLINE_SLOTS];
 } Env;
 
-Env* env_find(Env* env, SymbolRef symbol) {
-    for (; env != NULL; env = env->parent) {
-        if (symbol_eq(env->symbol, symbol))
-            return env;
+static struct {
+    Env* envs;
+    PoolMeta meta;
+} ENVS = {
+    .meta={
+        .name="ENVS", .collected=true, .column_count=1,
+        .columns={ (void**) &ENVS.envs },
+        .column_sizes={ sizeof(Env) },
+    }
+};
+
+#define is_global_env(env) ((env)->parent == NULL)
+
+// Bumped whenever any global binding changes, so caches of global lookups
+// (see `CallCache` in `./vm.h`) can tell when they may be stale. Shared by
+// every thread, so it is read and bumped atomically.
+static uint64_t GLOBAL_VERSION = 1;
+#define global_version() __atomic_load_n(&GLOBAL_VERSION, __ATOMIC_RELAXED)
+#define bump_global_version() __atomic_fetch_add(&GLOBAL_VERSION, 1, __ATOMIC_RELAXED)
+
+// How many frames each variable lookup walked up, counted while profiling
+// (see `./profile.h`). The last bucket counts every longer walk too.
+#define ENV_WALK_BUCKETS 17
+static uint64_t ENV_WALKS[ENV_WALK_BUCKETS];
+
+static inline void env_count_walk(size_t frames) {
+    if (__builtin_expect(PROFILING, 0)) {
+        size_t bucket = frames < ENV_WALK_BUCKETS - 1 ? frames : ENV_WALK_BUCKETS - 1;
+        __atomic_fetch_add(&ENV_WALKS[bucket], 1, __ATOMIC_RELAXED);
     }
-    panic("Unbound Symbol: `%s`", symbol_to_string(symbol));
 }
 
-ValueRef env_lookup(Env* env, SymbolRef symbol) {
-    return env_find(env, symbol)->value;
+// Per-thread free lists of slot blocks, indexed by size class: class `c`
+// blocks hold `1 << c` slots. A free block is linked through its first slot.
+static _Thread_local ValueRef* ENV_SLOT_BLOCKS[64];
+
+static unsigned slot_class(size_t count) {
+    return 64 - __builtin_clzl(count - 1);
 }
 
-void print_env(FILE* out, const Env* env) {
-    fprintf(out, "Env {\n");
-    for (; env != NULL; env = env->parent) {
-        fprintf(out, "\t%s: ", symbol_to_string(env->symbol));
-        print_value(out, env->value);
-        fputc('\n', out);
+static ValueRef* env_alloc_slots(Env* env, size_t count) {
+    if (count <= ENV_INLINE_SLOTS) return env->inline_slots;
+    unsigned class = slot_class(count);
+    ValueRef* slots = ENV_SLOT_BLOCKS[class];
+    if (slots != NULL) {
+        ENV_SLOT_BLOCKS[class] = (ValueRef*) slots[0];
+        return slots;
     }
-    fprintf(out, "}\n");
+    slots = malloc(sizeof(ValueRef) << class);
+    if (slots == NULL) panic("%s", "Env slots alloc error!");
+    return slots;
 }
 
-Env* make_env(Env* const parent, SymbolRef symbol, ValueRef value) {
-    Env* env = malloc(sizeof(env));
+/// Frees the calling thread's cached slot blocks, e.g. before it exits.
+void env_free_slot_blocks(void) {
+    for (unsigned class = 0; class < 64; class++) {
+        while (ENV_SLOT_BLOCKS[class] != NULL) {
+            ValueRef* block = ENV_SLOT_BLOCKS[class];
+            ENV_SLOT_BLOCKS[class] = (ValueRef*) block[0];
+            free(block);
+        }
+    }
+}
+
+static void env_free_slots(Env* env) {
+    if (env->slots == env->inline_slots) return;
+    unsigned class = slot_class(env->count);
+    env->slots[0] = (ValueRef) ENV_SLOT_BLOCKS[class];
+    ENV_SLOT_BLOCKS[class] = env->slots;
+}
+
+/// Makes a frame for `count` parameters named by `names`. Every slot starts
+/// out unbound.
+Env* make_frame(Env* const parent, ListRef names, size_t count) {
+    Idx idx = pool_alloc(&ENVS.meta);
+    Env* env = &ENVS.envs[idx];
     env->parent = parent;
-    env->symbol = symbol;
-    env->value = value;
+    env->root = parent ? parent->root : env;
+    env->names = names;
+    env->count = count;
+    env->captured = false;
+    env->slots = env_alloc_slots(env, count);
+    for (size_t i = 0; i < count; i++) env->slots[i] = UNBOUND_VALUE;
     return env;
 }
 
-#endif
\ No newline at end of file
+/// Marks `env` and the frames it extends as reachable from a closure.
+void env_capture(Env* env) {
+    for (; env != NULL && !env->captured; env = env->parent)
+        env->captured = true;
+}
+
+/// Returns a finished call's frame to the pool, unless a closure captured
+/// it. Nothing may use `env` afterwards.
+void env_release(Env* env) {
+    if (env->captured) return;
+    env_free_slots(env);
+    *env = (Env) { .parent=NULL, .root=NULL, .names=(ListRef) NULL, .count=0, .slots=NULL };
+    pool_free(&ENVS.meta, (Idx) (env - ENVS.envs));
+}
+
+Env* make_global_env(void) {
+    return make_frame(NULL, (ListRef) NULL, 0);
+}
+
+/// Makes a frame binding just `symbol` to `value`.
+Env* make_env(Env* const parent, SymbolRef symbol, ValueRef value) {
+    Env* env = make_frame(parent, (ListRef) make_pair_ref((ValueRef) symbol, (ValueRef) NULL), 1);
+    env->slots[0] = value;
+    return env;
+}
+
+/// Returns the slot `symbol` is bound in, or `NULL` if it's unbound.
+ValueRef* env_find(Env* env, SymbolRef symbol) {
+    size_t frames = 0;
+    for (; !is_global_env(env); env = env->parent, frames++) {
+        size_t slot = 0;
+        for (ListRef name = env->names; !is_null(name); name = cdr_lookup(name), slot++) {
+            if (symbol_eq(car_lookup(name), symbol) && slot < env->count) {
+                env_count_walk(frames);
+                return &env->slots[slot];
+            }
+        }
+    }
+    env_count_walk(frames);
+    Idx idx = GET_VALUE_DATA(symbol);
+    if (idx >= env->count || env->slots[idx] == UNBOUND_VALUE) return NULL;
+    return &env->slots[idx];
+}
+
+ValueRef env_lookup(Env* env, SymbolRef symbol) {
+    ValueRef* slot = env_find(env, symbol);
+    if (slot == NULL || *slot == UNBOUND_VALUE)
+        panic("Unbound Symbol: `%s`", symbol_to_string(symbol));
+    return *slot;
+}
+
+// Defined in `./optimize.h`.
+void optimize_check_rebind(Env* root, SymbolRef symbol);
+
+/// Binds `symbol` to `value` in the global frame at the root of `env`.
+void env_define(Env* env, SymbolRef symbol, ValueRef value) {
+    Env* root = env->root;
+    optimize_check_rebind(root, symbol);
+    Idx idx = GET_VALUE_DATA(symbol);
+    if (idx >= root->count) {
+        size_t count = root->count ? root->count : 64;
+        while (count <= idx) count *= 2;
+        ValueRef* slots = env_alloc_slots(root, count);
+        memcpy(slots, root->slots, root->count * sizeof(ValueRef));
+        for (size_t i = root->count; i < count; i++) slots[i] = UNBOUND_VALUE;
+        env_free_slots(root);
+        root->slots = slots;
+        root->count = count;
+    }
+    root->slots[idx] = value;
+    bump_global_version();
+}
+
+/// Finds the slot a resolved `LOCAL_REF` or `GLOBAL_REF` refers to. Global
+/// slots may be unbound.
+ValueRef* env_ref_slot(Env* env, ValueRef ref) {
+    if (is_other_kind(ref, LOCAL_REF)) {
+        env_count_walk(local_ref_depth(ref));
+        for (Idx depth = local_ref_depth(ref); depth > 0; depth--)
+            env = env->parent;
+        return &env->slots[local_ref_slot(ref)];
+    } else {
+        Env* root = env->root;
+        Idx idx = GET_OTHER_DATA(ref);
+        if (idx >= root->count) panic("Unbound Symbol: `%s`", symbol_to_string(global_ref_symbol(ref)));
+        return &root->slots[idx];
+    }
+}
+
+/// Names the variable a resolved reference refers to, for error messages.
+SymbolRef env_ref_name(Env* env, ValueRef ref) {
+    if (is_other_kind(ref, GLOBAL_REF)) return global_ref_symbol(ref);
+    for (Idx depth = local_ref_depth(ref); depth > 0; depth--)
+        env = env->parent;
+    ListRef name = env->names;
+    for (Idx slot = local_ref_slot(ref); slot > 0; slot--)
+        name = cdr_lookup(name);
+    return car_lookup(name);
+}
+
+ValueRef env_ref_lookup(Env* env, ValueRef ref) {
+    ValueRef value = *env_ref_slot(env, ref);
+    if (value == UNBOUND_VALUE)
+        panic("Unbound Symbol: `%s`", symbol_to_string(env_ref_name(env, ref)));
+    return value;
+}
+
+void print_env(FILE* out, const Env* env) {
+    fprintf(out, "Env {\n");
+    for (; !is_global_env(env); env = env->parent) {
+        size_t slot = 0;
+        for (ListRef name = env->names; !is_null(name) && slot < env->count; name = cdr_lookup(name), slot++) {
+            fprintf(out, "\t%s: ", symbol_to_string(car_lookup(name)));
+            println_value(out, env->slots[slot]);
+        }
+    }
+    for (Idx idx = 0; idx < env->count; idx++) {
+        if (env->slots[idx] == UNBOUND_VALUE) continue;
+        fprintf(out, "\t%s: ", symbol_to_string(MAKE_VALUE(SYMBOL, idx)));
+        println_value(out, env->slots[idx]);
+    }
+    fprintf(out, "}\n");
+}
+
+#endif
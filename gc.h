@@ -0,0 +1,472 @@
+#ifndef GC_H
+#define GC_H
+
+#include <time.h> // clock_gettime
+#include <stdint.h> // uintptr_t
+#include <pthread.h> // pthread_cond_t
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+
+// Non-moving mark-sweep collector over PAIRS, BIG_VALUES, ENVS and the pools
+// of heap-allocated `OTHER_VALUE` kinds registered with
+// `gc_register_other_kind`.
+//
+// Roots are found by conservatively scanning the C stack (and spilled
+// registers) of every attached thread, between its innermost frame and the
+// frame that called `GC_INIT()` or `GC_THREAD_ATTACH()`. Any word that looks
+// like a heap `ValueRef`, a pool index or a pointer into a pool keeps its
+// target alive. Since nothing moves, a false positive only retains garbage.
+//
+// A collection stops the world: the collecting thread waits, holding
+// nothing but `HEAP_LOCK`, until every other attached thread has parked,
+// either at a safepoint (any allocation, or taking the heap lock) or in
+// `gc_call_blocking`. A thread that blocks for long outside the
+// interpreter must do so through `gc_call_blocking`, or it holds up every
+// collection until it returns.
+
+#define GC_MAX_ROOT_SCANNERS 8
+
+// A thread that may allocate from the pools.
+typedef struct GcThread {
+    uintptr_t* stack_base;
+    uintptr_t* stack_top; // Innermost frame to scan, set whenever it parks.
+    bool parked;
+    Tlab* tlabs; // The thread's `TLABS`.
+    void* locals[GC_MAX_ROOT_SCANNERS]; // Per-thread state for each root scanner.
+    struct GcThread* next;
+} GcThread;
+
+static _Thread_local GcThread* GC_SELF = NULL;
+
+// Everything but `verbose` is guarded by `HEAP_LOCK`.
+static struct {
+    bool verbose;
+    size_t cycles;
+    size_t total_reclaimed;
+    double total_pause_ms;
+    ValueRef* mark_stack;
+    size_t mark_stack_len;
+    size_t mark_stack_cap;
+    GcThread* threads;
+    size_t thread_count;
+    size_t parked_count;
+    pthread_cond_t parked; // Signalled as threads park or detach.
+    pthread_cond_t resume; // Broadcast when a collection finishes.
+} GC = {
+    .verbose=false,
+    .parked=PTHREAD_COND_INITIALIZER,
+    .resume=PTHREAD_COND_INITIALIZER,
+};
+
+// How to collect the pool behind one `OTHER_VALUE` kind.
+typedef struct OtherKindGc {
+    PoolMeta* meta;
+    void (*trace)(Idx idx); // Pushes every value the cell refers to.
+    void (*clear)(Idx idx); // Releases whatever a dead cell owns.
+} OtherKindGc;
+
+static OtherKindGc GC_OTHER_KINDS[1 << OTHER_KIND_BITS];
+
+// Marks roots that live outside the C stack, e.g. an interpreter's own
+// stack. If `local` is set, each attached thread has its own such state:
+// `local()` returns the calling thread's, and `scan` is called once per
+// thread with it. Otherwise `scan` is called once, with `NULL`.
+typedef struct GcRootScanner {
+    void (*scan)(void* local);
+    void* (*local)(void);
+} GcRootScanner;
+
+static GcRootScanner GC_ROOT_SCANNERS[GC_MAX_ROOT_SCANNERS];
+static size_t GC_ROOT_SCANNER_COUNT = 0;
+
+#define GC_INIT() gc_init(__builtin_frame_address(0))
+#define GC_THREAD_ATTACH() gc_thread_attach(__builtin_frame_address(0))
+
+void gc_thread_attach(void* stack_base);
+
+/// Sets up the collector and attaches the calling (main) thread.
+void gc_init(void* stack_base) {
+    GC.verbose = getenv("LISP_GC_VERBOSE") != NULL;
+    gc_thread_attach(stack_base);
+}
+
+// Returns an address below the caller's frame, so scanning up from it
+// covers the caller's spilled registers.
+static __attribute__((noinline)) uintptr_t* gc_stack_top(void) {
+    return (uintptr_t*) __builtin_frame_address(0);
+}
+
+/// Waits out any pending collection, counting the caller as parked.
+static void gc_park_locked(GcThread* self) {
+    while (GC_STOP_REQUESTED) {
+        self->parked = true;
+        GC.parked_count++;
+        pthread_cond_signal(&GC.parked);
+        pthread_cond_wait(&GC.resume, &HEAP_LOCK);
+        self->parked = false;
+        GC.parked_count--;
+    }
+}
+
+/// Takes `HEAP_LOCK`, first parking if a collection is pending. This is a
+/// safepoint: the caller's frames must hold all its live values.
+__attribute__((noinline)) void gc_heap_lock(void) {
+    __builtin_unwind_init();
+    GcThread* self = GC_SELF;
+    if (self != NULL) self->stack_top = gc_stack_top();
+    pthread_mutex_lock(&HEAP_LOCK);
+    if (self != NULL && !self->parked) gc_park_locked(self);
+}
+
+void gc_safepoint(void) {
+    gc_heap_lock();
+    pthread_mutex_unlock(&HEAP_LOCK);
+}
+
+/// Calls `fn(arg)`, which must not touch the heap, with the calling thread
+/// parked, so collections can proceed while it blocks.
+__attribute__((noinline)) void gc_call_blocking(void (*fn)(void*), void* arg) {
+    __builtin_unwind_init();
+    GcThread* self = GC_SELF;
+    pthread_mutex_lock(&HEAP_LOCK);
+    self->stack_top = gc_stack_top();
+    self->parked = true;
+    GC.parked_count++;
+    pthread_cond_signal(&GC.parked);
+    pthread_mutex_unlock(&HEAP_LOCK);
+
+    fn(arg);
+
+    pthread_mutex_lock(&HEAP_LOCK);
+    while (GC_STOP_REQUESTED) pthread_cond_wait(&GC.resume, &HEAP_LOCK);
+    self->parked = false;
+    GC.parked_count--;
+    pthread_mutex_unlock(&HEAP_LOCK);
+}
+
+/// Registers the calling thread, whose stack starts at `stack_base`, with
+/// the collector. Use `GC_THREAD_ATTACH()` before a new thread allocates.
+void gc_thread_attach(void* stack_base) {
+    GcThread* self = calloc(1, sizeof(GcThread));
+    if (self == NULL) panic("%s", "GC thread alloc error!");
+    self->stack_base = (uintptr_t*) stack_base;
+    self->tlabs = TLABS;
+    for (size_t i = 0; i < GC_ROOT_SCANNER_COUNT; i++)
+        if (GC_ROOT_SCANNERS[i].local != NULL) self->locals[i] = GC_ROOT_SCANNERS[i].local();
+
+    pthread_mutex_lock(&HEAP_LOCK);
+    // Not attached yet, so no collection is waiting on us.
+    while (GC_STOP_REQUESTED) pthread_cond_wait(&GC.resume, &HEAP_LOCK);
+    self->next = GC.threads;
+    GC.threads = self;
+    GC.thread_count++;
+    pthread_mutex_unlock(&HEAP_LOCK);
+    GC_SELF = self;
+}
+
+/// Unregisters the calling thread, which must not allocate afterwards. The
+/// cells left in its batches are reclaimed by the next collection.
+void gc_thread_detach(void) {
+    GcThread* self = GC_SELF;
+    gc_heap_lock();
+    for (GcThread** link = &GC.threads; *link != NULL; link = &(*link)->next) {
+        if (*link == self) {
+            *link = self->next;
+            break;
+        }
+    }
+    GC.thread_count--;
+    pthread_cond_signal(&GC.parked);
+    pthread_mutex_unlock(&HEAP_LOCK);
+    memset(TLABS, 0, sizeof(TLABS));
+    GC_SELF = NULL;
+    free(self);
+}
+
+#define mark_bit_get(marks, idx) (((marks)[(idx) / 64] >> ((idx) % 64)) & 1UL)
+#define mark_bit_set(marks, idx) ((marks)[(idx) / 64] |= (1UL << ((idx) % 64)))
+
+/// Returns `true` if `idx` was not already marked.
+static bool pool_mark(PoolMeta* meta, Idx idx) {
+    if (mark_bit_get(meta->marks, idx)) return false;
+    mark_bit_set(meta->marks, idx);
+    return true;
+}
+
+void gc_register_other_kind(unsigned kind, PoolMeta* meta, void (*trace)(Idx), void (*clear)(Idx)) {
+    GC_OTHER_KINDS[kind] = (OtherKindGc) { .meta=meta, .trace=trace, .clear=clear };
+}
+
+/// Must be called before any thread but the main one attaches.
+void gc_register_root_scanner(void (*scan)(void*), void* (*local)(void)) {
+    if (GC_ROOT_SCANNER_COUNT == GC_MAX_ROOT_SCANNERS) panic("%s", "Too many GC root scanners!");
+    if (GC.thread_count > 1) panic("%s", "Root scanners must be registered before threads attach!");
+    if (local != NULL && GC_SELF != NULL) GC_SELF->locals[GC_ROOT_SCANNER_COUNT] = local();
+    GC_ROOT_SCANNERS[GC_ROOT_SCANNER_COUNT++] = (GcRootScanner) { .scan=scan, .local=local };
+}
+
+void gc_push(ValueRef value) {
+    if (GC.mark_stack_len == GC.mark_stack_cap) {
+        GC.mark_stack_cap = GC.mark_stack_cap ? 2 * GC.mark_stack_cap : 4096;
+        GC.mark_stack = realloc(GC.mark_stack, GC.mark_stack_cap * sizeof(ValueRef));
+        if (GC.mark_stack == NULL) panic("%s", "GC mark stack alloc error!");
+    }
+    GC.mark_stack[GC.mark_stack_len++] = value;
+}
+
+void gc_mark_env(Env* env) {
+    for (; env != NULL; env = env->parent) {
+        if (!pool_mark(&ENVS.meta, (Idx) (env - ENVS.envs))) return;
+        gc_push(env->names);
+        for (size_t slot = 0; slot < env->count; slot++)
+            gc_push(env->slots[slot]);
+    }
+}
+
+static void gc_drain(void) {
+    while (GC.mark_stack_len > 0) {
+        ValueRef value = GC.mark_stack[--GC.mark_stack_len];
+        Idx idx = GET_VALUE_DATA(value);
+        switch (GET_VALUE_KIND(value)) {
+        case PAIR:
+            // Walk down the spine so long lists don't grow the mark stack.
+            while (pool_mark(&PAIRS.meta, idx)) {
+                gc_push(pair_car(idx));
+                ValueRef cdr = pair_cdr(idx);
+                if (!is_pair(cdr)) {
+                    gc_push(cdr);
+                    break;
+                }
+                idx = GET_VALUE_DATA(cdr);
+            }
+            break;
+        case PROCEDURE:
+            if (pool_mark(&BIG_VALUES.meta, idx)) {
+                gc_mark_env((Env*) BIG_VALUES.v1[idx]);
+                gc_push(BIG_VALUES.v2[idx]);
+                gc_push(BIG_VALUES.v3[idx]);
+                gc_push(BIG_VALUES.v4[idx]);
+            }
+            break;
+        case BUILTIN_PROCEDURE:
+        case SPECIAL_FORM:
+            // The cell holds a name and a function pointer, not values.
+            pool_mark(&PAIRS.meta, idx);
+            break;
+        case OTHER_VALUE: {
+            OtherKindGc* kind = &GC_OTHER_KINDS[GET_OTHER_KIND(value)];
+            idx = GET_OTHER_DATA(value);
+            if (kind->meta != NULL && idx < kind->meta->next_idx && pool_mark(kind->meta, idx))
+                kind->trace(idx);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+/// If `word` points into `array` (of `count` elements of `size` bytes),
+/// returns the element index, else `NO_IDX`.
+static Idx gc_interior_idx(uintptr_t word, const void* array, size_t size, Idx count) {
+    uintptr_t lo = (uintptr_t) array;
+    if (word < lo || word >= lo + count * size) return NO_IDX;
+    return (word - lo) / size;
+}
+
+/// Marks whatever `word` might refer to.
+static void gc_mark_conservative(uintptr_t word) {
+    Idx idx = GET_VALUE_DATA(word);
+    switch (GET_VALUE_KIND(word)) {
+    case PAIR:
+    case BUILTIN_PROCEDURE:
+    case SPECIAL_FORM:
+        if (idx < PAIRS.meta.next_idx) gc_push((ValueRef) word);
+        return;
+    case PROCEDURE:
+        if (idx < BIG_VALUES.meta.next_idx) gc_push((ValueRef) word);
+        return;
+    case OTHER_VALUE:
+        // `gc_drain` checks the index against the kind's pool.
+        gc_push((ValueRef) word);
+        return;
+    case NULL_LIST:
+        break;
+    default:
+        return;
+    }
+
+    // An untagged word. After inlining, the compiler is free to keep just
+    // the index of a cell (or a pointer into one of the pool arrays) live
+    // across a call and re-tag it afterwards, so treat those as references
+    // too.
+    Idx pairs = PAIRS.meta.next_idx, big_values = BIG_VALUES.meta.next_idx;
+    if (word < pairs) gc_push(MAKE_VALUE(PAIR, word));
+    if (word < big_values) gc_push(MAKE_VALUE(PROCEDURE, word));
+    if (word < ENVS.meta.next_idx) gc_mark_env(&ENVS.envs[word]);
+
+    for (size_t i = 0; i < PAIRS.meta.column_count; i++) {
+        idx = gc_interior_idx(word, *PAIRS.meta.columns[i], PAIRS.meta.column_sizes[i], pairs);
+        if (idx != NO_IDX) gc_push(MAKE_VALUE(PAIR, idx));
+    }
+    if ((idx = gc_interior_idx(word, BIG_VALUES.v1, sizeof(ValueRef), big_values)) != NO_IDX ||
+        (idx = gc_interior_idx(word, BIG_VALUES.v2, sizeof(ValueRef), big_values)) != NO_IDX ||
+        (idx = gc_interior_idx(word, BIG_VALUES.v3, sizeof(ValueRef), big_values)) != NO_IDX ||
+        (idx = gc_interior_idx(word, BIG_VALUES.v4, sizeof(ValueRef), big_values)) != NO_IDX)
+        gc_push(MAKE_VALUE(PROCEDURE, idx));
+    if ((idx = gc_interior_idx(word, ENVS.envs, sizeof(Env), ENVS.meta.next_idx)) != NO_IDX)
+        gc_mark_env(&ENVS.envs[idx]);
+
+    for (unsigned kind = 0; kind < (1 << OTHER_KIND_BITS); kind++) {
+        PoolMeta* meta = GC_OTHER_KINDS[kind].meta;
+        if (meta == NULL) continue;
+        if (word < meta->next_idx) gc_push(MAKE_OTHER(kind, word));
+        for (size_t i = 0; i < meta->column_count; i++) {
+            idx = gc_interior_idx(word, *meta->columns[i], meta->column_sizes[i], meta->next_idx);
+            if (idx != NO_IDX) gc_push(MAKE_OTHER(kind, idx));
+        }
+    }
+}
+
+// Reads whole stacks, so it is exempt from address sanitizing.
+static __attribute__((no_sanitize_address)) void gc_scan_range(uintptr_t* top, uintptr_t* base) {
+    for (uintptr_t* word = top; word < base; word++) {
+        gc_mark_conservative(*word);
+        gc_drain();
+    }
+}
+
+/// Scans the collecting thread's stack and every parked thread's.
+static __attribute__((noinline)) void gc_scan_stacks(GcThread* self) {
+    uintptr_t here = 0;
+    gc_scan_range(&here, self->stack_base);
+    for (GcThread* thread = GC.threads; thread != NULL; thread = thread->next)
+        if (thread != self) gc_scan_range(thread->stack_top, thread->stack_base);
+}
+
+/// Rebuilds the free list from unmarked cells and clears the marks.
+/// Returns the number of cells that were in use before and are free now.
+static size_t gc_sweep(PoolMeta* meta, void (*clear)(Idx)) {
+    Idx in_use_before = meta->next_idx - meta->free_count;
+    meta->free_count = 0;
+    for (Idx idx = 0; idx < meta->next_idx; idx++) {
+        if (!mark_bit_get(meta->marks, idx)) {
+            clear(idx);
+            meta->free_idxs[meta->free_count++] = idx;
+        }
+    }
+    if (meta->marks != NULL) memset(meta->marks, 0, MARK_WORDS(meta->next_idx) * sizeof(uint64_t));
+    Idx live = meta->next_idx - meta->free_count;
+    return in_use_before > live ? in_use_before - live : 0;
+}
+
+/// Drops the hash-consed pairs the sweep is about to free from the table,
+/// so their cells come back as ordinary pairs.
+static void gc_sweep_hash_conses(void) {
+    if (HASH_CONSES.count == 0) return;
+    Idx* live = malloc(HASH_CONSES.count * sizeof(Idx));
+    if (live == NULL) panic("%s", "Hash cons sweep alloc error!");
+    size_t count = 0;
+    for (size_t slot = 0; slot < HASH_CONSES.size; slot++) {
+        Idx idx = HASH_CONSES.slots[slot];
+        if (idx == NO_IDX) continue;
+        if (mark_bit_get(PAIRS.meta.marks, idx)) live[count++] = idx;
+        else HASH_CONSES.consed[idx / 64] &= ~(1UL << (idx % 64));
+    }
+    hash_cons_rebuild(HASH_CONSES.size, live, count);
+    free(live);
+}
+
+static void clear_pair(Idx idx) {
+    pair_car(idx) = pair_cdr(idx) = (ValueRef) NULL;
+}
+
+static void clear_big_value(Idx idx) {
+    BIG_VALUES.v1[idx] = BIG_VALUES.v2[idx] = BIG_VALUES.v3[idx] = BIG_VALUES.v4[idx] = (ValueRef) NULL;
+}
+
+static void clear_env(Idx idx) {
+    Env* env = &ENVS.envs[idx];
+    if (env->slots != NULL) env_free_slots(env);
+    *env = (Env) { .parent=NULL, .root=NULL, .names=(ListRef) NULL, .count=0, .slots=NULL };
+}
+
+static double gc_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/// Collects with `HEAP_LOCK` held, once every other thread has parked.
+__attribute__((noinline)) void gc_collect_locked(void) {
+    GcThread* self = GC_SELF;
+    if (self == NULL) panic("%s", "Collecting from a thread that isn't attached!");
+    GC_STOP_REQUESTED = 1;
+    while (GC.parked_count + 1 < GC.thread_count)
+        pthread_cond_wait(&GC.parked, &HEAP_LOCK);
+    double start = gc_now_ms();
+
+    // Spill callee-saved registers onto the stack so the scan sees them.
+    // (`setjmp` won't do: glibc mangles some of the registers it saves.)
+    __builtin_unwind_init();
+    gc_scan_stacks(self);
+    for (size_t i = 0; i < GC_ROOT_SCANNER_COUNT; i++) {
+        GcRootScanner* scanner = &GC_ROOT_SCANNERS[i];
+        if (scanner->local == NULL) {
+            scanner->scan(NULL);
+        } else {
+            for (GcThread* thread = GC.threads; thread != NULL; thread = thread->next)
+                scanner->scan(thread->locals[i]);
+        }
+        gc_drain();
+    }
+
+    // Cells cached in batches are unmarked, so the sweep frees them.
+    for (GcThread* thread = GC.threads; thread != NULL; thread = thread->next)
+        for (unsigned id = 0; id < MAX_POOLS; id++) thread->tlabs[id].count = 0;
+
+    gc_sweep_hash_conses();
+    size_t pairs = gc_sweep(&PAIRS.meta, clear_pair);
+    size_t big_values = gc_sweep(&BIG_VALUES.meta, clear_big_value);
+    size_t envs = gc_sweep(&ENVS.meta, clear_env);
+    size_t others = 0;
+    for (unsigned kind = 0; kind < (1 << OTHER_KIND_BITS); kind++) {
+        OtherKindGc* other = &GC_OTHER_KINDS[kind];
+        if (other->meta != NULL) others += gc_sweep(other->meta, other->clear);
+    }
+
+    double pause_ms = gc_now_ms() - start;
+    GC.cycles++;
+    GC.total_reclaimed += pairs + big_values + envs + others;
+    GC.total_pause_ms += pause_ms;
+    if (GC.verbose) {
+        fprintf(stderr,
+            "[gc #%zu] pause=%.3fms reclaimed: pairs=%zu big_values=%zu envs=%zu others=%zu\n",
+            GC.cycles, pause_ms, pairs, big_values, envs, others);
+    }
+
+    GC_STOP_REQUESTED = 0;
+    pthread_cond_broadcast(&GC.resume);
+}
+
+void gc_collect(void) {
+    gc_heap_lock();
+    gc_collect_locked();
+    pthread_mutex_unlock(&HEAP_LOCK);
+}
+
+/// Counts the cells of a collected pool that are neither free nor cached
+/// in some thread's batch.
+Idx pool_in_use(PoolMeta* meta) {
+    pthread_mutex_lock(&HEAP_LOCK);
+    Idx in_use = meta->next_idx - meta->free_count;
+    if (meta->id != 0)
+        for (GcThread* thread = GC.threads; thread != NULL; thread = thread->next)
+            in_use -= thread->tlabs[meta->id].count;
+    pthread_mutex_unlock(&HEAP_LOCK);
+    return in_use;
+}
+
+#endif
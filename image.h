@@ -0,0 +1,745 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h> // FILE, fopen, fwrite
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "builtins.h"
+#include "numbers.h"
+#include "vectors.h"
+#include "tables.h"
+#include "memo.h"
+#include "gc.h"
+
+// Heap images, for starting up without re-evaluating a prelude.
+//
+// `image_save` writes everything reachable from a global environment to a
+// file, and `image_load` maps it back in at startup, before anything else
+// is allocated. Every cell keeps the index it had when saved, so no
+// `ValueRef` needs relocating: the pair columns, procedure parameters and
+// bodies, and flonums are mapped straight from the file, copy-on-write.
+// (Images always hold cars and cdrs as separate columns; a build with
+// interleaved pairs copies them into place instead.)
+// Only what holds C pointers is rebuilt on load: frames, each procedure's
+// `Env*`, symbol names, bignum limbs, the elements of vectors and strings,
+// the entries of tables, which are inserted again, and the cells of builtins
+// and special forms, which are looked up by name. Compiled code isn't saved;
+// the VM compiles procedures again as it calls them. A memoized procedure is
+// saved as the procedure it wraps and its size bound, and made again on load
+// with an empty table, in the cell it had.
+//
+// Cells that weren't reachable are saved empty and put back on the free
+// lists. An image only suits builds with the same `IMAGE_VERSION` and page
+// size, and may only refer to the builtins in `BUILTIN_PROCS`.
+
+#define IMAGE_MAGIC "LISPIMG"
+#define IMAGE_VERSION 4
+#define IMAGE_NAME_LEN 32
+
+// The collected pools an image holds, besides `SYMBOLS`.
+enum IMAGE_POOL {
+    IMAGE_PAIRS,
+    IMAGE_BIG_VALUES,
+    IMAGE_ENVS,
+    IMAGE_BIGNUMS,
+    IMAGE_FLONUMS,
+    IMAGE_VECTORS,
+    IMAGE_STRINGS,
+    IMAGE_TABLES,
+    IMAGE_POOL_COUNT,
+};
+
+static PoolMeta* const IMAGE_POOLS[IMAGE_POOL_COUNT] = {
+    &PAIRS.meta, &BIG_VALUES.meta, &ENVS.meta, &BIGNUMS.meta, &FLONUMS.meta,
+    &VECTORS.meta, &STRINGS.meta, &TABLES.meta,
+};
+
+// Each section starts on a page boundary, so the plain columns can be
+// mapped in place.
+enum IMAGE_SECTION {
+    IMAGE_CARS,          // `ValueRef` per pair.
+    IMAGE_CDRS,          // `ValueRef` per pair.
+    IMAGE_PROC_ENVS,     // Frame index + 1 per big value, or 0.
+    IMAGE_PROC_PARAMS,   // `ValueRef` per big value.
+    IMAGE_PROC_BODIES,   // `ValueRef` per big value.
+    IMAGE_FLONUM_VALUES, // `double` per flonum.
+    IMAGE_FRAMES,        // `ImageEnv` per frame.
+    IMAGE_FRAME_SLOTS,   // The frames' slots, one after another.
+    IMAGE_BIGNUM_HEADERS,// `ImageBignum` per bignum.
+    IMAGE_LIMBS,         // The bignums' limbs, one after another.
+    IMAGE_VECTOR_HEADERS,// `ImageSpan` per vector.
+    IMAGE_VECTOR_ITEMS,  // The vectors' elements, one after another.
+    IMAGE_STRING_HEADERS,// `ImageSpan` per string.
+    IMAGE_STRING_BYTES,  // The strings' bytes, one after another.
+    IMAGE_TABLE_HEADERS, // `ImageSpan` per table.
+    IMAGE_TABLE_ENTRIES, // The tables' `TableEntry`s, one after another.
+    IMAGE_SYMBOLS,       // `ImageSymbol` per symbol.
+    IMAGE_SYMBOL_TEXT,   // Every symbol's name, NUL-terminated.
+    IMAGE_NATIVES,       // `ImageNative` per builtin or special form cell.
+    IMAGE_MEMOS,         // `ImageMemo` per memoized procedure.
+    IMAGE_FREE,          // Each pool's free indices, in `IMAGE_POOL` order.
+    IMAGE_SECTION_COUNT,
+};
+
+typedef struct ImageSection {
+    uint64_t offset; // In bytes, from the start of the file.
+    uint64_t bytes;
+} ImageSection;
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t root_env; // Frame index of the saved global environment.
+    uint64_t symbol_count;
+    uint64_t next_idxs[IMAGE_POOL_COUNT];
+    uint64_t free_counts[IMAGE_POOL_COUNT];
+    ImageSection sections[IMAGE_SECTION_COUNT];
+} ImageHeader;
+
+typedef struct ImageEnv {
+    uint64_t parent; // Frame index + 1, or 0 for a global frame.
+    uint64_t root;   // Frame index + 1, or 0 for an unused cell.
+    ValueRef names;
+    uint64_t count;
+    uint64_t captured;
+    uint64_t slots; // Index of the first slot in `IMAGE_FRAME_SLOTS`.
+} ImageEnv;
+
+typedef struct ImageBignum {
+    uint64_t negative;
+    uint64_t len;
+    uint64_t limbs; // Index of the first limb in `IMAGE_LIMBS`.
+} ImageBignum;
+
+typedef struct ImageSpan {
+    uint64_t used; // 0 for an unused cell.
+    uint64_t len;
+    uint64_t start; // Index of the first element in the matching section.
+} ImageSpan;
+
+typedef struct ImageSymbol {
+    uint64_t text; // Offset of the name in `IMAGE_SYMBOL_TEXT`.
+    uint64_t len;
+    uint64_t hash;
+} ImageSymbol;
+
+typedef struct ImageNative {
+    uint64_t idx; // The pair cell.
+    uint64_t special;
+    char name[IMAGE_NAME_LEN];
+} ImageNative;
+
+typedef struct ImageMemo {
+    uint64_t proc; // The memoized procedure's cell, saved without a body.
+    ValueRef fn;
+    uint64_t limit;
+} ImageMemo;
+
+//////////////////////////////////// SAVING ////////////////////////////////////
+typedef struct ImageTrace {
+    uint64_t* live[IMAGE_POOL_COUNT];
+    ValueRef* stack;
+    size_t count, cap;
+    ValueRef* natives; // Every builtin and special form cell reached.
+    size_t native_count, native_cap;
+    ValueRef* memos; // Every memoized procedure reached.
+    size_t memo_count, memo_cap;
+} ImageTrace;
+
+static void image_append(ValueRef** items, size_t* count, size_t* cap, ValueRef value) {
+    if (*count == *cap) {
+        *cap = *cap ? 2 * *cap : 1024;
+        *items = realloc(*items, *cap * sizeof(ValueRef));
+        if (*items == NULL) panic("%s", "Image trace alloc error!");
+    }
+    (*items)[(*count)++] = value;
+}
+
+/// Returns `true` if the cell wasn't already marked live.
+static bool image_mark(ImageTrace* trace, unsigned pool, Idx idx) {
+    if (idx >= IMAGE_POOLS[pool]->next_idx) panic("%s index '%lu' out of bounds!", IMAGE_POOLS[pool]->name, idx);
+    if (mark_bit_get(trace->live[pool], idx)) return false;
+    mark_bit_set(trace->live[pool], idx);
+    return true;
+}
+
+#define image_push(trace, value) image_append(&(trace)->stack, &(trace)->count, &(trace)->cap, value)
+
+/// Marks `env` and the frames it extends, and pushes what they refer to.
+static void image_push_env(ImageTrace* trace, Env* env) {
+    for (; env != NULL; env = env->parent) {
+        if (!image_mark(trace, IMAGE_ENVS, (Idx) (env - ENVS.envs))) return;
+        image_push(trace, env->names);
+        for (size_t i = 0; i < env->count; i++) image_push(trace, env->slots[i]);
+    }
+}
+
+static void image_drain(ImageTrace* trace) {
+    while (trace->count > 0) {
+        ValueRef value = trace->stack[--trace->count];
+        Idx idx = GET_VALUE_DATA(value);
+        switch (GET_VALUE_KIND(value)) {
+        case PAIR:
+            if (image_mark(trace, IMAGE_PAIRS, idx)) {
+                image_push(trace, pair_car(idx));
+                image_push(trace, pair_cdr(idx));
+            }
+            break;
+        case BUILTIN_PROCEDURE:
+        case SPECIAL_FORM:
+            if (image_mark(trace, IMAGE_PAIRS, idx))
+                image_append(&trace->natives, &trace->native_count, &trace->native_cap, value);
+            break;
+        case PROCEDURE:
+            if (!image_mark(trace, IMAGE_BIG_VALUES, idx)) break;
+            if (memo_of_proc(value) != NULL) {
+                // Its frame and body hold the table; only what it wraps is saved.
+                image_append(&trace->memos, &trace->memo_count, &trace->memo_cap, value);
+                image_push(trace, BIG_VALUES.v2[idx]);
+                image_push(trace, memo_of_proc(value)->fn);
+            } else {
+                image_push(trace, BIG_VALUES.v2[idx]);
+                image_push(trace, BIG_VALUES.v3[idx]);
+                image_push_env(trace, (Env*) BIG_VALUES.v1[idx]);
+            }
+            break;
+        case OTHER_VALUE:
+            if (is_bignum(value)) image_mark(trace, IMAGE_BIGNUMS, GET_OTHER_DATA(value));
+            else if (is_flonum(value)) image_mark(trace, IMAGE_FLONUMS, GET_OTHER_DATA(value));
+            else if (is_other_kind(value, CODE)) panic("%s", "Can't save compiled code in an image!");
+            else if (is_other_kind(value, MEMO)) panic("%s", "Can't save a memoized procedure in an image!");
+            else if (is_string(value)) image_mark(trace, IMAGE_STRINGS, GET_OTHER_DATA(value));
+            else if (is_vector(value) && image_mark(trace, IMAGE_VECTORS, GET_OTHER_DATA(value))) {
+                Vector* vector = &VECTORS.vectors[GET_OTHER_DATA(value)];
+                for (size_t i = 0; i < vector->len; i++) image_push(trace, vector->items[i]);
+            } else if (is_table(value) && image_mark(trace, IMAGE_TABLES, GET_OTHER_DATA(value))) {
+                Table* table = &TABLES.tables[GET_OTHER_DATA(value)];
+                for (size_t slot = 0; slot < table->cap; slot++) {
+                    if (!table->hashes[slot]) continue;
+                    image_push(trace, table->entries[slot].key);
+                    image_push(trace, table->entries[slot].value);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/// One past the highest live index of `pool`.
+static Idx image_high(ImageTrace* trace, unsigned pool) {
+    for (Idx idx = IMAGE_POOLS[pool]->next_idx; idx > 0; idx--)
+        if (mark_bit_get(trace->live[pool], idx - 1)) return idx;
+    return 0;
+}
+
+static void image_write(FILE* out, ImageHeader* header, unsigned section, const void* data, size_t bytes) {
+    long offset = (long) page_round((size_t) ftell(out));
+    if (fseek(out, offset, SEEK_SET) != 0) panic("%s", "Image seek failed!");
+    if (bytes > 0 && fwrite(data, 1, bytes, out) != bytes) panic("%s", "Image write failed!");
+    header->sections[section] = (ImageSection) { .offset=(uint64_t) offset, .bytes=bytes };
+}
+
+static void* image_calloc(size_t count, size_t size) {
+    void* data = calloc(count ? count : 1, size);
+    if (data == NULL) panic("%s", "Image buffer alloc error!");
+    return data;
+}
+
+/// Writes everything reachable from the global frame at the root of `env`
+/// to `path`. No other thread may be evaluating in the meantime. The image
+/// is written next to `path` and moved over it once complete, so a failed
+/// save leaves any image already there as it was.
+void image_save(const char* path, Env* env) {
+    size_t path_len = strlen(path);
+    char* tmp_path = image_calloc(path_len + sizeof(".tmp"), 1);
+    memcpy(tmp_path, path, path_len);
+    strcpy(tmp_path + path_len, ".tmp");
+    FILE* out = fopen(tmp_path, "wb");
+    if (out == NULL) panic("Can't open image `%s` for writing!", tmp_path);
+
+    gc_heap_lock();
+    pthread_mutex_lock(&SYMBOLS.lock);
+    ImageTrace trace = {
+        .stack=NULL, .count=0, .cap=0,
+        .natives=NULL, .native_count=0, .native_cap=0,
+        .memos=NULL, .memo_count=0, .memo_cap=0,
+    };
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++)
+        trace.live[pool] = image_calloc(MARK_WORDS(IMAGE_POOLS[pool]->next_idx), sizeof(uint64_t));
+    Env* root = env->root;
+    image_push_env(&trace, root);
+    image_drain(&trace);
+
+    ImageHeader header = {
+        .magic=IMAGE_MAGIC,
+        .version=IMAGE_VERSION,
+        .page_size=(uint32_t) sysconf(_SC_PAGESIZE),
+        .root_env=(uint64_t) (root - ENVS.envs),
+        .symbol_count=SYMBOLS.meta.next_idx,
+    };
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++)
+        header.next_idxs[pool] = image_high(&trace, pool);
+    if (fwrite(&header, sizeof(header), 1, out) != 1) panic("%s", "Image write failed!");
+
+    // Pairs. Cells of builtins and special forms are left empty.
+    Idx pairs = header.next_idxs[IMAGE_PAIRS];
+    ValueRef* cars = image_calloc(pairs, sizeof(ValueRef));
+    ValueRef* cdrs = image_calloc(pairs, sizeof(ValueRef));
+    for (Idx idx = 0; idx < pairs; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_PAIRS], idx)) continue;
+        cars[idx] = pair_car(idx);
+        cdrs[idx] = pair_cdr(idx);
+    }
+    ImageNative* natives = image_calloc(trace.native_count, sizeof(ImageNative));
+    for (size_t i = 0; i < trace.native_count; i++) {
+        ValueRef native = trace.natives[i];
+        Idx idx = GET_VALUE_DATA(native);
+        bool special = is_special_form(native);
+        char* name = special ? special_form_lookup(native).name : builtin_proc_lookup(native).name;
+        if (special ? find_special_form(name) == NULL : find_builtin(name) == NULL)
+            panic("Can't save `%s` in an image: it isn't a standard builtin!", name);
+        if (strlen(name) >= IMAGE_NAME_LEN) panic("Builtin name `%s` is too long for an image!", name);
+        natives[i] = (ImageNative) { .idx=idx, .special=special };
+        strcpy(natives[i].name, name);
+        cars[idx] = cdrs[idx] = (ValueRef) NULL;
+    }
+    image_write(out, &header, IMAGE_CARS, cars, pairs * sizeof(ValueRef));
+    image_write(out, &header, IMAGE_CDRS, cdrs, pairs * sizeof(ValueRef));
+    image_write(out, &header, IMAGE_NATIVES, natives, trace.native_count * sizeof(ImageNative));
+    free(natives);
+    free(cdrs);
+    free(cars);
+
+    // Procedures.
+    Idx procs = header.next_idxs[IMAGE_BIG_VALUES];
+    uint64_t* proc_envs = image_calloc(procs, sizeof(uint64_t));
+    ValueRef* params = image_calloc(procs, sizeof(ValueRef));
+    ValueRef* bodies = image_calloc(procs, sizeof(ValueRef));
+    for (Idx idx = 0; idx < procs; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_BIG_VALUES], idx)) continue;
+        Env* proc_env = (Env*) BIG_VALUES.v1[idx];
+        proc_envs[idx] = proc_env ? (uint64_t) (proc_env - ENVS.envs) + 1 : 0;
+        params[idx] = BIG_VALUES.v2[idx];
+        bodies[idx] = BIG_VALUES.v3[idx];
+    }
+    ImageMemo* memos = image_calloc(trace.memo_count, sizeof(ImageMemo));
+    for (size_t i = 0; i < trace.memo_count; i++) {
+        Idx idx = GET_VALUE_DATA(trace.memos[i]);
+        Memo* memo = memo_of_proc(trace.memos[i]);
+        memos[i] = (ImageMemo) { .proc=idx, .fn=memo->fn, .limit=memo->limit };
+        proc_envs[idx] = 0;
+        bodies[idx] = (ValueRef) NULL;
+    }
+    image_write(out, &header, IMAGE_PROC_ENVS, proc_envs, procs * sizeof(uint64_t));
+    image_write(out, &header, IMAGE_PROC_PARAMS, params, procs * sizeof(ValueRef));
+    image_write(out, &header, IMAGE_PROC_BODIES, bodies, procs * sizeof(ValueRef));
+    image_write(out, &header, IMAGE_MEMOS, memos, trace.memo_count * sizeof(ImageMemo));
+    free(memos);
+    free(bodies);
+    free(params);
+    free(proc_envs);
+
+    // Frames.
+    Idx frames = header.next_idxs[IMAGE_ENVS];
+    ImageEnv* image_envs = image_calloc(frames, sizeof(ImageEnv));
+    size_t slot_count = 0;
+    for (Idx idx = 0; idx < frames; idx++)
+        if (mark_bit_get(trace.live[IMAGE_ENVS], idx)) slot_count += ENVS.envs[idx].count;
+    ValueRef* slots = image_calloc(slot_count, sizeof(ValueRef));
+    for (Idx idx = 0, next_slot = 0; idx < frames; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_ENVS], idx)) continue;
+        Env* frame = &ENVS.envs[idx];
+        image_envs[idx] = (ImageEnv) {
+            .parent=frame->parent ? (uint64_t) (frame->parent - ENVS.envs) + 1 : 0,
+            .root=(uint64_t) (frame->root - ENVS.envs) + 1,
+            .names=frame->names,
+            .count=frame->count,
+            .captured=frame->captured,
+            .slots=next_slot,
+        };
+        memcpy(&slots[next_slot], frame->slots, frame->count * sizeof(ValueRef));
+        next_slot += frame->count;
+    }
+    image_write(out, &header, IMAGE_FRAMES, image_envs, frames * sizeof(ImageEnv));
+    image_write(out, &header, IMAGE_FRAME_SLOTS, slots, slot_count * sizeof(ValueRef));
+    free(slots);
+    free(image_envs);
+
+    // Numbers.
+    Idx bignums = header.next_idxs[IMAGE_BIGNUMS];
+    ImageBignum* image_bignums = image_calloc(bignums, sizeof(ImageBignum));
+    size_t limb_count = 0;
+    for (Idx idx = 0; idx < bignums; idx++)
+        if (mark_bit_get(trace.live[IMAGE_BIGNUMS], idx)) limb_count += BIGNUMS.bignums[idx].len;
+    uint32_t* limbs = image_calloc(limb_count, sizeof(uint32_t));
+    for (Idx idx = 0, next_limb = 0; idx < bignums; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_BIGNUMS], idx)) continue;
+        Bignum* big = &BIGNUMS.bignums[idx];
+        image_bignums[idx] = (ImageBignum) { .negative=big->negative, .len=big->len, .limbs=next_limb };
+        memcpy(&limbs[next_limb], big->limbs, big->len * sizeof(uint32_t));
+        next_limb += big->len;
+    }
+    image_write(out, &header, IMAGE_BIGNUM_HEADERS, image_bignums, bignums * sizeof(ImageBignum));
+    image_write(out, &header, IMAGE_LIMBS, limbs, limb_count * sizeof(uint32_t));
+    free(limbs);
+    free(image_bignums);
+
+    Idx vectors = header.next_idxs[IMAGE_VECTORS];
+    ImageSpan* vector_spans = image_calloc(vectors, sizeof(ImageSpan));
+    size_t item_count = 0;
+    for (Idx idx = 0; idx < vectors; idx++)
+        if (mark_bit_get(trace.live[IMAGE_VECTORS], idx)) item_count += VECTORS.vectors[idx].len;
+    ValueRef* items = image_calloc(item_count, sizeof(ValueRef));
+    for (Idx idx = 0, next_item = 0; idx < vectors; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_VECTORS], idx)) continue;
+        Vector* vector = &VECTORS.vectors[idx];
+        vector_spans[idx] = (ImageSpan) { .used=1, .len=vector->len, .start=next_item };
+        memcpy(&items[next_item], vector->items, vector->len * sizeof(ValueRef));
+        next_item += vector->len;
+    }
+    image_write(out, &header, IMAGE_VECTOR_HEADERS, vector_spans, vectors * sizeof(ImageSpan));
+    image_write(out, &header, IMAGE_VECTOR_ITEMS, items, item_count * sizeof(ValueRef));
+    free(items);
+    free(vector_spans);
+
+    Idx strings = header.next_idxs[IMAGE_STRINGS];
+    ImageSpan* string_spans = image_calloc(strings, sizeof(ImageSpan));
+    size_t byte_count = 0;
+    for (Idx idx = 0; idx < strings; idx++)
+        if (mark_bit_get(trace.live[IMAGE_STRINGS], idx)) byte_count += STRINGS.strings[idx].len;
+    char* bytes = image_calloc(byte_count, 1);
+    for (Idx idx = 0, next_byte = 0; idx < strings; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_STRINGS], idx)) continue;
+        String* string = &STRINGS.strings[idx];
+        string_spans[idx] = (ImageSpan) { .used=1, .len=string->len, .start=next_byte };
+        memcpy(&bytes[next_byte], string->bytes, string->len);
+        next_byte += string->len;
+    }
+    image_write(out, &header, IMAGE_STRING_HEADERS, string_spans, strings * sizeof(ImageSpan));
+    image_write(out, &header, IMAGE_STRING_BYTES, bytes, byte_count);
+    free(bytes);
+    free(string_spans);
+
+    Idx tables = header.next_idxs[IMAGE_TABLES];
+    ImageSpan* table_spans = image_calloc(tables, sizeof(ImageSpan));
+    size_t entry_count = 0;
+    for (Idx idx = 0; idx < tables; idx++)
+        if (mark_bit_get(trace.live[IMAGE_TABLES], idx)) entry_count += TABLES.tables[idx].count;
+    TableEntry* entries = image_calloc(entry_count, sizeof(TableEntry));
+    for (Idx idx = 0, next_entry = 0; idx < tables; idx++) {
+        if (!mark_bit_get(trace.live[IMAGE_TABLES], idx)) continue;
+        Table* table = &TABLES.tables[idx];
+        table_spans[idx] = (ImageSpan) { .used=1, .len=table->count, .start=next_entry };
+        for (size_t slot = 0; slot < table->cap; slot++)
+            if (table->hashes[slot]) entries[next_entry++] = table->entries[slot];
+    }
+    image_write(out, &header, IMAGE_TABLE_HEADERS, table_spans, tables * sizeof(ImageSpan));
+    image_write(out, &header, IMAGE_TABLE_ENTRIES, entries, entry_count * sizeof(TableEntry));
+    free(entries);
+    free(table_spans);
+
+    Idx flonums = header.next_idxs[IMAGE_FLONUMS];
+    double* values = image_calloc(flonums, sizeof(double));
+    for (Idx idx = 0; idx < flonums; idx++)
+        if (mark_bit_get(trace.live[IMAGE_FLONUMS], idx)) values[idx] = FLONUMS.values[idx];
+    image_write(out, &header, IMAGE_FLONUM_VALUES, values, flonums * sizeof(double));
+    free(values);
+
+    // Symbols, all of them, so every symbol keeps its index.
+    Idx symbol_count = header.symbol_count;
+    ImageSymbol* symbols = image_calloc(symbol_count, sizeof(ImageSymbol));
+    size_t text_len = 0;
+    for (Idx idx = 0; idx < symbol_count; idx++) text_len += SYMBOLS.symbols[idx].len + 1;
+    char* text = image_calloc(text_len, 1);
+    for (Idx idx = 0, next_text = 0; idx < symbol_count; idx++) {
+        Symbol* sym = &SYMBOLS.symbols[idx];
+        symbols[idx] = (ImageSymbol) { .text=next_text, .len=sym->len, .hash=sym->hash };
+        memcpy(&text[next_text], sym->str, sym->len);
+        next_text += sym->len + 1;
+    }
+    image_write(out, &header, IMAGE_SYMBOLS, symbols, symbol_count * sizeof(ImageSymbol));
+    image_write(out, &header, IMAGE_SYMBOL_TEXT, text, text_len);
+    free(text);
+    free(symbols);
+
+    // Free lists: every cell below the high-water mark that wasn't reached.
+    size_t free_total = 0;
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++)
+        free_total += header.next_idxs[pool];
+    Idx* free_idxs = image_calloc(free_total, sizeof(Idx));
+    size_t free_count = 0;
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++) {
+        size_t before = free_count;
+        for (Idx idx = header.next_idxs[pool]; idx-- > 0;)
+            if (!mark_bit_get(trace.live[pool], idx)) free_idxs[free_count++] = idx;
+        header.free_counts[pool] = free_count - before;
+    }
+    image_write(out, &header, IMAGE_FREE, free_idxs, free_count * sizeof(Idx));
+    free(free_idxs);
+
+    pthread_mutex_unlock(&SYMBOLS.lock);
+    pthread_mutex_unlock(&HEAP_LOCK);
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++) free(trace.live[pool]);
+    free(trace.natives);
+    free(trace.memos);
+    free(trace.stack);
+
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1)
+        panic("%s", "Image write failed!");
+    if (fclose(out) != 0) panic("Writing image `%s` failed!", tmp_path);
+    if (rename(tmp_path, path) != 0) panic("Can't replace image `%s`!", path);
+    free(tmp_path);
+}
+////////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////// LOADING ///////////////////////////////////
+typedef struct ImageFile {
+    const char* path;
+    int fd;
+    const char* data;
+    size_t size;
+    const ImageHeader* header;
+} ImageFile;
+
+/// Checks that `section` lies within the file and holds `bytes` bytes.
+static const void* image_section(ImageFile* image, unsigned section, size_t bytes) {
+    ImageSection s = image->header->sections[section];
+    if (s.bytes != bytes || s.offset > image->size || s.bytes > image->size - s.offset)
+        panic("Image `%s` is corrupt!", image->path);
+    return image->data + s.offset;
+}
+
+/// Commits room for `count` cells of `meta`, which must be empty.
+static void image_pool_grow(ImageFile* image, PoolMeta* meta, Idx count) {
+    if (meta->next_idx != 0) panic("Image `%s` must be loaded before anything is allocated!", image->path);
+    Idx capacity = POOL_INITIAL_CAPACITY;
+    while (capacity < count) capacity *= 2;
+    pool_grow(meta, capacity);
+    if (meta->capacity < count) panic("Image `%s` needs a bigger LISP_HEAP_MAX!", image->path);
+    meta->next_idx = count;
+}
+
+/// Maps `section` over the start of `column`, copy-on-write.
+static void image_map(ImageFile* image, unsigned section, void* column) {
+    ImageSection s = image->header->sections[section];
+    if (s.bytes == 0) return;
+    void* mapped = mmap(column, page_round(s.bytes), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_FIXED, image->fd, (off_t) s.offset);
+    if (mapped == MAP_FAILED) panic("Mapping image `%s` failed!", image->path);
+}
+
+/// Loads the image at `path` and returns its global environment. Must run
+/// before anything has been allocated.
+Env* image_load(const char* path) {
+    ImageFile image = { .path=path, .fd=open(path, O_RDONLY) };
+    if (image.fd < 0) panic("Can't open image `%s`!", path);
+    struct stat st;
+    if (fstat(image.fd, &st) != 0) panic("Can't stat image `%s`!", path);
+    image.size = (size_t) st.st_size;
+    if (image.size < sizeof(ImageHeader)) panic("`%s` is not an image!", path);
+    image.data = mmap(NULL, image.size, PROT_READ, MAP_PRIVATE, image.fd, 0);
+    if (image.data == MAP_FAILED) panic("Mapping image `%s` failed!", path);
+    image.header = (const ImageHeader*) image.data;
+    const ImageHeader* header = image.header;
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0)
+        panic("`%s` is not an image!", path);
+    if (header->version != IMAGE_VERSION || header->page_size != (uint32_t) sysconf(_SC_PAGESIZE))
+        panic("Image `%s` was saved by an incompatible build!", path);
+
+    const uint64_t* next_idxs = header->next_idxs;
+    Idx pairs = next_idxs[IMAGE_PAIRS], procs = next_idxs[IMAGE_BIG_VALUES];
+    Idx frames = next_idxs[IMAGE_ENVS], bignums = next_idxs[IMAGE_BIGNUMS];
+    Idx flonums = next_idxs[IMAGE_FLONUMS], symbol_count = header->symbol_count;
+    Idx vectors = next_idxs[IMAGE_VECTORS], strings = next_idxs[IMAGE_STRINGS];
+    Idx tables = next_idxs[IMAGE_TABLES];
+    if (header->root_env >= frames) panic("Image `%s` is corrupt!", path);
+    image_section(&image, IMAGE_CARS, pairs * sizeof(ValueRef));
+    image_section(&image, IMAGE_CDRS, pairs * sizeof(ValueRef));
+    image_section(&image, IMAGE_PROC_PARAMS, procs * sizeof(ValueRef));
+    image_section(&image, IMAGE_PROC_BODIES, procs * sizeof(ValueRef));
+    image_section(&image, IMAGE_FLONUM_VALUES, flonums * sizeof(double));
+    const uint64_t* proc_envs = image_section(&image, IMAGE_PROC_ENVS, procs * sizeof(uint64_t));
+    const ImageEnv* image_envs = image_section(&image, IMAGE_FRAMES, frames * sizeof(ImageEnv));
+    const ImageBignum* image_bignums = image_section(&image, IMAGE_BIGNUM_HEADERS, bignums * sizeof(ImageBignum));
+    const ImageSymbol* symbols = image_section(&image, IMAGE_SYMBOLS, symbol_count * sizeof(ImageSymbol));
+    ImageSection s = header->sections[IMAGE_FRAME_SLOTS];
+    const ValueRef* slots = image_section(&image, IMAGE_FRAME_SLOTS, s.bytes);
+    size_t slot_count = s.bytes / sizeof(ValueRef);
+    s = header->sections[IMAGE_LIMBS];
+    const uint32_t* limbs = image_section(&image, IMAGE_LIMBS, s.bytes);
+    size_t limb_count = s.bytes / sizeof(uint32_t);
+    const ImageSpan* vector_spans = image_section(&image, IMAGE_VECTOR_HEADERS, vectors * sizeof(ImageSpan));
+    s = header->sections[IMAGE_VECTOR_ITEMS];
+    const ValueRef* items = image_section(&image, IMAGE_VECTOR_ITEMS, s.bytes);
+    size_t item_count = s.bytes / sizeof(ValueRef);
+    const ImageSpan* string_spans = image_section(&image, IMAGE_STRING_HEADERS, strings * sizeof(ImageSpan));
+    s = header->sections[IMAGE_STRING_BYTES];
+    const char* bytes = image_section(&image, IMAGE_STRING_BYTES, s.bytes);
+    size_t byte_count = s.bytes;
+    const ImageSpan* table_spans = image_section(&image, IMAGE_TABLE_HEADERS, tables * sizeof(ImageSpan));
+    s = header->sections[IMAGE_TABLE_ENTRIES];
+    const TableEntry* entries = image_section(&image, IMAGE_TABLE_ENTRIES, s.bytes);
+    size_t entry_count = s.bytes / sizeof(TableEntry);
+    s = header->sections[IMAGE_SYMBOL_TEXT];
+    const char* text = image_section(&image, IMAGE_SYMBOL_TEXT, s.bytes);
+    size_t text_len = s.bytes;
+    s = header->sections[IMAGE_NATIVES];
+    const ImageNative* natives = image_section(&image, IMAGE_NATIVES, s.bytes);
+    size_t native_count = s.bytes / sizeof(ImageNative);
+    s = header->sections[IMAGE_MEMOS];
+    const ImageMemo* memos = image_section(&image, IMAGE_MEMOS, s.bytes);
+    size_t memo_count = s.bytes / sizeof(ImageMemo);
+    for (size_t i = 0; i < memo_count; i++) {
+        const ImageMemo* memo = &memos[i];
+        if (memo->proc >= procs || !is_proc(memo->fn) || GET_VALUE_DATA(memo->fn) >= procs ||
+            memo->limit >= MEMO_NONE)
+            panic("Image `%s` is corrupt!", path);
+    }
+    size_t free_total = 0;
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++) {
+        if (header->free_counts[pool] > next_idxs[pool]) panic("Image `%s` is corrupt!", path);
+        free_total += header->free_counts[pool];
+    }
+    const Idx* free_idxs = image_section(&image, IMAGE_FREE, free_total * sizeof(Idx));
+
+    gc_heap_lock();
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++)
+        image_pool_grow(&image, IMAGE_POOLS[pool], next_idxs[pool]);
+#ifdef PAIRS_INTERLEAVED
+    const ValueRef* cars = image_section(&image, IMAGE_CARS, pairs * sizeof(ValueRef));
+    const ValueRef* cdrs = image_section(&image, IMAGE_CDRS, pairs * sizeof(ValueRef));
+    for (Idx idx = 0; idx < pairs; idx++)
+        PAIRS.cells[idx] = (Pair) { .car=cars[idx], .cdr=cdrs[idx] };
+#else
+    image_map(&image, IMAGE_CARS, PAIRS.cars);
+    image_map(&image, IMAGE_CDRS, PAIRS.cdrs);
+#endif
+    image_map(&image, IMAGE_PROC_PARAMS, BIG_VALUES.v2);
+    image_map(&image, IMAGE_PROC_BODIES, BIG_VALUES.v3);
+    image_map(&image, IMAGE_FLONUM_VALUES, FLONUMS.values);
+
+    for (Idx idx = 0; idx < frames; idx++) {
+        const ImageEnv* saved = &image_envs[idx];
+        if (saved->root == 0) continue; // Unused; already empty.
+        if (saved->parent > frames || saved->root > frames || saved->slots > slot_count ||
+            saved->count > slot_count - saved->slots)
+            panic("Image `%s` is corrupt!", path);
+        Env* env = &ENVS.envs[idx];
+        env->parent = saved->parent ? &ENVS.envs[saved->parent - 1] : NULL;
+        env->root = &ENVS.envs[saved->root - 1];
+        env->names = saved->names;
+        env->count = saved->count;
+        env->captured = saved->captured;
+        env->slots = env_alloc_slots(env, saved->count);
+        memcpy(env->slots, &slots[saved->slots], saved->count * sizeof(ValueRef));
+    }
+    for (Idx idx = 0; idx < procs; idx++) {
+        if (proc_envs[idx] > frames) panic("Image `%s` is corrupt!", path);
+        BIG_VALUES.v1[idx] = proc_envs[idx] ? (ValueRef) &ENVS.envs[proc_envs[idx] - 1] : (ValueRef) NULL;
+    }
+    for (Idx idx = 0; idx < bignums; idx++) {
+        const ImageBignum* saved = &image_bignums[idx];
+        if (saved->len == 0) continue; // Unused; bignums are never zero.
+        if (saved->limbs > limb_count || saved->len > limb_count - saved->limbs)
+            panic("Image `%s` is corrupt!", path);
+        uint32_t* copy = limbs_alloc(saved->len);
+        memcpy(copy, &limbs[saved->limbs], saved->len * sizeof(uint32_t));
+        BIGNUMS.bignums[idx] = (Bignum) { .negative=saved->negative, .len=saved->len, .limbs=copy };
+    }
+    for (Idx idx = 0; idx < vectors; idx++) {
+        const ImageSpan* saved = &vector_spans[idx];
+        if (!saved->used) continue;
+        if (saved->start > item_count || saved->len > item_count - saved->start)
+            panic("Image `%s` is corrupt!", path);
+        ValueRef* copy = malloc((saved->len ? saved->len : 1) * sizeof(ValueRef));
+        if (copy == NULL) panic("%s", "Vector alloc error!");
+        memcpy(copy, &items[saved->start], saved->len * sizeof(ValueRef));
+        VECTORS.vectors[idx] = (Vector) { .len=saved->len, .items=copy };
+    }
+    for (Idx idx = 0; idx < strings; idx++) {
+        const ImageSpan* saved = &string_spans[idx];
+        if (!saved->used) continue;
+        if (saved->start > byte_count || saved->len > byte_count - saved->start)
+            panic("Image `%s` is corrupt!", path);
+        char* copy = calloc(saved->len + 1, 1);
+        if (copy == NULL) panic("%s", "String alloc error!");
+        memcpy(copy, &bytes[saved->start], saved->len);
+        STRINGS.strings[idx] = (String) { .len=saved->len, .bytes=copy };
+    }
+    // Keys hash as they did when saved, but tables are rebuilt rather than
+    // copied, so they come back compact.
+    for (Idx idx = 0; idx < tables; idx++) {
+        const ImageSpan* saved = &table_spans[idx];
+        if (!saved->used) continue;
+        if (saved->start > entry_count || saved->len > entry_count - saved->start)
+            panic("Image `%s` is corrupt!", path);
+        ValueRef table = MAKE_OTHER(TABLE, idx);
+        for (size_t i = 0; i < saved->len; i++) {
+            const TableEntry* entry = &entries[saved->start + i];
+            table_put(table, entry->key, entry->value);
+        }
+    }
+    for (size_t i = 0; i < native_count; i++) {
+        const ImageNative* native = &natives[i];
+        char name[IMAGE_NAME_LEN + 1] = { 0 };
+        memcpy(name, native->name, IMAGE_NAME_LEN);
+        void* proc = native->special ? (void*) find_special_form(name) : (void*) find_builtin(name);
+        if (proc == NULL) panic("Image `%s` refers to unknown builtin `%s`!", path, name);
+        if (native->idx >= pairs) panic("Image `%s` is corrupt!", path);
+        pair_car(native->idx) = (ValueRef) proc;
+    }
+    for (unsigned pool = 0; pool < IMAGE_POOL_COUNT; pool++) {
+        PoolMeta* meta = IMAGE_POOLS[pool];
+        meta->free_count = header->free_counts[pool];
+        memcpy(meta->free_idxs, free_idxs, meta->free_count * sizeof(Idx));
+        free_idxs += meta->free_count;
+    }
+    pthread_mutex_unlock(&HEAP_LOCK);
+
+    // Symbols share one block of text, which is never freed.
+    pthread_mutex_lock(&SYMBOLS.lock);
+    if (SYMBOLS.table != NULL) panic("Image `%s` must be loaded before anything is interned!", path);
+    char* names = image_calloc(text_len, 1);
+    memcpy(names, text, text_len);
+    image_pool_grow(&image, &SYMBOLS.meta, symbol_count);
+    for (Idx idx = 0; idx < symbol_count; idx++) {
+        const ImageSymbol* saved = &symbols[idx];
+        if (saved->text > text_len || saved->len >= text_len - saved->text)
+            panic("Image `%s` is corrupt!", path);
+        SYMBOLS.symbols[idx] = (Symbol) { .str=&names[saved->text], .len=saved->len, .hash=saved->hash };
+    }
+    // Size the table while it is still empty, then fill it once.
+    SYMBOLS.meta.next_idx = 0;
+    while (SYMBOLS.table == NULL || 2 * (symbol_count + 1) > SYMBOLS.table->size)
+        symbol_table_grow();
+    SYMBOLS.meta.next_idx = symbol_count;
+    for (Idx idx = 0; idx < symbol_count; idx++) symbol_table_insert(SYMBOLS.table, idx);
+    pthread_mutex_unlock(&SYMBOLS.lock);
+
+    // Memoized procedures are made again, and moved into their old cells.
+    for (size_t i = 0; i < memo_count; i++) {
+        Idx idx = memos[i].proc;
+        Idx made = GET_VALUE_DATA(make_memo_proc(memos[i].fn, memos[i].limit));
+        BIG_VALUES.v1[idx] = BIG_VALUES.v1[made];
+        BIG_VALUES.v3[idx] = BIG_VALUES.v3[made];
+    }
+
+    Env* env = &ENVS.envs[header->root_env];
+    munmap((void*) image.data, image.size);
+    close(image.fd);
+    TRUE_SYMBOL = make_symbol_ref("t");
+    bump_global_version();
+    return env;
+}
+////////////////////////////////////////////////////////////////////////////////
+
+#endif
@@ -0,0 +1,905 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h> // offsetof
+#include <string.h> // memcpy
+#include <sys/mman.h> // memfd_create, mmap, munmap
+#include <unistd.h> // close, ftruncate
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "builtins.h"
+#include "vm.h"
+
+// Native code for hot prototypes, the VM's second tier.
+//
+// `jit_compile` translates a prototype's bytecode an instruction at a time
+// into x86-64 code that works on the frame's VM stack just as `vm_run`
+// would, so the VM can hand a frame to it and take it back between any
+// two instructions. Native code handles constants, variable reads, jumps,
+// returns, and calls of a few builtins (`+`, `-` and `*` on fixnums, `=`
+// and `<` on fixnums, `car` and `cdr`), inlined behind guards that the
+// global still holds that builtin and that the operands have the right
+// tags. A tail call of the procedure itself runs as a loop, reusing its
+// frame, if nothing captured it.
+//
+// Anything else, or any guard that fails (a flonum operand, an overflow,
+// a rebound global), exits to the interpreter at that instruction, with
+// nothing done yet. The VM reenters the native code after the calls and
+// other instructions the interpreter ran for it (see `JIT_RESUME` in
+// `./vm.h`), where no tag is known and checks start over.
+//
+// Tags are tracked at compile time through the stack, so the result of an
+// inlined `+` or a fixnum constant skips its check when used again, and a
+// comparison feeding an `if` branches on the flags without making a
+// boolean. While running in native code, `rbx` holds the stack base,
+// `r12` the frame, `r13` its slots, `r14` the global frame and `rbp`
+// whether the frame is the call's own; `r8`, `r10` and `r11` hold
+// `VALUE_DATA_MASK`, `t` and `UNBOUND_VALUE`.
+//
+// Code is compiled once per prototype, under `JIT.lock`, into a block of
+// the code heap, and the block is reused once the prototype is collected.
+// Elsewhere than x86-64 Linux, `jit_compile` does nothing.
+
+#if defined(__x86_64__) && defined(__linux__)
+
+enum JIT_REG { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+enum JIT_CC { CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_L = 0xC };
+
+// Opcodes of `op r/m64, r64` and the `/ext` of group 1 and 2 instructions.
+#define X86_ADD 0x01
+#define X86_AND 0x21
+#define X86_SUB 0x29
+#define X86_XOR 0x31
+#define X86_CMP 0x39
+#define X86_TEST 0x85
+#define X86_MOV 0x89
+#define EXT_ADD 0
+#define EXT_SUB 5
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+
+#ifdef PAIRS_INTERLEAVED
+#define JIT_CARS ((void*) &PAIRS.cells)
+#define JIT_CDRS ((void*) &PAIRS.cells)
+#define JIT_CAR_OFFSET offsetof(Pair, car)
+#define JIT_CDR_OFFSET offsetof(Pair, cdr)
+#define JIT_PAIR_SCALE 2 // Cells are two words.
+#else
+#define JIT_CARS ((void*) &PAIRS.cars)
+#define JIT_CDRS ((void*) &PAIRS.cdrs)
+#define JIT_CAR_OFFSET 0
+#define JIT_CDR_OFFSET 0
+#define JIT_PAIR_SCALE 1
+#endif
+
+////////////////////////////// ASSEMBLER /////////////////////////////
+typedef struct JitBuf {
+    uint8_t* bytes;
+    size_t len;
+    size_t cap;
+} JitBuf;
+
+static void jit_byte(JitBuf* b, uint8_t byte) {
+    if (b->len == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 1024;
+        b->bytes = realloc(b->bytes, b->cap);
+        if (b->bytes == NULL) panic("%s", "JIT buffer alloc error!");
+    }
+    b->bytes[b->len++] = byte;
+}
+
+static void jit_u32(JitBuf* b, uint32_t word) {
+    for (int i = 0; i < 4; i++) jit_byte(b, word >> (8 * i));
+}
+
+static void jit_u64(JitBuf* b, uint64_t word) {
+    for (int i = 0; i < 8; i++) jit_byte(b, word >> (8 * i));
+}
+
+static void jit_patch32(JitBuf* b, size_t at, uint32_t word) {
+    for (int i = 0; i < 4; i++) b->bytes[at + i] = word >> (8 * i);
+}
+
+static void jit_rex(JitBuf* b, bool wide, int reg, int index, int base) {
+    uint8_t rex = 0x40 | wide << 3 | (reg >= 8) << 2 | (index >= 8) << 1 | (base >= 8);
+    if (rex != 0x40) jit_byte(b, rex);
+}
+
+/// The ModRM (and SIB) bytes and displacement for `[base + disp]`, or
+/// `[base + index * 8 + disp]` if `index` isn't negative.
+static void jit_mem(JitBuf* b, int reg, int base, int index, int32_t disp) {
+    int mod = disp == 0 && (base & 7) != RBP ? 0 : disp == (int8_t) disp ? 1 : 2;
+    if (index >= 0) {
+        jit_byte(b, mod << 6 | (reg & 7) << 3 | RSP);
+        jit_byte(b, 3 << 6 | (index & 7) << 3 | (base & 7));
+    } else {
+        jit_byte(b, mod << 6 | (reg & 7) << 3 | (base & 7));
+        if ((base & 7) == RSP) jit_byte(b, 0x24);
+    }
+    if (mod == 1) jit_byte(b, (uint8_t) disp);
+    else if (mod == 2) jit_u32(b, (uint32_t) disp);
+}
+
+/// `op reg, [base + disp]` or `op [base + disp], reg`, on 64 bits.
+static void jit_op_mem(JitBuf* b, uint8_t op, int reg, int base, int32_t disp) {
+    jit_rex(b, true, reg, 0, base);
+    jit_byte(b, op);
+    jit_mem(b, reg, base, -1, disp);
+}
+
+#define jit_load(b, dst, base, disp) jit_op_mem(b, 0x8B, dst, base, disp)
+#define jit_store(b, base, disp, src) jit_op_mem(b, 0x89, src, base, disp)
+#define jit_lea(b, dst, base, disp) jit_op_mem(b, 0x8D, dst, base, disp)
+
+/// `mov dst, [base + index * 8 + disp]`
+static void jit_load_indexed(JitBuf* b, int dst, int base, int index, int32_t disp) {
+    jit_rex(b, true, dst, index, base);
+    jit_byte(b, 0x8B);
+    jit_mem(b, dst, base, index, disp);
+}
+
+/// `op dst, src` for an `op r/m64, r64` opcode.
+static void jit_op(JitBuf* b, uint8_t op, int dst, int src) {
+    jit_rex(b, true, src, 0, dst);
+    jit_byte(b, op);
+    jit_byte(b, 0xC0 | (src & 7) << 3 | (dst & 7));
+}
+
+/// `ext reg, imm` for a group 1 instruction.
+static void jit_op_imm(JitBuf* b, int ext, int reg, int32_t imm) {
+    jit_rex(b, true, 0, 0, reg);
+    jit_byte(b, imm == (int8_t) imm ? 0x83 : 0x81);
+    jit_byte(b, 0xC0 | ext << 3 | (reg & 7));
+    if (imm == (int8_t) imm) jit_byte(b, (uint8_t) imm);
+    else jit_u32(b, (uint32_t) imm);
+}
+
+/// `cmp [base + disp], imm` on a `size`-byte operand.
+static void jit_cmp_mem_imm(JitBuf* b, int size, int base, int32_t disp, int32_t imm) {
+    jit_rex(b, size == 8, 0, 0, base);
+    if (size == 1) jit_byte(b, 0x80);
+    else jit_byte(b, imm == (int8_t) imm ? 0x83 : 0x81);
+    jit_mem(b, EXT_CMP, base, -1, disp);
+    if (size == 1 || imm == (int8_t) imm) jit_byte(b, (uint8_t) imm);
+    else jit_u32(b, (uint32_t) imm);
+}
+
+static void jit_shift(JitBuf* b, int ext, int reg, uint8_t count) {
+    jit_rex(b, true, 0, 0, reg);
+    jit_byte(b, 0xC1);
+    jit_byte(b, 0xC0 | ext << 3 | (reg & 7));
+    jit_byte(b, count);
+}
+
+static void jit_mov_imm(JitBuf* b, int dst, uint64_t imm) {
+    if (imm <= UINT32_MAX) {
+        jit_rex(b, false, 0, 0, dst);
+        jit_byte(b, 0xB8 | (dst & 7));
+        jit_u32(b, imm);
+    } else {
+        jit_rex(b, true, 0, 0, dst);
+        jit_byte(b, 0xB8 | (dst & 7));
+        jit_u64(b, imm);
+    }
+}
+
+static void jit_push(JitBuf* b, int reg) {
+    jit_rex(b, false, 0, 0, reg);
+    jit_byte(b, 0x50 | (reg & 7));
+}
+
+static void jit_pop(JitBuf* b, int reg) {
+    jit_rex(b, false, 0, 0, reg);
+    jit_byte(b, 0x58 | (reg & 7));
+}
+
+/// Emits `jcc rel32` (or `jmp rel32` if `cc` is negative) and returns where
+/// its displacement goes.
+static size_t jit_jump(JitBuf* b, int cc) {
+    if (cc < 0) {
+        jit_byte(b, 0xE9);
+    } else {
+        jit_byte(b, 0x0F);
+        jit_byte(b, 0x80 | cc);
+    }
+    jit_u32(b, 0);
+    return b->len - 4;
+}
+
+static void jit_jump_to(JitBuf* b, int cc, size_t target) {
+    size_t at = jit_jump(b, cc);
+    jit_patch32(b, at, (uint32_t) (target - (at + 4)));
+}
+//////////////////////////////////////////////////////////////////////
+
+////////////////////////////// COMPILER //////////////////////////////
+// What's known about a stack entry at compile time.
+enum JIT_TYPE {
+    JIT_ANY,
+    JIT_FIXNUM,
+};
+
+typedef struct JitSlot {
+    uint8_t type;
+    bool constant; // `value` is known.
+    ValueRef value;
+} JitSlot;
+
+// A displacement to patch, once the code for `pc` is placed.
+typedef struct JitFixup {
+    size_t at;
+    size_t pc;
+} JitFixup;
+
+typedef struct JitCompiler {
+    Prototype* proto;
+    ValueRef code;
+    Env* root;
+    JitBuf buf;
+    size_t epilogue;
+    size_t* labels;    // Offset of each instruction's code.
+    size_t* stubs;     // Offset of each instruction's exit, or 0.
+    int* depths;       // Stack depth before each instruction jumped to, or -1.
+    JitSlot* states;   // What's known of the stack there: `max_stack` per instruction.
+    JitFixup* jumps;   // To `labels`.
+    size_t jump_count;
+    JitFixup* exits;   // To `stubs`.
+    size_t exit_count;
+    size_t fixup_cap;
+    size_t* deferred;  // Fused `OP_JUMP_IF_FALSE`s, placed out of line.
+    size_t deferred_count;
+} JitCompiler;
+
+enum JIT_INLINE { JIT_ADD, JIT_SUB, JIT_MUL, JIT_EQ, JIT_LT, JIT_CAR, JIT_CDR };
+
+static const struct {
+    BuiltinProc* proc;
+    size_t argc;
+    enum JIT_INLINE op;
+} JIT_INLINES[] = {
+    { &plus, 2, JIT_ADD }, { &minus, 2, JIT_SUB }, { &times, 2, JIT_MUL },
+    { &num_eq, 2, JIT_EQ }, { &less_than, 2, JIT_LT },
+    { &car, 1, JIT_CAR }, { &cdr, 1, JIT_CDR },
+};
+
+static size_t jit_instr_length(enum OPCODE op) {
+    switch (op) {
+    case OP_RETURN: return 1;
+    case OP_LOCAL: case OP_SET_LOCAL: return 3;
+    case OP_CALL_GLOBAL: case OP_TAIL_CALL_GLOBAL: return 4;
+    default: return 2;
+    }
+}
+
+static void jit_fixup(JitCompiler* c, JitFixup** list, size_t* count, size_t at, size_t pc) {
+    if (c->jump_count == c->fixup_cap || c->exit_count == c->fixup_cap) {
+        c->fixup_cap = c->fixup_cap ? 2 * c->fixup_cap : 64;
+        c->jumps = realloc(c->jumps, c->fixup_cap * sizeof(JitFixup));
+        c->exits = realloc(c->exits, c->fixup_cap * sizeof(JitFixup));
+        if (c->jumps == NULL || c->exits == NULL) panic("%s", "JIT fixup alloc error!");
+    }
+    (*list)[(*count)++] = (JitFixup) { .at=at, .pc=pc };
+}
+
+/// Jumps to the code for instruction `pc`.
+static void jit_goto(JitCompiler* c, int cc, size_t pc) {
+    jit_fixup(c, &c->jumps, &c->jump_count, jit_jump(&c->buf, cc), pc);
+}
+
+/// Exits to the interpreter at instruction `pc`, if `cc` holds.
+static void jit_exit(JitCompiler* c, int cc, size_t pc) {
+    jit_fixup(c, &c->exits, &c->exit_count, jit_jump(&c->buf, cc), pc);
+}
+
+/// Returns the value on top of a stack `depth` high to the interpreter.
+static void jit_return(JitCompiler* c, size_t depth) {
+    JitBuf* b = &c->buf;
+    jit_op(b, X86_XOR, RAX, RAX);
+    jit_lea(b, RDX, RBX, 8 * depth);
+    jit_jump_to(b, -1, c->epilogue);
+}
+
+/// Notes that the stack `stack`, `depth` high, may reach instruction `pc`.
+static void jit_reach(JitCompiler* c, size_t pc, const JitSlot* stack, size_t depth) {
+    JitSlot* state = &c->states[pc * c->proto->max_stack];
+    if (c->depths[pc] < 0) {
+        c->depths[pc] = depth;
+        memcpy(state, stack, depth * sizeof(JitSlot));
+        return;
+    }
+    for (size_t i = 0; i < depth; i++) {
+        if (state[i].constant && (!stack[i].constant || stack[i].value != state[i].value))
+            state[i].constant = false;
+        if (state[i].type != stack[i].type) state[i].type = JIT_ANY;
+    }
+}
+
+/// Exits at `pc` unless `reg` holds a value of kind `kind`. Uses `RSI`.
+static void jit_check_kind(JitCompiler* c, int reg, unsigned kind, size_t pc) {
+    JitBuf* b = &c->buf;
+    jit_op(b, X86_MOV, RSI, reg);
+    jit_shift(b, EXT_SHR, RSI, 64 - VALUE_KIND_BITS);
+    jit_op_imm(b, EXT_CMP, RSI, kind);
+    jit_exit(c, CC_NE, pc);
+}
+
+/// Loads the column whose pointer is at `column` into `reg`.
+static void jit_load_column(JitBuf* b, int reg, void* column) {
+    jit_mov_imm(b, reg, (uint64_t) column);
+    jit_load(b, reg, reg, 0);
+}
+
+/// Loads the global `symbol` into `RAX`, exiting at `pc` if it's unbound.
+static void jit_load_global(JitCompiler* c, Instr symbol, size_t pc) {
+    JitBuf* b = &c->buf;
+    jit_cmp_mem_imm(b, 8, R14, offsetof(Env, count), symbol);
+    jit_exit(c, CC_BE, pc);
+    jit_load(b, RAX, R14, offsetof(Env, slots));
+    jit_load(b, RAX, RAX, 8 * symbol);
+    jit_op(b, X86_CMP, RAX, R11);
+    jit_exit(c, CC_E, pc);
+}
+
+/// Exits at `pc` unless the global `symbol` holds the builtin `proc`.
+static void jit_guard_builtin(JitCompiler* c, Instr symbol, BuiltinProc* proc, size_t pc) {
+    JitBuf* b = &c->buf;
+    jit_load_global(c, symbol, pc);
+    jit_check_kind(c, RAX, BUILTIN_PROCEDURE, pc);
+    jit_op(b, X86_AND, RAX, R8);
+    if (JIT_PAIR_SCALE == 2) jit_op(b, X86_ADD, RAX, RAX);
+    jit_load_column(b, RDX, JIT_CARS);
+    jit_load_indexed(b, RAX, RDX, RAX, JIT_CAR_OFFSET);
+    jit_mov_imm(b, RDX, (uint64_t) proc);
+    jit_op(b, X86_CMP, RAX, RDX);
+    jit_exit(c, CC_NE, pc);
+}
+
+/// Whether `slot` is a fixnum constant that fits in `bits` bits once shifted
+/// left by `shift`.
+static bool jit_small_constant(JitSlot slot, int shift, int64_t* value) {
+    if (!slot.constant || !is_number(slot.value)) return false;
+    *value = fixnum_value(slot.value);
+    return *value >= -(1L << (31 - shift)) && *value < (1L << (31 - shift));
+}
+
+/// Loads the operands of a binary fixnum operation on the top two of a
+/// stack `depth` high, shifted left by `VALUE_KIND_BITS`, into `RAX` and
+/// `RCX`, or returns `true` with `*imm` set if the right one is a small
+/// constant. Exits at `pc` if either isn't a fixnum.
+static bool jit_fixnum_operands(JitCompiler* c, const JitSlot* stack, size_t depth, size_t pc,
+                                bool shift_right, int64_t* imm) {
+    JitBuf* b = &c->buf;
+    jit_load(b, RAX, RBX, 8 * (depth - 2));
+    if (stack[depth - 2].type != JIT_FIXNUM) jit_check_kind(c, RAX, NUMBER, pc);
+    bool constant = jit_small_constant(stack[depth - 1], shift_right ? VALUE_KIND_BITS : 0, imm);
+    if (!constant) {
+        jit_load(b, RCX, RBX, 8 * (depth - 1));
+        if (stack[depth - 1].type != JIT_FIXNUM) jit_check_kind(c, RCX, NUMBER, pc);
+        if (shift_right) jit_shift(b, EXT_SHL, RCX, VALUE_KIND_BITS);
+    }
+    jit_shift(b, EXT_SHL, RAX, VALUE_KIND_BITS);
+    return constant;
+}
+
+/// Inlines the builtin `op` on the top of a stack `depth` high, exiting at
+/// `pc` if it can't. If `fused_jump` isn't 0, a comparison jumps to that
+/// instruction when false instead of leaving a boolean.
+static void jit_inline(JitCompiler* c, enum JIT_INLINE op, JitSlot* stack, size_t depth, size_t pc,
+                       size_t fused_jump) {
+    JitBuf* b = &c->buf;
+    int64_t imm;
+    switch (op) {
+    case JIT_ADD:
+    case JIT_SUB: {
+        if (jit_fixnum_operands(c, stack, depth, pc, true, &imm))
+            jit_op_imm(b, op == JIT_ADD ? EXT_ADD : EXT_SUB, RAX, imm * (1 << VALUE_KIND_BITS));
+        else
+            jit_op(b, op == JIT_ADD ? X86_ADD : X86_SUB, RAX, RCX);
+        goto fixnum_result;
+    }
+    case JIT_MUL: {
+        // `(a << 3) * b`, with `b` sign-extended from its data bits.
+        if (jit_fixnum_operands(c, stack, depth, pc, false, &imm)) {
+            jit_rex(b, true, RAX, 0, RAX);
+            jit_byte(b, 0x69);
+            jit_byte(b, 0xC0);
+            jit_u32(b, (uint32_t) imm);
+        } else {
+            jit_shift(b, EXT_SHL, RCX, VALUE_KIND_BITS);
+            jit_shift(b, 7, RCX, VALUE_KIND_BITS); // sar
+            jit_rex(b, true, RAX, 0, RCX);
+            jit_byte(b, 0x0F);
+            jit_byte(b, 0xAF);
+            jit_byte(b, 0xC0 | (RAX << 3) | RCX);
+        }
+        goto fixnum_result;
+    }
+    fixnum_result:
+        jit_exit(c, CC_O, pc);
+        jit_shift(b, EXT_SHR, RAX, VALUE_KIND_BITS);
+        jit_rex(b, true, 0, 0, RAX);
+        jit_byte(b, 0x0F); // bts rax, 61
+        jit_byte(b, 0xBA);
+        jit_byte(b, 0xE8);
+        jit_byte(b, 64 - VALUE_KIND_BITS);
+        jit_store(b, RBX, 8 * (depth - 2), RAX);
+        stack[depth - 2] = (JitSlot) { .type=JIT_FIXNUM };
+        return;
+    case JIT_EQ:
+    case JIT_LT: {
+        if (jit_fixnum_operands(c, stack, depth, pc, true, &imm))
+            jit_op_imm(b, EXT_CMP, RAX, imm * (1 << VALUE_KIND_BITS));
+        else
+            jit_op(b, X86_CMP, RAX, RCX);
+        int false_cc = op == JIT_EQ ? CC_NE : CC_L ^ 1;
+        if (fused_jump != 0) {
+            jit_goto(c, false_cc, fused_jump);
+            return;
+        }
+        jit_op(b, X86_MOV, RAX, R10);
+        jit_mov_imm(b, RDX, 0);
+        jit_rex(b, true, RAX, 0, RDX); // cmov<false_cc> rax, rdx
+        jit_byte(b, 0x0F);
+        jit_byte(b, 0x40 | false_cc);
+        jit_byte(b, 0xC0 | (RAX << 3) | RDX);
+        jit_store(b, RBX, 8 * (depth - 2), RAX);
+        stack[depth - 2] = (JitSlot) { .type=JIT_ANY };
+        return;
+    }
+    case JIT_CAR:
+    case JIT_CDR: {
+        jit_load(b, RAX, RBX, 8 * (depth - 1));
+        jit_check_kind(c, RAX, PAIR, pc);
+        jit_op(b, X86_AND, RAX, R8);
+        jit_mov_imm(b, RDX, (uint64_t) &PAIRS.meta.next_idx);
+        jit_op_mem(b, 0x3B, RAX, RDX, 0); // cmp rax, [rdx]
+        jit_exit(c, CC_AE, pc);
+        if (JIT_PAIR_SCALE == 2) jit_op(b, X86_ADD, RAX, RAX);
+        jit_load_column(b, RDX, op == JIT_CAR ? JIT_CARS : JIT_CDRS);
+        jit_load_indexed(b, RAX, RDX, RAX, op == JIT_CAR ? JIT_CAR_OFFSET : JIT_CDR_OFFSET);
+        jit_store(b, RBX, 8 * (depth - 1), RAX);
+        stack[depth - 1] = (JitSlot) { .type=JIT_ANY };
+        return;
+    }
+    }
+}
+
+/// Loops back to the start for a tail call of the procedure itself with
+/// `argc` arguments, on a stack `depth` high. Exits at `pc` unless the
+/// global `symbol` still holds a closure of this code over the same
+/// parent frame, and the frame can be reused: it was made for this call,
+/// nothing captured it, and no collection is waiting for this thread.
+static void jit_self_tail_call(JitCompiler* c, Instr symbol, size_t argc, size_t depth, size_t pc) {
+    JitBuf* b = &c->buf;
+    jit_op(b, X86_TEST, RBP, RBP);
+    jit_exit(c, CC_E, pc);
+    jit_cmp_mem_imm(b, 1, R12, offsetof(Env, captured), 0);
+    jit_exit(c, CC_NE, pc);
+    jit_mov_imm(b, RAX, (uint64_t) &GC_STOP_REQUESTED);
+    jit_cmp_mem_imm(b, sizeof(GC_STOP_REQUESTED), RAX, 0, 0);
+    jit_exit(c, CC_NE, pc);
+    jit_load_global(c, symbol, pc);
+    jit_check_kind(c, RAX, PROCEDURE, pc);
+    jit_op(b, X86_AND, RAX, R8);
+    jit_load_column(b, RDX, &BIG_VALUES.v4);
+    jit_mov_imm(b, RCX, c->code);
+    jit_rex(b, true, RCX, RAX, RDX); // cmp [rdx + rax * 8], rcx
+    jit_byte(b, X86_CMP);
+    jit_mem(b, RCX, RDX, RAX, 0);
+    jit_exit(c, CC_NE, pc);
+    jit_load_column(b, RDX, &BIG_VALUES.v1);
+    jit_load(b, RCX, R12, offsetof(Env, parent));
+    jit_rex(b, true, RCX, RAX, RDX);
+    jit_byte(b, X86_CMP);
+    jit_mem(b, RCX, RDX, RAX, 0);
+    jit_exit(c, CC_NE, pc);
+    for (size_t i = 0; i < argc; i++) {
+        jit_load(b, RAX, RBX, 8 * (depth - argc + i));
+        jit_store(b, R13, 8 * i, RAX);
+    }
+    jit_goto(c, -1, 0);
+}
+
+/// The builtin a call of the global `symbol` with `argc` arguments inlines,
+/// or -1.
+static int jit_inlined(JitCompiler* c, Instr symbol, Instr argc) {
+    if (symbol >= c->root->count || !is_builtin_proc(c->root->slots[symbol])) return -1;
+    BuiltinProc* proc = (BuiltinProc*) pair_car(GET_VALUE_DATA(c->root->slots[symbol]));
+    for (size_t i = 0; i < sizeof(JIT_INLINES) / sizeof(JIT_INLINES[0]); i++)
+        if (JIT_INLINES[i].proc == proc && JIT_INLINES[i].argc == argc) return i;
+    return -1;
+}
+
+/// Whether the global `symbol` holds a procedure running this code.
+static bool jit_calls_self(JitCompiler* c, Instr symbol) {
+    if (symbol >= c->root->count || !is_proc(c->root->slots[symbol])) return false;
+    return BIG_VALUES.v4[GET_VALUE_DATA(c->root->slots[symbol])] == c->code;
+}
+
+/// Whether the VM may reenter native code after `op`, which native code
+/// leaves to the interpreter.
+static bool jit_resumes_after(enum OPCODE op) {
+    switch (op) {
+    case OP_SET_LOCAL: case OP_SET_GLOBAL: case OP_CLOSURE:
+    case OP_CALL: case OP_CALL_GLOBAL: case OP_EVAL:
+    case OP_DEFINE_GLOBAL: case OP_MEMOIZE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void jit_prologue(JitCompiler* c) {
+    JitBuf* b = &c->buf;
+    jit_push(b, RBX);
+    jit_push(b, RBP);
+    jit_push(b, R12);
+    jit_push(b, R13);
+    jit_push(b, R14);
+    jit_op(b, X86_MOV, R12, RDI);
+    jit_op(b, X86_MOV, RBX, RDX);
+    jit_byte(b, 0x89); // mov ebp, ecx
+    jit_byte(b, 0xCD);
+    jit_load(b, R13, R12, offsetof(Env, slots));
+    jit_load(b, R14, R12, offsetof(Env, root));
+    jit_mov_imm(b, R8, VALUE_DATA_MASK);
+    jit_mov_imm(b, R10, (uint64_t) &TRUE_SYMBOL);
+    jit_load(b, R10, R10, 0);
+    jit_mov_imm(b, R11, UNBOUND_VALUE);
+    jit_byte(b, 0xFF); // jmp rsi
+    jit_byte(b, 0xE6);
+    c->epilogue = b->len;
+    jit_pop(b, R14);
+    jit_pop(b, R13);
+    jit_pop(b, R12);
+    jit_pop(b, RBP);
+    jit_pop(b, RBX);
+    jit_byte(b, 0xC3);
+}
+
+/// Emits the code for every instruction, and returns the entries.
+static uint32_t* jit_body(JitCompiler* c) {
+    Prototype* proto = c->proto;
+    JitBuf* b = &c->buf;
+    uint32_t* entries = calloc(proto->code_len + 1, sizeof(uint32_t));
+    JitSlot* stack = calloc(proto->max_stack + 1, sizeof(JitSlot));
+    if (entries == NULL || stack == NULL) panic("%s", "JIT alloc error!");
+
+    size_t depth = 0;
+    bool live = true;  // The previous instruction falls through.
+    bool entry = true; // The VM may enter here.
+    size_t fused = SIZE_MAX; // A fused `OP_JUMP_IF_FALSE`.
+    for (size_t pc = 0; pc < proto->code_len; pc += jit_instr_length(proto->code[pc])) {
+        const Instr* instr = &proto->code[pc];
+        if (c->depths[pc] >= 0) {
+            JitSlot* state = &c->states[pc * proto->max_stack];
+            if (live) jit_reach(c, pc, stack, depth);
+            depth = c->depths[pc];
+            memcpy(stack, state, depth * sizeof(JitSlot));
+            live = true;
+        }
+        if (entry) {
+            for (size_t i = 0; i < depth; i++) stack[i] = (JitSlot) { .type=JIT_ANY };
+            entries[pc] = b->len;
+            live = true;
+            entry = false;
+        }
+        c->labels[pc] = b->len;
+        c->depths[pc] = depth;
+        if (!live) {
+            // Unreachable; nothing jumps here.
+            jit_exit(c, -1, pc);
+            continue;
+        }
+
+        switch ((enum OPCODE) instr[0]) {
+        case OP_CONST: {
+            ValueRef value = proto->consts[instr[1]];
+            jit_mov_imm(b, RAX, value);
+            jit_store(b, RBX, 8 * depth, RAX);
+            stack[depth++] = (JitSlot) {
+                .type=is_number(value) ? JIT_FIXNUM : JIT_ANY, .constant=true, .value=value,
+            };
+            break;
+        }
+        case OP_LOCAL: {
+            if (8 * (uint64_t) instr[2] > INT32_MAX) {
+                jit_exit(c, -1, pc);
+                stack[depth++] = (JitSlot) { .type=JIT_ANY };
+                break;
+            }
+            if (instr[1] == 0) {
+                jit_load(b, RAX, R13, 8 * instr[2]);
+            } else {
+                jit_load(b, RAX, R12, offsetof(Env, parent));
+                for (Instr i = 1; i < instr[1]; i++) jit_load(b, RAX, RAX, offsetof(Env, parent));
+                jit_load(b, RAX, RAX, offsetof(Env, slots));
+                jit_load(b, RAX, RAX, 8 * instr[2]);
+            }
+            jit_op(b, X86_CMP, RAX, R11);
+            jit_exit(c, CC_E, pc);
+            jit_store(b, RBX, 8 * depth, RAX);
+            stack[depth++] = (JitSlot) { .type=JIT_ANY };
+            break;
+        }
+        case OP_GLOBAL:
+            if (8 * (uint64_t) instr[1] > INT32_MAX) jit_exit(c, -1, pc);
+            else jit_load_global(c, instr[1], pc);
+            jit_store(b, RBX, 8 * depth, RAX);
+            stack[depth++] = (JitSlot) { .type=JIT_ANY };
+            break;
+        case OP_JUMP:
+            jit_reach(c, instr[1], stack, depth);
+            jit_goto(c, -1, instr[1]);
+            live = false;
+            break;
+        case OP_JUMP_IF_FALSE:
+            depth--;
+            jit_reach(c, instr[1], stack, depth);
+            if (pc == fused) {
+                // The comparison before already jumped; this is only
+                // reached from the VM, which left a boolean.
+                c->deferred[c->deferred_count++] = pc;
+                c->labels[pc] = 0;
+                entries[pc] = 0;
+                break;
+            }
+            jit_load(b, RAX, RBX, 8 * depth);
+            jit_op(b, X86_TEST, RAX, RAX);
+            jit_goto(c, CC_E, instr[1]);
+            break;
+        case OP_RETURN:
+            jit_return(c, depth);
+            live = false;
+            break;
+        case OP_CALL_GLOBAL:
+        case OP_TAIL_CALL_GLOBAL: {
+            bool tail = instr[0] == OP_TAIL_CALL_GLOBAL;
+            Instr argc = instr[2];
+            int inlined = jit_inlined(c, instr[1], argc);
+            size_t next = pc + jit_instr_length(instr[0]);
+            if (inlined >= 0 && 8 * (uint64_t) instr[1] <= INT32_MAX) {
+                enum JIT_INLINE op = JIT_INLINES[inlined].op;
+                bool fuse = !tail && (op == JIT_EQ || op == JIT_LT) && next < proto->code_len
+                    && proto->code[next] == OP_JUMP_IF_FALSE;
+                jit_guard_builtin(c, instr[1], JIT_INLINES[inlined].proc, pc);
+                jit_inline(c, op, stack, depth, pc, fuse ? proto->code[next + 1] : 0);
+                depth = depth + 1 - argc;
+                if (fuse) {
+                    // Both ways on from the jump start knowing nothing,
+                    // since the VM may come through it too.
+                    fused = next;
+                    for (size_t i = 0; i < depth - 1; i++) stack[i] = (JitSlot) { .type=JIT_ANY };
+                    jit_reach(c, proto->code[next + 1], stack, depth - 1);
+                    jit_reach(c, next + jit_instr_length(OP_JUMP_IF_FALSE), stack, depth - 1);
+                }
+                if (tail) {
+                    jit_return(c, depth);
+                    live = false;
+                }
+            } else if (tail && argc == proto->param_count && jit_calls_self(c, instr[1])
+                       && 8 * (uint64_t) instr[1] <= INT32_MAX) {
+                jit_self_tail_call(c, instr[1], argc, depth, pc);
+                live = false;
+            } else {
+                jit_exit(c, -1, pc);
+                depth = depth + 1 - argc;
+                stack[depth - 1] = (JitSlot) { .type=JIT_ANY };
+                live = !tail;
+            }
+            break;
+        }
+        case OP_CALL:
+            jit_exit(c, -1, pc);
+            depth -= instr[1];
+            stack[depth - 1] = (JitSlot) { .type=JIT_ANY };
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+            jit_exit(c, -1, pc);
+            stack[depth - 1] = (JitSlot) { .type=JIT_ANY };
+            break;
+        case OP_MEMOIZE:
+            jit_exit(c, -1, pc);
+            depth -= instr[1];
+            stack[depth - 1] = (JitSlot) { .type=JIT_ANY };
+            break;
+        case OP_CLOSURE:
+        case OP_EVAL:
+            jit_exit(c, -1, pc);
+            stack[depth++] = (JitSlot) { .type=JIT_ANY };
+            break;
+        case OP_TAIL_CALL:
+            jit_exit(c, -1, pc);
+            live = false;
+            break;
+        }
+        if (jit_resumes_after(instr[0])) entry = true;
+    }
+    free(stack);
+    return entries;
+}
+
+/// Places the fused jumps' own code and the exits, and patches the jumps
+/// to them.
+static void jit_finish(JitCompiler* c, uint32_t* entries) {
+    Prototype* proto = c->proto;
+    JitBuf* b = &c->buf;
+    for (size_t i = 0; i < c->deferred_count; i++) {
+        size_t pc = c->deferred[i];
+        size_t depth = c->depths[pc] - 1;
+        c->labels[pc] = entries[pc] = b->len;
+        jit_load(b, RAX, RBX, 8 * depth);
+        jit_op(b, X86_TEST, RAX, RAX);
+        jit_goto(c, CC_E, proto->code[pc + 1]);
+        jit_goto(c, -1, pc + jit_instr_length(OP_JUMP_IF_FALSE));
+    }
+    for (size_t i = 0; i < c->jump_count; i++) {
+        JitFixup fixup = c->jumps[i];
+        jit_patch32(b, fixup.at, (uint32_t) (c->labels[fixup.pc] - (fixup.at + 4)));
+    }
+    for (size_t i = 0; i < c->exit_count; i++) {
+        JitFixup fixup = c->exits[i];
+        if (c->stubs[fixup.pc] == 0) {
+            c->stubs[fixup.pc] = b->len;
+            jit_mov_imm(b, RAX, (uint64_t) &proto->code[fixup.pc]);
+            jit_lea(b, RDX, RBX, 8 * c->depths[fixup.pc]);
+            jit_jump_to(b, -1, c->epilogue);
+        }
+        jit_patch32(b, fixup.at, (uint32_t) (c->stubs[fixup.pc] - (fixup.at + 4)));
+    }
+}
+
+//////////////////////////////////////////////////////////////////////
+
+////////////////////////////// CODE HEAP /////////////////////////////
+// Native code lives in chunks mapped twice from one memfd: writable, where
+// the compiler copies code in, and executable, where it runs, so no page
+// is ever both. Blocks are powers of two from `JIT_MIN_BLOCK` bytes, cut
+// from the current chunk, and freed blocks are kept for reuse by size.
+// Guarded by `JIT.lock`.
+#define JIT_CHUNK_SIZE (4UL << 20)
+#define JIT_MIN_BLOCK 64
+#define JIT_BLOCK_CLASSES 48
+
+typedef struct JitBlock {
+    uint8_t* code;
+    uint8_t* writable;
+} JitBlock;
+
+static struct {
+    JitBlock chunk; // The rest of the current chunk.
+    size_t chunk_left;
+    JitBlock* free[JIT_BLOCK_CLASSES];
+    size_t free_count[JIT_BLOCK_CLASSES];
+    size_t free_cap[JIT_BLOCK_CLASSES];
+} JIT_HEAP;
+
+static unsigned jit_block_class(size_t len) {
+    unsigned class = 0;
+    while ((size_t) JIT_MIN_BLOCK << class < len) class++;
+    return class;
+}
+
+/// Maps `size` bytes both ways, or returns `false` if the system won't.
+static bool jit_map_chunk(size_t size, JitBlock* chunk) {
+    int fd = memfd_create("jit", MFD_CLOEXEC);
+    if (fd < 0) return false;
+    void* writable = MAP_FAILED;
+    void* code = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        writable = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (writable != MAP_FAILED)
+        code = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    close(fd);
+    if (code == MAP_FAILED) {
+        if (writable != MAP_FAILED) munmap(writable, size);
+        return false;
+    }
+    *chunk = (JitBlock) { .code=code, .writable=writable };
+    return true;
+}
+
+static bool jit_alloc_block(unsigned class, JitBlock* block) {
+    if (JIT_HEAP.free_count[class] > 0) {
+        *block = JIT_HEAP.free[class][--JIT_HEAP.free_count[class]];
+        return true;
+    }
+    size_t size = (size_t) JIT_MIN_BLOCK << class;
+    if (size >= JIT_CHUNK_SIZE) return jit_map_chunk(size, block);
+    if (size > JIT_HEAP.chunk_left) {
+        if (!jit_map_chunk(JIT_CHUNK_SIZE, &JIT_HEAP.chunk)) return false;
+        JIT_HEAP.chunk_left = JIT_CHUNK_SIZE;
+    }
+    *block = JIT_HEAP.chunk;
+    JIT_HEAP.chunk.code += size;
+    JIT_HEAP.chunk.writable += size;
+    JIT_HEAP.chunk_left -= size;
+    return true;
+}
+
+static void jit_free_block(unsigned class, JitBlock block) {
+    if (JIT_HEAP.free_count[class] == JIT_HEAP.free_cap[class]) {
+        JIT_HEAP.free_cap[class] = JIT_HEAP.free_cap[class] ? 2 * JIT_HEAP.free_cap[class] : 16;
+        JIT_HEAP.free[class] = realloc(JIT_HEAP.free[class], JIT_HEAP.free_cap[class] * sizeof(JitBlock));
+        if (JIT_HEAP.free[class] == NULL) panic("%s", "JIT free list alloc error!");
+    }
+    JIT_HEAP.free[class][JIT_HEAP.free_count[class]++] = block;
+}
+
+/// Compiles `code` to native code, for frames under the global frame
+/// `root`. The code keeps working under other global frames; `root` only
+/// tells which calls are worth inlining.
+void jit_compile(ValueRef code, Env* root) {
+    Prototype* proto = code_lookup(code);
+    pthread_mutex_lock(&JIT.lock);
+    if (proto->jit != NULL || proto->code_len == 0) {
+        pthread_mutex_unlock(&JIT.lock);
+        return;
+    }
+    size_t len = proto->code_len;
+    JitCompiler c = {
+        .proto=proto, .code=code, .root=root,
+        .labels=calloc(len, sizeof(size_t)),
+        .stubs=calloc(len, sizeof(size_t)),
+        .depths=malloc(len * sizeof(int)),
+        .states=calloc(len * (proto->max_stack + 1), sizeof(JitSlot)),
+        .deferred=calloc(len, sizeof(size_t)),
+    };
+    if (c.labels == NULL || c.stubs == NULL || c.depths == NULL || c.states == NULL || c.deferred == NULL)
+        panic("%s", "JIT alloc error!");
+    for (size_t pc = 0; pc < len; pc++) c.depths[pc] = -1;
+
+    jit_prologue(&c);
+    uint32_t* entries = jit_body(&c);
+    jit_finish(&c, entries);
+    JitBlock block;
+    unsigned class = jit_block_class(c.buf.len);
+    if (jit_alloc_block(class, &block)) {
+        memcpy(block.writable, c.buf.bytes, c.buf.len);
+        JitCode* jit = malloc(sizeof(JitCode));
+        if (jit == NULL) panic("%s", "JIT alloc error!");
+        *jit = (JitCode) {
+            .fn=(JitFn) block.code, .writable=block.writable,
+            .size=(size_t) JIT_MIN_BLOCK << class, .entries=entries,
+        };
+        JIT.compiled++;
+        JIT.code_bytes += jit->size;
+        __atomic_store_n(&proto->jit, jit, __ATOMIC_RELEASE);
+    } else {
+        free(entries);
+    }
+    free(c.buf.bytes);
+    free(c.labels);
+    free(c.stubs);
+    free(c.depths);
+    free(c.states);
+    free(c.deferred);
+    free(c.jumps);
+    free(c.exits);
+    pthread_mutex_unlock(&JIT.lock);
+}
+
+void jit_free(JitCode* jit) {
+    pthread_mutex_lock(&JIT.lock);
+    jit_free_block(jit_block_class(jit->size), (JitBlock) { .code=(uint8_t*) jit->fn, .writable=jit->writable });
+    JIT.code_bytes -= jit->size;
+    pthread_mutex_unlock(&JIT.lock);
+    free(jit->entries);
+    free(jit);
+}
+
+#else
+
+void jit_compile(ValueRef code, Env* root) {}
+
+void jit_free(JitCode* jit) {}
+
+#endif
+
+#endif
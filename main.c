@@ -6,9 +6,20 @@
 #include "value_types.h"
 #include "env_type.h"
 #include "builtins.h"
+#include "gc.h"
+#include "vm.h"
+#include "jit.h"
+#include "reader.h"
+#include "context.h"
+#include "parallel.h"
+#include "image.h"
+#include "memo.h"
+#include "optimize.h"
+#include "bench.h"
 
 
-ValueRef apply(ValueRef proc_val, PairRef args_val, Env* env);
+Env* bind_arguments(Proc, ListRef, Env*);
+ValueRef apply_builtin_proc(BuiltinProc, ListRef, Env*);
 
 bool self_evaluating(ValueRef value) {
     switch (GET_VALUE_KIND(value)) {
@@ -18,91 +29,192 @@ bool self_evaluating(ValueRef value) {
     case BUILTIN_PROCEDURE:
     case SPECIAL_FORM:
         return true;
+    case OTHER_VALUE:
+        return is_numeric(value) || is_vector(value) || is_string(value);
     default:
         return false;
     }
 }
 
-ValueRef eval(ValueRef expr, Env* env) {
-    PairRef list;
-    if (self_evaluating(expr)) {
-        return expr;
-    } else if (is_symbol(expr)) {
-        return env_lookup(env, (SymbolRef) expr);
-    } else if (is_pair(expr) && (list = (PairRef) expr, true)) {
+/// Evaluates code that has been through `resolve`.
+///
+/// Calls in tail position (procedure bodies and the branches of tail special
+/// forms like `if`) loop here instead of recursing, so they run in constant
+/// C stack space. `*frame` tracks the frame of the call currently running,
+/// which the loop made and so may release.
+static ValueRef eval_loop(ValueRef expr, Env* env, Env** frame) {
+    for (;;) {
+        if (self_evaluating(expr)) {
+            return expr;
+        } else if (is_other_value(expr)) {
+            return env_ref_lookup(env, expr);
+        } else if (is_symbol(expr)) {
+            return env_lookup(env, (SymbolRef) expr);
+        } else if (!is_pair(expr)) {
+            unimplemented();
+        }
+
         // General procedure application case.
-        return apply(car_lookup(list), assume_list(cdr_lookup(list)), env);
-    } else {
-        unimplemented();
+        ValueRef fn_unev = car_lookup(expr);
+        ListRef args_unev = assume_list(cdr_lookup(expr));
+
+        // 1) Evaluate the procedure value in the current environment.
+        ValueRef fn = eval_resolved(fn_unev, env);
+
+        if (is_null(fn)) {
+            panic("%s", "Cannot call null as a procedure!");
+        }
+
+        switch (GET_VALUE_KIND(fn)) {
+        case PROCEDURE: {
+            // 2) Tail call: evaluate the body in a frame for the arguments.
+            Proc proc = proc_lookup(fn);
+            Env* callee = bind_arguments(proc, args_unev, env);
+            if (VM.enabled && !is_null(proc.code)) {
+                // Compiled procedures keep running on the VM.
+                profile_hook(profile_enter(fn, false));
+                ValueRef result = vm_run(proc.code, callee);
+                env_release(callee);
+                profile_hook(profile_leave());
+                return result;
+            }
+            profile_hook(profile_enter(fn, *frame != NULL));
+            if (*frame != NULL) env_release(*frame);
+            env = *frame = callee;
+            expr = proc.body;
+            continue;
+        }
+        case BUILTIN_PROCEDURE:
+            profile_hook(profile_call(fn));
+            return apply_builtin_proc(builtin_proc_lookup(fn), args_unev, env);
+        case SPECIAL_FORM: {
+            if (!is_special_form(fn_unev)) {
+                // Evaluate the arguments first, as the VM does, so both
+                // report the same error.
+                for (ListRef arg = args_unev; !is_null(arg); arg = assume_list(cdr_lookup(arg)))
+                    eval_resolved(car_lookup(arg), env);
+                special_form_misused(fn);
+            }
+            SpecialForm form = special_form_lookup(fn);
+            ValueRef result = form.fn(args_unev, env);
+            if (!form.tail) return result;
+            expr = result;
+            continue;
+        }
+        default:
+            fprintf(stderr, "ERROR: unevaluated function = ");
+            print_value(stderr, fn_unev);
+            fprintf(stderr, ", unevaluated args = ");
+            println_value(stderr, (ValueRef) args_unev);
+            panic("Cannot call value of type %s as a procedure!", typename_of(fn));
+        }
     }
 }
 
-// Note rad LISP-style recursion!
-ListRef eval_args(ListRef args, Env* env) {
-    if (is_null(args)) {
-        return (ListRef) NULL;
-    } else {
-        ValueRef arg = eval(car_lookup(args), env);
-        ListRef rest = eval_args(assume_list(cdr_lookup(args)), env);
-        return (ListRef) make_pair_ref(arg, (ValueRef) rest);
+ValueRef eval_resolved(ValueRef expr, Env* env) {
+    Env* frame = NULL;
+    ValueRef result = eval_loop(expr, env, &frame);
+    if (frame != NULL) {
+        env_release(frame);
+        profile_hook(profile_leave());
     }
+    return result;
 }
 
-ValueRef apply_procedure(Proc, ListRef, Env*);
-ValueRef apply_builtin_proc(BuiltinProc, ListRef, Env*);
-ValueRef apply_special_form(SpecialForm, ListRef, Env*);
+ValueRef eval(ValueRef expr, Env* env) {
+    ValueRef resolved = resolve_in_env(expr, env);
+    if (OPTIMIZING) resolved = optimize(resolved, env);
+    if (VM.enabled) return vm_eval_resolved(resolved, env);
+    return eval_resolved(resolved, env);
+}
 
-ValueRef apply(ValueRef fn_unev, ListRef args_unev, Env* env) {
-    // 1) Evaluate the procedure value in the current environment.
-    ValueRef fn = eval(fn_unev, env);
+/// Makes the frame for a call to `proc`, evaluating `args_unev` in `env`.
+Env* bind_arguments(Proc proc, ListRef args_unev, Env* env) {
+    size_t param_count = 0;
+    for (ListRef param = proc.params; !is_null(param); param = cdr_lookup(param))
+        param_count++;
 
-    if (is_null(fn)) {
-        panic("%s", "Cannot call null as a procedure!");
-    }
-
-    switch (GET_VALUE_KIND(fn)) {
-    case PROCEDURE:
-        return apply_procedure(proc_lookup(fn), args_unev, env);
-    case BUILTIN_PROCEDURE:
-        return apply_builtin_proc(builtin_proc_lookup(fn), args_unev, env);
-    case SPECIAL_FORM:
-        return apply_special_form(special_form_lookup(fn), args_unev, env);
-    default:
-        fprintf(stderr, "ERROR: unevaluated function = ");
-        print_value(stderr, fn_unev);
-        fprintf(stderr, ", unevaluated args = ");
-        println_value(stderr, (ValueRef) args_unev);
-        panic("Cannot call value of type %s as a procedure!", typename_of(fn));
+    // 1) Create a new frame--extending the procedure's creation environment--
+    //    with a slot for each parameter.
+    // 2) Evaluate the arguments in the current environment into those slots.
+    Env* new_env = make_frame(proc.creation_env, proc.params, param_count);
+    ListRef unev_arg = args_unev;
+    for (size_t slot = 0; slot < param_count && !is_null(unev_arg); slot++) {
+        new_env->slots[slot] = eval_resolved(car_lookup(unev_arg), env);
+        unev_arg = assume_list(cdr_lookup(unev_arg));
     }
+    return new_env;
 }
 
 ValueRef apply_procedure(Proc proc, ListRef args_unev, Env* env) {
+    Env* frame = bind_arguments(proc, args_unev, env);
+    ValueRef result = eval_resolved(proc.body, frame);
+    env_release(frame);
+    return result;
+}
 
-    // 1) Evaluate the arguments in the current environment.
-    // 2) Create a new environment--extending the procedure's creation environment--
-    //    by pairing parameters with argument values.
-    Env* new_env = proc.creation_env;
-    PairRef unev_arg, param;
-    for (
-        param = proc.params, unev_arg = args_unev;
-        !is_null(param)&& !is_null(unev_arg);
-        param = (PairRef) cdr_lookup(param), unev_arg = assume_list(cdr_lookup(unev_arg))
-    ) {
-        ValueRef arg = eval(car_lookup(unev_arg), env);
-        new_env = make_env(new_env, assume_symbol_ref(car_lookup(param)), arg);
+/// Calls the procedure or builtin `fn` on already evaluated arguments.
+ValueRef apply_value(ValueRef fn, size_t argc, const ValueRef* argv) {
+    if (is_builtin_proc(fn)) {
+        BuiltinProc proc = builtin_proc_lookup(fn);
+        builtin_check_arity(proc, argc);
+        profile_hook(profile_call(fn));
+        return proc.fn(argc, argv);
     }
-
-    // 3) Evaluate the procedure's body in the context of this new environment.
-    return eval(proc.body, new_env);
+    if (is_special_form(fn)) special_form_misused(fn);
+    if (!is_proc(fn)) panic("Cannot call value of type %s as a procedure!", typename_of(fn));
+    Proc proc = proc_lookup(fn);
+    size_t param_count = 0;
+    for (ListRef param = proc.params; !is_null(param); param = cdr_lookup(param))
+        param_count++;
+    Env* frame = make_frame(proc.creation_env, proc.params, param_count);
+    for (size_t slot = 0; slot < param_count && slot < argc; slot++)
+        frame->slots[slot] = argv[slot];
+    profile_hook(profile_enter(fn, false));
+    ValueRef result = VM.enabled ? vm_run(proc_code(fn), frame) : eval_resolved(proc.body, frame);
+    env_release(frame);
+    profile_hook(profile_leave());
+    return result;
 }
 
+/// Evaluates the arguments into an array on the C stack, so calling a
+/// builtin allocates nothing.
 ValueRef apply_builtin_proc(BuiltinProc proc, ListRef args_unev, Env* env) {
-    ListRef args = eval_args(args_unev, env);
-    return proc.fn(args);
+    size_t argc = 0;
+    for (ListRef arg = args_unev; !is_null(arg); arg = assume_list(cdr_lookup(arg)))
+        argc++;
+    builtin_check_arity(proc, argc);
+    if (argc == 2 && proc.binary != NULL) {
+        ValueRef a = eval_resolved(car_lookup(args_unev), env);
+        ValueRef b = eval_resolved(car_lookup(cdr_lookup(args_unev)), env);
+        return proc.binary(a, b);
+    }
+    ValueRef argv[argc ? argc : 1];
+    ListRef arg = args_unev;
+    for (size_t i = 0; i < argc; i++, arg = cdr_lookup(arg))
+        argv[i] = eval_resolved(car_lookup(arg), env);
+    return proc.fn(argc, argv);
 }
 
-ValueRef apply_special_form(SpecialForm form, ListRef args_unev, Env* env) {
-    return form.fn(args_unev, env);
+/// Reads and evaluates the top-level forms of `in` one at a time. In a REPL,
+/// prompts for each form and prints its value.
+void run_stream(FILE* in, Env* env, bool repl) {
+    Reader reader;
+    reader_init(&reader, in);
+    for (;;) {
+        if (repl) {
+            printf("> ");
+            fflush(stdout);
+        }
+        ValueRef expr;
+        if (!read_value(&reader, &expr)) break;
+        double start = PROFILING ? profile_now_ns() : 0;
+        ValueRef value = eval(expr, env);
+        profile_hook(profile_form(expr, profile_now_ns() - start));
+        if (repl) println_value(stdout, value);
+    }
+    if (repl) printf("\n");
+    reader_free(&reader);
 }
 
 void test_lambda_application_and_builtins() {
@@ -137,14 +249,963 @@ void test_cons_car_cdr() {
     ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("cdr"), program), env), LIST(NUM(2), NUM(3)));
 }
 
+void test_gc_reclaims_garbage() {
+    Env* env = global_env();
+    ValueRef program = LIST(SYM("cons"), NUM(1), NUM(2));
+    size_t cycles_before = GC.cycles;
+    Idx capacity_before = PAIRS.meta.capacity;
+    // Each evaluation conses three cells, so this fills PAIRS many times
+    // over unless garbage is reclaimed.
+    for (Idx i = 0; i < (1UL << 21); i++) {
+        ASSERT_VALUE_REFS_EQ(eval(program, env), CONS(NUM(1), NUM(2)));
+    }
+    if (GC.cycles == cycles_before)
+        panic("%s", "Expected the collector to run!");
+    if (PAIRS.meta.capacity != capacity_before)
+        panic("PAIRS grew from %lu to %lu cells on garbage alone!", capacity_before, PAIRS.meta.capacity);
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("car"), program), env), NUM(1));
+}
+
+void test_pools_grow_with_live_data() {
+    Env* env = global_env();
+    ValueRef list = (ValueRef) NULL;
+    Idx length = 8 * POOL_INITIAL_CAPACITY;
+    for (Idx i = 0; i < length; i++) {
+        Env* with_list = make_env(env, SYM("xs"), list);
+        list = eval(LIST(SYM("cons"), NUM(i), SYM("xs")), with_list);
+    }
+    if (PAIRS.meta.capacity <= length)
+        panic("PAIRS capacity %lu can't hold %lu live cells!", PAIRS.meta.capacity, length);
+    for (Idx i = length; i-- > 0; list = cdr_lookup(list)) {
+        ASSERT_VALUE_REFS_EQ(car_lookup(list), NUM(i));
+    }
+}
+
+void test_symbol_interning() {
+    // The interner must copy names, since `name` is reused for every one.
+    char name[32];
+    SymbolRef first = (SymbolRef) NULL;
+    for (int i = 0; i < 100000; i++) {
+        snprintf(name, sizeof(name), "sym-%d", i);
+        SymbolRef sym = make_symbol_ref(name);
+        if (i == 0) first = sym;
+    }
+    ASSERT_VALUE_REFS_EQ(first, SYM("sym-0"));
+    if (strcmp(symbol_to_string(SYM("sym-99999")), "sym-99999") != 0)
+        panic("%s", "Interned symbol name was clobbered!");
+    if (symbol_eq(SYM("sym-1"), SYM("sym-10")))
+        panic("%s", "Distinct names interned to the same symbol!");
+}
+
+void test_lexical_addressing() {
+    Env* env = global_env();
+    ValueRef lambda = SYM("lambda");
+    // ((lambda (x) ((lambda (y) (+ x y)) 10)) 5)
+    ValueRef nested =
+        LIST(LIST(lambda, LIST(SYM("x")),
+            LIST(LIST(lambda, LIST(SYM("y")), LIST(SYM("+"), SYM("x"), SYM("y"))), NUM(10))),
+        NUM(5));
+    ASSERT_VALUE_REFS_EQ(eval(nested, env), NUM(15));
+
+    // ((lambda (+) (+ 2 3)) *)
+    ValueRef shadowed = LIST(LIST(lambda, LIST(SYM("+")), LIST(SYM("+"), NUM(2), NUM(3))), SYM("*"));
+    ASSERT_VALUE_REFS_EQ(eval(shadowed, env), NUM(6));
+
+    // ((lambda (a b c d e f) (+ a b c d e f)) 1 2 3 4 5 6)
+    ValueRef params = LIST(SYM("a"), SYM("b"), SYM("c"), SYM("d"), SYM("e"), SYM("f"));
+    ValueRef wide = LIST(LIST(lambda, params, CONS(SYM("+"), params)),
+        NUM(1), NUM(2), NUM(3), NUM(4), NUM(5), NUM(6));
+    ASSERT_VALUE_REFS_EQ(eval(wide, env), NUM(21));
+
+    // ((lambda (x) (cdr (cons (set! x 4) x))) 1)
+    ValueRef set_local = LIST(LIST(lambda, LIST(SYM("x")),
+        LIST(SYM("cdr"), LIST(SYM("cons"), LIST(SYM("set!"), SYM("x"), NUM(4)), SYM("x")))), NUM(1));
+    ASSERT_VALUE_REFS_EQ(eval(set_local, env), NUM(4));
+
+    Env* inner = make_env(make_env(env, SYM("x"), NUM(1)), SYM("y"), NUM(2));
+    ASSERT_VALUE_REFS_EQ(resolve_in_env(SYM("x"), inner), make_local_ref(1, 0));
+    ASSERT_VALUE_REFS_EQ(resolve_in_env(SYM("car"), inner), make_global_ref(SYM("car")));
+}
+
+void test_tail_calls() {
+    Env* env = global_env();
+    ValueRef lambda = SYM("lambda"), self = SYM("self"), n = SYM("n");
+    // ((lambda (loop) (loop loop 1000000))
+    //  (lambda (self n) (if (= n 0) 42 (self self (- n 1)))))
+    ValueRef loop =
+        LIST(lambda, LIST(self, n),
+            LIST(SYM("if"), LIST(SYM("="), n, NUM(0)),
+                NUM(42),
+                LIST(self, self, LIST(SYM("-"), n, NUM(1)))));
+    ValueRef program =
+        LIST(LIST(lambda, LIST(SYM("loop")), LIST(SYM("loop"), SYM("loop"), NUM(1000000))), loop);
+    ASSERT_VALUE_REFS_EQ(eval(program, env), NUM(42));
+
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("if"), LIST(SYM("<"), NUM(2), NUM(1)), NUM(1)), env), (ValueRef) NULL);
+}
+
+void test_vm_interop() {
+    Env* env = global_env();
+    ValueRef add = LIST(SYM("lambda"), LIST(SYM("a"), SYM("b")), LIST(SYM("+"), SYM("a"), SYM("b")));
+    // A closure made by one evaluator must be callable from the other.
+    bool enabled = VM.enabled;
+    VM.enabled = !enabled;
+    Env* with_add = make_env(env, SYM("add"), eval(add, env));
+    VM.enabled = enabled;
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("add"), NUM(2), NUM(3)), with_add), NUM(5));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("add"), NUM(2), NUM(3)), with_add), NUM(5));
+}
+
+ValueRef read_string(const char* text) {
+    FILE* in = fmemopen((void*) text, strlen(text), "r");
+    Reader reader;
+    reader_init(&reader, in);
+    ValueRef value = (ValueRef) NULL;
+    if (!read_value(&reader, &value)) panic("No datum in `%s`!", text);
+    reader_free(&reader);
+    fclose(in);
+    return value;
+}
+
+void run_string(const char* program, Env* env) {
+    FILE* in = fmemopen((void*) program, strlen(program), "r");
+    run_stream(in, env, false);
+    fclose(in);
+}
+
+void test_reader() {
+    ASSERT_VALUE_REFS_EQ(read_string("  ; comment\n 42"), NUM(42));
+    ASSERT_VALUE_REFS_EQ(read_string("(a (b . c) 'd)"),
+        LIST(SYM("a"), CONS(SYM("b"), SYM("c")), LIST(SYM("quote"), SYM("d"))));
+    ASSERT_VALUE_REFS_EQ(read_string("(-1 .5x -)"), LIST(NUM(-1), SYM(".5x"), SYM("-")));
+    ASSERT_VALUE_REFS_EQ(read_string("()"), (ValueRef) NULL);
+
+    // Top-level forms are evaluated as they are read, so later ones see
+    // earlier definitions.
+    const char* program =
+        "(define square (lambda (x) (* x x)))\n"
+        "(define xs '(1 2 3))\n"
+        "(define result (cons (square 7) (cdr xs)))\n";
+    FILE* in = fmemopen((void*) program, strlen(program), "r");
+    Env* env = global_env();
+    run_stream(in, env, false);
+    fclose(in);
+    ASSERT_VALUE_REFS_EQ(env_lookup(env, SYM("result")), LIST(NUM(49), NUM(2), NUM(3)));
+}
+
+void test_numbers() {
+    Env* env = global_env();
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("-"), NUM(3), NUM(5)), env), NUM(-2));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("*"), NUM(-4), NUM(5)), env), NUM(-20));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("<"), NUM(-1), NUM(0)), env), SYM("t"));
+    if (!is_number(eval(LIST(SYM("+"), NUM(FIXNUM_MAX - 1), NUM(1)), env)))
+        panic("%s", "In-range sum left the fixnum fast path!");
+
+    // Overflowing the fixnum range promotes to a bignum, and results that
+    // fit again come back as fixnums.
+    ValueRef big = eval(LIST(SYM("+"), NUM(FIXNUM_MAX), NUM(1)), env);
+    if (!is_bignum(big)) panic("Expected a bignum, got %s!", typename_of(big));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("-"), big, NUM(1)), env), NUM(FIXNUM_MAX));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("-"), NUM(FIXNUM_MIN)), env), big);
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("<"), NUM(FIXNUM_MAX), big), env), SYM("t"));
+
+    // 2^64 * 2^64 - 1 == 2^128 - 1
+    ValueRef two_64 = read_string("18446744073709551616");
+    ValueRef product = eval(LIST(SYM("-"), LIST(SYM("*"), two_64, two_64), NUM(1)), env);
+    ASSERT_VALUE_REFS_EQ(product, read_string("340282366920938463463374607431768211455"));
+
+    char text[64];
+    FILE* out = fmemopen(text, sizeof(text), "w");
+    print_value(out, read_string("(-12 -340282366920938463463374607431768211455)"));
+    fclose(out);
+    if (strcmp(text, "(-12 -340282366920938463463374607431768211455)") != 0)
+        panic("Printed `%s`!", text);
+
+    // Flonums mix with integers, and exact division stays exact.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(+ 1 0.5 (* 2 .25))"), env), read_string("2.0"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(/ 1 4)"), env), read_string("0.25"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(/ 12 -4)"), env), NUM(-3));
+    // Also across the fixnum boundary.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(/ (* 4294967296 4294967296) 4294967296)"), env), NUM(4294967296L));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(/ (* 4294967296 4294967296) -2)"), env), read_string("-9223372036854775808"));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("/"), product, read_string("18446744073709551615")), env),
+                         read_string("18446744073709551617"));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("/"), product, two_64), env), read_string("18446744073709551616.0"));
+    ASSERT_VALUE_REFS_EQ(eval(LIST(SYM("/"), product, NUM(2)), env), read_string("170141183460469231731687303715884105728.0"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< 2 2.5 3)"), env), SYM("t"));
+    // A NaN is neither equal to nor less than anything, itself included.
+    run_string("(define nan (/ 0.0 0.0))", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(= nan 5)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(= nan nan)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< nan 5)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< 5 nan)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< 1 nan 3)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(= 5 5.0)"), env), SYM("t"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(- 1e3 1000)"), env), read_string("0."));
+
+    out = fmemopen(text, sizeof(text), "w");
+    print_value(out, eval(read_string("(cons (* 0.1 3) (cons (- 2.5) (/ 10 5.0)))"), env));
+    fclose(out);
+    if (strcmp(text, "(0.30000000000000004 -2.5 . 2.0)") != 0)
+        panic("Printed `%s`!", text);
+}
+
+void test_frame_reuse() {
+    Env* env = global_env();
+    run_string(
+        "(define add (lambda (a b) (+ a b)))\n"
+        "(define sum6 (lambda (a b c d e f) (+ a b c d e f)))\n"
+        "(define make-adder (lambda (n) (lambda (x) (add x n))))\n"
+        "(define add5 (make-adder 5))\n", env);
+    // Calls that create no closures hand their frames straight back, so
+    // they leave no frames behind for the collector.
+    ValueRef calls = read_string("(add (sum6 1 2 3 4 5 6) 1)");
+    for (int i = 0; i < 1000; i++) {
+        size_t cycles_before = GC.cycles;
+        Idx in_use_before = pool_in_use(&ENVS.meta);
+        ASSERT_VALUE_REFS_EQ(eval(calls, env), NUM(22));
+        Idx in_use = pool_in_use(&ENVS.meta);
+        if (GC.cycles == cycles_before && in_use != in_use_before)
+            panic("Frames weren't released: %lu in use, up from %lu!", in_use, in_use_before);
+    }
+    // A captured frame outlives its call.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(add5 (add5 1))"), env), NUM(11));
+}
+
+void test_global_call_caches() {
+    Env* env = global_env();
+    run_string(
+        "(define f (lambda (x) (+ x 1)))\n"
+        "(define g (lambda (x) (f x)))\n", env);
+    ValueRef call = read_string("(g 1)");
+    ASSERT_VALUE_REFS_EQ(eval(call, env), NUM(2));
+    ASSERT_VALUE_REFS_EQ(eval(call, env), NUM(2));
+    // Rebinding the global must invalidate what `g`'s call site cached.
+    run_string("(set! f (lambda (x) (* x 10)))", env);
+    ASSERT_VALUE_REFS_EQ(eval(call, env), NUM(10));
+    run_string("(define f -)", env);
+    ASSERT_VALUE_REFS_EQ(eval(call, env), NUM(-1));
+}
+
+void test_defines_run_on_vm() {
+    Env* env = global_env();
+    run_string(
+        "(define down (lambda (n) (if (= n 0) '() (cons n (down (- n 1))))))\n"
+        "(define short (down 3))\n", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(equal? short '(3 2 1))"), env), TRUE_SYMBOL);
+    if (!VM.enabled) return;
+    // Deeper than the tree-walker's C stack allows, so `down` must run on
+    // the VM even when called from a `define`.
+    run_string("(define long (down 200000))\n", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(car long)"), env), NUM(200000));
+}
+
+void test_builtin_calls_dont_allocate() {
+    Env* env = make_env(global_env(), SYM("x"), NUM(41));
+    ValueRef resolved = resolve_in_env(read_string("(car (cons (+ x 1) x))"), env);
+    ValueRef code = compile_prototype((ListRef) NULL, resolved);
+    Idx pairs_before = pool_in_use(&PAIRS.meta);
+    ASSERT_VALUE_REFS_EQ(eval_resolved(resolved, env), NUM(42));
+    ASSERT_VALUE_REFS_EQ(vm_run(code, env), NUM(42));
+    // Only the cell `cons` itself makes, once per run.
+    Idx pairs = pool_in_use(&PAIRS.meta);
+    if (pairs != pairs_before + 2)
+        panic("Builtin calls used %lu cells, expected 2!", pairs - pairs_before);
+}
+
+void test_one_shot_code_is_freed() {
+    Env* env = global_env();
+    run_string("(define twice (lambda (f x) (f (f x))))\n", env);
+    Idx codes_before = pool_in_use(&CODES.meta);
+    // Each expression's own code is freed once it returns: only the
+    // lambdas' bodies are left for the collector.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("((lambda (x) (+ x 1)) 41)"), env), NUM(42));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(twice (lambda (x) (* x 2)) 3)"), env), NUM(12));
+    Idx codes = pool_in_use(&CODES.meta);
+    if (VM.enabled && codes > codes_before + 2)
+        panic("Top-level code left %lu prototypes, expected 2!", codes - codes_before);
+}
+
+void test_binary_builtin_entries() {
+    Env* env = global_env();
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(+ 40 2)"), env), NUM(42));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(- 40 2)"), env), NUM(38));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(* -6 7)"), env), NUM(-42));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< -1 1)"), env), TRUE_SYMBOL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< 1 -1)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(= 3 3)"), env), TRUE_SYMBOL);
+    // Leaving the fixnum fast path still gives the generic result.
+    ASSERT_VALUE_REFS_EQ(eval(read_string(
+        "(- (* 1152921504606846975 2) (+ 1152921504606846975 1152921504606846975))"), env), NUM(0));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(< 1 1.5)"), env), TRUE_SYMBOL);
+
+    // Call sites that took the binary entry notice `+` being rebound.
+    run_string("(define add2 (lambda (a b) (+ a b)))", env);
+    ValueRef call = read_string("(add2 1 2)");
+    ASSERT_VALUE_REFS_EQ(eval(call, env), NUM(3));
+    run_string("(set! + cons)", env);
+    ASSERT_VALUE_REFS_EQ(eval(call, env), CONS(NUM(1), NUM(2)));
+}
+
+#define CONTEXT_TEST_THREADS 4
+
+typedef struct ContextTest {
+    bool vm;
+    int id;
+    ValueRef sum;
+    ValueRef fib;
+    SymbolRef shared;
+    SymbolRef own;
+} ContextTest;
+
+static void* run_context_test(void* arg) {
+    LISP_THREAD_ATTACH();
+    ContextTest* test = arg;
+    LispContext* ctx = lisp_context_new(test->vm);
+    // Each thread gives `n` a different value, so leaking definitions
+    // between contexts would show up in the results.
+    char source[512];
+    snprintf(source, sizeof(source),
+        "(define n %d)\n"
+        "(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))\n"
+        "(define fold (lambda (f acc xs) (if xs (fold f (f acc (car xs)) (cdr xs)) acc)))\n"
+        "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))\n"
+        "(define churn (lambda (k) (if (= k 0) 0 (churn (- k 1)))))\n",
+        test->id);
+    lisp_context_eval_string(ctx, source);
+    for (int round = 0; round < 50; round++) {
+        test->sum = lisp_context_eval_string(ctx, "(fold (lambda (a x) (+ a x)) n (iota 5000 '()))");
+        lisp_context_eval_string(ctx, "(churn 100)");
+        // Collect while the other threads run, whatever the heap's size.
+        if (round % 10 == 0) gc_collect();
+    }
+    test->fib = lisp_context_eval_string(ctx, "(fib n)");
+    test->shared = lisp_context_eval_string(ctx, "'shared-symbol");
+    snprintf(source, sizeof(source), "'own-symbol-%d", test->id);
+    test->own = lisp_context_eval_string(ctx, source);
+    lisp_context_free(ctx);
+    lisp_thread_detach();
+    return NULL;
+}
+
+void test_concurrent_contexts() {
+    size_t cycles_before = GC.cycles;
+    pthread_t threads[CONTEXT_TEST_THREADS];
+    ContextTest tests[CONTEXT_TEST_THREADS];
+    for (int i = 0; i < CONTEXT_TEST_THREADS; i++) {
+        tests[i] = (ContextTest) { .vm=VM.enabled, .id=10 + i };
+        if (pthread_create(&threads[i], NULL, run_context_test, &tests[i]) != 0)
+            panic("%s", "pthread_create failed!");
+    }
+    for (int i = 0; i < CONTEXT_TEST_THREADS; i++)
+        lisp_thread_join(threads[i]);
+
+    int fibs[] = { 55, 89, 144, 233 };
+    for (int i = 0; i < CONTEXT_TEST_THREADS; i++) {
+        ASSERT_VALUE_REFS_EQ(tests[i].sum, NUM(5000 * 5001 / 2 + 10 + i));
+        ASSERT_VALUE_REFS_EQ(tests[i].fib, NUM(fibs[i]));
+        ASSERT_VALUE_REFS_EQ(tests[i].shared, SYM("shared-symbol"));
+        char name[32];
+        snprintf(name, sizeof(name), "own-symbol-%d", 10 + i);
+        ASSERT_VALUE_REFS_EQ(tests[i].own, SYM(name));
+    }
+    if (GC.cycles == cycles_before) panic("%s", "Expected the threads to collect!");
+}
+
+// '(collect), collects garbage, for tests. Returns '().
+builtin_procedure_definition("collect", collect_garbage, 0, 0, {
+    gc_collect();
+    return (ValueRef) NULL;
+});
+
+void test_parallel_map() {
+    par_configure(4);
+    Env* env = global_env();
+    register_builtin(env, &collect_garbage);
+    run_string(
+        "(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))\n"
+        "(define fold (lambda (f acc xs) (if xs (fold f (f acc (car xs)) (cdr xs)) acc)))\n"
+        "(define xs (iota 20000 '()))\n"
+        "(define k 3)\n", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(pmap car '())"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(pmap (lambda (x) (* x k)) '(1 2 3))"), env),
+        LIST(NUM(3), NUM(6), NUM(9)));
+    // Results come back in order even though the chunks run out of order.
+    ASSERT_VALUE_REFS_EQ(eval(read_string(
+        "(fold (lambda (i x) (if (= i x) (+ i 1) -1)) 1 (pmap (lambda (x) (- (* x k) (* x 2))) xs))"), env),
+        NUM(20001));
+    // Each call's result must survive collections started by the others.
+    ASSERT_VALUE_REFS_EQ(eval(read_string(
+        "(fold (lambda (a x) (+ a (car x))) 0"
+        "  (pmap (lambda (x) (car (cons (cons x (iota 60 '())) (collect)))) (iota 64 '())))"), env),
+        NUM(64 * 65 / 2));
+    // A nested `pmap` runs sequentially.
+    ASSERT_VALUE_REFS_EQ(eval(read_string(
+        "(fold + 0 (pmap (lambda (x) (fold + 0 (pmap (lambda (y) (* x y)) '(1 2)))) '(1 2 3)))"), env),
+        NUM(18));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(pfor-each (lambda (x) (cons x x)) xs)"), env), (ValueRef) NULL);
+}
+
+static void write_file(const char* path, const char* text) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL || fputs(text, out) == EOF || fclose(out) != 0) panic("Can't write `%s`!", path);
+}
+
+/// Runs `text` as a script in a new process, on the evaluator the tests are
+/// running on, and returns whether it exited normally. What it printed,
+/// panics included, is left in `output`.
+static bool run_script(const char* flags, const char* text, char* output, size_t size) {
+    char script[] = "/tmp/lisp-script-XXXXXX";
+    int script_fd = mkstemp(script);
+    if (script_fd < 0) panic("%s", "mkstemp failed!");
+    close(script_fd);
+    write_file(script, text);
+    char exe[256] = { 0 }, command[512];
+    if (readlink("/proc/self/exe", exe, sizeof(exe) - 1) < 0) panic("%s", "readlink failed!");
+    snprintf(command, sizeof(command), "'%s' %s%s %s 2>&1",
+             exe, !VM.enabled ? "--tree " : JIT.enabled ? "" : "--no-jit ", flags, script);
+    FILE* child = popen(command, "r");
+    if (child == NULL) panic("%s", "popen failed!");
+    size_t len = fread(output, 1, size - 1, child);
+    output[len] = '\0';
+    int status = pclose(child);
+    remove(script);
+    return status == 0;
+}
+
+void test_malformed_forms() {
+    // Special forms with the wrong number of arguments, or called other
+    // than by name, panic on either evaluator, including in bodies the VM
+    // compiles.
+    const char* cases[][2] = {
+        { "(define f (lambda (x) 1 2))\n(f 0)\n", "can only handle one expression in the body" },
+        { "(define f (lambda (x) (if x 1 2 3)))\n(f 1)\n", "`if` takes no more than 3 arguments" },
+        { "(define f (lambda (x) (set! x 1 2)))\n(f 1)\n", "`set!` takes no more than 2 arguments" },
+        { "(define f (lambda (x) (quote x x)))\n(f 1)\n", "`quote` takes no more than 1 argument" },
+        { "(define f (lambda (x) (quote)))\n(f 1)\n", "`quote` takes 1 argument, none given" },
+        // A special form can only be called by name.
+        { "(define g (lambda (q) (q 'a)))\n(g quote)\n", "`quote` can only be called by name" },
+        { "(define g (lambda (q) (q a)))\n(g quote)\n", "Unbound Symbol: `a`" },
+        { "((lambda (q) (q 1 2 3)) if)\n", "`if` can only be called by name" },
+        { "(vector-map quote (vector 1 2))\n", "`quote` can only be called by name" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char output[512];
+        if (run_script("", cases[i][0], output, sizeof(output)) || strstr(output, cases[i][1]) == NULL)
+            panic("`%s` printed:\n%s", cases[i][0], output);
+    }
+}
+
+void test_image_round_trip() {
+    Env* env = global_env();
+    run_string(
+        "(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))\n"
+        "(define square (lambda (x) (* x x)))\n"
+        "(define big (* 4294967296 4294967296 3))\n"
+        "(define half 0.5)\n"
+        "(define items '(a (b . c) 3))\n"
+        "(define make-adder (lambda (n) (lambda (x) (+ x n))))\n"
+        "(define add5 (make-adder 5))\n"
+        "(define vec (vector 1 \"two\" items))\n"
+        "(define tab (make-table))\n"
+        "(table-set! tab 'k big)\n"
+        "(table-set! tab items \"v\")\n"
+        "(define-memo mfib (lambda (n) (if (< n 2) n (+ (mfib (- n 1)) (mfib (- n 2))))))\n"
+        "(define twice (memoize (lambda (x) (* 2 x)) 4))\n"
+        "(mfib 20)\n", env);
+    char image[] = "/tmp/lisp-image-XXXXXX";
+    int image_fd = mkstemp(image);
+    if (image_fd < 0) panic("%s", "mkstemp failed!");
+    close(image_fd);
+    image_save(image, env);
+    char partial[64];
+    snprintf(partial, sizeof(partial), "%s.tmp", image);
+    if (access(partial, F_OK) == 0) panic("`%s` was left behind!", partial);
+
+    // A fresh process starts from the image alone. The `iota` call runs
+    // collections over the loaded heap.
+    char flags[64], output[512];
+    snprintf(flags, sizeof(flags), "--image %s", image);
+    bool ok = run_script(flags,
+        "(print (square 12))\n"
+        "(print big)\n"
+        "(print (+ half 1))\n"
+        "(print items)\n"
+        "(print (add5 (square 3)))\n"
+        "(print (car (iota 100000 '())))\n"
+        "(define fresh 'new-symbol)\n"
+        "(print (cons fresh (car items)))\n"
+        "(print (if (< 1 2) 'yes 'no))\n"
+        "(print vec)\n"
+        "(print (cons (table-ref tab 'k) (table-ref tab '(a (b . c) 3))))\n"
+        "(print (cons (mfib 80) (twice 21)))\n", output, sizeof(output));
+    remove(image);
+    if (!ok) panic("Image run failed:\n%s", output);
+    const char* expected =
+        "144\n"
+        "55340232221128654848\n"
+        "1.5\n"
+        "(a (b . c) 3)\n"
+        "14\n"
+        "1\n"
+        "(new-symbol . a)\n"
+        "yes\n"
+        "#(1 \"two\" (a (b . c) 3))\n"
+        "(55340232221128654848 . \"v\")\n"
+        "(23416728348467685 . 42)\n";
+    if (strcmp(output, expected) != 0) panic("Image run printed:\n%s", output);
+}
+
+void test_profiler() {
+    Env* env = global_env();
+    run_string(
+        "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))\n"
+        "(define make-adder (lambda (n) (lambda (x) (+ x n))))\n", env);
+    profile_reset();
+    profile_start();
+    // The first call records a sample.
+    PROFILE_SAMPLE_DUE = 1;
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(fib 15)"), env), NUM(610));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("((make-adder 1) ((make-adder 2) 0))"), env), NUM(3));
+    profile_stop();
+
+    // fib(15) makes 1973 calls, 986 of which add; the adders add twice more.
+    if (profile_calls(env_lookup(env, SYM("fib"))) != 1973)
+        panic("Counted %lu calls of `fib`!", profile_calls(env_lookup(env, SYM("fib"))));
+    if (profile_calls(env_lookup(env, SYM("+"))) != 988)
+        panic("Counted %lu calls of `+`!", profile_calls(env_lookup(env, SYM("+"))));
+    // Every closure of a `lambda` counts towards the same entry.
+    ValueRef adder = eval(read_string("(make-adder 5)"), env);
+    if (profile_calls(adder) != 2) panic("Counted %lu calls of adders!", profile_calls(adder));
+    if (POOL_ALLOCS[ENVS.meta.id] < 1973) panic("Counted %lu frames!", POOL_ALLOCS[ENVS.meta.id]);
+    if (ENV_WALKS[0] == 0 || ENV_WALKS[1] == 0) panic("%s", "Lookups weren't counted!");
+
+    char* text;
+    size_t len;
+    FILE* out = open_memstream(&text, &len);
+    profile_write_folded(out, env);
+    fclose(out);
+    if (strcmp(text, "fib 1\n") != 0) panic("Folded stacks were `%s`!", text);
+    free(text);
+    profile_reset();
+}
+
+void test_memoize() {
+    Env* env = global_env();
+    register_builtin(env, &collect_garbage);
+    run_string(
+        "(define calls 0)\n"
+        "(define-memo fib (lambda (n) (begin-count (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))))\n"
+        "(define begin-count (lambda (x) (car (cons x (set! calls (+ calls 1))))))\n"
+        "(define pair-sum (memoize (lambda (p) (set! calls (+ calls 1))) 2))\n", env);
+    // Each argument is computed once, so fib(80) takes 81 calls, not 10^16.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(fib 80)"), env), NUM(23416728348467685L));
+    ASSERT_VALUE_REFS_EQ(env_lookup(env, SYM("calls")), NUM(81));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(fib 90)"), env), NUM(2880067194370816120L));
+    ASSERT_VALUE_REFS_EQ(env_lookup(env, SYM("calls")), NUM(91));
+    // Results survive collections.
+    eval(read_string("(collect)"), env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(fib 90)"), env), NUM(2880067194370816120L));
+    ASSERT_VALUE_REFS_EQ(env_lookup(env, SYM("calls")), NUM(91));
+
+    // Keys are compared by structure, and at most two are kept: looking up
+    // `(1 2)` keeps it recent, so `(3 4)` is the one evicted.
+    run_string(
+        "(set! calls 0)\n"
+        "(pair-sum '(1 2))\n"
+        "(pair-sum '(3 4))\n"
+        "(pair-sum (cons 1 (cons 2 '())))\n"
+        "(pair-sum 2.5)\n"
+        "(pair-sum '(1 2))\n"
+        "(pair-sum 2.5)\n", env);
+    ASSERT_VALUE_REFS_EQ(env_lookup(env, SYM("calls")), NUM(3));
+    run_string("(pair-sum '(3 4))\n", env);
+    ASSERT_VALUE_REFS_EQ(env_lookup(env, SYM("calls")), NUM(4));
+    Memo* memo = memo_lookup(env_lookup(proc_lookup(env_lookup(env, SYM("pair-sum"))).creation_env, SYM("memo")));
+    if (memo->count != 2 || memo->hits != 3 || memo->misses != 4)
+        panic("Memo table has %zu entries, %zu hits and %zu misses!", memo->count, memo->hits, memo->misses);
+}
+
+void test_compact_lists() {
+    Env* env = global_env();
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(list)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(list 1 (+ 1 1) 'c)"), env), LIST(NUM(1), NUM(2), SYM("c")));
+
+    // With room at the end of the pool, a long list takes consecutive cells.
+    ValueRef items[100];
+    ListRef consed = (ValueRef) NULL;
+    for (size_t i = 100; i-- > 0;) {
+        items[i] = NUM(i);
+        consed = CONS(items[i], consed);
+    }
+    gc_heap_lock();
+    pool_grow(&PAIRS.meta, PAIRS.meta.next_idx + 100);
+    pthread_mutex_unlock(&HEAP_LOCK);
+    ListRef list = make_list(items, 100);
+    Idx first = GET_VALUE_DATA(list);
+    size_t i = 0;
+    for (ListRef x = list; !is_null(x); x = cdr_lookup(x), i++) {
+        if (GET_VALUE_DATA(x) != first + i) panic("Cell %zu of the list is out of place!", i);
+    }
+    ASSERT_VALUE_REFS_EQ(list, consed);
+}
+
+void test_vectors_and_strings() {
+    Env* env = global_env();
+    run_string(
+        "(define v (make-vector 3 0))\n"
+        "(vector-set! v 1 'x)\n"
+        "(define s \"say \\\"hi\\\"\\n\")\n", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(vector-ref v 1)"), env), SYM("x"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(vector-length v)"), env), NUM(3));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(vector->list (vector-map (lambda (x) (* x x)) #(1 2 3)))"), env),
+                         LIST(NUM(1), NUM(4), NUM(9)));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(list->vector '(1 (2) \"3\"))"), env),
+                         read_string("#(1 (2) \"3\")"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(string-length s)"), env), NUM(9));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(string-index s \"h\")"), env), NUM(5));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(string-index s 122)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(string-append \"ab\" \"\" \"c\")"), env), read_string("\"abc\""));
+    if (value_hash(read_string("#(1 \"a\")")) != value_hash(read_string("#(1 \"a\")")))
+        panic("%s", "Equal vectors hashed differently!");
+
+    char text[64];
+    FILE* out = fmemopen(text, sizeof(text), "w");
+    print_value(out, eval(read_string("(cons s v)"), env));
+    fclose(out);
+    if (strcmp(text, "(\"say \\\"hi\\\"\\n\" . #(0 x 0))") != 0)
+        panic("Printed `%s`!", text);
+
+    // Sums stay exact past the fixnum range, and fall back to the numeric
+    // tower for flonums.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(vector-sum (make-vector 1001 -7))"), env), NUM(-7007));
+    ValueRef big = eval(LIST(SYM("vector-sum"), LIST(SYM("make-vector"), NUM(40), NUM(FIXNUM_MAX))), env);
+    ASSERT_VALUE_REFS_EQ(big, eval(LIST(SYM("*"), NUM(40), NUM(FIXNUM_MAX)), env));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(vector-sum #(1 2 0.5))"), env), read_string("3.5"));
+
+    // Every kernel agrees with the scalar one, at every length and offset.
+    FixnumSumFn kernels[] = {
+        fixnum_sum_scalar,
+#ifdef __x86_64__
+        fixnum_sum_sse2,
+        __builtin_cpu_supports("avx2") ? fixnum_sum_avx2 : fixnum_sum_sse2,
+#endif
+    };
+    ValueRef items[67];
+    for (size_t i = 0; i < 67; i++) items[i] = NUM((int64_t) (i * 7919 % 1000) - 500);
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        for (size_t len = 0; len <= 67; len++) {
+            int64_t expected = 0, total = -1;
+            for (size_t i = 0; i < len; i++) expected += fixnum_value(items[i]);
+            if (!kernels[k](items, len, &total) || total != expected)
+                panic("Kernel %zu summed %zu items wrong!", k, len);
+        }
+        ValueRef saved = items[61];
+        items[61] = SYM("x");
+        int64_t total;
+        if (kernels[k](items, 67, &total)) panic("Kernel %zu summed a symbol!", k);
+        items[61] = saved;
+    }
+}
+
+void test_hash_consing() {
+    // Comparing long lists walks them rather than recursing.
+    ListRef xs = (ValueRef) NULL, ys = (ValueRef) NULL;
+    for (size_t i = 0; i < 200000; i++) {
+        xs = CONS(NUM(i), xs);
+        ys = CONS(NUM(i), ys);
+    }
+    if (!value_eq(xs, ys)) panic("%s", "Equal long lists compared unequal!");
+
+    HASH_CONSING = true;
+    Env* env = global_env();
+    ValueRef a = read_string("(a (b 2.5) (b 2.5) \"s\")");
+    ValueRef b = read_string("(a (b 2.5) (b 2.5) \"s\")");
+    ASSERT_VALUE_REFS_EQ(a, b);
+    if (a != b || car_lookup(cdr_lookup(a)) != car_lookup(cdr_lookup(cdr_lookup(a))))
+        panic("%s", "Equal data wasn't shared!");
+    ValueRef plain = make_list((ValueRef[]) {
+        SYM("a"), LIST(SYM("b"), read_string("2.5")), LIST(SYM("b"), read_string("2.5")),
+        make_string("s", 1),
+    }, 4);
+    if (hash_consed(plain) || !value_eq(plain, a) || value_hash(plain) != value_hash(a))
+        panic("%s", "Plain and hash-consed copies disagree!");
+    if (eval(read_string("(cons 'a (cdr '(x (b 2.5) (b 2.5) \"s\")))"), env) != a)
+        panic("%s", "`cons` didn't hash-cons!");
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(equal? (list 1 '(2)) '(1 (2)))"), env), SYM("t"));
+
+    // Flonums are shared only if they're the same double, so -0.0 keeps
+    // its sign, and still compares equal to 0.0.
+    ValueRef zero = read_string("(0.0)"), negative_zero = read_string("(-0.0)");
+    if (zero == negative_zero) panic("%s", "-0.0 and 0.0 were shared!");
+    char printed[32];
+    FILE* out = fmemopen(printed, sizeof(printed), "w");
+    print_value(out, negative_zero);
+    fputc(' ', out);
+    print_value(out, eval(read_string("(/ 1 (car (cons -0.0 '())))"), env));
+    fclose(out);
+    if (strcmp(printed, "(-0.0) -inf") != 0) panic("Printed `%s`!", printed);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(equal? '(0.0) '(-0.0))"), env), SYM("t"));
+
+    // Vectors can change, so pairs holding them aren't shared.
+    ValueRef holder = read_string("(#(1) 2)");
+    if (hash_consed(holder) || !hash_consed(cdr_lookup(holder)))
+        panic("%s", "A pair holding a vector was hash-consed!");
+
+    // Repetitive data takes a cell per distinct subtree, and what survives
+    // a collection stays shared.
+    char text[4096] = "(";
+    for (size_t i = 0; i < 200; i++) strcat(text, "(p q r) ");
+    strcat(text, ")");
+    gc_collect();
+    Idx before = pool_in_use(&PAIRS.meta);
+    ValueRef repeated = read_string(text);
+    gc_collect();
+    Idx used = pool_in_use(&PAIRS.meta) - before;
+    if (used > 250) panic("200 copies of a list took %lu pairs!", used);
+    if (read_string(text) != repeated || read_string("(b 2.5)") != car_lookup(cdr_lookup(a)))
+        panic("%s", "Hash-consed data stopped being shared after a collection!");
+    HASH_CONSING = false;
+}
+
+void test_tables() {
+    Env* env = global_env();
+    run_string(
+        "(define t (make-table))\n"
+        "(table-set! t 'name 'ada)\n"
+        "(table-set! t 'born 1815)\n"
+        "(table-set! t '(1 \"x\") 'pair)\n"
+        "(table-set! t 1.5 'flonum)\n"
+        "(table-set! t 'born 1816)\n", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-ref t 'name)"), env), SYM("ada"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-ref t 'born)"), env), NUM(1816));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-ref t (list 1 \"x\"))"), env), SYM("pair"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-ref t (/ 3 2.0))"), env), SYM("flonum"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-ref t 'died)"), env), (ValueRef) NULL);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-ref t 'died 'unknown)"), env), SYM("unknown"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(table-count t)"), env), NUM(4));
+
+    // Growing keeps every entry, and the table keeps its keys and values
+    // alive across collections.
+    ValueRef table = make_table();
+    for (int64_t i = 0; i < 5000; i++) table_put(table, CONS(NUM(i), (ValueRef) NULL), NUM(-i));
+    gc_collect();
+    for (int64_t i = 0; i < 5000; i++)
+        ASSERT_VALUE_REFS_EQ(table_get(table, LIST(NUM(i)), (ValueRef) NULL), NUM(-i));
+    if (table_lookup(table)->count != 5000) panic("%s", "Table lost count of its keys!");
+}
+
+void test_optimizer() {
+    Env* env = global_env();
+    OPTIMIZING = true;
+    size_t folds = OPTIMIZER.folds, inlined = OPTIMIZER.inlined;
+
+    // Constant arguments are substituted and the arithmetic folded away.
+    ValueRef code = resolve_in_env(read_string("((lambda (x y) (* x (+ y 1))) 2 3)"), env);
+    ASSERT_VALUE_REFS_EQ(optimize(code, env), NUM(8));
+    code = resolve_in_env(read_string("(if (< 1 2) 'yes 'no)"), env);
+    ASSERT_VALUE_REFS_EQ(eval_resolved(optimize(code, env), env), SYM("yes"));
+    if (OPTIMIZER.folds < folds + 3 || OPTIMIZER.inlined == inlined)
+        panic("%s", "Optimizer didn't count its rewrites!");
+
+    // An unused pure argument is dropped; one with effects is kept.
+    code = resolve_in_env(read_string("((lambda (x y) (car x)) (cons 1 2) 7)"), env);
+    ValueRef params = car_lookup(cdr_lookup(car_lookup(optimize(code, env))));
+    ASSERT_VALUE_REFS_EQ(params, LIST(SYM("x")));
+    run_string("(define n 0)", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("((lambda (x) 1) (set! n 5))"), env), NUM(1));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("n"), env), NUM(5));
+
+    // References past an inlined frame still reach their bindings.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(((lambda (x) (lambda (y) (+ x y))) 5) 1)"), env), NUM(6));
+    ASSERT_VALUE_REFS_EQ(eval(read_string(
+        "((lambda (a) ((lambda (b c) (list a b c)) 2 a)) 1)"), env), LIST(NUM(1), NUM(2), NUM(1)));
+
+    // A form that rebinds a builtin doesn't have calls of it folded. Calls
+    // of `+` were folded in `env`, so this one runs in a new global frame.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("((lambda () (if (define + -) (+ 1 2) 0)))"), global_env()), NUM(-1));
+    OPTIMIZING = false;
+
+    // Rebinding a builtin after calls of it were folded panics, rather than
+    // leave the folded code computing something else.
+    const char* rebinds[] = {
+        "(set! * +)\n",
+        "(define * +)\n",
+        "(define g (lambda () (set! * +)))\n(g)\n",
+    };
+    for (size_t i = 0; i < sizeof(rebinds) / sizeof(rebinds[0]); i++) {
+        char script[256], output[512];
+        snprintf(script, sizeof(script), "(define f (lambda (x) (+ x (* 2 3))))\n%s(print (f 1))\n", rebinds[i]);
+        if (run_script("--optimize", script, output, sizeof(output))
+            || strstr(output, "Can't rebind `*`") == NULL)
+            panic("`%s` printed:\n%s", script, output);
+    }
+}
+
+void test_jit() {
+    bool vm = VM.enabled, jit = JIT.enabled;
+    uint32_t threshold = JIT.threshold;
+    VM.enabled = JIT.enabled = true;
+    JIT.threshold = 3;
+    Env* env = global_env();
+    run_string(
+        "(define count (lambda (n acc) (if (< n 1) acc (count (- n 1) (+ acc n)))))\n"
+        "(define walk (lambda (xs n) (if xs (walk (cdr xs) (+ n (car xs))) n)))\n"
+        "(define sq (lambda (x) (* x x)))\n"
+        "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))\n"
+        "(define keep (lambda (n acc) (if (= n 0) acc (keep (- n 1) (cons (lambda () n) acc)))))\n", env);
+    for (int i = 0; i < 3; i++) eval(read_string("(list (count 3 0) (walk '(1 2) 0) (sq 2) (fib 2))"), env);
+#if defined(__x86_64__) && defined(__linux__)
+    const char* hot[] = { "count", "walk", "sq", "fib" };
+    for (size_t i = 0; i < sizeof(hot) / sizeof(hot[0]); i++) {
+        Prototype* proto = code_lookup(proc_lookup(eval(SYM(hot[i]), env)).code);
+        if (proto->jit == NULL) panic("`%s` wasn't compiled!", hot[i]);
+    }
+#endif
+
+    // Native loops, and the interpreter taking over where guards fail.
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(count 100000 0)"), env), NUM(5000050000));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(walk '(1 2 3 4) 0)"), env), NUM(10));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(fib 15)"), env), NUM(610));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(sq 1073741823)"), env), NUM(1152921502459363329));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(= (sq 2305843009213693951) (* 2305843009213693951 2305843009213693951))"), env), SYM("t"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(count 2.5 0)"), env), eval(read_string("(+ 2.5 1.5)"), env));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(walk '(1 2.5) 0)"), env), eval(read_string("3.5"), env));
+
+    // A frame a closure captured isn't reused for the next iteration.
+    ASSERT_VALUE_REFS_EQ(eval(read_string(
+        "((lambda (fs) (list ((car fs)) ((car (cdr fs))) ((car (cdr (cdr fs)))))) (keep 3 '()))"), env),
+        LIST(NUM(1), NUM(2), NUM(3)));
+
+    // Rebinding an inlined builtin, or the procedure itself, takes effect.
+    run_string("(define + -)", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(count 3 0)"), env), NUM(-6));
+    run_string("(define + *)", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(count 3 1)"), env), NUM(6));
+    run_string(
+        "(define spin (lambda (n) (if (= n 0) 'done\n"
+        "  (spin (- n (if (= n 5) (if (set! spin (lambda (m) 'replaced)) 1 1) 1))))))", env);
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(spin 4)"), env), SYM("done"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(spin 4)"), env), SYM("done"));
+    ASSERT_VALUE_REFS_EQ(eval(read_string("(spin 10)"), env), SYM("replaced"));
+
+    VM.enabled = vm;
+    JIT.enabled = jit;
+    JIT.threshold = threshold;
+}
+
 void test() {
     test_lambda_application_and_builtins();
     test_set_bang();
     test_cons_car_cdr();
-    printf("All tests passed!\n");
+    test_lexical_addressing();
+    test_tail_calls();
+    test_gc_reclaims_garbage();
+    test_pools_grow_with_live_data();
+    test_symbol_interning();
+    test_vm_interop();
+    test_reader();
+    test_numbers();
+    test_frame_reuse();
+    test_global_call_caches();
+    test_defines_run_on_vm();
+    test_one_shot_code_is_freed();
+    test_malformed_forms();
+    test_builtin_calls_dont_allocate();
+    test_binary_builtin_entries();
+    test_concurrent_contexts();
+    test_parallel_map();
+    test_image_round_trip();
+    test_profiler();
+    test_memoize();
+    test_compact_lists();
+    test_vectors_and_strings();
+    test_hash_consing();
+    test_tables();
+    test_optimizer();
+    test_jit();
+    printf("All tests passed! (%s)\n",
+           !VM.enabled ? "tree-walking eval" : JIT.enabled ? "bytecode VM, JIT" : "bytecode VM");
 }
 
-int main(void) {
-    test();
+static void usage(const char* program) {
+    fprintf(stderr, "usage: %s [--tree] [--no-jit] [--hash-cons] [--optimize] [--image IMAGE] [--save-image OUT] [--profile OUT] [--repl | FILE | -]\n", program);
+    fprintf(stderr, "       %s --bench\n", program);
+    fprintf(stderr, "With no arguments, runs the tests. --image starts from a saved image\n");
+    fprintf(stderr, "instead of the builtins alone; --save-image saves one after FILE runs.\n");
+    fprintf(stderr, "--profile writes sampled stacks to OUT in folded format and prints\n");
+    fprintf(stderr, "call, allocation and timing counts to stderr. --hash-cons shares\n");
+    fprintf(stderr, "structurally equal data read or built with cons and list. --optimize\n");
+    fprintf(stderr, "folds constants and inlines lambdas before running each form, and\n");
+    fprintf(stderr, "reports how much code it removed to stderr. --no-jit runs hot\n");
+    fprintf(stderr, "procedures on the bytecode VM instead of compiling them to x86-64.\n");
+    exit(2);
+}
+
+int main(int argc, char** argv) {
+    GC_INIT();
+    numbers_init();
+    vectors_init();
+    tables_init();
+    vm_init();
+    memo_init();
+    context_init();
+    parallel_init();
+    profile_init();
+    optimize_init();
+    if (argc == 1) {
+        // The JIT only runs the VM's code, so runs the tests again with
+        // everything the VM runs compiled on first use. Top-level forms are
+        // compiled too, so that none of the tests' code escapes the VM.
+        bool jit = JIT.enabled;
+        JIT.enabled = false;
+        test();
+        VM.enabled = true;
+        VM_COMPILE_ALL = true;
+        test();
+        if (jit) {
+            JIT.enabled = true;
+            JIT.threshold = 1;
+            test();
+        }
+        return 0;
+    }
+    if (argc == 2 && strcmp(argv[1], "--bench") == 0) {
+        bench();
+        return 0;
+    }
+
+    VM.enabled = true;
+    bool repl = false;
+    const char* path = NULL;
+    const char* image = NULL;
+    const char* save_image = NULL;
+    const char* profile = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--tree") == 0) VM.enabled = false;
+        else if (strcmp(argv[i], "--no-jit") == 0) JIT.enabled = false;
+        else if (strcmp(argv[i], "--hash-cons") == 0) HASH_CONSING = true;
+        else if (strcmp(argv[i], "--optimize") == 0) OPTIMIZING = true;
+        else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) image = argv[++i];
+        else if (strcmp(argv[i], "--save-image") == 0 && i + 1 < argc) save_image = argv[++i];
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profile = argv[++i];
+        else if (strcmp(argv[i], "--repl") == 0) repl = true;
+        else if (path == NULL && (strcmp(argv[i], "-") == 0 || argv[i][0] != '-')) path = argv[i];
+        else usage(argv[0]);
+    }
+    if (repl == (path != NULL)) usage(argv[0]);
+
+    Env* env = image ? image_load(image) : global_env();
+    FILE* in = (repl || strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return 1;
+    }
+    if (profile != NULL) profile_start();
+    run_stream(in, env, repl);
+    if (OPTIMIZING) optimize_report(stderr);
+    if (profile != NULL) profile_report(profile, env);
+    if (in != stdin) fclose(in);
+    if (save_image != NULL) image_save(save_image, env);
     return 0;
 }
@@ -0,0 +1,238 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <pthread.h> // pthread_mutex_t
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "builtins.h"
+#include "gc.h"
+
+// Memoized procedures, made by `memoize` and `define-memo`.
+//
+// A memoized procedure is an ordinary closure over a `MEMO` cell, of the
+// same arity as the procedure `f` it wraps, whose body is
+// `(memo-call memo x1 x2 ...)`. It runs under either evaluator and is
+// called like any other procedure. `memo-call` conses its arguments into a
+// key and looks it up in the cell's table, and only calls `f` on a miss.
+//
+// Keys are compared with `value_eq` and hashed with `value_hash`, so equal
+// argument lists hit the same entry however they were built. A table with
+// a size bound keeps its entries on a most-recently-used list and, once
+// full, reuses the least recently used one for each new result.
+//
+// Tables are locked, so a memoized procedure may be shared by the calls of
+// a `pmap`. The lock is never held across a call of `f` or an allocation:
+// two threads that miss on the same key both call `f`, and the first
+// result stored wins.
+
+#define MEMO_NONE UINT32_MAX
+
+typedef struct MemoEntry {
+    ValueRef key; // The arguments, as a list.
+    ValueRef value;
+    uint64_t hash;
+    uint32_t next;  // Next entry in the same bucket, or `MEMO_NONE`.
+    uint32_t newer; // Neighbours in the recently-used list.
+    uint32_t older;
+} MemoEntry;
+
+typedef struct Memo {
+    pthread_mutex_t lock;
+    ProcRef fn;
+    size_t limit; // Most entries kept, or 0 for no bound.
+    size_t count;
+    size_t cap;   // Entries allocated; also the number of buckets.
+    MemoEntry* entries;
+    uint32_t* buckets; // Heads of the chains, indexed by hash.
+    uint32_t newest;
+    uint32_t oldest;
+    size_t hits;
+    size_t misses;
+} Memo;
+
+static struct {
+    Memo* memos;
+    PoolMeta meta;
+} MEMOS = {
+    .meta={
+        .name="MEMOS", .collected=true, .column_count=1,
+        .columns={ (void**) &MEMOS.memos },
+        .column_sizes={ sizeof(Memo) },
+    }
+};
+
+static void trace_memo(Idx idx) {
+    Memo* memo = &MEMOS.memos[idx];
+    gc_push(memo->fn);
+    for (size_t i = 0; i < memo->count; i++) {
+        gc_push(memo->entries[i].key);
+        gc_push(memo->entries[i].value);
+    }
+}
+
+static void clear_memo(Idx idx) {
+    Memo* memo = &MEMOS.memos[idx];
+    if (memo->fn == (ValueRef) NULL) return; // Already free.
+    pthread_mutex_destroy(&memo->lock);
+    free(memo->entries);
+    free(memo->buckets);
+    memset(memo, 0, sizeof(Memo));
+}
+
+void memo_init(void) {
+    gc_register_other_kind(MEMO, &MEMOS.meta, trace_memo, clear_memo);
+}
+
+Memo* memo_lookup(ValueRef ref) {
+    Idx idx = GET_OTHER_DATA(ref);
+    if (!is_other_kind(ref, MEMO) || idx >= MEMOS.meta.next_idx)
+        panic("Expected memo table, got %s!", typename_of(ref));
+    return &MEMOS.memos[idx];
+}
+
+/// Returns the entry for `key`, or `MEMO_NONE`.
+static uint32_t memo_find(Memo* memo, ValueRef key, uint64_t hash) {
+    if (memo->cap == 0) return MEMO_NONE;
+    uint32_t i = memo->buckets[hash & (memo->cap - 1)];
+    for (; i != MEMO_NONE; i = memo->entries[i].next) {
+        MemoEntry* entry = &memo->entries[i];
+        if (entry->hash == hash && value_eq(entry->key, key)) return i;
+    }
+    return MEMO_NONE;
+}
+
+static void memo_unlink_recent(Memo* memo, uint32_t i) {
+    MemoEntry* entry = &memo->entries[i];
+    if (entry->newer != MEMO_NONE) memo->entries[entry->newer].older = entry->older;
+    else memo->newest = entry->older;
+    if (entry->older != MEMO_NONE) memo->entries[entry->older].newer = entry->newer;
+    else memo->oldest = entry->newer;
+}
+
+static void memo_push_recent(Memo* memo, uint32_t i) {
+    MemoEntry* entry = &memo->entries[i];
+    entry->newer = MEMO_NONE;
+    entry->older = memo->newest;
+    if (memo->newest != MEMO_NONE) memo->entries[memo->newest].newer = i;
+    else memo->oldest = i;
+    memo->newest = i;
+}
+
+static void memo_unlink_bucket(Memo* memo, uint32_t i) {
+    uint32_t* link = &memo->buckets[memo->entries[i].hash & (memo->cap - 1)];
+    while (*link != i) link = &memo->entries[*link].next;
+    *link = memo->entries[i].next;
+}
+
+/// Doubles the table and rehashes it.
+static void memo_grow(Memo* memo) {
+    size_t cap = memo->cap ? 2 * memo->cap : 16;
+    memo->entries = realloc(memo->entries, cap * sizeof(MemoEntry));
+    memo->buckets = realloc(memo->buckets, cap * sizeof(uint32_t));
+    if (memo->entries == NULL || memo->buckets == NULL) panic("%s", "Memo table alloc error!");
+    memo->cap = cap;
+    for (size_t b = 0; b < cap; b++) memo->buckets[b] = MEMO_NONE;
+    for (uint32_t i = 0; i < memo->count; i++) {
+        uint32_t* head = &memo->buckets[memo->entries[i].hash & (cap - 1)];
+        memo->entries[i].next = *head;
+        *head = i;
+    }
+}
+
+/// Stores `value` for `key`, evicting the least recently used entry if the
+/// table is full. Expects `memo->lock` to be held.
+static void memo_insert(Memo* memo, ValueRef key, uint64_t hash, ValueRef value) {
+    uint32_t i;
+    if (memo->limit != 0 && memo->count == memo->limit) {
+        i = memo->oldest;
+        memo_unlink_bucket(memo, i);
+        memo_unlink_recent(memo, i);
+    } else {
+        if (memo->count == memo->cap) memo_grow(memo);
+        i = memo->count++;
+    }
+    uint32_t* head = &memo->buckets[hash & (memo->cap - 1)];
+    memo->entries[i] = (MemoEntry) { .key=key, .value=value, .hash=hash, .next=*head };
+    *head = i;
+    memo_push_recent(memo, i);
+}
+
+// Defined in `./main.c`.
+ValueRef apply_value(ValueRef fn, size_t argc, const ValueRef* argv);
+
+// '(memo-call memo x1 x2 ...), calls the memoized procedure, if need be.
+// Only reachable through the bodies `make_memo_proc` builds.
+builtin_procedure_definition("memo-call", memo_call, 1, VARIADIC, {
+    ValueRef ref = argv[0];
+    size_t count = argc - 1;
+    ValueRef args[count ? count : 1];
+    memcpy(args, argv + 1, count * sizeof(ValueRef));
+
+    ListRef key = (ValueRef) NULL;
+    for (size_t i = count; i-- > 0;) key = CONS(args[i], key);
+    uint64_t hash = value_hash(key);
+
+    Memo* memo = memo_lookup(ref);
+    pthread_mutex_lock(&memo->lock);
+    uint32_t found = memo_find(memo, key, hash);
+    if (found != MEMO_NONE) {
+        ValueRef value = memo->entries[found].value;
+        memo_unlink_recent(memo, found);
+        memo_push_recent(memo, found);
+        memo->hits++;
+        pthread_mutex_unlock(&memo->lock);
+        return value;
+    }
+    memo->misses++;
+    ProcRef fn = memo->fn;
+    pthread_mutex_unlock(&memo->lock);
+
+    ValueRef value = apply_value(fn, count, args);
+
+    // Another thread may have stored the key in the meantime.
+    pthread_mutex_lock(&memo->lock);
+    found = memo_find(memo, key, hash);
+    if (found == MEMO_NONE) memo_insert(memo, key, hash, value);
+    else value = memo->entries[found].value;
+    pthread_mutex_unlock(&memo->lock);
+    return value;
+});
+
+/// Returns the table of a procedure `make_memo_proc` made, or `NULL` for
+/// any other procedure.
+Memo* memo_of_proc(ProcRef fn) {
+    Proc proc = proc_lookup(fn);
+    if (!is_pair(proc.body)) return NULL;
+    ValueRef head = car_lookup(proc.body);
+    if (!is_builtin_proc(head) || builtin_proc_lookup(head).fn != memo_call.fn) return NULL;
+    return memo_lookup(proc.creation_env->slots[0]);
+}
+
+/// Wraps `fn` in a procedure of the same parameters that caches its
+/// results, keeping at most `limit` of them if `limit` isn't 0.
+ProcRef make_memo_proc(ProcRef fn, size_t limit) {
+    if (limit >= MEMO_NONE) panic("%s", "A memo table's size bound must be below 2^32!");
+    Proc proc = proc_lookup(fn);
+    Idx idx = pool_alloc(&MEMOS.meta);
+    Memo* memo = &MEMOS.memos[idx];
+    *memo = (Memo) { .fn=fn, .limit=limit, .newest=MEMO_NONE, .oldest=MEMO_NONE };
+    pthread_mutex_init(&memo->lock, NULL);
+    ValueRef ref = MAKE_OTHER(MEMO, idx);
+
+    // The closure's frame holds the table; its body passes it on, then
+    // the parameters in order.
+    Env* frame = make_frame(proc.creation_env, LIST(SYM("memo")), 1);
+    frame->slots[0] = ref;
+    size_t param_count = 0;
+    for (ListRef param = proc.params; !is_null(param); param = cdr_lookup(param))
+        param_count++;
+    ListRef args = (ValueRef) NULL;
+    for (size_t slot = param_count; slot-- > 0;)
+        args = CONS(make_local_ref(0, slot), args);
+    ValueRef body = CONS(make_builtin_proc(&memo_call), CONS(make_local_ref(1, 0), args));
+    return make_proc(frame, proc.params, body);
+}
+
+#endif
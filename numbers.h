@@ -0,0 +1,523 @@
+#ifndef NUMBERS_H
+#define NUMBERS_H
+
+#include <stdint.h> // uint32_t, int64_t
+#include <ctype.h> // isdigit
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "gc.h"
+
+// Numeric tower: fixnums, bignums and flonums.
+//
+// Fixnums are checked for overflow on the tagged word itself: shifted left
+// by `VALUE_KIND_BITS`, a fixnum is its value times 8 in an `int64_t`, so
+// the result leaves the fixnum range exactly when the machine operation
+// overflows. Only then does arithmetic fall back to bignums.
+//
+// Bignums live in the `BIGNUMS` pool as a sign and a malloc'd magnitude of
+// 32-bit limbs. Results are always normalized: a value that fits in a
+// fixnum is never a bignum, so integers compare equal iff their refs are
+// equal or both are bignums with the same digits.
+//
+// Flonums are IEEE doubles packed into the `FLONUMS` pool, one cell per
+// value, so an intermediate result costs a pool index rather than a malloc.
+// Mixing a flonum with an integer converts the integer to a double.
+
+typedef struct Bignum {
+    bool negative;
+    size_t len;      // Limbs in use; the most significant one is nonzero.
+    uint32_t* limbs; // Magnitude, least significant limb first.
+} Bignum;
+
+static struct {
+    Bignum* bignums;
+    PoolMeta meta;
+} BIGNUMS = {
+    .meta={
+        .name="BIGNUMS", .collected=true, .column_count=1,
+        .columns={ (void**) &BIGNUMS.bignums },
+        .column_sizes={ sizeof(Bignum) },
+    }
+};
+
+static void trace_bignum(Idx idx) {
+    // Bignums refer to no other values.
+}
+
+static void clear_bignum(Idx idx) {
+    free(BIGNUMS.bignums[idx].limbs);
+    BIGNUMS.bignums[idx] = (Bignum) { .negative=false, .len=0, .limbs=NULL };
+}
+
+static struct {
+    double* values;
+    PoolMeta meta;
+} FLONUMS = {
+    .meta={
+        .name="FLONUMS", .collected=true, .column_count=1,
+        .columns={ (void**) &FLONUMS.values },
+        .column_sizes={ sizeof(double) },
+    }
+};
+
+static void trace_flonum(Idx idx) {
+    // Flonums refer to no other values.
+}
+
+static void clear_flonum(Idx idx) {
+    FLONUMS.values[idx] = 0.0;
+}
+
+void numbers_init(void) {
+    gc_register_other_kind(BIGNUM, &BIGNUMS.meta, trace_bignum, clear_bignum);
+    gc_register_other_kind(FLONUM, &FLONUMS.meta, trace_flonum, clear_flonum);
+}
+
+Bignum* bignum_lookup(Number num) {
+    Idx idx = GET_OTHER_DATA(num);
+    if (!is_bignum(num) || idx >= BIGNUMS.meta.next_idx)
+        panic("Expected bignum, got %s!", typename_of(num));
+    return &BIGNUMS.bignums[idx];
+}
+
+// A read-only signed magnitude, borrowed from a bignum or spelled out from
+// a fixnum into `small`. Never copy one: `limbs` may point into it.
+typedef struct BigView {
+    bool negative;
+    size_t len;
+    const uint32_t* limbs;
+    uint32_t small[2];
+} BigView;
+
+static void big_view(Number num, BigView* view) {
+    if (is_number(num)) {
+        int64_t n = fixnum_value(num);
+        uint64_t magnitude = n < 0 ? -(uint64_t) n : (uint64_t) n;
+        view->negative = n < 0;
+        view->small[0] = (uint32_t) magnitude;
+        view->small[1] = (uint32_t) (magnitude >> 32);
+        view->len = view->small[1] ? 2 : view->small[0] ? 1 : 0;
+        view->limbs = view->small;
+    } else {
+        Bignum* big = bignum_lookup(assume_integer(num));
+        view->negative = big->negative;
+        view->len = big->len;
+        view->limbs = big->limbs;
+    }
+}
+
+static uint32_t* limbs_alloc(size_t len) {
+    uint32_t* limbs = calloc(len ? len : 1, sizeof(uint32_t));
+    if (limbs == NULL) panic("%s", "Bignum limbs alloc error!");
+    return limbs;
+}
+
+/// Makes an integer from a magnitude, taking ownership of `limbs`.
+static Number big_make(bool negative, uint32_t* limbs, size_t len) {
+    while (len > 0 && limbs[len - 1] == 0) len--;
+    if (len <= 2) {
+        uint64_t magnitude = len == 0 ? 0 : len == 1 ? limbs[0] : limbs[0] | (uint64_t) limbs[1] << 32;
+        if (negative ? magnitude <= (uint64_t) -FIXNUM_MIN : magnitude <= (uint64_t) FIXNUM_MAX) {
+            free(limbs);
+            return make_fixnum(negative ? -(int64_t) magnitude : (int64_t) magnitude);
+        }
+    }
+    Idx idx = pool_alloc(&BIGNUMS.meta);
+    BIGNUMS.bignums[idx] = (Bignum) { .negative=negative, .len=len, .limbs=limbs };
+    return MAKE_OTHER(BIGNUM, idx);
+}
+
+Number make_bignum_from_int(int64_t num) {
+    uint64_t magnitude = num < 0 ? -(uint64_t) num : (uint64_t) num;
+    uint32_t* limbs = limbs_alloc(2);
+    limbs[0] = (uint32_t) magnitude;
+    limbs[1] = (uint32_t) (magnitude >> 32);
+    return big_make(num < 0, limbs, 2);
+}
+
+static int mag_cmp(const BigView* a, const BigView* b) {
+    if (a->len != b->len) return a->len < b->len ? -1 : 1;
+    for (size_t i = a->len; i-- > 0;) {
+        if (a->limbs[i] != b->limbs[i]) return a->limbs[i] < b->limbs[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+static Number mag_add(bool negative, const BigView* a, const BigView* b) {
+    if (a->len < b->len) return mag_add(negative, b, a);
+    uint32_t* limbs = limbs_alloc(a->len + 1);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < a->len; i++) {
+        carry += (uint64_t) a->limbs[i] + (i < b->len ? b->limbs[i] : 0);
+        limbs[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    limbs[a->len] = (uint32_t) carry;
+    return big_make(negative, limbs, a->len + 1);
+}
+
+/// Subtracts magnitudes, assuming `|a| >= |b|`.
+static Number mag_sub(bool negative, const BigView* a, const BigView* b) {
+    uint32_t* limbs = limbs_alloc(a->len);
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a->len; i++) {
+        int64_t diff = (int64_t) a->limbs[i] - (i < b->len ? b->limbs[i] : 0) - borrow;
+        borrow = diff < 0;
+        limbs[i] = (uint32_t) (diff + (borrow << 32));
+    }
+    return big_make(negative, limbs, a->len);
+}
+
+static Number big_add(const BigView* a, const BigView* b) {
+    if (a->negative == b->negative) return mag_add(a->negative, a, b);
+    if (mag_cmp(a, b) >= 0) return mag_sub(a->negative, a, b);
+    return mag_sub(b->negative, b, a);
+}
+
+static Number big_mul(const BigView* a, const BigView* b) {
+    size_t len = a->len + b->len;
+    uint32_t* limbs = limbs_alloc(len);
+    for (size_t i = 0; i < a->len; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b->len; j++) {
+            carry += (uint64_t) a->limbs[i] * b->limbs[j] + limbs[i + j];
+            limbs[i + j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        limbs[i + b->len] = (uint32_t) carry;
+    }
+    return big_make(a->negative != b->negative, limbs, len);
+}
+
+/// Divides `a` by `b`, which is nonzero. If `b` divides `a`, stores the
+/// quotient in `*out` and returns true; otherwise returns false. Long
+/// division on 32-bit limbs (Knuth's Algorithm D).
+static bool big_div_exact(const BigView* a, const BigView* b, Number* out) {
+    size_t m = a->len, n = b->len;
+    bool negative = a->negative != b->negative;
+    if (m < n) {
+        if (m != 0) return false;
+        *out = make_fixnum(0);
+        return true;
+    }
+    uint32_t* q = limbs_alloc(m - n + 1);
+    if (n == 1) {
+        uint64_t rem = 0;
+        for (size_t i = m; i-- > 0;) {
+            uint64_t num = rem << 32 | a->limbs[i];
+            q[i] = (uint32_t) (num / b->limbs[0]);
+            rem = num % b->limbs[0];
+        }
+        if (rem != 0) {
+            free(q);
+            return false;
+        }
+        *out = big_make(negative, q, m);
+        return true;
+    }
+
+    // Shift both so the divisor's top limb has its high bit set, which
+    // keeps each estimated quotient limb at most 2 too large.
+    unsigned s = __builtin_clz(b->limbs[n - 1]);
+    uint32_t* v = limbs_alloc(n);
+    uint32_t* u = limbs_alloc(m + 1);
+    for (size_t i = n - 1; i > 0; i--)
+        v[i] = b->limbs[i] << s | (s ? (uint32_t) ((uint64_t) b->limbs[i - 1] >> (32 - s)) : 0);
+    v[0] = b->limbs[0] << s;
+    u[m] = s ? (uint32_t) ((uint64_t) a->limbs[m - 1] >> (32 - s)) : 0;
+    for (size_t i = m - 1; i > 0; i--)
+        u[i] = a->limbs[i] << s | (s ? (uint32_t) ((uint64_t) a->limbs[i - 1] >> (32 - s)) : 0);
+    u[0] = a->limbs[0] << s;
+
+    for (size_t j = m - n + 1; j-- > 0;) {
+        uint64_t num = (uint64_t) u[j + n] << 32 | u[j + n - 1];
+        uint64_t qhat = num / v[n - 1], rhat = num % v[n - 1];
+        while (qhat >> 32 || qhat * v[n - 2] > (rhat << 32 | u[j + n - 2])) {
+            qhat--;
+            rhat += v[n - 1];
+            if (rhat >> 32) break;
+        }
+        // Subtract `qhat * v` from the window of `u`, adding `v` back if
+        // that went negative.
+        int64_t borrow = 0, t;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t p = qhat * v[i];
+            t = (int64_t) u[i + j] - borrow - (int64_t) (p & 0xFFFFFFFF);
+            u[i + j] = (uint32_t) t;
+            borrow = (int64_t) (p >> 32) - (t >> 32);
+        }
+        t = (int64_t) u[j + n] - borrow;
+        u[j + n] = (uint32_t) t;
+        q[j] = (uint32_t) qhat;
+        if (t < 0) {
+            q[j]--;
+            uint64_t carry = 0;
+            for (size_t i = 0; i < n; i++) {
+                carry += (uint64_t) u[i + j] + v[i];
+                u[i + j] = (uint32_t) carry;
+                carry >>= 32;
+            }
+            u[j + n] += (uint32_t) carry;
+        }
+    }
+
+    bool exact = true;
+    for (size_t i = 0; i < n; i++) exact &= u[i] == 0;
+    free(u);
+    free(v);
+    if (!exact) {
+        free(q);
+        return false;
+    }
+    *out = big_make(negative, q, m - n + 1);
+    return true;
+}
+
+bool bignum_eq(Number a, Number b) {
+    BigView x, y;
+    big_view(a, &x);
+    big_view(b, &y);
+    return x.negative == y.negative && mag_cmp(&x, &y) == 0;
+}
+
+uint64_t bignum_hash(Number num) {
+    BigView x;
+    big_view(num, &x);
+    return hash_bytes((const char*) x.limbs, x.len * sizeof(uint32_t)) ^ x.negative;
+}
+
+/// Parses the decimal `digits`, which must all be digits.
+Number parse_bignum(const char* digits, size_t len, bool negative) {
+    // Accumulate nine digits at a time: limbs = limbs * 10^chunk_len + chunk.
+    size_t cap = len / 9 + 2, used = 0;
+    uint32_t* limbs = limbs_alloc(cap);
+    for (size_t i = 0; i < len;) {
+        uint32_t chunk = 0, scale = 1;
+        for (size_t end = i + 9 < len ? i + 9 : len; i < end; i++) {
+            chunk = 10 * chunk + (digits[i] - '0');
+            scale *= 10;
+        }
+        uint64_t carry = chunk;
+        for (size_t j = 0; j < used; j++) {
+            carry += (uint64_t) limbs[j] * scale;
+            limbs[j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        if (carry) limbs[used++] = (uint32_t) carry;
+    }
+    return big_make(negative, limbs, used);
+}
+
+void print_bignum(FILE* out, Number num) {
+    Bignum* big = bignum_lookup(num);
+    // Peel off nine decimal digits at a time by dividing by 10^9.
+    uint32_t* limbs = limbs_alloc(big->len);
+    memcpy(limbs, big->limbs, big->len * sizeof(uint32_t));
+    uint32_t* chunks = limbs_alloc(big->len * 32 / 29 + 2);
+    size_t chunk_count = 0;
+    for (size_t len = big->len; len > 0;) {
+        uint64_t rem = 0;
+        for (size_t i = len; i-- > 0;) {
+            uint64_t cur = (rem << 32) | limbs[i];
+            limbs[i] = (uint32_t) (cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        chunks[chunk_count++] = (uint32_t) rem;
+        while (len > 0 && limbs[len - 1] == 0) len--;
+    }
+    if (big->negative) fputc('-', out);
+    fprintf(out, "%u", chunks[chunk_count - 1]);
+    for (size_t i = chunk_count - 1; i-- > 0;)
+        fprintf(out, "%09u", chunks[i]);
+    free(chunks);
+    free(limbs);
+}
+
+Number make_flonum(double value) {
+    Idx idx = pool_alloc(&FLONUMS.meta);
+    FLONUMS.values[idx] = value;
+    return MAKE_OTHER(FLONUM, idx);
+}
+
+double flonum_value(Number num) {
+    Idx idx = GET_OTHER_DATA(num);
+    if (!is_flonum(num) || idx >= FLONUMS.meta.next_idx)
+        panic("Expected flonum, got %s!", typename_of(num));
+    return FLONUMS.values[idx];
+}
+
+/// Converts any number to the nearest double.
+double num_to_double(Number num) {
+    if (is_number(num)) return (double) fixnum_value(num);
+    if (is_flonum(num)) return flonum_value(num);
+    Bignum* big = bignum_lookup(assume_integer(num));
+    double value = 0.0;
+    for (size_t i = big->len; i-- > 0;)
+        value = value * 4294967296.0 + big->limbs[i];
+    return big->negative ? -value : value;
+}
+
+bool flonum_eq(Number a, Number b) {
+    return flonum_value(a) == flonum_value(b);
+}
+
+/// Whether `a` and `b` are the very same double: like `flonum_eq`, but
+/// -0.0 and 0.0 differ, and a NaN is the same as nothing.
+bool flonum_same(Number a, Number b) {
+    double x = flonum_value(a), y = flonum_value(b);
+    return x == y && memcmp(&x, &y, sizeof(x)) == 0;
+}
+
+uint64_t flonum_hash(Number num) {
+    double value = flonum_value(num);
+    if (value == 0.0) value = 0.0; // -0.0 is `flonum_eq` to 0.0.
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return hash_mix(bits);
+}
+
+/// Parses `token` as a flonum if it looks like one: it must contain a digit
+/// and a `.` or an exponent, and `strtod` must consume all of it.
+bool parse_flonum(const char* token, size_t len, Number* out) {
+    bool digit = false, point = false;
+    for (size_t i = 0; i < len; i++) {
+        if (isdigit((unsigned char) token[i])) digit = true;
+        else if (token[i] == '.' || token[i] == 'e' || token[i] == 'E') point = true;
+    }
+    if (!digit || !point) return false;
+    char* end;
+    double value = strtod(token, &end);
+    if (end != token + len) return false;
+    *out = make_flonum(value);
+    return true;
+}
+
+/// Prints the shortest representation that reads back as the same double,
+/// always with a `.` or an exponent so it reads back as a flonum.
+void print_flonum(FILE* out, Number num) {
+    double value = flonum_value(num);
+    char text[32];
+    for (int precision = 15; precision <= 17; precision++) {
+        snprintf(text, sizeof(text), "%.*g", precision, value);
+        if (strtod(text, NULL) == value) break;
+    }
+    fputs(text, out);
+    if (strpbrk(text, ".eni") == NULL) fputs(".0", out);
+}
+
+////////////////////////////// FIXNUMS //////////////////////////////
+// Each sets `*out` and returns `true` unless the result leaves the fixnum
+// range. Both arguments must be fixnums.
+
+static inline bool fixnum_add(Number a, Number b, Number* out) {
+    int64_t sum;
+    if (__builtin_add_overflow((int64_t) (a << VALUE_KIND_BITS), (int64_t) (b << VALUE_KIND_BITS), &sum))
+        return false;
+    *out = make_fixnum(sum >> VALUE_KIND_BITS);
+    return true;
+}
+
+static inline bool fixnum_sub(Number a, Number b, Number* out) {
+    int64_t difference;
+    if (__builtin_sub_overflow((int64_t) (a << VALUE_KIND_BITS), (int64_t) (b << VALUE_KIND_BITS), &difference))
+        return false;
+    *out = make_fixnum(difference >> VALUE_KIND_BITS);
+    return true;
+}
+
+static inline bool fixnum_mul(Number a, Number b, Number* out) {
+    int64_t product;
+    if (__builtin_mul_overflow((int64_t) (a << VALUE_KIND_BITS), fixnum_value(b), &product))
+        return false;
+    *out = make_fixnum(product >> VALUE_KIND_BITS);
+    return true;
+}
+
+// Shifted left, fixnums order like their values, so no untagging is needed.
+#define fixnum_cmp(a, b) \
+    (((int64_t) ((a) << VALUE_KIND_BITS) > (int64_t) ((b) << VALUE_KIND_BITS)) - \
+     ((int64_t) ((a) << VALUE_KIND_BITS) < (int64_t) ((b) << VALUE_KIND_BITS)))
+/////////////////////////////////////////////////////////////////////
+
+////////////////////////////// GENERIC //////////////////////////////
+Number num_add(Number a, Number b) {
+    Number sum;
+    if (is_number(a) && is_number(b) && fixnum_add(a, b, &sum)) return sum;
+    if (is_flonum(a) || is_flonum(b)) return make_flonum(num_to_double(a) + num_to_double(b));
+    BigView x, y;
+    big_view(a, &x);
+    big_view(b, &y);
+    return big_add(&x, &y);
+}
+
+Number num_sub(Number a, Number b) {
+    Number difference;
+    if (is_number(a) && is_number(b) && fixnum_sub(a, b, &difference)) return difference;
+    if (is_flonum(a) || is_flonum(b)) return make_flonum(num_to_double(a) - num_to_double(b));
+    BigView x, y;
+    big_view(a, &x);
+    big_view(b, &y);
+    y.negative = !y.negative;
+    return big_add(&x, &y);
+}
+
+Number num_mul(Number a, Number b) {
+    Number product;
+    if (is_number(a) && is_number(b) && fixnum_mul(a, b, &product)) return product;
+    if (is_flonum(a) || is_flonum(b)) return make_flonum(num_to_double(a) * num_to_double(b));
+    BigView x, y;
+    big_view(a, &x);
+    big_view(b, &y);
+    return big_mul(&x, &y);
+}
+
+Number num_neg(Number a) {
+    if (is_flonum(a)) return make_flonum(-flonum_value(a));
+    return num_sub(make_fixnum(0), a);
+}
+
+/// Divides exactly when both are integers and `b` divides `a`, else in
+/// floating point.
+Number num_div(Number a, Number b) {
+    if (is_number(a) && is_number(b)) {
+        int64_t x = fixnum_value(a), y = fixnum_value(b);
+        if (y == 0) panic("%s", "Division by zero!");
+        // Only FIXNUM_MIN / -1 leaves the range, and `make_number` promotes it.
+        if (x % y == 0) return make_number(x / y);
+    } else if (!is_flonum(a) && !is_flonum(b)) {
+        if (is_number(b) && fixnum_value(b) == 0) panic("%s", "Division by zero!");
+        BigView x, y;
+        big_view(a, &x);
+        big_view(b, &y);
+        Number quotient;
+        if (big_div_exact(&x, &y, &quotient)) return quotient;
+    }
+    return make_flonum(num_to_double(a) / num_to_double(b));
+}
+
+/// Returns a negative, zero or positive number as `a` is less than, equal
+/// to or greater than `b`. A NaN is unordered, so it comes out equal to
+/// everything: `num_compare` is what `=` and `<` use.
+int num_cmp(Number a, Number b) {
+    if (is_number(a) && is_number(b)) return fixnum_cmp(a, b);
+    if (is_flonum(a) || is_flonum(b)) {
+        double x = num_to_double(a), y = num_to_double(b);
+        return (x > y) - (x < y);
+    }
+    BigView x, y;
+    big_view(a, &x);
+    big_view(b, &y);
+    if (x.negative != y.negative) return x.negative ? -1 : 1;
+    int cmp = mag_cmp(&x, &y);
+    return x.negative ? -cmp : cmp;
+}
+
+// Whether `a OP b`, for `OP` one of `==` and `<`. When either is a
+// flonum both compare as doubles, so a NaN is neither equal to nor less
+// than anything.
+#define num_compare(a, b, OP) \
+    ((is_flonum(a) || is_flonum(b)) ? num_to_double(a) OP num_to_double(b) : num_cmp(a, b) OP 0)
+/////////////////////////////////////////////////////////////////////
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stdio.h> // FILE, fprintf
+#include <stdlib.h> // realloc
+#include <pthread.h> // pthread_mutex_t
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "resolve.h"
+#include "builtins.h"
+#include "numbers.h"
+#include "gc.h"
+
+// Optimizing pre-pass, run with `--optimize`.
+//
+// `optimize` rewrites code that has been through `resolve`, before either
+// evaluator sees it:
+//
+// - Calls of the arithmetic and comparison builtins on constant numbers
+//   are folded into their result, as is an `if` with a constant test.
+// - An immediately applied lambda, `((lambda (x y) body) a b)`, has each
+//   constant argument substituted into its body, and each argument that
+//   is never used dropped if evaluating it can't matter. A lambda left
+//   with no parameters is replaced by its body, so no frame is made.
+//
+// A call is folded only if the global it calls still holds the builtin
+// and the form being optimized never `set!`s or `define`s that global.
+// Forms are optimized just before they run, so a *later* form could still
+// rebind a builtin that earlier code had folded calls of. Each folded
+// global is recorded in `FOLDED_GLOBALS`, and rebinding one panics rather
+// than leave the folded code computing something else.
+//
+// `OPTIMIZER` counts the nodes going in and coming out: each atom, lambda
+// parameter and quoted datum is one node. `optimize_report` prints them.
+
+// Set with `--optimize`. See `eval` in `./main.c`.
+static bool OPTIMIZING = false;
+
+static struct {
+    size_t forms;
+    size_t nodes_in;
+    size_t nodes_out;
+    size_t folds;
+    size_t inlined;  // Immediately applied lambdas rewritten.
+    size_t bindings; // Parameters substituted or dropped.
+} OPTIMIZER;
+
+// The globals, by the global frame they're bound in, whose calls were
+// folded. The frames are kept alive, so a new global frame can never
+// take over one's entries.
+typedef struct FoldedGlobal {
+    Env* root;
+    SymbolRef symbol;
+} FoldedGlobal;
+
+static struct {
+    FoldedGlobal* globals;
+    size_t count;
+    size_t cap;
+    pthread_mutex_t lock;
+} FOLDED_GLOBALS = {
+    .lock=PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void optimize_mark_roots(void* local) {
+    for (size_t i = 0; i < FOLDED_GLOBALS.count; i++)
+        gc_mark_env(FOLDED_GLOBALS.globals[i].root);
+}
+
+void optimize_init(void) {
+    gc_register_root_scanner(optimize_mark_roots, NULL);
+}
+
+static bool optimize_was_folded(Env* root, SymbolRef symbol) {
+    for (size_t i = 0; i < FOLDED_GLOBALS.count; i++)
+        if (FOLDED_GLOBALS.globals[i].root == root && FOLDED_GLOBALS.globals[i].symbol == symbol)
+            return true;
+    return false;
+}
+
+static void optimize_record_fold(Env* root, SymbolRef symbol) {
+    pthread_mutex_lock(&FOLDED_GLOBALS.lock);
+    if (!optimize_was_folded(root, symbol)) {
+        if (FOLDED_GLOBALS.count == FOLDED_GLOBALS.cap) {
+            FOLDED_GLOBALS.cap = FOLDED_GLOBALS.cap ? FOLDED_GLOBALS.cap * 2 : 8;
+            FOLDED_GLOBALS.globals = realloc(FOLDED_GLOBALS.globals, FOLDED_GLOBALS.cap * sizeof(FoldedGlobal));
+            if (FOLDED_GLOBALS.globals == NULL) panic("%s", "Folded globals alloc error!");
+        }
+        FOLDED_GLOBALS.globals[FOLDED_GLOBALS.count] = (FoldedGlobal) { .root=root, .symbol=symbol };
+        __atomic_store_n(&FOLDED_GLOBALS.count, FOLDED_GLOBALS.count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&FOLDED_GLOBALS.lock);
+}
+
+/// Panics if `symbol` is about to be rebound in the global frame `root`
+/// after calls of it were folded.
+void optimize_check_rebind(Env* root, SymbolRef symbol) {
+    if (__atomic_load_n(&FOLDED_GLOBALS.count, __ATOMIC_ACQUIRE) == 0) return;
+    pthread_mutex_lock(&FOLDED_GLOBALS.lock);
+    bool folded = optimize_was_folded(root, symbol);
+    pthread_mutex_unlock(&FOLDED_GLOBALS.lock);
+    if (folded)
+        panic("Can't rebind `%s`: --optimize already folded calls of it!", symbol_to_string(symbol));
+}
+
+// Defined in `./main.c`.
+bool self_evaluating(ValueRef value);
+
+/// Counts the nodes of resolved code.
+size_t optimize_count(ValueRef expr) {
+    if (!is_pair(expr)) return 1;
+    ValueRef head = car_lookup(expr);
+    ListRef args = cdr_lookup(expr);
+    if (is_form(head, &quote)) return 2;
+    if (is_form(head, &lambda)) {
+        size_t count = 1;
+        for (ListRef param = car_lookup(args); !is_null(param); param = cdr_lookup(param)) count++;
+        return count + optimize_count(car_lookup(cdr_lookup(args)));
+    }
+    size_t count = 0;
+    for (; is_pair(expr); expr = cdr_lookup(expr)) count += optimize_count(car_lookup(expr));
+    return count;
+}
+
+/// Whether `expr` always evaluates to the same value, which goes in
+/// `*value`.
+static bool optimize_constant(ValueRef expr, ValueRef* value) {
+    if (is_pair(expr)) {
+        if (!is_form(car_lookup(expr), &quote)) return false;
+        *value = car_lookup(cdr_lookup(expr));
+        return true;
+    }
+    if (!self_evaluating(expr)) return false;
+    *value = expr;
+    return true;
+}
+
+/// Code that evaluates to `value`.
+static ValueRef optimize_literal(ValueRef value) {
+    if (self_evaluating(value)) return value;
+    return LIST(make_special_form(&quote), value);
+}
+
+/// Whether `expr` can be left unevaluated without changing what happens.
+static bool optimize_pure(ValueRef expr) {
+    ValueRef value;
+    return optimize_constant(expr, &value) || is_other_kind(expr, LOCAL_REF)
+        || (is_pair(expr) && is_form(car_lookup(expr), &lambda));
+}
+
+/// Whether `expr` assigns the global `symbol` anywhere.
+static bool optimize_assigns(ValueRef expr, SymbolRef symbol) {
+    if (!is_pair(expr)) return false;
+    ValueRef head = car_lookup(expr);
+    if (is_form(head, &quote)) return false;
+    if (is_form(head, &define) || is_form(head, &define_memo)) {
+        if (car_lookup(cdr_lookup(expr)) == symbol) return true;
+    } else if (is_form(head, &set_bang)) {
+        if (car_lookup(cdr_lookup(expr)) == make_global_ref(symbol)) return true;
+    }
+    for (; is_pair(expr); expr = cdr_lookup(expr))
+        if (optimize_assigns(car_lookup(expr), symbol)) return true;
+    return false;
+}
+
+// The builtins that are folded: pure, and total on numbers but for `/`.
+static BuiltinProc* const FOLDABLE_BUILTINS[] = {
+    &plus, &times, &minus, &divide, &num_eq, &less_than,
+};
+
+/// Folds `(fn arg...)` into its value if it can be. `form` is the whole
+/// form being optimized.
+static bool optimize_fold(ValueRef fn, ListRef args, ValueRef form, Env* global, ValueRef* value) {
+    if (!is_other_kind(fn, GLOBAL_REF)) return false;
+    SymbolRef symbol = global_ref_symbol(fn);
+    ValueRef* slot = env_find(global, symbol);
+    if (slot == NULL || !is_builtin_proc(*slot)) return false;
+    BuiltinProc proc = builtin_proc_lookup(*slot);
+    bool foldable = false;
+    for (size_t i = 0; i < sizeof(FOLDABLE_BUILTINS) / sizeof(FOLDABLE_BUILTINS[0]); i++)
+        if (proc.fn == FOLDABLE_BUILTINS[i]->fn) foldable = true;
+    if (!foldable) return false;
+
+    size_t argc = 0;
+    for (ListRef arg = args; !is_null(arg); arg = cdr_lookup(arg)) argc++;
+    if (argc < proc.min_args || argc > proc.max_args) return false;
+    ValueRef argv[argc ? argc : 1];
+    for (size_t i = 0; i < argc; i++, args = cdr_lookup(args)) {
+        argv[i] = car_lookup(args);
+        if (!is_numeric(argv[i])) return false;
+        bool divisor = proc.fn == divide.fn && (i > 0 || argc == 1);
+        if (divisor && num_to_double(argv[i]) == 0.0) return false; // Leave the error to run time.
+    }
+    if (optimize_assigns(form, symbol)) return false;
+    *value = proc.fn(argc, argv);
+    optimize_record_fold(global, symbol);
+    OPTIMIZER.folds++;
+    return true;
+}
+
+// What becomes of each parameter of an inlined lambda.
+typedef struct Binding {
+    bool kept;
+    Idx slot;       // The parameter's slot, if kept.
+    ValueRef value; // Code for the parameter's value, if not.
+} Binding;
+
+/// Counts the references to each of the `count` parameters of the frame
+/// `depth` frames out from `expr`, and notes the ones assigned.
+static void optimize_uses(ValueRef expr, Idx depth, size_t count, size_t uses[], bool assigned[]) {
+    if (is_other_kind(expr, LOCAL_REF)) {
+        if (local_ref_depth(expr) == depth && local_ref_slot(expr) < count) uses[local_ref_slot(expr)]++;
+        return;
+    }
+    if (!is_pair(expr)) return;
+    ValueRef head = car_lookup(expr);
+    ListRef args = cdr_lookup(expr);
+    if (is_form(head, &quote)) return;
+    if (is_form(head, &lambda)) {
+        optimize_uses(car_lookup(cdr_lookup(args)), depth + 1, count, uses, assigned);
+        return;
+    }
+    if (is_form(head, &set_bang)) {
+        ValueRef target = car_lookup(args);
+        if (is_other_kind(target, LOCAL_REF) && local_ref_depth(target) == depth && local_ref_slot(target) < count)
+            assigned[local_ref_slot(target)] = true;
+        args = cdr_lookup(args);
+    } else if (is_form(head, &define) || is_form(head, &define_memo)) {
+        args = cdr_lookup(args);
+    } else if (!is_special_form(head)) {
+        optimize_uses(head, depth, count, uses, assigned);
+    }
+    for (; is_pair(args); args = cdr_lookup(args))
+        optimize_uses(car_lookup(args), depth, count, uses, assigned);
+}
+
+static ValueRef optimize_rebind(ValueRef expr, Idx depth, const Binding bindings[], bool dropped);
+
+static ListRef optimize_rebind_list(ListRef list, Idx depth, const Binding bindings[], bool dropped) {
+    if (!is_pair(list)) return list;
+    ValueRef first = optimize_rebind(car_lookup(list), depth, bindings, dropped);
+    return CONS(first, optimize_rebind_list(cdr_lookup(list), depth, bindings, dropped));
+}
+
+/// Rewrites the references in `expr` to the frame `depth` frames out, as
+/// `bindings` says. If `dropped`, that frame is gone, so references past
+/// it reach one frame less far.
+static ValueRef optimize_rebind(ValueRef expr, Idx depth, const Binding bindings[], bool dropped) {
+    if (is_other_kind(expr, LOCAL_REF)) {
+        Idx ref_depth = local_ref_depth(expr), slot = local_ref_slot(expr);
+        if (ref_depth < depth) return expr;
+        if (ref_depth > depth) return dropped ? make_local_ref(ref_depth - 1, slot) : expr;
+        // Substituted values are constants, so they mean the same at any depth.
+        if (!bindings[slot].kept) return bindings[slot].value;
+        return make_local_ref(depth, bindings[slot].slot);
+    }
+    if (!is_pair(expr)) return expr;
+    ValueRef head = car_lookup(expr);
+    ListRef args = cdr_lookup(expr);
+    if (is_form(head, &quote)) return expr;
+    if (is_form(head, &lambda)) {
+        ValueRef body = optimize_rebind(car_lookup(cdr_lookup(args)), depth + 1, bindings, dropped);
+        return CONS(head, CONS(car_lookup(args), CONS(body, cdr_lookup(cdr_lookup(args)))));
+    }
+    if (is_form(head, &define) || is_form(head, &define_memo))
+        return CONS(head, CONS(car_lookup(args), optimize_rebind_list(cdr_lookup(args), depth, bindings, dropped)));
+    return optimize_rebind_list(expr, depth, bindings, dropped);
+}
+
+/// Rewrites `((lambda params body) args...)`, or returns `NULL` if nothing
+/// can be substituted or dropped.
+static ValueRef optimize_inline(ValueRef lambda_form, ListRef args) {
+    ListRef lambda_args = cdr_lookup(lambda_form);
+    ListRef params = car_lookup(lambda_args);
+    ValueRef body = car_lookup(cdr_lookup(lambda_args));
+    size_t count = 0, argc = 0;
+    for (ListRef param = params; !is_null(param); param = cdr_lookup(param)) count++;
+    for (ListRef arg = args; !is_null(arg); arg = cdr_lookup(arg)) argc++;
+    if (argc != count) return (ValueRef) NULL; // Leave the error to run time.
+
+    size_t uses[count ? count : 1];
+    bool assigned[count ? count : 1];
+    for (size_t i = 0; i < count; i++) uses[i] = assigned[i] = 0;
+    optimize_uses(body, 0, count, uses, assigned);
+
+    Binding bindings[count ? count : 1];
+    ValueRef kept_args[count ? count : 1];
+    SymbolRef kept_params[count ? count : 1];
+    size_t kept = 0;
+    ListRef arg = args, param = params;
+    for (size_t i = 0; i < count; i++, arg = cdr_lookup(arg), param = cdr_lookup(param)) {
+        ValueRef value, code = car_lookup(arg);
+        // A quoted constant is two nodes, so it's only substituted once.
+        if (!assigned[i] && optimize_constant(code, &value) && (!is_pair(code) || uses[i] <= 1)) {
+            bindings[i] = (Binding) { .kept=false, .value=code };
+        } else if (!assigned[i] && uses[i] == 0 && optimize_pure(code)) {
+            bindings[i] = (Binding) { .kept=false, .value=(ValueRef) NULL };
+        } else {
+            kept_args[kept] = code;
+            kept_params[kept] = car_lookup(param);
+            bindings[i] = (Binding) { .kept=true, .slot=kept++ };
+        }
+    }
+    if (count > 0 && kept == count) return (ValueRef) NULL;
+    OPTIMIZER.inlined++;
+    OPTIMIZER.bindings += count - kept;
+
+    ValueRef new_body = optimize_rebind(body, 0, bindings, kept == 0);
+    if (kept == 0) return new_body;
+    ValueRef new_lambda = CONS(car_lookup(lambda_form),
+        CONS(make_list(kept_params, kept), CONS(new_body, cdr_lookup(cdr_lookup(lambda_args)))));
+    return CONS(new_lambda, make_list(kept_args, kept));
+}
+
+static ValueRef optimize_expr(ValueRef expr, ValueRef form, Env* global);
+
+static ListRef optimize_list(ListRef list, ValueRef form, Env* global) {
+    if (!is_pair(list)) return list;
+    ValueRef first = optimize_expr(car_lookup(list), form, global);
+    return CONS(first, optimize_list(cdr_lookup(list), form, global));
+}
+
+static ValueRef optimize_expr(ValueRef expr, ValueRef form, Env* global) {
+    if (!is_pair(expr)) return expr;
+    ValueRef head = car_lookup(expr);
+    ListRef args = cdr_lookup(expr);
+    if (is_form(head, &quote)) return expr;
+    if (is_form(head, &lambda)) {
+        ValueRef body = optimize_expr(car_lookup(cdr_lookup(args)), form, global);
+        return CONS(head, CONS(car_lookup(args), CONS(body, cdr_lookup(cdr_lookup(args)))));
+    }
+    if (is_form(head, &define) || is_form(head, &define_memo) || is_form(head, &set_bang))
+        return CONS(head, CONS(car_lookup(args), optimize_list(cdr_lookup(args), form, global)));
+    if (is_form(head, &if_)) {
+        args = optimize_list(args, form, global);
+        ValueRef test;
+        if (!optimize_constant(car_lookup(args), &test)) return CONS(head, args);
+        OPTIMIZER.folds++;
+        ListRef branches = cdr_lookup(args);
+        if (!is_null(test)) return car_lookup(branches);
+        return is_null(cdr_lookup(branches)) ? (ValueRef) NULL : car_lookup(cdr_lookup(branches));
+    }
+    if (is_special_form(head)) return CONS(head, optimize_list(args, form, global));
+
+    head = optimize_expr(head, form, global);
+    args = optimize_list(args, form, global);
+    ValueRef value;
+    if (optimize_fold(head, args, form, global, &value)) return optimize_literal(value);
+    if (is_pair(head) && is_form(car_lookup(head), &lambda)) {
+        ValueRef inlined = optimize_inline(head, args);
+        // Substituted constants may make more of the body foldable.
+        if (!is_null(inlined)) return optimize_expr(inlined, form, global);
+    }
+    return CONS(head, args);
+}
+
+/// Optimizes `expr`, code resolved to run in `env`.
+ValueRef optimize(ValueRef expr, Env* env) {
+    ValueRef optimized = optimize_expr(expr, expr, env->root);
+    OPTIMIZER.forms++;
+    OPTIMIZER.nodes_in += optimize_count(expr);
+    OPTIMIZER.nodes_out += optimize_count(optimized);
+    return optimized;
+}
+
+void optimize_report(FILE* out) {
+    size_t eliminated = OPTIMIZER.nodes_in - OPTIMIZER.nodes_out;
+    fprintf(out, "optimizer: %zu forms, %zu of %zu nodes eliminated (%.1f%%): "
+                 "%zu folds, %zu lambdas inlined, %zu bindings removed\n",
+            OPTIMIZER.forms, eliminated, OPTIMIZER.nodes_in,
+            OPTIMIZER.nodes_in ? 100.0 * eliminated / OPTIMIZER.nodes_in : 0.0,
+            OPTIMIZER.folds, OPTIMIZER.inlined, OPTIMIZER.bindings);
+}
+
+#endif
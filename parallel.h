@@ -0,0 +1,256 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <pthread.h> // pthread_create, pthread_mutex_t
+#include <unistd.h> // sysconf
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "gc.h"
+#include "vm.h"
+#include "context.h"
+
+// Work-stealing thread pool behind `pmap` and `pfor-each`.
+//
+// A parallel call copies the list's elements into an array and cuts it
+// into chunks, dealt round-robin onto one deque per participant: the pool's
+// workers plus the calling thread. Each participant pops chunks from the
+// bottom of its own deque and, once that is empty, steals from the top of
+// the others'. Results go straight into the cars of a list built before
+// the work starts, so they are reachable, and in order, as soon as they
+// are stored.
+//
+// Calls of `f` run concurrently, sharing `f`'s environment and the global
+// frame: `f` may read anything and allocate freely, but must not `define`
+// or `set!` variables other calls can see. One parallel call runs at a
+// time; one that starts while another runs (say, a `pmap` inside `f`)
+// runs sequentially on its own thread.
+//
+// The pool has `LISP_THREADS` participants (default: one per core), and so
+// one worker fewer. Workers start on first use and live until exit.
+
+// Defined in `./main.c`.
+ValueRef apply_value(ValueRef fn, size_t argc, const ValueRef* argv);
+
+#define PAR_MAX_GRAIN 1024 // Most elements per chunk.
+#define PAR_CHUNKS_PER_PARTICIPANT 8
+
+typedef struct ParChunk {
+    size_t lo, hi;
+} ParChunk;
+
+typedef struct ParDeque {
+    pthread_mutex_t lock;
+    ParChunk* chunks;
+    size_t top, bottom; // Chunks `[top, bottom)` are left.
+} ParDeque;
+
+typedef struct ParJob {
+    ValueRef fn;
+    bool vm;
+    const ValueRef* items;
+    PairRef* out; // The result cell for each item, or `NULL` for `pfor-each`.
+    ParDeque* deques;
+    size_t participants;
+} ParJob;
+
+// Everything is guarded by `lock`, which is never held across anything
+// that might collect.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t posted;   // A job was posted.
+    pthread_cond_t finished; // A worker finished its part of the job.
+    size_t participants;
+    bool started;
+    bool running;  // A parallel call is under way.
+    ParJob* job;
+    uint64_t generation; // Bumped for each job.
+    size_t busy;   // Workers not yet done with the current job.
+} PAR = {
+    .lock=PTHREAD_MUTEX_INITIALIZER,
+    .posted=PTHREAD_COND_INITIALIZER,
+    .finished=PTHREAD_COND_INITIALIZER,
+};
+
+void parallel_init(void) {
+    const char* threads = getenv("LISP_THREADS");
+    long count = threads ? strtol(threads, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    PAR.participants = count > 0 ? (size_t) count : 1;
+}
+
+/// Sets the number of participants, if the pool hasn't started yet.
+void par_configure(size_t participants) {
+    pthread_mutex_lock(&PAR.lock);
+    if (!PAR.started && participants > 0) PAR.participants = participants;
+    pthread_mutex_unlock(&PAR.lock);
+}
+
+/// Takes a chunk from `slot`'s own deque, or else steals one.
+static bool par_take(ParJob* job, size_t slot, ParChunk* chunk) {
+    ParDeque* own = &job->deques[slot];
+    pthread_mutex_lock(&own->lock);
+    bool found = own->bottom > own->top;
+    if (found) *chunk = own->chunks[--own->bottom];
+    pthread_mutex_unlock(&own->lock);
+    for (size_t i = 1; !found && i < job->participants; i++) {
+        ParDeque* victim = &job->deques[(slot + i) % job->participants];
+        pthread_mutex_lock(&victim->lock);
+        found = victim->bottom > victim->top;
+        if (found) *chunk = victim->chunks[victim->top++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return found;
+}
+
+static void par_run(ParJob* job, size_t slot) {
+    bool enabled = VM.enabled;
+    VM.enabled = job->vm;
+    ParChunk chunk;
+    while (par_take(job, slot, &chunk)) {
+        for (size_t i = chunk.lo; i < chunk.hi; i++) {
+            ValueRef result = apply_value(job->fn, 1, &job->items[i]);
+            if (job->out != NULL) pair_car(GET_VALUE_DATA(job->out[i])) = result;
+        }
+    }
+    VM.enabled = enabled;
+}
+
+typedef struct ParWait {
+    uint64_t* seen;
+    ParJob* job;
+} ParWait;
+
+static void par_wait_for_job(void* arg) {
+    ParWait* wait = arg;
+    pthread_mutex_lock(&PAR.lock);
+    while (PAR.generation == *wait->seen) pthread_cond_wait(&PAR.posted, &PAR.lock);
+    *wait->seen = PAR.generation;
+    wait->job = PAR.job;
+    pthread_mutex_unlock(&PAR.lock);
+}
+
+static void* par_worker(void* arg) {
+    LISP_THREAD_ATTACH();
+    size_t slot = (size_t) arg;
+    uint64_t seen = 0;
+    for (;;) {
+        ParWait wait = { .seen=&seen, .job=NULL };
+        gc_call_blocking(par_wait_for_job, &wait);
+        par_run(wait.job, slot);
+        pthread_mutex_lock(&PAR.lock);
+        if (--PAR.busy == 0) pthread_cond_signal(&PAR.finished);
+        pthread_mutex_unlock(&PAR.lock);
+    }
+    return NULL;
+}
+
+/// Claims the pool for one parallel call, starting it if need be.
+static bool par_begin(void) {
+    pthread_mutex_lock(&PAR.lock);
+    bool claimed = !PAR.running;
+    if (claimed) PAR.running = true;
+    bool start = claimed && !PAR.started;
+    if (start) PAR.started = true;
+    pthread_mutex_unlock(&PAR.lock);
+    for (size_t slot = 1; start && slot < PAR.participants; slot++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, par_worker, (void*) slot) != 0)
+            panic("%s", "pthread_create failed!");
+        pthread_detach(thread);
+    }
+    return claimed;
+}
+
+static void par_wait_for_workers(void* arg) {
+    pthread_mutex_lock(&PAR.lock);
+    while (PAR.busy > 0) pthread_cond_wait(&PAR.finished, &PAR.lock);
+    PAR.job = NULL;
+    PAR.running = false;
+    pthread_mutex_unlock(&PAR.lock);
+}
+
+/// Applies `fn` to each element of `xs`, in parallel if the pool is free.
+/// Lists the results in order if `collect` is set, else returns '().
+ListRef par_map(ValueRef fn, ListRef xs, bool collect) {
+    size_t count = 0;
+    for (ListRef x = xs; !is_null(x); x = assume_list(cdr_lookup(x)))
+        count++;
+
+    // Build the result list up front; the calls fill in its cars.
+    ListRef results = (ListRef) NULL;
+    for (size_t i = 0; collect && i < count; i++)
+        results = make_pair_ref((ValueRef) NULL, results);
+
+    if (count == 0 || !par_begin()) {
+        ListRef out = results;
+        for (ListRef x = xs; !is_null(x); x = cdr_lookup(x)) {
+            ValueRef item = car_lookup(x);
+            ValueRef result = apply_value(fn, 1, &item);
+            if (collect) {
+                pair_car(GET_VALUE_DATA(out)) = result;
+                out = cdr_lookup(out);
+            }
+        }
+        return results;
+    }
+
+    // Compile once here rather than racing to in every worker.
+    if (VM.enabled && is_proc(fn)) proc_code(fn);
+
+    size_t participants = PAR.participants;
+    size_t grain = count / (participants * PAR_CHUNKS_PER_PARTICIPANT);
+    grain = grain < 1 ? 1 : grain > PAR_MAX_GRAIN ? PAR_MAX_GRAIN : grain;
+    size_t chunk_count = (count + grain - 1) / grain;
+
+    ValueRef* items = malloc(count * sizeof(ValueRef));
+    PairRef* out = collect ? malloc(count * sizeof(PairRef)) : NULL;
+    ParDeque* deques = malloc(participants * sizeof(ParDeque));
+    ParChunk* chunks = malloc(chunk_count * sizeof(ParChunk));
+    if (items == NULL || (collect && out == NULL) || deques == NULL || chunks == NULL)
+        panic("%s", "Parallel job alloc error!");
+    ListRef x = xs, cell = results;
+    for (size_t i = 0; i < count; i++, x = cdr_lookup(x)) {
+        items[i] = car_lookup(x);
+        if (collect) {
+            out[i] = cell;
+            cell = cdr_lookup(cell);
+        }
+    }
+
+    // Deque `d` gets chunks `d`, `d + participants`, ..., and its slice of
+    // `chunks` follows deque `d - 1`'s.
+    for (size_t d = 0, next = 0; d < participants; d++) {
+        pthread_mutex_init(&deques[d].lock, NULL);
+        deques[d].chunks = chunks + next;
+        deques[d].top = deques[d].bottom = 0;
+        for (size_t c = d; c < chunk_count; c += participants) {
+            size_t hi = (c + 1) * grain < count ? (c + 1) * grain : count;
+            chunks[next++] = (ParChunk) { .lo=c * grain, .hi=hi };
+            deques[d].bottom++;
+        }
+    }
+
+    ParJob job = {
+        .fn=fn, .vm=VM.enabled, .items=items, .out=out,
+        .deques=deques, .participants=participants,
+    };
+    pthread_mutex_lock(&PAR.lock);
+    PAR.job = &job;
+    PAR.busy = participants - 1;
+    PAR.generation++;
+    pthread_cond_broadcast(&PAR.posted);
+    pthread_mutex_unlock(&PAR.lock);
+
+    par_run(&job, 0);
+    gc_call_blocking(par_wait_for_workers, NULL);
+
+    for (size_t d = 0; d < participants; d++) pthread_mutex_destroy(&deques[d].lock);
+    free(chunks);
+    free(deques);
+    free(out);
+    free(items);
+    return results;
+}
+
+#endif
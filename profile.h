@@ -0,0 +1,453 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h> // FILE, fprintf, open_memstream
+#include <signal.h> // sigaction, SIGPROF
+#include <sys/time.h> // setitimer
+#include <time.h> // clock_gettime
+#include <pthread.h> // pthread_mutex_t
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "gc.h"
+
+// Evaluator profiling, turned on with `main --profile OUT`.
+//
+// While `PROFILING` is set, both evaluators count the calls to each
+// procedure and builtin, variable lookups count the frames they walk up
+// (`ENV_WALKS`), the pools count the cells they hand out (`POOL_ALLOCS`),
+// and `run_stream` times each top-level form. Otherwise every hook costs
+// one predicted-not-taken test of `PROFILING`.
+//
+// Procedures are counted by body, so the closures one `lambda` makes count
+// as one. The report names them after a global bound to one of them, or
+// else `lambda(PARAMS)`.
+//
+// Each thread keeps a shadow stack of the procedures it is in. A `SIGPROF`
+// timer marks a sample due every `PROFILE_INTERVAL_US` of CPU time, and the
+// next call records the stack, with the builtin as the leaf if it calls
+// one. `profile_report` writes the samples to OUT as folded stacks
+// (`outer;inner COUNT` per line, the input format of flamegraph.pl) and
+// prints the rest to stderr.
+
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_REPORT_ROWS 20
+
+typedef struct ProfileCount {
+    ValueRef key;   // The builtin, or the procedure's body. '() if empty.
+    ValueRef fn;    // The first procedure seen with this body.
+    uint64_t count;
+} ProfileCount;
+
+typedef struct ProfileSample {
+    ValueRef* keys; // Outermost first.
+    size_t depth;
+    uint64_t hash;
+    uint64_t count;
+} ProfileSample;
+
+typedef struct ProfileForm {
+    ValueRef form;
+    double ns;
+} ProfileForm;
+
+typedef struct ProfileStack {
+    ValueRef* keys;
+    size_t depth;
+    size_t cap;
+} ProfileStack;
+
+static _Thread_local ProfileStack PROFILE_STACK;
+
+// The tables are open-addressing hash sets, kept at most half full. All of
+// it is guarded by `lock`, which is never held across anything that might
+// collect.
+static struct {
+    pthread_mutex_t lock;
+    ProfileCount* calls;
+    size_t call_count;
+    size_t call_cap;
+    ProfileSample* samples;
+    size_t sample_count;
+    size_t sample_cap;
+    uint64_t sample_total;
+    ProfileForm* forms;
+    size_t form_count;
+    size_t form_cap;
+} PROFILE = {
+    .lock=PTHREAD_MUTEX_INITIALIZER,
+};
+
+static volatile sig_atomic_t PROFILE_SAMPLE_DUE = 0;
+
+/// Runs `call` only while profiling.
+#define profile_hook(call)                               \
+    do {                                                 \
+        if (__builtin_expect(PROFILING, 0)) call;        \
+    } while (0)
+
+static uint64_t profile_hash(ValueRef key) {
+    return (key ^ (key >> 29)) * 0x9e3779b97f4a7c15UL;
+}
+
+static void* profile_calloc(size_t count, size_t size) {
+    void* data = calloc(count, size);
+    if (data == NULL) panic("%s", "Profile alloc error!");
+    return data;
+}
+
+static ValueRef profile_key(ValueRef fn) {
+    return is_proc(fn) ? BIG_VALUES.v3[GET_VALUE_DATA(fn)] : fn;
+}
+
+/// Finds `key`'s entry, or the empty slot it would go in.
+static ProfileCount* profile_count_find(ValueRef key) {
+    size_t mask = PROFILE.call_cap - 1;
+    for (size_t slot = profile_hash(key) & mask;; slot = (slot + 1) & mask) {
+        ProfileCount* entry = &PROFILE.calls[slot];
+        if (entry->count == 0 || entry->key == key) return entry;
+    }
+}
+
+/// Like `profile_count_find`, but makes room for a new entry first.
+static ProfileCount* profile_count_slot(ValueRef key) {
+    if (2 * (PROFILE.call_count + 1) > PROFILE.call_cap) {
+        ProfileCount* old = PROFILE.calls;
+        size_t old_cap = PROFILE.call_cap;
+        PROFILE.call_cap = old_cap ? 2 * old_cap : 256;
+        PROFILE.calls = profile_calloc(PROFILE.call_cap, sizeof(ProfileCount));
+        PROFILE.call_count = 0;
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].count == 0) continue;
+            *profile_count_slot(old[i].key) = old[i];
+            PROFILE.call_count++;
+        }
+        free(old);
+    }
+    return profile_count_find(key);
+}
+
+static void profile_count_call(ValueRef fn) {
+    ProfileCount* entry = profile_count_slot(profile_key(fn));
+    if (entry->count++ == 0) {
+        entry->key = profile_key(fn);
+        entry->fn = fn;
+        PROFILE.call_count++;
+    }
+}
+
+static uint64_t profile_stack_hash(const ValueRef* keys, size_t depth) {
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; i++) hash = (hash ^ profile_hash(keys[i])) * 0x100000001b3UL;
+    return hash;
+}
+
+static void profile_sample_insert(ProfileSample sample) {
+    size_t mask = PROFILE.sample_cap - 1;
+    size_t slot = sample.hash & mask;
+    while (PROFILE.samples[slot].keys != NULL) slot = (slot + 1) & mask;
+    PROFILE.samples[slot] = sample;
+}
+
+/// Records the calling thread's stack, plus `leaf` unless it is '().
+static void profile_sample(ValueRef leaf) {
+    PROFILE_SAMPLE_DUE = 0;
+    ProfileStack* stack = &PROFILE_STACK;
+    size_t depth = stack->depth + !is_null(leaf);
+    ValueRef keys[depth ? depth : 1];
+    memcpy(keys, stack->keys, stack->depth * sizeof(ValueRef));
+    if (!is_null(leaf)) keys[depth - 1] = leaf;
+    uint64_t hash = profile_stack_hash(keys, depth);
+    PROFILE.sample_total++;
+
+    if (2 * (PROFILE.sample_count + 1) > PROFILE.sample_cap) {
+        ProfileSample* old = PROFILE.samples;
+        size_t old_cap = PROFILE.sample_cap;
+        PROFILE.sample_cap = old_cap ? 2 * old_cap : 256;
+        PROFILE.samples = profile_calloc(PROFILE.sample_cap, sizeof(ProfileSample));
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i].keys != NULL) profile_sample_insert(old[i]);
+        free(old);
+    }
+    size_t mask = PROFILE.sample_cap - 1;
+    for (size_t slot = hash & mask; PROFILE.samples[slot].keys != NULL; slot = (slot + 1) & mask) {
+        ProfileSample* sample = &PROFILE.samples[slot];
+        if (sample->hash == hash && sample->depth == depth &&
+            memcmp(sample->keys, keys, depth * sizeof(ValueRef)) == 0) {
+            sample->count++;
+            return;
+        }
+    }
+    // Never empty, so `keys != NULL` marks the slot as taken.
+    ValueRef* copy = profile_calloc(depth ? depth : 1, sizeof(ValueRef));
+    memcpy(copy, keys, depth * sizeof(ValueRef));
+    profile_sample_insert((ProfileSample) { .keys=copy, .depth=depth, .hash=hash, .count=1 });
+    PROFILE.sample_count++;
+}
+
+/// Counts a call of the builtin `fn`, which doesn't enter the shadow stack.
+void profile_call(ValueRef fn) {
+    pthread_mutex_lock(&PROFILE.lock);
+    profile_count_call(fn);
+    if (PROFILE_SAMPLE_DUE) profile_sample(profile_key(fn));
+    pthread_mutex_unlock(&PROFILE.lock);
+}
+
+/// Counts a call of the procedure `fn` and pushes it on the shadow stack,
+/// in place of the top entry for a tail call that replaces it.
+void profile_enter(ValueRef fn, bool replace) {
+    ProfileStack* stack = &PROFILE_STACK;
+    if (replace && stack->depth > 0) stack->depth--;
+    if (stack->depth == stack->cap) {
+        stack->cap = stack->cap ? 2 * stack->cap : 256;
+        stack->keys = realloc(stack->keys, stack->cap * sizeof(ValueRef));
+        if (stack->keys == NULL) panic("%s", "Profile stack alloc error!");
+    }
+    stack->keys[stack->depth++] = profile_key(fn);
+    pthread_mutex_lock(&PROFILE.lock);
+    profile_count_call(fn);
+    if (PROFILE_SAMPLE_DUE) profile_sample((ValueRef) NULL);
+    pthread_mutex_unlock(&PROFILE.lock);
+}
+
+/// Pops the shadow stack when a procedure returns.
+void profile_leave(void) {
+    if (PROFILE_STACK.depth > 0) PROFILE_STACK.depth--;
+}
+
+/// Frees the calling thread's shadow stack, e.g. before it exits.
+void profile_thread_free(void) {
+    free(PROFILE_STACK.keys);
+    PROFILE_STACK = (ProfileStack) { .keys=NULL, .depth=0, .cap=0 };
+}
+
+double profile_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// Records that evaluating the top-level `form` took `ns`.
+void profile_form(ValueRef form, double ns) {
+    pthread_mutex_lock(&PROFILE.lock);
+    if (PROFILE.form_count == PROFILE.form_cap) {
+        PROFILE.form_cap = PROFILE.form_cap ? 2 * PROFILE.form_cap : 64;
+        PROFILE.forms = realloc(PROFILE.forms, PROFILE.form_cap * sizeof(ProfileForm));
+        if (PROFILE.forms == NULL) panic("%s", "Profile alloc error!");
+    }
+    PROFILE.forms[PROFILE.form_count++] = (ProfileForm) { .form=form, .ns=ns };
+    pthread_mutex_unlock(&PROFILE.lock);
+}
+
+/// Returns how many times `fn`, or any procedure sharing its body, was
+/// called while profiling.
+uint64_t profile_calls(ValueRef fn) {
+    pthread_mutex_lock(&PROFILE.lock);
+    uint64_t count = PROFILE.call_cap ? profile_count_find(profile_key(fn))->count : 0;
+    pthread_mutex_unlock(&PROFILE.lock);
+    return count;
+}
+
+// Keeps everything the tables refer to alive, so a body's cells can't be
+// reused for another procedure's while it is being counted.
+static void profile_mark_roots(void* local) {
+    for (size_t i = 0; i < PROFILE.call_cap; i++) {
+        if (PROFILE.calls[i].count == 0) continue;
+        gc_push(PROFILE.calls[i].key);
+        gc_push(PROFILE.calls[i].fn);
+    }
+    for (size_t i = 0; i < PROFILE.sample_cap; i++)
+        for (size_t j = 0; PROFILE.samples[i].keys != NULL && j < PROFILE.samples[i].depth; j++)
+            gc_push(PROFILE.samples[i].keys[j]);
+    for (size_t i = 0; i < PROFILE.form_count; i++)
+        gc_push(PROFILE.forms[i].form);
+}
+
+void profile_init(void) {
+    gc_register_root_scanner(profile_mark_roots, NULL);
+}
+
+static void profile_on_sigprof(int signal) {
+    PROFILE_SAMPLE_DUE = 1;
+}
+
+static void profile_set_timer(long interval_us) {
+    struct itimerval timer = {
+        .it_interval={ .tv_sec=0, .tv_usec=interval_us },
+        .it_value={ .tv_sec=0, .tv_usec=interval_us },
+    };
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) panic("%s", "setitimer failed!");
+}
+
+/// Clears what earlier profiling recorded.
+void profile_reset(void) {
+    pthread_mutex_lock(&PROFILE.lock);
+    for (size_t i = 0; i < PROFILE.sample_cap; i++) free(PROFILE.samples[i].keys);
+    free(PROFILE.samples);
+    free(PROFILE.calls);
+    free(PROFILE.forms);
+    PROFILE.calls = NULL;
+    PROFILE.samples = NULL;
+    PROFILE.forms = NULL;
+    PROFILE.call_count = PROFILE.call_cap = 0;
+    PROFILE.sample_count = PROFILE.sample_cap = PROFILE.sample_total = 0;
+    PROFILE.form_count = PROFILE.form_cap = 0;
+    memset(POOL_ALLOCS, 0, sizeof(POOL_ALLOCS));
+    memset(ENV_WALKS, 0, sizeof(ENV_WALKS));
+    pthread_mutex_unlock(&PROFILE.lock);
+}
+
+void profile_start(void) {
+    struct sigaction action = { .sa_handler=profile_on_sigprof, .sa_flags=SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) panic("%s", "sigaction failed!");
+    PROFILE_STACK.depth = 0;
+    PROFILING = true;
+    profile_set_timer(PROFILE_INTERVAL_US);
+}
+
+void profile_stop(void) {
+    profile_set_timer(0);
+    PROFILING = false;
+    PROFILE_SAMPLE_DUE = 0;
+}
+
+////////////////////////////// REPORTING //////////////////////////////
+/// Writes `key`'s name to `out`: the builtin's, a global's bound to a
+/// procedure with that body (looked up in `names`), or `lambda(PARAMS)`.
+static void profile_print_name(FILE* out, ValueRef key, ProfileCount* names, size_t name_cap) {
+    if (is_builtin_proc(key)) {
+        fprintf(out, "%s", builtin_proc_lookup(key).name);
+        return;
+    }
+    size_t mask = name_cap - 1;
+    for (size_t slot = profile_hash(key) & mask; names[slot].count != 0; slot = (slot + 1) & mask) {
+        if (names[slot].key == key) {
+            fprintf(out, "%s", symbol_to_string(MAKE_VALUE(SYMBOL, names[slot].count - 1)));
+            return;
+        }
+    }
+    ProfileCount* entry = profile_count_find(key);
+    fprintf(out, "lambda");
+    if (entry->count == 0 || is_null(proc_lookup(entry->fn).params)) fprintf(out, "()");
+    else print_value(out, proc_lookup(entry->fn).params);
+}
+
+/// Maps each procedure body bound to a global of `root` to the global's
+/// symbol index + 1, in the `count` field.
+static ProfileCount* profile_global_names(Env* root, size_t* name_cap) {
+    size_t cap = 256;
+    while (cap < 2 * root->count + 2) cap *= 2;
+    ProfileCount* names = profile_calloc(cap, sizeof(ProfileCount));
+    for (Idx idx = 0; idx < root->count; idx++) {
+        ValueRef value = root->slots[idx];
+        if (!is_proc(value)) continue;
+        ValueRef key = profile_key(value);
+        size_t slot = profile_hash(key) & (cap - 1);
+        while (names[slot].count != 0 && names[slot].key != key) slot = (slot + 1) & (cap - 1);
+        if (names[slot].count == 0) names[slot] = (ProfileCount) { .key=key, .fn=value, .count=idx + 1 };
+    }
+    *name_cap = cap;
+    return names;
+}
+
+/// Writes every sampled stack as `outer;inner COUNT`.
+void profile_write_folded(FILE* out, Env* env) {
+    pthread_mutex_lock(&PROFILE.lock);
+    size_t name_cap;
+    ProfileCount* names = profile_global_names(env->root, &name_cap);
+    for (size_t i = 0; i < PROFILE.sample_cap; i++) {
+        ProfileSample* sample = &PROFILE.samples[i];
+        if (sample->keys == NULL) continue;
+        if (sample->depth == 0) fprintf(out, "(top-level)");
+        for (size_t j = 0; j < sample->depth; j++) {
+            if (j > 0) fputc(';', out);
+            profile_print_name(out, sample->keys[j], names, name_cap);
+        }
+        fprintf(out, " %lu\n", sample->count);
+    }
+    free(names);
+    pthread_mutex_unlock(&PROFILE.lock);
+}
+
+static int compare_counts_desc(const void* a, const void* b) {
+    uint64_t x = ((const ProfileCount*) a)->count, y = ((const ProfileCount*) b)->count;
+    return (x < y) - (x > y);
+}
+
+static int compare_forms_desc(const void* a, const void* b) {
+    double x = ((const ProfileForm*) a)->ns, y = ((const ProfileForm*) b)->ns;
+    return (x < y) - (x > y);
+}
+
+/// Prints up to `PROFILE_REPORT_ROWS` of each table to `out`.
+void profile_print_summary(FILE* out, Env* env) {
+    pthread_mutex_lock(&PROFILE.lock);
+    double total_ns = 0;
+    for (size_t i = 0; i < PROFILE.form_count; i++) total_ns += PROFILE.forms[i].ns;
+    fprintf(out, "profile: %zu top-level forms in %.3f ms, %lu samples\n",
+            PROFILE.form_count, total_ns / 1e6, PROFILE.sample_total);
+
+    ProfileForm* forms = profile_calloc(PROFILE.form_count + 1, sizeof(ProfileForm));
+    memcpy(forms, PROFILE.forms, PROFILE.form_count * sizeof(ProfileForm));
+    qsort(forms, PROFILE.form_count, sizeof(ProfileForm), compare_forms_desc);
+    fprintf(out, "slowest top-level forms:\n");
+    for (size_t i = 0; i < PROFILE.form_count && i < PROFILE_REPORT_ROWS; i++) {
+        char* text;
+        size_t len;
+        FILE* buf = open_memstream(&text, &len);
+        if (buf == NULL) panic("%s", "open_memstream failed!");
+        print_value(buf, forms[i].form);
+        fclose(buf);
+        fprintf(out, "  %12.3f ms  %.60s%s\n", forms[i].ns / 1e6, text, len > 60 ? "..." : "");
+        free(text);
+    }
+    free(forms);
+
+    size_t name_cap;
+    ProfileCount* names = profile_global_names(env->root, &name_cap);
+    ProfileCount* calls = profile_calloc(PROFILE.call_count + 1, sizeof(ProfileCount));
+    size_t call_count = 0;
+    for (size_t i = 0; i < PROFILE.call_cap; i++)
+        if (PROFILE.calls[i].count != 0) calls[call_count++] = PROFILE.calls[i];
+    qsort(calls, call_count, sizeof(ProfileCount), compare_counts_desc);
+    fprintf(out, "most called:\n");
+    for (size_t i = 0; i < call_count && i < PROFILE_REPORT_ROWS; i++) {
+        fprintf(out, "  %12lu  ", calls[i].count);
+        profile_print_name(out, calls[i].key, names, name_cap);
+        fprintf(out, "%s\n", is_builtin_proc(calls[i].key) ? " (builtin)" : "");
+    }
+    free(calls);
+    free(names);
+
+    fprintf(out, "allocations:\n");
+    for (unsigned id = 1; id <= POOL_COUNT; id++)
+        fprintf(out, "  %12lu  %s\n", POOL_ALLOCS[id], POOLS_BY_ID[id]->name);
+
+    fprintf(out, "frames walked per variable lookup:\n");
+    for (size_t walked = 0; walked < ENV_WALK_BUCKETS; walked++) {
+        if (ENV_WALKS[walked] == 0) continue;
+        fprintf(out, "  %12lu  %zu%s\n", ENV_WALKS[walked], walked,
+                walked == ENV_WALK_BUCKETS - 1 ? "+" : "");
+    }
+    pthread_mutex_unlock(&PROFILE.lock);
+}
+
+/// Stops profiling, writes the folded stacks to `folded_path` and prints
+/// the summary to stderr. Procedures are named after `env`'s globals.
+void profile_report(const char* folded_path, Env* env) {
+    profile_stop();
+    FILE* out = fopen(folded_path, "w");
+    if (out == NULL) {
+        perror(folded_path);
+        exit(1);
+    }
+    profile_write_folded(out, env);
+    fclose(out);
+    profile_print_summary(stderr, env);
+    fprintf(stderr, "Wrote %s\n", folded_path);
+}
+///////////////////////////////////////////////////////////////////////
+
+#endif
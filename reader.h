@@ -0,0 +1,189 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdio.h> // FILE, getc_unlocked, ungetc
+#include <ctype.h> // isspace, isdigit
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "numbers.h"
+#include "vectors.h"
+
+// Single-pass S-expression reader over a `FILE*`.
+//
+// Characters are pulled one at a time, so input is never buffered beyond
+// stdio's own buffer and the current token. Symbol tokens are interned
+// straight from the token buffer; `intern_symbol` only copies names it
+// hasn't seen.
+//
+// Syntax: integers, decimal flonums like `1.5` or `2e-3`, symbols,
+// strings like `"a \"b\"\n"`, `(a b ...)`, dotted pairs `(a . b)`, vectors
+// `#(a b ...)`, `'x` for `(quote x)` and `;` comments to the end of the line.
+
+typedef struct Reader {
+    FILE* in;
+    size_t line;
+    char* token;
+    size_t token_cap;
+} Reader;
+
+void reader_init(Reader* reader, FILE* in) {
+    *reader = (Reader) { .in=in, .line=1, .token=NULL, .token_cap=0 };
+}
+
+void reader_free(Reader* reader) {
+    free(reader->token);
+    reader->token = NULL;
+    reader->token_cap = 0;
+}
+
+static int reader_getc(Reader* reader) {
+    int c = getc_unlocked(reader->in);
+    if (c == '\n') reader->line++;
+    return c;
+}
+
+static void reader_ungetc(Reader* reader, int c) {
+    if (c == EOF) return;
+    if (c == '\n') reader->line--;
+    ungetc(c, reader->in);
+}
+
+/// Returns the next character that isn't whitespace or part of a comment.
+static int reader_skip_space(Reader* reader) {
+    for (;;) {
+        int c = reader_getc(reader);
+        if (c == ';') {
+            while (c != '\n' && c != EOF) c = reader_getc(reader);
+        } else if (c == EOF || !isspace(c)) {
+            return c;
+        }
+    }
+}
+
+static bool is_delimiter(int c) {
+    return c == EOF || isspace(c) || c == '(' || c == ')' || c == '\'' || c == ';' || c == '"';
+}
+
+/// Parses `token` as a decimal integer, if it is one. Integers too big for
+/// a fixnum become bignums.
+static bool parse_integer(const char* token, size_t len, Number* out) {
+    size_t start = (token[0] == '-' || token[0] == '+') ? 1 : 0;
+    if (start == len) return false;
+    uint64_t magnitude = 0;
+    for (size_t i = start; i < len; i++) {
+        if (!isdigit((unsigned char) token[i])) return false;
+        magnitude = 10 * magnitude + (token[i] - '0');
+    }
+    bool negative = token[0] == '-';
+    if (len - start > 18) *out = parse_bignum(token + start, len - start, negative);
+    else *out = make_number(negative ? -(int64_t) magnitude : (int64_t) magnitude);
+    return true;
+}
+
+/// Appends `c` to the token buffer, which holds `len` characters.
+static void reader_push(Reader* reader, size_t len, char c) {
+    if (len + 1 >= reader->token_cap) {
+        reader->token_cap = reader->token_cap ? 2 * reader->token_cap : 64;
+        reader->token = realloc(reader->token, reader->token_cap);
+        if (reader->token == NULL) panic("%s", "Reader token alloc error!");
+    }
+    reader->token[len] = c;
+}
+
+/// Reads the atom starting with `c`.
+static ValueRef read_atom(Reader* reader, int c) {
+    size_t len = 0;
+    for (; !is_delimiter(c); c = reader_getc(reader))
+        reader_push(reader, len++, c);
+    reader_ungetc(reader, c);
+    reader->token[len] = '\0';
+
+    Number number;
+    if (parse_integer(reader->token, len, &number)) return number;
+    if (parse_flonum(reader->token, len, &number)) return number;
+    return intern_symbol(reader->token, len);
+}
+
+static ValueRef read_datum(Reader* reader, int c);
+
+/// Reads the rest of a string whose `"` has been consumed. Knows the
+/// escapes `\"`, `\\`, `\n` and `\t`.
+static ValueRef read_string_literal(Reader* reader) {
+    size_t start_line = reader->line, len = 0;
+    for (int c = reader_getc(reader); c != '"'; c = reader_getc(reader)) {
+        if (c == EOF) panic("Reader: unterminated string starting on line %zu!", start_line);
+        if (c == '\\') {
+            c = reader_getc(reader);
+            if (c == 'n') c = '\n';
+            else if (c == 't') c = '\t';
+            else if (c != '"' && c != '\\') panic("Reader: unknown escape in string on line %zu!", reader->line);
+        }
+        reader_push(reader, len++, c);
+    }
+    return make_string(reader->token, len);
+}
+
+/// Reads the rest of a list whose `(` has been consumed.
+static ValueRef read_list(Reader* reader) {
+    size_t start_line = reader->line;
+    ListRef head = (ListRef) NULL;
+    PairRef tail = (PairRef) NULL;
+    for (;;) {
+        int c = reader_skip_space(reader);
+        if (c == EOF) panic("Reader: unterminated list starting on line %zu!", start_line);
+        if (c == ')') return head;
+
+        if (c == '.' && !is_null(tail)) {
+            int after = reader_getc(reader);
+            reader_ungetc(reader, after);
+            if (is_delimiter(after)) {
+                set_cdr(tail, read_datum(reader, reader_skip_space(reader)));
+                if (reader_skip_space(reader) != ')')
+                    panic("Reader: expected `)` after dotted pair on line %zu!", reader->line);
+                return head;
+            }
+        }
+
+        PairRef next = make_pair_ref(read_datum(reader, c), (ValueRef) NULL);
+        if (is_null(tail)) head = next;
+        else set_cdr(tail, next);
+        tail = next;
+    }
+}
+
+/// Reads the datum starting with `c`.
+static ValueRef read_datum(Reader* reader, int c) {
+    switch (c) {
+    case EOF:
+        panic("Reader: unexpected end of input on line %zu!", reader->line);
+    case '(':
+        return read_list(reader);
+    case ')':
+        panic("Reader: unexpected `)` on line %zu!", reader->line);
+    case '\'':
+        return LIST(SYM("quote"), read_datum(reader, reader_skip_space(reader)));
+    case '"':
+        return read_string_literal(reader);
+    case '#': {
+        int next = reader_getc(reader);
+        if (next == '(') return list_to_vector(read_list(reader));
+        reader_ungetc(reader, next);
+        return read_atom(reader, c);
+    }
+    default:
+        return read_atom(reader, c);
+    }
+}
+
+/// Reads the next top-level datum into `out`, hash-consed if hash consing
+/// is on. Returns `false` at the end of the input.
+bool read_value(Reader* reader, ValueRef* out) {
+    int c = reader_skip_space(reader);
+    if (c == EOF) return false;
+    *out = read_datum(reader, c);
+    if (HASH_CONSING) *out = hash_cons_copy(*out);
+    return true;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef RESOLVE_H
+#define RESOLVE_H
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+
+// Lexical addressing pre-pass.
+//
+// `resolve` rewrites an expression so that every variable reference becomes
+// a `LOCAL_REF` (frame depth, slot index) or a `GLOBAL_REF` (symbol index),
+// which `eval_resolved` can look up without searching. A `Scope` mirrors, at
+// resolve time, the chain of frames the code will run in.
+//
+// Special forms are recognized by what their head symbol is bound to in the
+// global frame when the code is resolved, and are left to rewrite their own
+// arguments (see `SpecialForm.resolve`). The resolved call then carries the
+// special form value itself in head position. A special form reached any
+// other way, e.g. passed in a variable, has had its arguments resolved as
+// ordinary expressions, so calling it panics (see `special_form_misused`).
+
+typedef struct Scope {
+    struct Scope* parent; // `NULL` for the global scope
+    ListRef names;
+    Env* root;
+} Scope;
+
+ValueRef resolve(ValueRef expr, Scope* scope);
+
+/// Resolves a variable reference.
+ValueRef resolve_symbol(SymbolRef symbol, Scope* scope) {
+    Idx depth = 0;
+    for (; scope->parent != NULL; scope = scope->parent, depth++) {
+        Idx slot = 0;
+        for (ListRef name = scope->names; !is_null(name); name = cdr_lookup(name), slot++) {
+            if (symbol_eq(car_lookup(name), symbol))
+                return make_local_ref(depth, slot);
+        }
+    }
+    return make_global_ref(symbol);
+}
+
+/// Returns the special form `head` denotes in `scope`, or `NULL`.
+static SpecialFormRef special_form_of(ValueRef head, Scope* scope) {
+    if (is_symbol(head)) {
+        if (!is_other_kind(resolve_symbol((SymbolRef) head, scope), GLOBAL_REF))
+            return (SpecialFormRef) NULL;
+        ValueRef* slot = env_find(scope->root, (SymbolRef) head);
+        head = slot ? *slot : (ValueRef) NULL;
+    }
+    return is_special_form(head) ? (SpecialFormRef) head : (SpecialFormRef) NULL;
+}
+
+/// Resolves every element of `list`.
+ListRef resolve_list(ListRef list, Scope* scope) {
+    if (is_null(list)) return (ListRef) NULL;
+    ListRef head = make_pair_ref(resolve(car_lookup(list), scope), (ValueRef) NULL);
+    ListRef tail = head;
+    for (list = assume_list(cdr_lookup(list)); !is_null(list); list = assume_list(cdr_lookup(list))) {
+        ListRef next = make_pair_ref(resolve(car_lookup(list), scope), (ValueRef) NULL);
+        set_cdr(tail, next);
+        tail = next;
+    }
+    return head;
+}
+
+ValueRef resolve(ValueRef expr, Scope* scope) {
+    if (is_symbol(expr)) {
+        return resolve_symbol((SymbolRef) expr, scope);
+    } else if (is_pair(expr)) {
+        SpecialFormRef form = special_form_of(car_lookup(expr), scope);
+        if (!is_null(form)) {
+            ListRef args = special_form_lookup(form).resolve(assume_list(cdr_lookup(expr)), scope);
+            return make_pair_ref(form, args);
+        }
+        return resolve_list((ListRef) expr, scope);
+    } else {
+        return expr;
+    }
+}
+
+/// Resolves `expr` to run in the frame `env`.
+ValueRef resolve_in_env(ValueRef expr, Env* env) {
+    size_t depth = 0;
+    for (Env* frame = env; !is_global_env(frame); frame = frame->parent)
+        depth++;
+
+    Scope scopes[depth + 1];
+    for (size_t i = 0; i <= depth; i++, env = env->parent) {
+        scopes[i] = (Scope) {
+            .parent=(i < depth) ? &scopes[i + 1] : NULL,
+            .names=env->names,
+            .root=env->root,
+        };
+    }
+    return resolve(expr, &scopes[0]);
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef TABLES_H
+#define TABLES_H
+
+#include <string.h> // memset
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "gc.h"
+
+// Hash tables, made by `make-table`.
+//
+// A table lives in the `TABLES` pool and keeps its entries in two malloc'd
+// arrays of `cap` slots, probed linearly: `hashes` and, in step with it,
+// `entries`. A probe scans the dense `hashes` array, eight slots to a
+// cache line, and only reads an entry whose hash matches. A slot's hash
+// has `TABLE_USED` set if the slot is taken, so zero marks an empty one.
+// Tables are kept at most three quarters full and never shrink.
+//
+// Keys are compared with `value_eq` and hashed with `value_hash`, so pairs
+// and other structured keys match by structure. Symbols, fixnums and '()
+// are equal only to themselves, so for those keys (symbol-keyed records
+// being the common case) the hash is a single `hash_mix` and a probe
+// compares bits alone.
+//
+// Like vectors, tables are changed in place and take no lock: a table may
+// be read by several threads at once, but not read while it is written.
+
+#define TABLE_USED (1UL << 63)
+
+typedef struct TableEntry {
+    ValueRef key;
+    ValueRef value;
+} TableEntry;
+
+typedef struct Table {
+    size_t count;
+    size_t cap; // A power of two, or 0 before the first insertion.
+    uint64_t* hashes;
+    TableEntry* entries;
+} Table;
+
+static struct {
+    Table* tables;
+    PoolMeta meta;
+} TABLES = {
+    .meta={
+        .name="TABLES", .collected=true, .column_count=1,
+        .columns={ (void**) &TABLES.tables },
+        .column_sizes={ sizeof(Table) },
+    }
+};
+
+static void trace_table(Idx idx) {
+    Table* table = &TABLES.tables[idx];
+    for (size_t slot = 0; slot < table->cap; slot++) {
+        if (!table->hashes[slot]) continue;
+        TableEntry* entry = &table->entries[slot];
+        if (!is_null(entry->key) && !is_number(entry->key)) gc_push(entry->key);
+        if (!is_null(entry->value) && !is_number(entry->value)) gc_push(entry->value);
+    }
+}
+
+static void clear_table(Idx idx) {
+    free(TABLES.tables[idx].hashes);
+    free(TABLES.tables[idx].entries);
+    TABLES.tables[idx] = (Table) { .count=0, .cap=0, .hashes=NULL, .entries=NULL };
+}
+
+void tables_init(void) {
+    gc_register_other_kind(TABLE, &TABLES.meta, trace_table, clear_table);
+}
+
+Table* table_lookup(ValueRef table) {
+    Idx idx = GET_OTHER_DATA(table);
+    if (!is_table(table) || idx >= TABLES.meta.next_idx)
+        panic("Expected table, got %s!", typename_of(table));
+    return &TABLES.tables[idx];
+}
+
+ValueRef make_table(void) {
+    Idx idx = pool_alloc(&TABLES.meta);
+    TABLES.tables[idx] = (Table) { .count=0, .cap=0, .hashes=NULL, .entries=NULL };
+    return MAKE_OTHER(TABLE, idx);
+}
+
+// Keys that are `value_eq` only to themselves.
+#define table_identity_key(key) (is_symbol(key) || is_number(key) || is_null(key))
+
+/// The same as `value_hash(key)`, with `TABLE_USED` set.
+static inline uint64_t table_hash(ValueRef key) {
+    return (table_identity_key(key) ? hash_mix(key) : value_hash(key)) | TABLE_USED;
+}
+
+/// Returns the slot holding `key`, or else the empty slot it would go in.
+/// Expects the table to have at least one empty slot.
+static size_t table_probe(const Table* table, ValueRef key, uint64_t hash) {
+    size_t mask = table->cap - 1;
+    size_t slot = hash & mask;
+    if (table_identity_key(key)) {
+        for (;; slot = (slot + 1) & mask) {
+            uint64_t h = table->hashes[slot];
+            if (h == 0 || (h == hash && table->entries[slot].key == key)) return slot;
+        }
+    }
+    for (;; slot = (slot + 1) & mask) {
+        uint64_t h = table->hashes[slot];
+        if (h == 0 || (h == hash && value_eq(table->entries[slot].key, key))) return slot;
+    }
+}
+
+static void table_grow(Table* table) {
+    size_t old_cap = table->cap;
+    uint64_t* old_hashes = table->hashes;
+    TableEntry* old_entries = table->entries;
+    table->cap = old_cap ? 2 * old_cap : 8;
+    table->hashes = calloc(table->cap, sizeof(uint64_t));
+    table->entries = malloc(table->cap * sizeof(TableEntry));
+    if (table->hashes == NULL || table->entries == NULL) panic("%s", "Table alloc error!");
+    size_t mask = table->cap - 1;
+    for (size_t old = 0; old < old_cap; old++) {
+        uint64_t hash = old_hashes[old];
+        if (!hash) continue;
+        size_t slot = hash & mask;
+        while (table->hashes[slot]) slot = (slot + 1) & mask;
+        table->hashes[slot] = hash;
+        table->entries[slot] = old_entries[old];
+    }
+    free(old_hashes);
+    free(old_entries);
+}
+
+/// Returns the value for `key` in `table`, or `missing` if there is none.
+ValueRef table_get(ValueRef table, ValueRef key, ValueRef missing) {
+    Table* t = table_lookup(table);
+    if (t->count == 0) return missing;
+    uint64_t hash = table_hash(key);
+    size_t slot = table_probe(t, key, hash);
+    return t->hashes[slot] ? t->entries[slot].value : missing;
+}
+
+void table_put(ValueRef table, ValueRef key, ValueRef value) {
+    Table* t = table_lookup(table);
+    uint64_t hash = table_hash(key);
+    if (4 * (t->count + 1) > 3 * t->cap) table_grow(t);
+    size_t slot = table_probe(t, key, hash);
+    if (!t->hashes[slot]) {
+        t->hashes[slot] = hash;
+        t->entries[slot].key = key;
+        t->count++;
+    }
+    t->entries[slot].value = value;
+}
+
+#endif
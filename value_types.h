@@ -3,6 +3,9 @@
 
 #include <stdlib.h> // malloc
 #include <stdint.h> // uint64_t
+#include <pthread.h> // pthread_mutex_t
+#include <sys/mman.h> // mmap, mprotect
+#include <unistd.h> // sysconf
 
 // Forward declaration. See `./env_type.h` for impl.
 typedef struct Env Env;
@@ -43,11 +46,69 @@ enum VALUE_KIND {
 #define MAKE_VALUE(kind, data) \
     ((((uint64_t) kind) << (64 - VALUE_KIND_BITS)) | (VALUE_DATA_MASK & (data)))
 
+// `OTHER_VALUE` refs carry a sub-kind in the top bits of their data.
+#define OTHER_KIND_BITS 5
+enum OTHER_KIND {
+    LOCAL_REF = 0,  // Resolved variable reference: (frame depth, slot index).
+    GLOBAL_REF = 1, // Resolved variable reference: symbol index in the global frame.
+    UNBOUND = 2,    // Fills frame slots that hold no binding.
+    CODE = 3,       // Bytecode compiled from a procedure body. See `./vm.h`.
+    BIGNUM = 4,     // Integer outside the fixnum range. See `./numbers.h`.
+    FLONUM = 5,     // IEEE double. See `./numbers.h`.
+    MEMO = 6,       // Result cache of a memoized procedure. See `./memo.h`.
+    VECTOR = 7,     // Array of values. See `./vectors.h`.
+    STRING = 8,     // Array of bytes. See `./vectors.h`.
+    TABLE = 9,      // Hash table. See `./tables.h`.
+};
+
+#define OTHER_DATA_BITS (64 - VALUE_KIND_BITS - OTHER_KIND_BITS)
+#define OTHER_DATA_MASK (~0UL >> (VALUE_KIND_BITS + OTHER_KIND_BITS))
+
+#define GET_OTHER_KIND(ptr) ((unsigned) (GET_VALUE_DATA(ptr) >> OTHER_DATA_BITS))
+#define GET_OTHER_DATA(ptr) ((Idx) (OTHER_DATA_MASK & (ptr)))
+#define is_other_kind(value, kind) (is_other_value(value) && GET_OTHER_KIND(value) == (kind))
+
+#define MAKE_OTHER(kind, data) \
+    MAKE_VALUE(OTHER_VALUE, (((uint64_t) kind) << OTHER_DATA_BITS) | (OTHER_DATA_MASK & (data)))
+
+#define UNBOUND_VALUE MAKE_OTHER(UNBOUND, 0)
+
+#define LOCAL_REF_SLOT_BITS 32
+#define make_local_ref(depth, slot) \
+    MAKE_OTHER(LOCAL_REF, (((uint64_t) depth) << LOCAL_REF_SLOT_BITS) | (slot))
+#define local_ref_depth(ref) (GET_OTHER_DATA(ref) >> LOCAL_REF_SLOT_BITS)
+#define local_ref_slot(ref) (GET_OTHER_DATA(ref) & ((1UL << LOCAL_REF_SLOT_BITS) - 1))
+
+#define make_global_ref(symbol) MAKE_OTHER(GLOBAL_REF, GET_VALUE_DATA(symbol))
+#define global_ref_symbol(ref) ((SymbolRef) MAKE_VALUE(SYMBOL, GET_OTHER_DATA(ref)))
+
+// Integers in `[FIXNUM_MIN, FIXNUM_MAX]` are stored unboxed in the data bits
+// of a `NUMBER`, in two's complement; anything bigger is a `BIGNUM`.
 typedef ValueRef Number;
 
+#define FIXNUM_BITS (64 - VALUE_KIND_BITS)
+#define FIXNUM_MIN (-(1L << (FIXNUM_BITS - 1)))
+#define FIXNUM_MAX ((1L << (FIXNUM_BITS - 1)) - 1)
+
+#define fixnum_fits(n) ((n) >= FIXNUM_MIN && (n) <= FIXNUM_MAX)
+#define make_fixnum(n) ((Number) MAKE_VALUE(NUMBER, (uint64_t) (n)))
+// Shifts the tag out and back in, sign-extending the data bits.
+#define fixnum_value(ref) (((int64_t) ((ref) << VALUE_KIND_BITS)) >> VALUE_KIND_BITS)
+
+#define is_bignum(value) is_other_kind(value, BIGNUM)
+#define is_integer(value) (is_number(value) || is_bignum(value))
+#define is_flonum(value) is_other_kind(value, FLONUM)
+#define is_numeric(value) (is_integer(value) || is_flonum(value))
+
+#define is_vector(value) is_other_kind(value, VECTOR)
+#define is_string(value) is_other_kind(value, STRING)
+#define is_table(value) is_other_kind(value, TABLE)
+
 typedef ValueRef SymbolRef;
 typedef struct Symbol {
     char* str;
+    size_t len;
+    uint64_t hash;
 } Symbol;
 
 /// NOTE: '() == NULL is not a Pair! Use ListRef instead.
@@ -65,6 +126,7 @@ typedef struct BigValue {
     ValueRef v1;
     ValueRef v2;
     ValueRef v3;
+    ValueRef v4;
 } BigValue;
 
 typedef ValueRef ProcRef;
@@ -72,55 +134,346 @@ typedef struct Proc {
     Env* creation_env;
     PairRef params;
     ValueRef body;
+    // Compiled `CODE` for the body, or '() until the bytecode VM needs it.
+    ValueRef code;
 } Proc;
 
-typedef ValueRef (*BuiltinFnPtr)(ListRef args);
+// Builtins take their evaluated arguments as an array, so calling one
+// allocates nothing. `argv` may point into the VM's value stack: a builtin
+// that evaluates code must copy what it needs from `argv` first.
+typedef ValueRef (*BuiltinFnPtr)(size_t argc, const ValueRef* argv);
+typedef ValueRef (*BuiltinBinaryFnPtr)(ValueRef a, ValueRef b);
 typedef ValueRef BuiltinProcRef;
 typedef struct BuiltinProc {
     char* name;
     BuiltinFnPtr fn;
+    size_t min_args;
+    size_t max_args; // `VARIADIC` if there is no limit.
+    // Optional entry point for calls with exactly two arguments.
+    BuiltinBinaryFnPtr binary;
 } BuiltinProc;
 
+#define VARIADIC SIZE_MAX
+
+// Forward declaration. See `./resolve.h` for impl.
+typedef struct Scope Scope;
+
 typedef ValueRef (*SpecialFormFnPtr)(ListRef args, Env* env);
+typedef ListRef (*SpecialFormResolverPtr)(ListRef args, Scope* scope);
 typedef ValueRef SpecialFormRef;
 typedef struct SpecialForm {
     char* name;
     SpecialFormFnPtr fn;
+    // Rewrites the form's unevaluated arguments into resolved code.
+    SpecialFormResolverPtr resolve;
+    // If set, `fn` returns an expression for `eval` to evaluate in tail
+    // position (in the same environment) rather than a value.
+    bool tail;
 } SpecialForm;
 
 ////////////////////ALLOCATION POOLS////////////////
 #define MAX_ALLOC_SIZE (1UL << (64 - VALUE_KIND_BITS))
-#define ALLOC_SIZE (MAX_ALLOC_SIZE >> 40) // dont use up all of memory
 
-static struct {
-    ValueRef cars[ALLOC_SIZE];
-    ValueRef cdrs[ALLOC_SIZE];
+// Each pool reserves room for `POOL_DEFAULT_MAX` cells of address space up
+// front (override with the `LISP_HEAP_MAX` environment variable) but only
+// commits pages as `next_idx` grows, starting from `POOL_INITIAL_CAPACITY`.
+#define POOL_DEFAULT_MAX (1UL << 28)
+#define POOL_INITIAL_CAPACITY (1UL << 14)
+#define POOL_MAX_COLUMNS 4
+
+#define NO_IDX (~0UL)
+#define MARK_WORDS(n) (((n) + 63) / 64)
+
+// Bookkeeping shared by every pool. Each column is a separate array of
+// `max` elements reserved with `mmap`, of which the first `capacity` are
+// committed, so cells never move once handed out. For garbage-collected
+// pools, every index below `next_idx` is either live, sitting in
+// `free_idxs`, or cached in some thread's `Tlab`. See `./gc.h`.
+typedef struct PoolMeta {
+    const char* name;
+    bool collected;
+    unsigned id; // Collected pools' index into `TLABS`, set when first grown.
     Idx next_idx;
+    Idx capacity;
+    Idx max;
+    Idx free_count;
+    Idx* free_idxs;
+    uint64_t* marks;
+    size_t column_count;
+    void** columns[POOL_MAX_COLUMNS];
+    size_t column_sizes[POOL_MAX_COLUMNS];
+} PoolMeta;
+
+// By default cars and cdrs are separate columns, so a scan over just one
+// of them (say, marking the cars of a list) is dense. Build with
+// `-DPAIRS_INTERLEAVED` to store each cell's car and cdr side by side
+// instead, so walking a list touches one cache line per cell rather than
+// two. `main --bench` compares the two on `list-walk`. Either way, go
+// through `pair_car` and `pair_cdr`.
+#ifdef PAIRS_INTERLEAVED
+static struct {
+    Pair* cells;
+    PoolMeta meta;
 } PAIRS = {
-    .next_idx=0UL
+    .meta={
+        .name="PAIRS", .collected=true, .column_count=1,
+        .columns={ (void**) &PAIRS.cells },
+        .column_sizes={ sizeof(Pair) },
+    }
 };
 
+#define pair_car(idx) (PAIRS.cells[idx].car)
+#define pair_cdr(idx) (PAIRS.cells[idx].cdr)
+#else
 static struct {
-    Symbol symbols[ALLOC_SIZE];
-    Idx next_idx;
+    ValueRef* cars;
+    ValueRef* cdrs;
+    PoolMeta meta;
+} PAIRS = {
+    .meta={
+        .name="PAIRS", .collected=true, .column_count=2,
+        .columns={ (void**) &PAIRS.cars, (void**) &PAIRS.cdrs },
+        .column_sizes={ sizeof(ValueRef), sizeof(ValueRef) },
+    }
+};
+
+#define pair_car(idx) (PAIRS.cars[idx])
+#define pair_cdr(idx) (PAIRS.cdrs[idx])
+#endif
+
+// An open-addressing hash set of symbol indices (`NO_IDX` marks an empty
+// slot), kept at most half full. A table is never changed except to fill
+// an empty slot, so readers can probe it without locking.
+typedef struct SymbolTable {
+    size_t size;
+    struct SymbolTable* retired; // The table this one replaced.
+    Idx slots[];
+} SymbolTable;
+
+// Symbols are interned and never collected. Lookups of existing symbols
+// take no lock; adding one takes `lock`, which also guards the pool.
+static struct {
+    Symbol* symbols;
+    PoolMeta meta;
+    SymbolTable* table;
+    pthread_mutex_t lock;
 } SYMBOLS = {
-    .next_idx=0UL
+    .meta={
+        .name="SYMBOLS", .collected=false, .column_count=1,
+        .columns={ (void**) &SYMBOLS.symbols },
+        .column_sizes={ sizeof(Symbol) },
+    },
+    .lock=PTHREAD_MUTEX_INITIALIZER,
 };
 
 static struct {
-    ValueRef v1[ALLOC_SIZE];
-    ValueRef v2[ALLOC_SIZE];
-    ValueRef v3[ALLOC_SIZE];
-    Idx next_idx;
+    ValueRef* v1;
+    ValueRef* v2;
+    ValueRef* v3;
+    ValueRef* v4;
+    PoolMeta meta;
 } BIG_VALUES = {
-    .next_idx=0UL
+    .meta={
+        .name="BIG_VALUES", .collected=true, .column_count=4,
+        .columns={
+            (void**) &BIG_VALUES.v1, (void**) &BIG_VALUES.v2,
+            (void**) &BIG_VALUES.v3, (void**) &BIG_VALUES.v4,
+        },
+        .column_sizes={ sizeof(ValueRef), sizeof(ValueRef), sizeof(ValueRef), sizeof(ValueRef) },
+    }
 };
+
+static size_t page_round(size_t bytes) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+static void* pool_reserve(PoolMeta* meta, size_t bytes) {
+    void* base = mmap(NULL, page_round(bytes), PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) panic("%s reservation of %zu bytes failed!", meta->name, bytes);
+    return base;
+}
+
+static void pool_commit(PoolMeta* meta, void* base, size_t bytes) {
+    if (mprotect(base, page_round(bytes), PROT_READ | PROT_WRITE) != 0)
+        panic("%s commit of %zu bytes failed!", meta->name, bytes);
+}
+
+static Idx heap_max_cells(void) {
+    const char* max = getenv("LISP_HEAP_MAX");
+    Idx cells = max ? strtoul(max, NULL, 10) : POOL_DEFAULT_MAX;
+    if (cells < POOL_INITIAL_CAPACITY) cells = POOL_INITIAL_CAPACITY;
+    return cells < MAX_ALLOC_SIZE ? cells : MAX_ALLOC_SIZE;
+}
+
+// Each thread takes cells from the collected pools in batches, so the
+// common allocation and release paths touch only thread-local state.
+// Batches are refilled from, and spill back to, the shared free list under
+// `HEAP_LOCK`, and the collector empties them all before it sweeps.
+#define TLAB_CELLS 256
+#define TLAB_REFILL (TLAB_CELLS / 2)
+#define MAX_POOLS 16
+
+typedef struct Tlab {
+    Idx count;
+    Idx idxs[TLAB_CELLS];
+} Tlab;
+
+// `TLABS[0]` belongs to pools with no `id` yet and is always empty.
+static _Thread_local Tlab TLABS[MAX_POOLS];
+static unsigned POOL_COUNT = 0;
+static PoolMeta* POOLS_BY_ID[MAX_POOLS];
+
+// Set while the evaluator is being profiled. See `./profile.h`.
+static bool PROFILING = false;
+// Cells handed out by each collected pool while profiling, by pool `id`.
+static uint64_t POOL_ALLOCS[MAX_POOLS];
+
+/// Commits room for `capacity` cells in every column of the pool,
+/// reserving the address space on first use.
+static void pool_grow(PoolMeta* meta, Idx capacity) {
+    if (meta->max == 0) {
+        meta->max = heap_max_cells();
+        for (size_t i = 0; i < meta->column_count; i++)
+            *meta->columns[i] = pool_reserve(meta, meta->max * meta->column_sizes[i]);
+        if (meta->collected) {
+            meta->free_idxs = pool_reserve(meta, meta->max * sizeof(Idx));
+            meta->marks = pool_reserve(meta, MARK_WORDS(meta->max) * sizeof(uint64_t));
+        }
+    }
+    if (capacity > meta->max) capacity = meta->max;
+    if (capacity <= meta->capacity) return;
+    if (meta->collected && meta->id == 0) {
+        if (POOL_COUNT + 1 == MAX_POOLS) panic("%s", "Too many pools!");
+        meta->id = ++POOL_COUNT;
+        POOLS_BY_ID[meta->id] = meta;
+    }
+    for (size_t i = 0; i < meta->column_count; i++)
+        pool_commit(meta, *meta->columns[i], capacity * meta->column_sizes[i]);
+    if (meta->collected) {
+        pool_commit(meta, meta->free_idxs, capacity * sizeof(Idx));
+        pool_commit(meta, meta->marks, MARK_WORDS(capacity) * sizeof(uint64_t));
+    }
+    meta->capacity = capacity;
+}
+
+// Defined in `./gc.h`.
+void gc_collect_locked(void);
+void gc_heap_lock(void);
+void gc_safepoint(void);
+
+// Guards every pool's free list and growth, the collector's thread list,
+// and collection itself. Take it with `gc_heap_lock`, which parks the
+// caller if a collection is pending, unless waiting on it can't hold up a
+// collection (see `pool_spill`).
+static pthread_mutex_t HEAP_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while a collection waits for the other threads to stop. Allocation
+// checks it, so every thread that allocates soon reaches a safepoint.
+static volatile int GC_STOP_REQUESTED = 0;
+
+static Idx pool_try_alloc(PoolMeta* meta) {
+    if (meta->free_count > 0) return meta->free_idxs[--meta->free_count];
+    if (meta->next_idx < meta->capacity) return meta->next_idx++;
+    return NO_IDX;
+}
+
+/// Makes room in a pool whose free list and committed cells ran out.
+/// Collected pools first try a collection and only grow if it leaves less
+/// than a quarter free.
+static void pool_replenish(PoolMeta* meta) {
+    if (meta->capacity == 0) {
+        pool_grow(meta, POOL_INITIAL_CAPACITY);
+    } else if (!meta->collected) {
+        pool_grow(meta, 2 * meta->capacity);
+    } else {
+        gc_collect_locked();
+        if (meta->free_count < meta->capacity / 4)
+            pool_grow(meta, 2 * meta->capacity);
+    }
+}
+
+/// Refills the calling thread's empty batch of `meta` cells and takes one.
+static __attribute__((noinline)) Idx pool_refill(PoolMeta* meta) {
+    gc_heap_lock();
+    if (meta->free_count == 0 && meta->next_idx == meta->capacity) pool_replenish(meta);
+    Tlab* tlab = &TLABS[meta->id];
+    Idx idx;
+    while (tlab->count < TLAB_REFILL && (idx = pool_try_alloc(meta)) != NO_IDX)
+        tlab->idxs[tlab->count++] = idx;
+    pthread_mutex_unlock(&HEAP_LOCK);
+    if (tlab->count == 0) panic("%s alloc error!", meta->name);
+    return tlab->idxs[--tlab->count];
+}
+
+/// Returns half of the calling thread's full batch to the shared free list.
+/// This takes the lock without parking: a pending collection releases the
+/// lock while it waits for threads to park, so it can't be waiting on us.
+static __attribute__((noinline)) void pool_spill(PoolMeta* meta) {
+    pthread_mutex_lock(&HEAP_LOCK);
+    Tlab* tlab = &TLABS[meta->id];
+    while (tlab->count > TLAB_REFILL)
+        meta->free_idxs[meta->free_count++] = tlab->idxs[--tlab->count];
+    pthread_mutex_unlock(&HEAP_LOCK);
+}
+
+/// Hands out a free index. Cells of collected pools come from the calling
+/// thread's batch; uncollected pools must be guarded by the caller.
+Idx pool_alloc(PoolMeta* meta) {
+    if (!meta->collected) {
+        Idx idx = pool_try_alloc(meta);
+        if (idx != NO_IDX) return idx;
+        pool_replenish(meta);
+        if ((idx = pool_try_alloc(meta)) == NO_IDX) panic("%s alloc error!", meta->name);
+        return idx;
+    }
+    if (__builtin_expect(GC_STOP_REQUESTED, 0)) gc_safepoint();
+    if (__builtin_expect(PROFILING, 0)) __atomic_fetch_add(&POOL_ALLOCS[meta->id], 1, __ATOMIC_RELAXED);
+    Tlab* tlab = &TLABS[meta->id];
+    if (tlab->count > 0) return tlab->idxs[--tlab->count];
+    return pool_refill(meta);
+}
+
+/// Hands a cleared, unreferenced cell of a collected pool back for reuse.
+void pool_free(PoolMeta* meta, Idx idx) {
+    Tlab* tlab = &TLABS[meta->id];
+    if (tlab->count == TLAB_CELLS) pool_spill(meta);
+    tlab->idxs[tlab->count++] = idx;
+}
+
+/// Hands out `count` consecutive indices of a collected pool, or `NO_IDX`
+/// if no such run is free. Runs come from the top of the free list, which
+/// the sweep leaves in ascending order, or else from the uncommitted end
+/// of the pool; this never collects or grows the pool.
+Idx pool_alloc_run(PoolMeta* meta, Idx count) {
+    if (__builtin_expect(GC_STOP_REQUESTED, 0)) gc_safepoint();
+    gc_heap_lock();
+    Idx first = NO_IDX;
+    if (meta->free_count >= count) {
+        Idx* run = &meta->free_idxs[meta->free_count - count];
+        Idx i = 1;
+        while (i < count && run[i] == run[0] + i) i++;
+        if (i == count) {
+            first = run[0];
+            meta->free_count -= count;
+        }
+    }
+    if (first == NO_IDX && meta->capacity - meta->next_idx >= count) {
+        first = meta->next_idx;
+        meta->next_idx += count;
+    }
+    pthread_mutex_unlock(&HEAP_LOCK);
+    if (__builtin_expect(PROFILING, 0) && first != NO_IDX)
+        __atomic_fetch_add(&POOL_ALLOCS[meta->id], count, __ATOMIC_RELAXED);
+    return first;
+}
 ////////////////////////////////////////////////////
 
 ValueRef car_lookup(PairRef pair) {
     Idx idx = GET_VALUE_DATA(pair);
-    if (idx < PAIRS.next_idx) {
-        return PAIRS.cars[idx];
+    if (idx < PAIRS.meta.next_idx) {
+        return pair_car(idx);
     } else {
         panic("Car index '%lu' out of bounds!", idx);
     }
@@ -128,47 +481,117 @@ ValueRef car_lookup(PairRef pair) {
 
 ValueRef cdr_lookup(PairRef pair) {
     Idx idx = GET_VALUE_DATA(pair);
-    if (idx < PAIRS.next_idx) {
-        return PAIRS.cdrs[idx];
+    if (idx < PAIRS.meta.next_idx) {
+        return pair_cdr(idx);
     } else {
         panic("Cdr index '%lu' out of bounds!", idx);
     }
 }
 
+void set_cdr(PairRef pair, ValueRef cdr) {
+    Idx idx = GET_VALUE_DATA(pair);
+    if (idx >= PAIRS.meta.next_idx) panic("Cdr index '%lu' out of bounds!", idx);
+    pair_cdr(idx) = cdr;
+}
+
 PairRef make_pair_ref(ValueRef car, ValueRef cdr) {
-    Idx idx = PAIRS.next_idx++;
-    if (idx > ALLOC_SIZE) panic("%s", "PAIRS alloc error!");
-    PAIRS.cars[idx] = car;
-    PAIRS.cdrs[idx] = cdr;
+    Idx idx = pool_alloc(&PAIRS.meta);
+    pair_car(idx) = car;
+    pair_cdr(idx) = cdr;
     return (PairRef) MAKE_VALUE(PAIR, idx);
 }
 
-// Interns a string!
-SymbolRef make_symbol_ref(char* str) {
-    for (Idx idx = 0; idx < SYMBOLS.next_idx; idx++) {
-        if (str_eq(str, SYMBOLS.symbols[idx].str)) {
-            return MAKE_VALUE(SYMBOL, idx);
-        }
+// FNV-1a.
+static uint64_t hash_bytes(const char* bytes, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325UL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) bytes[i];
+        hash *= 0x100000001b3UL;
+    }
+    return hash;
+}
+
+static void symbol_table_insert(SymbolTable* table, Idx idx) {
+    size_t mask = table->size - 1;
+    size_t slot = SYMBOLS.symbols[idx].hash & mask;
+    while (table->slots[slot] != NO_IDX) slot = (slot + 1) & mask;
+    // Publishes the symbol written before it to lock-free readers.
+    __atomic_store_n(&table->slots[slot], idx, __ATOMIC_RELEASE);
+}
+
+/// Replaces the table with one twice the size. Readers may still be
+/// probing the old one, so it is kept (on the `retired` chain) rather
+/// than freed; the chain adds up to less than the live table.
+static void symbol_table_grow(void) {
+    SymbolTable* old = SYMBOLS.table;
+    size_t size = old ? 2 * old->size : 1024;
+    SymbolTable* table = malloc(sizeof(SymbolTable) + size * sizeof(Idx));
+    if (table == NULL) panic("%s", "Symbol table alloc error!");
+    table->size = size;
+    table->retired = old;
+    memset(table->slots, 0xff, size * sizeof(Idx)); // All `NO_IDX`.
+    for (Idx idx = 0; idx < SYMBOLS.meta.next_idx; idx++)
+        symbol_table_insert(table, idx);
+    __atomic_store_n(&SYMBOLS.table, table, __ATOMIC_RELEASE);
+}
+
+static Idx symbol_table_find(const char* str, size_t len, uint64_t hash) {
+    SymbolTable* table = __atomic_load_n(&SYMBOLS.table, __ATOMIC_ACQUIRE);
+    if (table == NULL) return NO_IDX;
+    size_t mask = table->size - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        Idx idx = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+        if (idx == NO_IDX) return NO_IDX;
+        Symbol* sym = &SYMBOLS.symbols[idx];
+        if (sym->hash == hash && sym->len == len && memcmp(sym->str, str, len) == 0)
+            return idx;
     }
-    Idx idx = SYMBOLS.next_idx++;
-    if (idx >= ALLOC_SIZE) panic("%s", "SYMBOLS alloc error!");
-    SYMBOLS.symbols[idx] = (Symbol) { .str=str };
+}
+
+// Interns the `len` bytes at `str`, copying them only if the symbol is new.
+// Safe to call from any thread.
+SymbolRef intern_symbol(const char* str, size_t len) {
+    uint64_t hash = hash_bytes(str, len);
+    Idx idx = symbol_table_find(str, len, hash);
+    if (idx != NO_IDX) return MAKE_VALUE(SYMBOL, idx);
+
+    pthread_mutex_lock(&SYMBOLS.lock);
+    // Another thread may have added it since we looked.
+    idx = symbol_table_find(str, len, hash);
+    if (idx == NO_IDX) {
+        if (SYMBOLS.table == NULL || 2 * (SYMBOLS.meta.next_idx + 1) > SYMBOLS.table->size)
+            symbol_table_grow();
+        char* copy = malloc(len + 1);
+        if (copy == NULL) panic("%s", "Symbol string alloc error!");
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+        idx = pool_alloc(&SYMBOLS.meta);
+        SYMBOLS.symbols[idx] = (Symbol) { .str=copy, .len=len, .hash=hash };
+        symbol_table_insert(SYMBOLS.table, idx);
+    }
+    pthread_mutex_unlock(&SYMBOLS.lock);
     return MAKE_VALUE(SYMBOL, idx);
 }
 
+// Interns a string!
+SymbolRef make_symbol_ref(const char* str) {
+    return intern_symbol(str, strlen(str));
+}
+
 Symbol symbol_lookup(SymbolRef sym) {
     Idx idx = GET_VALUE_DATA(sym);
-    if (idx >= SYMBOLS.next_idx) panic("Symbol index '%lu' out of bounds!", idx);
+    if (idx >= SYMBOLS.meta.next_idx) panic("Symbol index '%lu' out of bounds!", idx);
     return SYMBOLS.symbols[idx];
 }
 
 BigValue big_value_lookup(BigValueRef val) {
     Idx idx = GET_VALUE_DATA(val);
-    if (idx >= BIG_VALUES.next_idx) panic("Big value index '%lu' out of bounds!", idx);
+    if (idx >= BIG_VALUES.meta.next_idx) panic("Big value index '%lu' out of bounds!", idx);
     return (BigValue) {
         .v1=BIG_VALUES.v1[idx],
         .v2=BIG_VALUES.v2[idx],
         .v3=BIG_VALUES.v3[idx],
+        .v4=BIG_VALUES.v4[idx],
     };
 }
 
@@ -181,6 +604,20 @@ const char* typename_of(ValueRef value) {
     case PROCEDURE: return "procedure";
     case BUILTIN_PROCEDURE: return "builtin procedure";
     case SPECIAL_FORM: return "special form";
+    case OTHER_VALUE:
+        switch (GET_OTHER_KIND(value)) {
+        case LOCAL_REF: return "local reference";
+        case GLOBAL_REF: return "global reference";
+        case UNBOUND: return "unbound";
+        case CODE: return "code";
+        case BIGNUM: return "bignum";
+        case FLONUM: return "flonum";
+        case MEMO: return "memo table";
+        case VECTOR: return "vector";
+        case STRING: return "string";
+        case TABLE: return "table";
+        default: unimplemented();
+        }
     default: unimplemented();
     }
 }
@@ -195,9 +632,27 @@ char* symbol_to_string(const SymbolRef sym) {
     return symbol_lookup(sym).str;
 }
 
-// TODO: check that it's within bounds!
+// Defined in `./numbers.h`.
+Number make_bignum_from_int(int64_t num);
+bool bignum_eq(Number a, Number b);
+void print_bignum(FILE* out, Number num);
+bool flonum_eq(Number a, Number b);
+bool flonum_same(Number a, Number b);
+void print_flonum(FILE* out, Number num);
+uint64_t bignum_hash(Number num);
+uint64_t flonum_hash(Number num);
+
+// Defined in `./vectors.h`.
+bool vector_eq(ValueRef a, ValueRef b);
+bool string_eq(ValueRef a, ValueRef b);
+uint64_t vector_hash(ValueRef vector);
+uint64_t string_hash(ValueRef string);
+void print_vector(FILE* out, ValueRef vector);
+void print_string(FILE* out, ValueRef string);
+
 Number make_number(int64_t num) {
-    return MAKE_VALUE(NUMBER, num);
+    if (fixnum_fits(num)) return make_fixnum(num);
+    return make_bignum_from_int(num);
 }
 
 #define NUM(n) ((ValueRef) make_number(n))
@@ -205,7 +660,20 @@ Number make_number(int64_t num) {
 
 #define CONS(x, y) ((ValueRef) make_pair_ref(x, y))
 
-ValueRef make_list(ValueRef values[], size_t count) {
+// Shorter lists aren't worth taking `HEAP_LOCK` for.
+#define LIST_RUN_MIN 16
+
+/// Lists `values`. Long lists go in consecutive cells when such a run is
+/// free, so walking one reads memory in order.
+ValueRef make_list(const ValueRef values[], size_t count) {
+    Idx run = count >= LIST_RUN_MIN ? pool_alloc_run(&PAIRS.meta, count) : NO_IDX;
+    if (run != NO_IDX) {
+        for (size_t i = 0; i < count; i++) {
+            pair_car(run + i) = values[i];
+            pair_cdr(run + i) = i + 1 < count ? MAKE_VALUE(PAIR, run + i + 1) : (ValueRef) NULL;
+        }
+        return MAKE_VALUE(PAIR, run);
+    }
     ValueRef list = (ValueRef) NULL;
     for (int i = count-1; i >= 0; i--) {
         list = make_pair_ref(values[i], list);
@@ -219,14 +687,65 @@ ValueRef make_list(ValueRef values[], size_t count) {
         sizeof((ValueRef[]) { __VA_ARGS__ }) / sizeof(ValueRef)  \
     )
 
+//////////////////////////////// HASH CONSING ////////////////////////////////
+// With hash consing on (`--hash-cons`), the reader and the `cons` and `list`
+// builtins make pairs with `hash_cons`, which hands back the pair it made
+// before for an equal car and cdr. Structurally equal trees made that way
+// are then one and the same pair, so `value_eq` tells two of them apart
+// with `==`, and repetitive data takes one cell per distinct subtree.
+//
+// A hash-consed pair's car and cdr are atoms or hash-consed pairs, but
+// never vectors, which can change. Its structural hash is worked out once
+// from its children's and kept in `hashes`, and `value_hash` stops at the
+// first hash-consed pair it reaches. The table is weak: the collector
+// drops the pairs it frees (see `gc_sweep_hash_conses`).
+//
+// Atoms match by `value_eq`, but flonums only if they're the same double
+// (`flonum_same`), so that -0.0 and 0.0 keep their sign. Two hash-consed
+// pairs can then still be `value_eq`, though only if they hash alike.
+//
+// `hashes` and the `consed` bitmap are indexed like the pair pool and
+// reserved the same way, so they never move and reads take no lock.
+// Changing the table takes `lock`, which is never held while allocating.
+
+static bool HASH_CONSING = false;
+
+static struct {
+    uint64_t* hashes; // Of each hash-consed pair.
+    uint64_t* consed; // A bit per pair, set if it is in the table.
+    Idx committed;    // Pair indices `hashes` and `consed` have room for.
+    Idx* slots;       // Open addressing, `NO_IDX` when empty; at most half full.
+    size_t size;
+    size_t count;
+    pthread_mutex_t lock;
+} HASH_CONSES = { .lock=PTHREAD_MUTEX_INITIALIZER };
+
+static inline bool hash_consed(PairRef pair) {
+    Idx idx = GET_VALUE_DATA(pair);
+    if (idx >= __atomic_load_n(&HASH_CONSES.committed, __ATOMIC_ACQUIRE)) return false;
+    return (__atomic_load_n(&HASH_CONSES.consed[idx / 64], __ATOMIC_ACQUIRE) >> (idx % 64)) & 1;
+}
+
 bool value_eq(ValueRef, ValueRef);
 
-/// Expects non-null arguments.
+/// Expects non-null arguments. Walks down the spine, so long lists don't
+/// recurse.
 bool pair_eq(PairRef a, PairRef b) {
-    return value_eq(car_lookup(a), car_lookup(b)) && value_eq(cdr_lookup(a), cdr_lookup(b));
+    for (;;) {
+        if (a == b) return true;
+        // Two hash-consed pairs are only equal if they hash alike.
+        if (hash_consed(a) && hash_consed(b)
+            && HASH_CONSES.hashes[GET_VALUE_DATA(a)] != HASH_CONSES.hashes[GET_VALUE_DATA(b)])
+            return false;
+        if (!value_eq(car_lookup(a), car_lookup(b))) return false;
+        a = cdr_lookup(a);
+        b = cdr_lookup(b);
+        if (!is_pair(a) || !is_pair(b)) return value_eq(a, b);
+    }
 }
 
 bool value_eq(ValueRef a, ValueRef b) {
+    if (a == b) return true;
     if (is_null(a) && is_null(b)) return true;
     else if (is_null(a) || is_null(b)) return false;
     if (GET_VALUE_KIND(a) != GET_VALUE_KIND(b)) return false;
@@ -242,69 +761,251 @@ bool value_eq(ValueRef a, ValueRef b) {
     case BUILTIN_PROCEDURE: // Pointer equality
     case SPECIAL_FORM:      // Pointer equality
         return a == b;
+    case OTHER_VALUE:
+        if (is_bignum(a) && is_bignum(b)) return bignum_eq(a, b);
+        if (is_flonum(a) && is_flonum(b)) return flonum_eq(a, b);
+        if (is_vector(a) && is_vector(b)) return vector_eq(a, b);
+        if (is_string(a) && is_string(b)) return string_eq(a, b);
+        return a == b;      // Resolved references are compared bit-for-bit
     default:
         unimplemented();
     }
 }
 
+/// Scrambles the bits of `x`, so that nearby values hash far apart.
+static inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9UL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebUL;
+    return x ^ (x >> 31);
+}
+
+// A pair hashes to `hash_mix(car + PAIR) + PAIR_HASH_SCALE * cdr`, in terms
+// of its children's hashes, so a hash-consed pair's hash can be worked out
+// from its children's and a list's from left to right.
+#define PAIR_HASH_SCALE 0x9e3779b97f4a7c15UL
+
+static inline uint64_t pair_hash(uint64_t car_hash, uint64_t cdr_hash) {
+    return hash_mix(car_hash + PAIR) + PAIR_HASH_SCALE * cdr_hash;
+}
+
+/// Hashes `value` by structure, so values that are `value_eq` hash alike.
+uint64_t value_hash(ValueRef value) {
+    uint64_t hash = 0, scale = 1;
+    // Walk down the spine so long lists don't recurse.
+    for (; is_pair(value); value = cdr_lookup(value)) {
+        if (hash_consed(value))
+            return hash + scale * HASH_CONSES.hashes[GET_VALUE_DATA(value)];
+        hash += scale * hash_mix(value_hash(car_lookup(value)) + PAIR);
+        scale *= PAIR_HASH_SCALE;
+    }
+    uint64_t atom;
+    if (is_bignum(value)) atom = hash_mix(bignum_hash(value));
+    else if (is_flonum(value)) atom = hash_mix(flonum_hash(value));
+    else if (is_vector(value)) atom = hash_mix(vector_hash(value));
+    else if (is_string(value)) atom = hash_mix(string_hash(value));
+    else atom = hash_mix(value); // Everything else is compared bit-for-bit
+    return hash + scale * atom;
+}
+
+/// Makes room in `hashes` and `consed` for pair `idx`. Expects
+/// `HASH_CONSES.lock` to be held.
+static void hash_cons_reserve(Idx idx) {
+    if (idx < HASH_CONSES.committed) return;
+    if (HASH_CONSES.hashes == NULL) {
+        HASH_CONSES.hashes = pool_reserve(&PAIRS.meta, PAIRS.meta.max * sizeof(uint64_t));
+        HASH_CONSES.consed = pool_reserve(&PAIRS.meta, MARK_WORDS(PAIRS.meta.max) * sizeof(uint64_t));
+    }
+    Idx committed = 2 * HASH_CONSES.committed > idx + 1 ? 2 * HASH_CONSES.committed : idx + 1;
+    if (committed < POOL_INITIAL_CAPACITY) committed = POOL_INITIAL_CAPACITY;
+    if (committed > PAIRS.meta.max) committed = PAIRS.meta.max;
+    pool_commit(&PAIRS.meta, HASH_CONSES.hashes, committed * sizeof(uint64_t));
+    pool_commit(&PAIRS.meta, HASH_CONSES.consed, MARK_WORDS(committed) * sizeof(uint64_t));
+    __atomic_store_n(&HASH_CONSES.committed, committed, __ATOMIC_RELEASE);
+}
+
+static void hash_cons_slot_insert(Idx idx) {
+    size_t mask = HASH_CONSES.size - 1;
+    size_t slot = HASH_CONSES.hashes[idx] & mask;
+    while (HASH_CONSES.slots[slot] != NO_IDX) slot = (slot + 1) & mask;
+    HASH_CONSES.slots[slot] = idx;
+}
+
+/// Rebuilds the table's slots, `size` of them, from the `count` pairs in
+/// `idxs`. Expects `HASH_CONSES.lock` to be held, or the world stopped.
+void hash_cons_rebuild(size_t size, const Idx* idxs, size_t count) {
+    free(HASH_CONSES.slots);
+    HASH_CONSES.slots = malloc(size * sizeof(Idx));
+    if (HASH_CONSES.slots == NULL) panic("%s", "Hash cons table alloc error!");
+    memset(HASH_CONSES.slots, 0xff, size * sizeof(Idx)); // All `NO_IDX`.
+    HASH_CONSES.size = size;
+    HASH_CONSES.count = count;
+    for (size_t i = 0; i < count; i++) hash_cons_slot_insert(idxs[i]);
+}
+
+/// Whether a hash-consed pair holding the atom `a` may stand for one
+/// holding `b`.
+static inline bool hash_cons_atom_eq(ValueRef a, ValueRef b) {
+    if (is_flonum(a) && is_flonum(b)) return flonum_same(a, b);
+    return value_eq(a, b);
+}
+
+/// Returns the hash-consed pair of `car` and `cdr`, or `NO_IDX`. Children
+/// that are pairs are hash-consed, so they match by identity.
+static Idx hash_cons_find(ValueRef car, ValueRef cdr, uint64_t hash) {
+    if (HASH_CONSES.size == 0) return NO_IDX;
+    size_t mask = HASH_CONSES.size - 1;
+    for (size_t slot = hash & mask; HASH_CONSES.slots[slot] != NO_IDX; slot = (slot + 1) & mask) {
+        Idx idx = HASH_CONSES.slots[slot];
+        if (HASH_CONSES.hashes[idx] != hash) continue;
+        ValueRef a = pair_car(idx), d = pair_cdr(idx);
+        if ((a == car || (!is_pair(a) && hash_cons_atom_eq(a, car)))
+            && (d == cdr || (!is_pair(d) && hash_cons_atom_eq(d, cdr))))
+            return idx;
+    }
+    return NO_IDX;
+}
+
+/// Whether a hash-consed pair may hold `value`.
+static inline bool hash_consable(ValueRef value) {
+    return is_pair(value) ? hash_consed(value) : !is_vector(value);
+}
+
+/// `hash_cons` for a `car` and `cdr` already made hash-consed where they
+/// can be.
+static PairRef hash_cons_pair(ValueRef car, ValueRef cdr) {
+    if (!hash_consable(car) || !hash_consable(cdr)) return make_pair_ref(car, cdr);
+    uint64_t hash = pair_hash(value_hash(car), value_hash(cdr));
+    pthread_mutex_lock(&HASH_CONSES.lock);
+    Idx found = hash_cons_find(car, cdr, hash);
+    pthread_mutex_unlock(&HASH_CONSES.lock);
+    if (found != NO_IDX) return MAKE_VALUE(PAIR, found);
+
+    // Allocating may collect, so it happens outside the lock, and another
+    // thread may have made the same pair in the meantime.
+    PairRef fresh = make_pair_ref(car, cdr);
+    pthread_mutex_lock(&HASH_CONSES.lock);
+    found = hash_cons_find(car, cdr, hash);
+    if (found == NO_IDX) {
+        found = GET_VALUE_DATA(fresh);
+        hash_cons_reserve(found);
+        HASH_CONSES.hashes[found] = hash;
+        __atomic_fetch_or(&HASH_CONSES.consed[found / 64], 1UL << (found % 64), __ATOMIC_RELEASE);
+        if (2 * (HASH_CONSES.count + 1) > HASH_CONSES.size) {
+            size_t count = 0, size = HASH_CONSES.size ? 2 * HASH_CONSES.size : 1024;
+            Idx* idxs = malloc((HASH_CONSES.count + 1) * sizeof(Idx));
+            if (idxs == NULL) panic("%s", "Hash cons table alloc error!");
+            for (size_t slot = 0; slot < HASH_CONSES.size; slot++)
+                if (HASH_CONSES.slots[slot] != NO_IDX) idxs[count++] = HASH_CONSES.slots[slot];
+            hash_cons_rebuild(size, idxs, count);
+            free(idxs);
+        }
+        hash_cons_slot_insert(found);
+        HASH_CONSES.count++;
+    }
+    pthread_mutex_unlock(&HASH_CONSES.lock);
+    return MAKE_VALUE(PAIR, found);
+}
+
+/// Returns the hash-consed equivalent of `value`: `value` itself if it
+/// isn't a pair or is hash-consed already, or else a copy. Any part of the
+/// copy that holds a vector is made of ordinary pairs.
+ValueRef hash_cons_copy(ValueRef value) {
+    if (!is_pair(value) || hash_consed(value)) return value;
+    size_t len = 0;
+    ValueRef tail = value;
+    for (; is_pair(tail) && !hash_consed(tail); tail = cdr_lookup(tail)) len++;
+    // The spine is reachable from `value`, so keeping it off the stack is
+    // safe; the copy so far is in `tail`.
+    PairRef* spine = malloc(len * sizeof(PairRef));
+    if (spine == NULL) panic("%s", "Hash cons spine alloc error!");
+    size_t i = 0;
+    for (ValueRef x = value; i < len; x = cdr_lookup(x)) spine[i++] = x;
+    while (i-- > 0) tail = hash_cons_pair(hash_cons_copy(car_lookup(spine[i])), tail);
+    free(spine);
+    return tail;
+}
+
+/// Returns the one hash-consed pair of `car` and `cdr`, making it if it's
+/// new. See `HASH_CONSES`.
+PairRef hash_cons(ValueRef car, ValueRef cdr) {
+    return hash_cons_pair(hash_cons_copy(car), hash_cons_copy(cdr));
+}
+////////////////////////////////////////////////////////////////////////////////
+
 Proc proc_lookup(ProcRef proc) {
     BigValue bv = big_value_lookup((BigValueRef) proc);
     return (Proc) {
         .creation_env = (Env*) bv.v1,
         .params = (PairRef) bv.v2,
         .body = (ValueRef) bv.v3,
+        .code = (ValueRef) bv.v4,
     };
 }
 
-ProcRef make_proc(Env* creation_env, PairRef params, ValueRef body) {
-    Idx idx = BIG_VALUES.next_idx++;
-    if (idx >= ALLOC_SIZE) panic("%s", "BIG_VALUES alloc overflow!");
+// Defined in `./env_type.h`.
+void env_capture(Env* env);
+
+ProcRef make_proc_with_code(Env* creation_env, PairRef params, ValueRef body, ValueRef code) {
+    env_capture(creation_env);
+    Idx idx = pool_alloc(&BIG_VALUES.meta);
     BIG_VALUES.v1[idx] = (ValueRef) creation_env;
     BIG_VALUES.v2[idx] = (ValueRef) params;
     BIG_VALUES.v3[idx] = (ValueRef) body;
+    BIG_VALUES.v4[idx] = code;
     return MAKE_VALUE(PROCEDURE, idx);
 }
 
+ProcRef make_proc(Env* creation_env, PairRef params, ValueRef body) {
+    return make_proc_with_code(creation_env, params, body, (ValueRef) NULL);
+}
+
 #define PROC(env, formals, body) ((ValueRef) make_proc(env, formals, body))
 
 Pair pair_lookup(PairRef pair) {
     Idx idx = GET_VALUE_DATA(pair);
-    if (idx >= PAIRS.next_idx) panic("Pair idx '%lu' out of bounds!", idx);
+    if (idx >= PAIRS.meta.next_idx) panic("Pair idx '%lu' out of bounds!", idx);
     return (Pair) {
-        .car=PAIRS.cars[idx],
-        .cdr=PAIRS.cdrs[idx],
+        .car=pair_car(idx),
+        .cdr=pair_cdr(idx),
     };
 }
 
+// Builtins are statically allocated, so the cell just points at one.
 BuiltinProc builtin_proc_lookup(BuiltinProcRef proc) {
     Pair pair = pair_lookup((PairRef) proc);
-    return (BuiltinProc) {
-        .name = (char*) pair.car,
-        .fn = (BuiltinFnPtr) pair.cdr,
-    };
+    return *(BuiltinProc*) pair.car;
 }
 
-BuiltinProcRef make_builtin_proc(const char* name, BuiltinFnPtr fn) {
-    Idx idx = PAIRS.next_idx++;
-    if (idx >= ALLOC_SIZE) panic("%s", "PAIRS alloc overflow");
-    PAIRS.cars[idx] = (ValueRef) name;
-    PAIRS.cdrs[idx] = (ValueRef) fn;
+BuiltinProcRef make_builtin_proc(BuiltinProc* proc) {
+    Idx idx = pool_alloc(&PAIRS.meta);
+    pair_car(idx) = (ValueRef) proc;
+    pair_cdr(idx) = (ValueRef) NULL;
     return MAKE_VALUE(BUILTIN_PROCEDURE, idx);
 }
 
+/// Panics unless `proc` takes `argc` arguments.
+void builtin_check_arity(BuiltinProc proc, size_t argc) {
+    if (argc < proc.min_args) {
+        if (proc.min_args == proc.max_args)
+            panic("Builtin `%s` takes %zu argument(s), %zu given!", proc.name, proc.min_args, argc);
+        panic("Builtin `%s` takes at least %zu argument(s), %zu given!", proc.name, proc.min_args, argc);
+    }
+    if (argc > proc.max_args)
+        panic("Builtin `%s` takes no more than %zu argument(s)!", proc.name, proc.max_args);
+}
+
+// Special forms are statically allocated, so the cell just points at one.
 SpecialForm special_form_lookup(SpecialFormRef form) {
     Pair pair = pair_lookup((PairRef) form);
-    return (SpecialForm) {
-        .name = (char*) pair.car,
-        .fn = (SpecialFormFnPtr) pair.cdr,
-    };
+    return *(SpecialForm*) pair.car;
 }
 
-SpecialFormRef make_special_form(char* name, SpecialFormFnPtr fn) {
-    Idx idx = PAIRS.next_idx++;
-    if (idx >= ALLOC_SIZE) panic("%s", "PAIRS alloc overflow");
-    PAIRS.cars[idx] = (ValueRef) name;
-    PAIRS.cdrs[idx] = (ValueRef) fn;
+SpecialFormRef make_special_form(SpecialForm* form) {
+    Idx idx = pool_alloc(&PAIRS.meta);
+    pair_car(idx) = (ValueRef) form;
+    pair_cdr(idx) = (ValueRef) NULL;
     return MAKE_VALUE(SPECIAL_FORM, idx);
 }
 
@@ -322,6 +1023,10 @@ SpecialFormRef make_special_form(char* name, SpecialFormFnPtr fn) {
 //==============================================================================
 
 #define assume_number(value) value_downcast(value, Number, NUMBER)
+#define assume_integer(value) \
+    (!is_integer(value) ? panic("Expected %s, got %s!", "Integer", typename_of(value)), (Number) NULL : (Number) (value))
+#define assume_numeric(value) \
+    (!is_numeric(value) ? panic("Expected %s, got %s!", "Number", typename_of(value)), (Number) NULL : (Number) (value))
 #define assume_symbol_ref(value) value_downcast(value, SymbolRef, SYMBOL)
 #define assume_pair_ref(value) value_downcast(value, PairRef, PAIR)
 #define assume_list(value) nullable_value_downcast(value, ListRef, PAIR)
@@ -354,7 +1059,7 @@ void print_pair(FILE* out, const PairRef pair) {
     if (is_null(cdr)) {
         fputc(')', out);
     } else {
-        fprintf(out, ". ");
+        fprintf(out, " . ");
         print_value(out, cdr);
         fprintf(out, ")");
     }
@@ -366,7 +1071,7 @@ void print_value(FILE* out, ValueRef value) {
         fprintf(out, "%s", "'()");
         break;
     case NUMBER:
-        fprintf(out, "%lu", GET_VALUE_DATA(value));
+        fprintf(out, "%ld", fixnum_value(value));
         break;
     case SYMBOL:
         fprintf(out, "%s", symbol_to_string((SymbolRef) value));
@@ -384,6 +1089,42 @@ void print_value(FILE* out, ValueRef value) {
     case SPECIAL_FORM:
         fprintf(out, "<special-form[%s]>", special_form_lookup(value).name);
         break;
+    case OTHER_VALUE:
+        switch (GET_OTHER_KIND(value)) {
+        case LOCAL_REF:
+            fprintf(out, "<local[%lu:%lu]>", local_ref_depth(value), local_ref_slot(value));
+            break;
+        case GLOBAL_REF:
+            fprintf(out, "<global[%s]>", symbol_to_string(global_ref_symbol(value)));
+            break;
+        case UNBOUND:
+            fprintf(out, "%s", "<unbound>");
+            break;
+        case CODE:
+            fprintf(out, "<code[%lu]>", GET_OTHER_DATA(value));
+            break;
+        case MEMO:
+            fprintf(out, "<memo[%lu]>", GET_OTHER_DATA(value));
+            break;
+        case TABLE:
+            fprintf(out, "<table[%lu]>", GET_OTHER_DATA(value));
+            break;
+        case VECTOR:
+            print_vector(out, value);
+            break;
+        case STRING:
+            print_string(out, value);
+            break;
+        case BIGNUM:
+            print_bignum(out, value);
+            break;
+        case FLONUM:
+            print_flonum(out, value);
+            break;
+        default:
+            panic("`print_value` is not implemented for other-value kind: %u", GET_OTHER_KIND(value));
+        }
+        break;
     default:
         panic("`print_value` is not implemented for value kind: %u", GET_VALUE_KIND(value));
     }
@@ -0,0 +1,289 @@
+#ifndef VECTORS_H
+#define VECTORS_H
+
+#include <stdio.h> // FILE, fputc
+#include <string.h> // memchr, memcmp, memcpy
+#ifdef __x86_64__
+#include <immintrin.h> // __m128i, __m256i
+#endif
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "gc.h"
+#include "numbers.h"
+
+// Vectors and strings: the contiguous aggregates.
+//
+// A vector lives in the `VECTORS` pool as a length and a malloc'd array of
+// values, and may be changed in place. A string lives in the `STRINGS` pool
+// as a length and malloc'd bytes, and is never changed once made.
+//
+// Bulk operations work on the arrays directly. `vector_sum` adds fixnums
+// with AVX2 where the CPU has it and SSE2 otherwise (see `vectors_init`),
+// and only falls back to the numeric tower if some element isn't a
+// fixnum or the total leaves the `int64_t` range. Byte scans use `memchr`,
+// which glibc already dispatches to SSE2 or AVX2 kernels per CPU.
+
+typedef struct Vector {
+    size_t len;
+    ValueRef* items;
+} Vector;
+
+static struct {
+    Vector* vectors;
+    PoolMeta meta;
+} VECTORS = {
+    .meta={
+        .name="VECTORS", .collected=true, .column_count=1,
+        .columns={ (void**) &VECTORS.vectors },
+        .column_sizes={ sizeof(Vector) },
+    }
+};
+
+static void trace_vector(Idx idx) {
+    Vector* vector = &VECTORS.vectors[idx];
+    for (size_t i = 0; i < vector->len; i++) {
+        ValueRef item = vector->items[i];
+        if (!is_null(item) && !is_number(item)) gc_push(item);
+    }
+}
+
+static void clear_vector(Idx idx) {
+    free(VECTORS.vectors[idx].items);
+    VECTORS.vectors[idx] = (Vector) { .len=0, .items=NULL };
+}
+
+typedef struct String {
+    size_t len;
+    char* bytes; // NUL-terminated, though the string may hold NULs too.
+} String;
+
+static struct {
+    String* strings;
+    PoolMeta meta;
+} STRINGS = {
+    .meta={
+        .name="STRINGS", .collected=true, .column_count=1,
+        .columns={ (void**) &STRINGS.strings },
+        .column_sizes={ sizeof(String) },
+    }
+};
+
+static void trace_string(Idx idx) {
+    // Strings refer to no other values.
+}
+
+static void clear_string(Idx idx) {
+    free(STRINGS.strings[idx].bytes);
+    STRINGS.strings[idx] = (String) { .len=0, .bytes=NULL };
+}
+
+Vector* vector_lookup(ValueRef vector) {
+    Idx idx = GET_OTHER_DATA(vector);
+    if (!is_vector(vector) || idx >= VECTORS.meta.next_idx)
+        panic("Expected vector, got %s!", typename_of(vector));
+    return &VECTORS.vectors[idx];
+}
+
+String* string_lookup(ValueRef string) {
+    Idx idx = GET_OTHER_DATA(string);
+    if (!is_string(string) || idx >= STRINGS.meta.next_idx)
+        panic("Expected string, got %s!", typename_of(string));
+    return &STRINGS.strings[idx];
+}
+
+/// Makes a vector of `len` copies of `fill`.
+ValueRef make_vector(size_t len, ValueRef fill) {
+    ValueRef* items = malloc((len ? len : 1) * sizeof(ValueRef));
+    if (items == NULL) panic("%s", "Vector alloc error!");
+    for (size_t i = 0; i < len; i++) items[i] = fill;
+    Idx idx = pool_alloc(&VECTORS.meta);
+    VECTORS.vectors[idx] = (Vector) { .len=len, .items=items };
+    return MAKE_OTHER(VECTOR, idx);
+}
+
+/// Makes a vector of the elements of the list `xs`.
+ValueRef list_to_vector(ListRef xs) {
+    size_t len = 0;
+    for (ListRef x = xs; !is_null(x); x = assume_list(cdr_lookup(x)))
+        len++;
+    ValueRef vector = make_vector(len, (ValueRef) NULL);
+    ValueRef* items = VECTORS.vectors[GET_OTHER_DATA(vector)].items;
+    for (size_t i = 0; i < len; i++, xs = cdr_lookup(xs))
+        items[i] = car_lookup(xs);
+    return vector;
+}
+
+/// Makes a string of the `len` bytes at `bytes`, or of `len` zero bytes
+/// if `bytes` is `NULL`.
+ValueRef make_string(const char* bytes, size_t len) {
+    char* copy = calloc(len + 1, 1);
+    if (copy == NULL) panic("%s", "String alloc error!");
+    if (bytes != NULL) memcpy(copy, bytes, len);
+    Idx idx = pool_alloc(&STRINGS.meta);
+    STRINGS.strings[idx] = (String) { .len=len, .bytes=copy };
+    return MAKE_OTHER(STRING, idx);
+}
+
+bool vector_eq(ValueRef a, ValueRef b) {
+    Vector* x = vector_lookup(a);
+    Vector* y = vector_lookup(b);
+    if (x->len != y->len) return false;
+    for (size_t i = 0; i < x->len; i++)
+        if (!value_eq(x->items[i], y->items[i])) return false;
+    return true;
+}
+
+bool string_eq(ValueRef a, ValueRef b) {
+    String* x = string_lookup(a);
+    String* y = string_lookup(b);
+    return x->len == y->len && memcmp(x->bytes, y->bytes, x->len) == 0;
+}
+
+uint64_t vector_hash(ValueRef vector) {
+    Vector* v = vector_lookup(vector);
+    uint64_t hash = v->len;
+    for (size_t i = 0; i < v->len; i++)
+        hash = hash_mix(hash + value_hash(v->items[i]));
+    return hash;
+}
+
+uint64_t string_hash(ValueRef string) {
+    String* s = string_lookup(string);
+    return hash_bytes(s->bytes, s->len);
+}
+
+void print_vector(FILE* out, ValueRef vector) {
+    Vector* v = vector_lookup(vector);
+    fputs("#(", out);
+    for (size_t i = 0; i < v->len; i++) {
+        if (i > 0) fputc(' ', out);
+        print_value(out, v->items[i]);
+    }
+    fputc(')', out);
+}
+
+/// Prints `string` as the reader would read it back.
+void print_string(FILE* out, ValueRef string) {
+    String* s = string_lookup(string);
+    fputc('"', out);
+    for (size_t i = 0; i < s->len; i++) {
+        char c = s->bytes[i];
+        if (c == '"' || c == '\\') fputc('\\', out);
+        if (c == '\n') fputs("\\n", out);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+//////////////////////////////// FIXNUM SUMS ///////////////////////////////
+// Each kernel adds up `items` into `*total` and returns `true` if they are
+// all fixnums and no partial sum overflows. The SIMD kernels sign-extend a
+// fixnum's data bits as `((x & VALUE_DATA_MASK) ^ FIXNUM_SIGN) - FIXNUM_SIGN`,
+// since neither SSE2 nor AVX2 has a 64-bit arithmetic shift. A fixnum is
+// below 2^60 in magnitude, so a lane can take 8 of them before it must be
+// added into the total with an overflow check.
+#define FIXNUM_TAG ((uint64_t) NUMBER << (64 - VALUE_KIND_BITS))
+#define FIXNUM_SIGN (1UL << (FIXNUM_BITS - 1))
+#define SUM_LANE_BLOCK 8
+
+typedef bool (*FixnumSumFn)(const ValueRef* items, size_t len, int64_t* total);
+
+static bool fixnum_sum_scalar(const ValueRef* items, size_t len, int64_t* total) {
+    int64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!is_number(items[i]) || __builtin_add_overflow(sum, fixnum_value(items[i]), &sum))
+            return false;
+    }
+    *total = sum;
+    return true;
+}
+
+#ifdef __x86_64__
+static bool fixnum_sum_sse2(const ValueRef* items, size_t len, int64_t* total) {
+    const __m128i kind_mask = _mm_set1_epi64x(VALUE_KIND_MASK);
+    const __m128i tag = _mm_set1_epi64x(FIXNUM_TAG);
+    const __m128i data_mask = _mm_set1_epi64x(VALUE_DATA_MASK);
+    const __m128i sign = _mm_set1_epi64x(FIXNUM_SIGN);
+    __m128i bad = _mm_setzero_si128();
+    int64_t sum = 0;
+    size_t i = 0;
+    while (len - i >= 2) {
+        size_t end = len - i >= 2 * SUM_LANE_BLOCK ? i + 2 * SUM_LANE_BLOCK : len & ~(size_t) 1;
+        __m128i acc = _mm_setzero_si128();
+        for (; i < end; i += 2) {
+            __m128i x = _mm_loadu_si128((const __m128i*) (items + i));
+            bad = _mm_or_si128(bad, _mm_xor_si128(_mm_and_si128(x, kind_mask), tag));
+            __m128i value = _mm_sub_epi64(_mm_xor_si128(_mm_and_si128(x, data_mask), sign), sign);
+            acc = _mm_add_epi64(acc, value);
+        }
+        int64_t lanes[2];
+        _mm_storeu_si128((__m128i*) lanes, acc);
+        if (__builtin_add_overflow(sum, lanes[0], &sum) || __builtin_add_overflow(sum, lanes[1], &sum))
+            return false;
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, _mm_setzero_si128())) != 0xffff) return false;
+    int64_t rest;
+    if (!fixnum_sum_scalar(items + i, len - i, &rest) || __builtin_add_overflow(sum, rest, &sum))
+        return false;
+    *total = sum;
+    return true;
+}
+
+__attribute__((target("avx2")))
+static bool fixnum_sum_avx2(const ValueRef* items, size_t len, int64_t* total) {
+    const __m256i kind_mask = _mm256_set1_epi64x(VALUE_KIND_MASK);
+    const __m256i tag = _mm256_set1_epi64x(FIXNUM_TAG);
+    const __m256i data_mask = _mm256_set1_epi64x(VALUE_DATA_MASK);
+    const __m256i sign = _mm256_set1_epi64x(FIXNUM_SIGN);
+    __m256i bad = _mm256_setzero_si256();
+    int64_t sum = 0;
+    size_t i = 0;
+    while (len - i >= 4) {
+        size_t end = len - i >= 4 * SUM_LANE_BLOCK ? i + 4 * SUM_LANE_BLOCK : len & ~(size_t) 3;
+        __m256i acc = _mm256_setzero_si256();
+        for (; i < end; i += 4) {
+            __m256i x = _mm256_loadu_si256((const __m256i*) (items + i));
+            bad = _mm256_or_si256(bad, _mm256_xor_si256(_mm256_and_si256(x, kind_mask), tag));
+            __m256i value = _mm256_sub_epi64(_mm256_xor_si256(_mm256_and_si256(x, data_mask), sign), sign);
+            acc = _mm256_add_epi64(acc, value);
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256((__m256i*) lanes, acc);
+        for (int lane = 0; lane < 4; lane++)
+            if (__builtin_add_overflow(sum, lanes[lane], &sum)) return false;
+    }
+    if (!_mm256_testz_si256(bad, bad)) return false;
+    int64_t rest;
+    if (!fixnum_sum_scalar(items + i, len - i, &rest) || __builtin_add_overflow(sum, rest, &sum))
+        return false;
+    *total = sum;
+    return true;
+}
+#endif
+
+// The best kernel this CPU runs, picked by `vectors_init`.
+static FixnumSumFn FIXNUM_SUM = fixnum_sum_scalar;
+
+void vectors_init(void) {
+    gc_register_other_kind(VECTOR, &VECTORS.meta, trace_vector, clear_vector);
+    gc_register_other_kind(STRING, &STRINGS.meta, trace_string, clear_string);
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    FIXNUM_SUM = __builtin_cpu_supports("avx2") ? fixnum_sum_avx2 : fixnum_sum_sse2;
+#endif
+}
+
+/// Adds up the elements of `vector`.
+Number vector_sum(ValueRef vector) {
+    Vector* v = vector_lookup(vector);
+    int64_t total;
+    if (FIXNUM_SUM(v->items, v->len, &total)) return make_number(total);
+    Number sum = make_fixnum(0);
+    for (size_t i = 0; i < v->len; i++)
+        sum = num_add(sum, assume_numeric(v->items[i]));
+    return sum;
+}
+////////////////////////////////////////////////////////////////////////////
+
+#endif
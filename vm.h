@@ -0,0 +1,834 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h> // uint32_t, SIZE_MAX
+
+#include "helper_macros.h"
+#include "value_types.h"
+#include "env_type.h"
+#include "resolve.h"
+#include "builtins.h"
+#include "gc.h"
+#include "profile.h"
+
+// Bytecode compiler and stack VM, an alternative to `eval_resolved`.
+//
+// Resolved code compiles to one `Prototype` per lambda body (and one per
+// top-level expression compiled, see `vm_eval_resolved`), stored as a `CODE`
+// value. Procedures carry their compiled body in `Proc.code`, filled in
+// lazily for procedures the tree-walking evaluator created. VM frames are
+// ordinary `Env`s, so closures made by either evaluator can be called from
+// the other.
+//
+// Calls whose operator is a global variable go through a per-call-site
+// `CallCache` holding the callee (and, for a builtin, its function pointer),
+// which stays valid until `GLOBAL_VERSION` changes.
+//
+// Each prototype counts the frames entered for it, and once that reaches
+// `JIT.threshold` it is compiled to x86-64 code (see `./jit.h`). `vm_run`
+// then runs a frame's native code wherever it may be entered, and the
+// native code hands the frame back to the interpreter at any instruction
+// it doesn't handle itself.
+
+enum OPCODE {
+    OP_CONST,         // k: push consts[k]
+    OP_LOCAL,         // depth slot: push a local variable
+    OP_GLOBAL,        // symbol: push a global variable
+    OP_SET_LOCAL,     // depth slot: pop into a local variable, push '()
+    OP_SET_GLOBAL,    // symbol: pop into a global variable, push '()
+    OP_CLOSURE,       // k: push a procedure for the `CODE` in consts[k]
+    OP_CALL,          // argc: call the procedure under the top argc values
+    OP_TAIL_CALL,     // argc: like `OP_CALL`, replacing the current frame
+    OP_RETURN,        // return the top value
+    OP_JUMP,          // target
+    OP_JUMP_IF_FALSE, // target: pop, and jump if it was '()
+    OP_EVAL,          // k: push `eval_resolved(consts[k])`, for other special forms
+    OP_CALL_GLOBAL,   // symbol argc cache: call a global on the top argc values
+    OP_TAIL_CALL_GLOBAL, // symbol argc cache: like `OP_CALL_GLOBAL`, replacing the current frame
+    OP_DEFINE_GLOBAL, // symbol: pop into a new or existing global, push the symbol
+    OP_MEMOIZE,       // limited: pop a procedure (under its size bound, if limited), push it memoized
+};
+
+typedef uint32_t Instr;
+
+// What the global a call site calls was bound to when last looked up.
+// Never traced: while `version` is current, the callee is still reachable
+// from the global frame.
+typedef struct CallCache {
+    uint64_t version; // `GLOBAL_VERSION` when filled, or 0 if empty.
+    Env* root;
+    ValueRef callee;
+    BuiltinFnPtr builtin;      // Set if `callee` is a builtin procedure.
+    BuiltinBinaryFnPtr binary; // Set if the site passes two arguments to a
+                               // builtin with a binary entry point.
+    ValueRef code;             // Set if `callee` is a procedure.
+} CallCache;
+
+typedef struct JitCode JitCode;
+
+typedef struct Prototype {
+    Instr* code;
+    size_t code_len;
+    size_t code_cap;
+    ValueRef* consts;
+    size_t const_count;
+    size_t const_cap;
+    ListRef params;
+    size_t param_count;
+    ValueRef body; // The resolved body, for the tree-walking evaluator.
+    size_t max_stack;
+    CallCache* caches;
+    size_t cache_count;
+    uint32_t calls; // Frames entered, until the code is compiled.
+    JitCode* jit;   // Native code, once compiled. See `./jit.h`.
+} Prototype;
+
+////////////////////////////// JIT ///////////////////////////////////
+// Where native code stopped: at the instruction `pc` the interpreter takes
+// over from, or at a return if `pc` is `NULL`, with the stack top at `sp`.
+typedef struct JitExit {
+    const Instr* pc;
+    ValueRef* sp;
+} JitExit;
+
+// Enters native code at `entry` for the frame running in `env` whose stack
+// starts at `base`.
+typedef JitExit (*JitFn)(Env* env, const void* entry, ValueRef* base, unsigned owns_env);
+
+struct JitCode {
+    JitFn fn;          // Start of the code.
+    void* writable;    // The same code, where it was written.
+    size_t size;       // Bytes of the code heap it takes.
+    uint32_t* entries; // Offset into the code for each instruction the VM
+                       // may enter at, by index; 0 where it may not.
+};
+
+static struct {
+    bool enabled;
+    uint32_t threshold; // Calls before a prototype is compiled.
+    pthread_mutex_t lock;
+    size_t compiled;    // Prototypes compiled.
+    size_t code_bytes;  // Code heap taken by those not yet collected.
+} JIT = {
+#if defined(__x86_64__) && defined(__linux__)
+    .enabled=true,
+#endif
+    .threshold=100,
+    .lock=PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Defined in `./jit.h`.
+void jit_compile(ValueRef code, Env* root);
+void jit_free(JitCode* jit);
+
+/// Counts a frame entered for `proto`, compiling it once it's hot. Threads
+/// running the same code may lose each other's counts, which only delays
+/// compilation.
+static inline void jit_count_call(ValueRef code, Prototype* proto, Env* env) {
+    if (!JIT.enabled || __atomic_load_n(&proto->jit, __ATOMIC_RELAXED) != NULL) return;
+    uint32_t calls = __atomic_load_n(&proto->calls, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&proto->calls, calls, __ATOMIC_RELAXED);
+    if (calls == JIT.threshold) jit_compile(code, env->root);
+}
+//////////////////////////////////////////////////////////////////////
+
+static struct {
+    Prototype** prototypes;
+    PoolMeta meta;
+} CODES = {
+    .meta={
+        .name="CODES", .collected=true, .column_count=1,
+        .columns={ (void**) &CODES.prototypes },
+        .column_sizes={ sizeof(Prototype*) },
+    }
+};
+
+Prototype* code_lookup(ValueRef code) {
+    Idx idx = GET_OTHER_DATA(code);
+    if (!is_other_kind(code, CODE) || idx >= CODES.meta.next_idx)
+        panic("Expected code, got %s!", typename_of(code));
+    return CODES.prototypes[idx];
+}
+
+static void trace_code(Idx idx) {
+    Prototype* proto = CODES.prototypes[idx];
+    if (proto == NULL) return;
+    gc_push(proto->params);
+    gc_push(proto->body);
+    for (size_t i = 0; i < proto->const_count; i++)
+        gc_push(proto->consts[i]);
+}
+
+static void clear_code(Idx idx) {
+    Prototype* proto = CODES.prototypes[idx];
+    if (proto == NULL) return;
+    free(proto->code);
+    free(proto->consts);
+    free(proto->caches);
+    if (proto->jit != NULL) jit_free(proto->jit);
+    free(proto);
+    CODES.prototypes[idx] = NULL;
+}
+
+////////////////////////////// COMPILER //////////////////////////////
+typedef struct Compiler {
+    Prototype* proto;
+    size_t depth; // Stack depth at the current instruction.
+} Compiler;
+
+static void emit(Compiler* c, Instr word) {
+    Prototype* proto = c->proto;
+    if (proto->code_len == proto->code_cap) {
+        proto->code_cap = proto->code_cap ? 2 * proto->code_cap : 16;
+        proto->code = realloc(proto->code, proto->code_cap * sizeof(Instr));
+        if (proto->code == NULL) panic("%s", "Bytecode alloc error!");
+    }
+    proto->code[proto->code_len++] = word;
+}
+
+/// Emits `op`, which changes the stack depth by `stack_effect`.
+static void emit_op(Compiler* c, enum OPCODE op, long stack_effect) {
+    emit(c, op);
+    c->depth += stack_effect;
+    if (c->depth > c->proto->max_stack) c->proto->max_stack = c->depth;
+}
+
+static Instr add_const(Compiler* c, ValueRef value) {
+    Prototype* proto = c->proto;
+    if (proto->const_count == proto->const_cap) {
+        proto->const_cap = proto->const_cap ? 2 * proto->const_cap : 8;
+        proto->consts = realloc(proto->consts, proto->const_cap * sizeof(ValueRef));
+        if (proto->consts == NULL) panic("%s", "Constant pool alloc error!");
+    }
+    proto->consts[proto->const_count] = value;
+    return proto->const_count++;
+}
+
+/// Emits a jump with a placeholder target and returns where to patch it.
+static size_t emit_jump(Compiler* c, enum OPCODE op, long stack_effect) {
+    emit_op(c, op, stack_effect);
+    emit(c, 0);
+    return c->proto->code_len - 1;
+}
+
+static void patch_jump(Compiler* c, size_t at) {
+    c->proto->code[at] = c->proto->code_len;
+}
+
+ValueRef compile_prototype(ListRef params, ValueRef body);
+
+static void compile_expr(Compiler* c, ValueRef expr, bool tail);
+
+static void compile_set(Compiler* c, ValueRef target) {
+    if (is_other_kind(target, LOCAL_REF)) {
+        emit_op(c, OP_SET_LOCAL, 0);
+        emit(c, local_ref_depth(target));
+        emit(c, local_ref_slot(target));
+    } else {
+        emit_op(c, OP_SET_GLOBAL, 0);
+        emit(c, GET_OTHER_DATA(target));
+    }
+}
+
+/// Whether a special form has as many arguments as the compiler expects.
+static bool compile_arity_ok(ValueRef head, ListRef args) {
+    size_t min = 0, max = SIZE_MAX;
+    if (is_form(head, &lambda) || is_form(head, &set_bang) || is_form(head, &define))
+        min = max = 2;
+    else if (is_form(head, &if_) || is_form(head, &define_memo))
+        min = 2, max = 3;
+    else if (is_form(head, &quote))
+        min = max = 1;
+    size_t count = 0;
+    for (; !is_null(args) && count <= max; args = cdr_lookup(args)) count++;
+    return min <= count && count <= max;
+}
+
+static void compile_form(Compiler* c, ValueRef head, ListRef args, bool tail) {
+    if (!compile_arity_ok(head, args)) {
+        // Let the tree-walker report the wrong number of arguments.
+        Instr k = add_const(c, make_pair_ref(head, args));
+        emit_op(c, OP_EVAL, 1);
+        emit(c, k);
+    } else if (is_form(head, &lambda)) {
+        ListRef params = assume_list(car_lookup(args));
+        ValueRef body = car_lookup(cdr_lookup(args));
+        Instr k = add_const(c, compile_prototype(params, body));
+        emit_op(c, OP_CLOSURE, 1);
+        emit(c, k);
+    } else if (is_form(head, &set_bang)) {
+        compile_expr(c, car_lookup(cdr_lookup(args)), false);
+        compile_set(c, car_lookup(args));
+    } else if (is_form(head, &define) || is_form(head, &define_memo)) {
+        ListRef rest = cdr_lookup(args);
+        ListRef limit = cdr_lookup(rest);
+        compile_expr(c, car_lookup(rest), false);
+        if (is_form(head, &define_memo)) {
+            if (!is_null(limit)) compile_expr(c, car_lookup(limit), false);
+            emit_op(c, OP_MEMOIZE, is_null(limit) ? 0 : -1);
+            emit(c, !is_null(limit));
+        }
+        emit_op(c, OP_DEFINE_GLOBAL, 0);
+        emit(c, GET_VALUE_DATA(car_lookup(args)));
+    } else if (is_form(head, &quote)) {
+        Instr k = add_const(c, car_lookup(args));
+        emit_op(c, OP_CONST, 1);
+        emit(c, k);
+    } else if (is_form(head, &if_)) {
+        ListRef branches = cdr_lookup(args);
+        ListRef alternative = cdr_lookup(branches);
+        compile_expr(c, car_lookup(args), false);
+        size_t to_alternative = emit_jump(c, OP_JUMP_IF_FALSE, -1);
+        compile_expr(c, car_lookup(branches), tail);
+        size_t to_end = tail ? 0 : emit_jump(c, OP_JUMP, 0);
+        patch_jump(c, to_alternative);
+        if (!tail) c->depth--; // Only one of the branches runs.
+        compile_expr(c, is_null(alternative) ? (ValueRef) NULL : car_lookup(alternative), tail);
+        if (!tail) patch_jump(c, to_end);
+        return; // Each branch already returned if in tail position.
+    } else {
+        Instr k = add_const(c, make_pair_ref(head, args));
+        emit_op(c, OP_EVAL, 1);
+        emit(c, k);
+    }
+    if (tail) emit_op(c, OP_RETURN, -1);
+}
+
+static void compile_expr(Compiler* c, ValueRef expr, bool tail) {
+    if (is_other_kind(expr, LOCAL_REF)) {
+        emit_op(c, OP_LOCAL, 1);
+        emit(c, local_ref_depth(expr));
+        emit(c, local_ref_slot(expr));
+    } else if (is_other_kind(expr, GLOBAL_REF)) {
+        emit_op(c, OP_GLOBAL, 1);
+        emit(c, GET_OTHER_DATA(expr));
+    } else if (is_pair(expr)) {
+        ValueRef head = car_lookup(expr);
+        ListRef args = assume_list(cdr_lookup(expr));
+        if (is_special_form(head)) {
+            compile_form(c, head, args, tail);
+            return;
+        }
+        bool global = is_other_kind(head, GLOBAL_REF);
+        if (!global) compile_expr(c, head, false);
+        Instr argc = 0;
+        for (; !is_null(args); args = assume_list(cdr_lookup(args)), argc++)
+            compile_expr(c, car_lookup(args), false);
+        if (global) {
+            emit_op(c, tail ? OP_TAIL_CALL_GLOBAL : OP_CALL_GLOBAL, 1 - (long) argc);
+            emit(c, GET_OTHER_DATA(head));
+            emit(c, argc);
+            emit(c, c->proto->cache_count++);
+        } else {
+            emit_op(c, tail ? OP_TAIL_CALL : OP_CALL, -(long) argc);
+            emit(c, argc);
+        }
+        if (tail) c->depth--; // A tail call leaves the frame.
+        return;
+    } else if (is_symbol(expr)) {
+        // Unresolved code; let the tree-walker look it up by name.
+        Instr k = add_const(c, expr);
+        emit_op(c, OP_EVAL, 1);
+        emit(c, k);
+    } else {
+        Instr k = add_const(c, expr);
+        emit_op(c, OP_CONST, 1);
+        emit(c, k);
+    }
+    if (tail) emit_op(c, OP_RETURN, -1);
+}
+
+/// Compiles the resolved `body` of a procedure taking `params`.
+ValueRef compile_prototype(ListRef params, ValueRef body) {
+    Prototype* proto = calloc(1, sizeof(Prototype));
+    if (proto == NULL) panic("%s", "Prototype alloc error!");
+    proto->params = params;
+    proto->body = body;
+    for (ListRef param = params; !is_null(param); param = cdr_lookup(param))
+        proto->param_count++;
+
+    // Allocate the `CODE` cell first so the collector traces the constants
+    // while the rest is compiled.
+    Idx idx = pool_alloc(&CODES.meta);
+    CODES.prototypes[idx] = proto;
+    ValueRef code = MAKE_OTHER(CODE, idx);
+
+    Compiler c = { .proto=proto, .depth=0 };
+    compile_expr(&c, body, true);
+    if (proto->cache_count > 0) {
+        proto->caches = calloc(proto->cache_count, sizeof(CallCache));
+        if (proto->caches == NULL) panic("%s", "Call cache alloc error!");
+    }
+    return code;
+}
+//////////////////////////////////////////////////////////////////////
+
+////////////////////////////// MACHINE ///////////////////////////////
+typedef struct VmFrame {
+    ValueRef code;
+    const Instr* pc;
+    Env* env;
+    bool owns_env; // `env` was made for this call, and is released with it.
+    size_t base;   // Stack height when the frame was entered.
+} VmFrame;
+
+// Each thread runs its own VM.
+typedef struct VmState {
+    bool enabled;
+    ValueRef* stack;
+    size_t sp;
+    size_t stack_cap;
+    VmFrame* frames;
+    size_t frame_count;
+    size_t frame_cap;
+} VmState;
+
+static _Thread_local VmState VM = {
+    .enabled=false,
+};
+
+/// Compile every top-level expression, rather than handing those that make
+/// no closures to the tree-walker. The tests set this so that the VM runs
+/// all of their code.
+static bool VM_COMPILE_ALL = false;
+
+static void vm_mark_roots(void* local) {
+    VmState* vm = local;
+    for (size_t i = 0; i < vm->sp; i++)
+        gc_push(vm->stack[i]);
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        gc_push(vm->frames[i].code);
+        gc_mark_env(vm->frames[i].env);
+    }
+}
+
+static void* vm_local(void) {
+    return &VM;
+}
+
+void vm_init(void) {
+    gc_register_other_kind(CODE, &CODES.meta, trace_code, clear_code);
+    gc_register_root_scanner(vm_mark_roots, vm_local);
+}
+
+/// Frees the calling thread's VM stacks, e.g. before it exits.
+void vm_thread_free(void) {
+    free(VM.stack);
+    free(VM.frames);
+    VM = (VmState) { .enabled=VM.enabled };
+}
+
+static void vm_reserve_stack(size_t height) {
+    if (height <= VM.stack_cap) return;
+    while (VM.stack_cap < height)
+        VM.stack_cap = VM.stack_cap ? 2 * VM.stack_cap : 1024;
+    VM.stack = realloc(VM.stack, VM.stack_cap * sizeof(ValueRef));
+    if (VM.stack == NULL) panic("%s", "VM stack alloc error!");
+}
+
+static VmFrame* vm_push_frame(ValueRef code, Env* env, size_t base) {
+    if (VM.frame_count == VM.frame_cap) {
+        VM.frame_cap = VM.frame_cap ? 2 * VM.frame_cap : 256;
+        VM.frames = realloc(VM.frames, VM.frame_cap * sizeof(VmFrame));
+        if (VM.frames == NULL) panic("%s", "VM frame stack alloc error!");
+    }
+    Prototype* proto = code_lookup(code);
+    jit_count_call(code, proto, env);
+    vm_reserve_stack(base + proto->max_stack);
+    VmFrame* frame = &VM.frames[VM.frame_count++];
+    *frame = (VmFrame) { .code=code, .pc=proto->code, .env=env, .owns_env=false, .base=base };
+    return frame;
+}
+
+/// Returns the compiled body of `fn`, compiling it on first use.
+static ValueRef proc_code(ProcRef fn) {
+    Idx idx = GET_VALUE_DATA(fn);
+    if (is_null(BIG_VALUES.v4[idx]))
+        BIG_VALUES.v4[idx] = compile_prototype(BIG_VALUES.v2[idx], BIG_VALUES.v3[idx]);
+    return BIG_VALUES.v4[idx];
+}
+
+/// Makes the frame for calling `fn` on the top `argc` stack values.
+static Env* vm_bind_arguments(ProcRef fn, Prototype* callee, Instr argc) {
+    Proc proc = proc_lookup(fn);
+    Env* frame = make_frame(proc.creation_env, proc.params, callee->param_count);
+    ValueRef* args = &VM.stack[VM.sp - argc];
+    for (size_t i = 0; i < argc && i < callee->param_count; i++)
+        frame->slots[i] = args[i];
+    return frame;
+}
+
+/// Calls `fn` on the top `argc` stack values, in place.
+static ValueRef vm_call_builtin(BuiltinFnPtr fn, Instr argc) {
+    return fn(argc, &VM.stack[VM.sp - argc]);
+}
+
+static BuiltinFnPtr vm_builtin_fn(BuiltinProcRef fn, Instr argc) {
+    BuiltinProc proc = builtin_proc_lookup(fn);
+    builtin_check_arity(proc, argc);
+    return proc.fn;
+}
+
+/// Returns the call site's cache, refilled from the global `symbol` if
+/// it's stale. A call site always passes the same `argc`, so a builtin's
+/// arity is only checked when the cache is filled.
+static CallCache* vm_call_cache(Prototype* proto, Instr k, Env* env, Instr symbol, Instr argc) {
+    CallCache* cache = &proto->caches[k];
+    if (__atomic_load_n(&cache->version, __ATOMIC_ACQUIRE) == global_version() && cache->root == env->root)
+        return cache;
+    uint64_t version = global_version();
+    Env* root = env->root;
+    ValueRef callee = symbol < root->count ? root->slots[symbol] : UNBOUND_VALUE;
+    if (callee == UNBOUND_VALUE)
+        panic("Unbound Symbol: `%s`", symbol_to_string(MAKE_VALUE(SYMBOL, symbol)));
+    // Threads running the same code (see `./parallel.h`) may fill a cache
+    // at once. They store the same entry, and the version goes last, so a
+    // reader that sees it current sees the rest too.
+    cache->root = root;
+    cache->callee = callee;
+    cache->builtin = is_builtin_proc(callee) ? vm_builtin_fn(callee, argc) : NULL;
+    cache->binary = is_builtin_proc(callee) && argc == 2 ? builtin_proc_lookup(callee).binary : NULL;
+    cache->code = is_proc(callee) ? proc_code(callee) : (ValueRef) NULL;
+    __atomic_store_n(&cache->version, version, __ATOMIC_RELEASE);
+    return cache;
+}
+
+static void vm_bad_call(ValueRef fn) {
+    if (is_special_form(fn)) special_form_misused(fn);
+    panic("Cannot call value of type %s as a procedure!", typename_of(fn));
+}
+
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO
+#endif
+
+/// Runs `code` in `env` until it returns.
+ValueRef vm_run(ValueRef code, Env* env) {
+    size_t entry_frames = VM.frame_count;
+    vm_push_frame(code, env, VM.sp);
+
+    Prototype* proto;
+    const Instr* pc;
+    ValueRef* sp;
+
+    // `VM.sp` must be current whenever anything that might collect runs,
+    // and the stack may move whenever a frame is pushed.
+#define SAVE() (VM.sp = sp - VM.stack, VM.frames[VM.frame_count - 1].pc = pc)
+#define LOAD()                                        \
+    do {                                              \
+        VmFrame* top = &VM.frames[VM.frame_count - 1]; \
+        proto = code_lookup(top->code);                \
+        pc = top->pc;                                  \
+        env = top->env;                                \
+        sp = VM.stack + VM.sp;                         \
+        JIT_RESUME();                                  \
+    } while (0)
+    // Runs the frame's native code from `pc`, if it may be entered there,
+    // until it returns or hands back to the interpreter. Native code skips
+    // the profiler's hooks, so it doesn't run while profiling.
+#define JIT_RESUME()                                                                    \
+    do {                                                                                \
+        JitCode* jit = __atomic_load_n(&proto->jit, __ATOMIC_ACQUIRE);                  \
+        uint32_t entry = jit != NULL ? jit->entries[pc - proto->code] : 0;              \
+        if (entry != 0 && JIT.enabled && !PROFILING) {                                  \
+            VmFrame* top = &VM.frames[VM.frame_count - 1];                              \
+            JitExit stop = jit->fn(env, (const char*) jit->fn + entry,                  \
+                                   VM.stack + top->base, top->owns_env);                \
+            sp = stop.sp;                                                               \
+            if (stop.pc == NULL) goto op_return;                                        \
+            pc = stop.pc;                                                               \
+        }                                                                               \
+    } while (0)
+
+    LOAD();
+
+#ifdef VM_COMPUTED_GOTO
+    static const void* dispatch[] = {
+        [OP_CONST]=&&op_CONST, [OP_LOCAL]=&&op_LOCAL, [OP_GLOBAL]=&&op_GLOBAL,
+        [OP_SET_LOCAL]=&&op_SET_LOCAL, [OP_SET_GLOBAL]=&&op_SET_GLOBAL,
+        [OP_CLOSURE]=&&op_CLOSURE, [OP_CALL]=&&op_CALL, [OP_TAIL_CALL]=&&op_TAIL_CALL,
+        [OP_RETURN]=&&op_RETURN, [OP_JUMP]=&&op_JUMP, [OP_JUMP_IF_FALSE]=&&op_JUMP_IF_FALSE,
+        [OP_EVAL]=&&op_EVAL, [OP_CALL_GLOBAL]=&&op_CALL_GLOBAL,
+        [OP_TAIL_CALL_GLOBAL]=&&op_TAIL_CALL_GLOBAL,
+        [OP_DEFINE_GLOBAL]=&&op_DEFINE_GLOBAL, [OP_MEMOIZE]=&&op_MEMOIZE,
+    };
+#define CASE(OP) op_##OP:
+#define NEXT() goto *dispatch[*pc++]
+    NEXT();
+#else
+#define CASE(OP) case OP_##OP:
+#define NEXT() continue
+    for (;;) switch (*pc++) {
+#endif
+
+    CASE(CONST) {
+        *sp++ = proto->consts[*pc++];
+        NEXT();
+    }
+    CASE(LOCAL) {
+        Env* frame = env;
+        env_count_walk(*pc);
+        for (Instr depth = *pc++; depth > 0; depth--) frame = frame->parent;
+        ValueRef value = frame->slots[*pc++];
+        if (value == UNBOUND_VALUE)
+            env_ref_lookup(env, make_local_ref(pc[-2], pc[-1])); // Panics.
+        *sp++ = value;
+        NEXT();
+    }
+    CASE(GLOBAL) {
+        Env* root = env->root;
+        Instr idx = *pc++;
+        ValueRef value = idx < root->count ? root->slots[idx] : UNBOUND_VALUE;
+        if (value == UNBOUND_VALUE)
+            panic("Unbound Symbol: `%s`", symbol_to_string(MAKE_VALUE(SYMBOL, idx)));
+        *sp++ = value;
+        NEXT();
+    }
+    CASE(SET_LOCAL) {
+        ValueRef target = make_local_ref(pc[0], pc[1]);
+        pc += 2;
+        ValueRef* slot = env_ref_slot(env, target);
+        if (*slot == UNBOUND_VALUE)
+            panic("Unbound Symbol: `%s`", symbol_to_string(env_ref_name(env, target)));
+        *slot = sp[-1];
+        sp[-1] = (ValueRef) NULL;
+        JIT_RESUME();
+        NEXT();
+    }
+    CASE(SET_GLOBAL) {
+        ValueRef target = MAKE_OTHER(GLOBAL_REF, *pc++);
+        ValueRef* slot = env_ref_slot(env, target);
+        if (*slot == UNBOUND_VALUE)
+            panic("Unbound Symbol: `%s`", symbol_to_string(global_ref_symbol(target)));
+        optimize_check_rebind(env->root, global_ref_symbol(target));
+        *slot = sp[-1];
+        sp[-1] = (ValueRef) NULL;
+        bump_global_version();
+        JIT_RESUME();
+        NEXT();
+    }
+    CASE(DEFINE_GLOBAL) {
+        SymbolRef symbol = MAKE_VALUE(SYMBOL, *pc++);
+        SAVE();
+        env_define(env, symbol, sp[-1]); // Bumps the global version.
+        sp[-1] = symbol;
+        JIT_RESUME();
+        NEXT();
+    }
+    CASE(MEMOIZE) {
+        Instr limited = *pc++;
+        ValueRef fn = sp[-1 - (long) limited];
+        if (!is_proc(fn))
+            panic("Special form `define-memo` expects a procedure, got %s!", typename_of(fn));
+        size_t max_entries = limited ? memo_limit(sp[-1]) : 0;
+        SAVE();
+        ValueRef memo = make_memo_proc(fn, max_entries);
+        sp -= limited;
+        sp[-1] = memo;
+        JIT_RESUME();
+        NEXT();
+    }
+    CASE(CLOSURE) {
+        ValueRef child = proto->consts[*pc++];
+        Prototype* child_proto = code_lookup(child);
+        SAVE();
+        ProcRef fn = make_proc_with_code(env, child_proto->params, child_proto->body, child);
+        *sp++ = fn;
+        JIT_RESUME();
+        NEXT();
+    }
+    CASE(CALL) {
+        Instr argc = *pc++;
+        ValueRef fn = sp[-(long) argc - 1];
+        SAVE();
+        if (is_proc(fn)) {
+            ValueRef callee = proc_code(fn);
+            Env* frame = vm_bind_arguments(fn, code_lookup(callee), argc);
+            profile_hook(profile_enter(fn, false));
+            vm_push_frame(callee, frame, VM.sp - argc - 1)->owns_env = true;
+            VM.sp -= argc + 1;
+            LOAD();
+        } else if (is_builtin_proc(fn)) {
+            profile_hook(profile_call(fn));
+            ValueRef result = vm_call_builtin(vm_builtin_fn(fn, argc), argc);
+            sp -= argc + 1;
+            *sp++ = result;
+            JIT_RESUME();
+        } else {
+            vm_bad_call(fn);
+        }
+        NEXT();
+    }
+    CASE(TAIL_CALL) {
+        Instr argc = *pc++;
+        ValueRef fn = sp[-(long) argc - 1];
+        SAVE();
+        if (is_proc(fn)) {
+            ValueRef callee = proc_code(fn);
+            Env* frame = vm_bind_arguments(fn, code_lookup(callee), argc);
+            VmFrame* caller = &VM.frames[--VM.frame_count];
+            size_t base = caller->base;
+            if (caller->owns_env) env_release(caller->env);
+            profile_hook(profile_enter(fn, caller->owns_env));
+            VM.sp = base;
+            vm_push_frame(callee, frame, base)->owns_env = true;
+            LOAD();
+            NEXT();
+        } else if (is_builtin_proc(fn)) {
+            profile_hook(profile_call(fn));
+            ValueRef result = vm_call_builtin(vm_builtin_fn(fn, argc), argc);
+            sp -= argc + 1;
+            *sp++ = result;
+        } else {
+            vm_bad_call(fn);
+        }
+        // A builtin in tail position returns its result straight away.
+        goto op_return;
+    }
+    CASE(CALL_GLOBAL) {
+        CallCache* cache = vm_call_cache(proto, pc[2], env, pc[0], pc[1]);
+        Instr argc = pc[1];
+        pc += 3;
+        SAVE();
+        if (cache->binary != NULL) {
+            profile_hook(profile_call(cache->callee));
+            ValueRef result = cache->binary(sp[-2], sp[-1]);
+            sp -= 2;
+            *sp++ = result;
+            JIT_RESUME();
+            NEXT();
+        } else if (cache->builtin != NULL) {
+            profile_hook(profile_call(cache->callee));
+            ValueRef result = vm_call_builtin(cache->builtin, argc);
+            sp -= argc;
+            *sp++ = result;
+            JIT_RESUME();
+        } else if (!is_null(cache->code)) {
+            ValueRef callee = cache->code;
+            Env* frame = vm_bind_arguments(cache->callee, code_lookup(callee), argc);
+            profile_hook(profile_enter(cache->callee, false));
+            vm_push_frame(callee, frame, VM.sp - argc)->owns_env = true;
+            VM.sp -= argc;
+            LOAD();
+        } else {
+            vm_bad_call(cache->callee);
+        }
+        NEXT();
+    }
+    CASE(TAIL_CALL_GLOBAL) {
+        CallCache* cache = vm_call_cache(proto, pc[2], env, pc[0], pc[1]);
+        Instr argc = pc[1];
+        pc += 3;
+        SAVE();
+        if (cache->binary != NULL) {
+            profile_hook(profile_call(cache->callee));
+            ValueRef result = cache->binary(sp[-2], sp[-1]);
+            sp -= 2;
+            *sp++ = result;
+            goto op_return;
+        } else if (cache->builtin != NULL) {
+            profile_hook(profile_call(cache->callee));
+            ValueRef result = vm_call_builtin(cache->builtin, argc);
+            sp -= argc;
+            *sp++ = result;
+            goto op_return;
+        } else if (!is_null(cache->code)) {
+            ValueRef callee = cache->code;
+            Env* frame = vm_bind_arguments(cache->callee, code_lookup(callee), argc);
+            VmFrame* caller = &VM.frames[--VM.frame_count];
+            size_t base = caller->base;
+            if (caller->owns_env) env_release(caller->env);
+            profile_hook(profile_enter(cache->callee, caller->owns_env));
+            VM.sp = base;
+            vm_push_frame(callee, frame, base)->owns_env = true;
+            LOAD();
+        } else {
+            vm_bad_call(cache->callee);
+        }
+        NEXT();
+    }
+    CASE(RETURN) {
+    op_return: ;
+        ValueRef result = *--sp;
+        VmFrame* done = &VM.frames[--VM.frame_count];
+        if (done->owns_env) {
+            env_release(done->env);
+            profile_hook(profile_leave());
+        }
+        VM.sp = done->base;
+        if (VM.frame_count == entry_frames) return result;
+        VM.stack[VM.sp++] = result;
+        LOAD();
+        NEXT();
+    }
+    CASE(JUMP) {
+        pc = proto->code + *pc;
+        NEXT();
+    }
+    CASE(JUMP_IF_FALSE) {
+        Instr target = *pc++;
+        if (is_null(*--sp)) pc = proto->code + target;
+        NEXT();
+    }
+    CASE(EVAL) {
+        ValueRef expr = proto->consts[*pc++];
+        SAVE();
+        ValueRef result = eval_resolved(expr, env);
+        *sp++ = result;
+        JIT_RESUME();
+        NEXT();
+    }
+
+#ifndef VM_COMPUTED_GOTO
+    default:
+        unreachable();
+    }
+#endif
+
+#undef SAVE
+#undef LOAD
+#undef JIT_RESUME
+#undef CASE
+#undef NEXT
+}
+
+/// Whether `expr` makes a closure that may outlive it or be called more
+/// than once, i.e. has a `lambda` other than at the head of a call.
+static bool vm_makes_closures(ValueRef expr) {
+    if (!is_pair(expr)) return false;
+    ValueRef head = car_lookup(expr);
+    if (is_form(head, &quote)) return false;
+    if (is_form(head, &lambda)) return true;
+    if (is_pair(head) && is_form(car_lookup(head), &lambda)) {
+        ListRef lambda_args = cdr_lookup(head);
+        if (!is_null(lambda_args) && !is_null(cdr_lookup(lambda_args)) &&
+            vm_makes_closures(car_lookup(cdr_lookup(lambda_args))))
+            return true;
+    } else if (vm_makes_closures(head)) {
+        return true;
+    }
+    for (ValueRef args = cdr_lookup(expr); is_pair(args); args = cdr_lookup(args))
+        if (vm_makes_closures(car_lookup(args))) return true;
+    return false;
+}
+
+/// Evaluates resolved code on the VM.
+///
+/// A top-level expression runs once, so unless it makes closures (whose
+/// bodies are compiled with it) it runs on the tree-walker, which hands
+/// calls to compiled procedures back to the VM. Otherwise the code
+/// compiled for `expr` is freed as soon as it returns, since nothing else
+/// refers to it: closures refer to their own bodies' code. With
+/// `VM_COMPILE_ALL` set every expression is compiled.
+ValueRef vm_eval_resolved(ValueRef expr, Env* env) {
+    if (!VM_COMPILE_ALL && !vm_makes_closures(expr)) return eval_resolved(expr, env);
+    ValueRef code = compile_prototype((ListRef) NULL, expr);
+    ValueRef result = vm_run(code, env);
+    Idx idx = GET_OTHER_DATA(code);
+    clear_code(idx);
+    pool_free(&CODES.meta, idx);
+    return result;
+}
+//////////////////////////////////////////////////////////////////////
+
+#endif